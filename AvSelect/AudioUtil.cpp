@@ -216,4 +216,191 @@ FindAudioPlaybackDevice(
 		CoUninitialize();
 
 	return hr;
-}
\ No newline at end of file
+}
+
+HRESULT
+EnumerateAudioPlaybackDevices(
+	_Out_ std::vector<AudioPlaybackDevice>* pDeviceList
+	)
+{
+	HRESULT hr;
+	IMMDeviceEnumerator *pEnum = NULL;
+	IMMDeviceCollection *pDevices = NULL;
+	BOOLEAN comIntialized = FALSE;
+	UINT count = 0;
+
+	pDeviceList->clear();
+
+	hr = CoInitialize(NULL);
+	ORIGINATE_HR_ERR(Out, hr, "CoInitialize");
+	comIntialized = TRUE;
+
+	hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL,
+		CLSCTX_ALL, __uuidof(IMMDeviceEnumerator), (void**)&pEnum);
+	ORIGINATE_HR_ERR(Out, hr, "CoCreateInstance");
+
+	hr = pEnum->EnumAudioEndpoints(eRender, DEVICE_STATE_ACTIVE, &pDevices);
+	ORIGINATE_HR_ERR(Out, hr, "IMMDeviceEnumerator::EnumAudioEndpoints");
+
+	hr = pDevices->GetCount(&count);
+	ORIGINATE_HR_ERR(Out, hr, "IMMDeviceCollection::GetCount");
+
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		IMMDevice *pDevice = NULL;
+		IPropertyStore *pStore = NULL;
+		LPWSTR wstrID = NULL;
+		PROPVARIANT friendlyName;
+		PropVariantInit(&friendlyName);
+
+		hr = pDevices->Item(i, &pDevice);
+		ORIGINATE_HR_ERR(Loop, hr, "IMMDeviceCollection::Item");
+
+		hr = pDevice->GetId(&wstrID);
+		ORIGINATE_HR_ERR(Loop, hr, "IMMDevice::GetId");
+
+		hr = pDevice->OpenPropertyStore(STGM_READ, &pStore);
+		ORIGINATE_HR_ERR(Loop, hr, "IMMDevice::OpenPropertyStore");
+
+		hr = pStore->GetValue(PKEY_Device_FriendlyName, &friendlyName);
+		ORIGINATE_HR_ERR(Loop, hr, "IPropertyStore::GetValue");
+
+		pDeviceList->push_back(AudioPlaybackDevice{ friendlyName.pwszVal, wstrID });
+
+		Loop:
+
+		PropVariantClear(&friendlyName);
+		CoTaskMemFree(wstrID);
+
+		if (pDevice)
+			pDevice->Release();
+
+		if (pStore)
+			pStore->Release();
+	}
+
+	hr = S_OK;
+
+	Out:
+
+	if (pDevices)
+		pDevices->Release();
+
+	if (pEnum)
+		pEnum->Release();
+
+	if (comIntialized)
+		CoUninitialize();
+
+	return hr;
+}
+
+class AudioEndpointWatcher : public IMMNotificationClient
+{
+public:
+	AudioEndpointWatcher(std::function<void()> onChange)
+	:
+	mRefs(1),
+	mpEnumerator(NULL),
+	mOnChange(onChange)
+	{
+	}
+
+	ULONG STDMETHODCALLTYPE AddRef() override
+	{
+		return InterlockedIncrement(&mRefs);
+	}
+
+	ULONG STDMETHODCALLTYPE Release() override
+	{
+		ULONG refs = InterlockedDecrement(&mRefs);
+		if (!refs)
+			delete this;
+		return refs;
+	}
+
+	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, VOID** ppvInterface) override
+	{
+		if (riid == IID_IUnknown || riid == __uuidof(IMMNotificationClient))
+		{
+			AddRef();
+			*ppvInterface = (IMMNotificationClient*)this;
+			return S_OK;
+		}
+
+		*ppvInterface = NULL;
+		return E_NOINTERFACE;
+	}
+
+	HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(LPCWSTR, DWORD) override { mOnChange(); return S_OK; }
+	HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR) override { mOnChange(); return S_OK; }
+	HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR) override { mOnChange(); return S_OK; }
+
+	// Which endpoint is the default doesn't change what is connected.
+	HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(EDataFlow, ERole, LPCWSTR) override { return S_OK; }
+	HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(LPCWSTR, const PROPERTYKEY) override { return S_OK; }
+
+	LONG mRefs;
+	IMMDeviceEnumerator* mpEnumerator;
+
+private:
+	std::function<void()> mOnChange;
+};
+
+HRESULT
+WatchAudioPlaybackDevices(
+	_In_ std::function<void()> onChange,
+	_Outptr_ AudioEndpointWatcher** ppWatcher
+	)
+{
+	HRESULT hr;
+	AudioEndpointWatcher* pWatcher = NULL;
+	BOOLEAN comIntialized = FALSE;
+
+	*ppWatcher = NULL;
+
+	hr = CoInitialize(NULL);
+	ORIGINATE_HR_ERR(Out, hr, "CoInitialize");
+	comIntialized = TRUE;
+
+	pWatcher = new AudioEndpointWatcher(onChange);
+
+	hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL,
+		CLSCTX_ALL, __uuidof(IMMDeviceEnumerator), (void**)&pWatcher->mpEnumerator);
+	ORIGINATE_HR_ERR(Out, hr, "CoCreateInstance");
+
+	hr = pWatcher->mpEnumerator->RegisterEndpointNotificationCallback(pWatcher);
+	ORIGINATE_HR_ERR(Out, hr, "IMMDeviceEnumerator::RegisterEndpointNotificationCallback");
+
+	*ppWatcher = pWatcher;
+	return S_OK;
+
+	Out:
+
+	if (pWatcher)
+	{
+		if (pWatcher->mpEnumerator)
+			pWatcher->mpEnumerator->Release();
+		pWatcher->Release();
+	}
+
+	if (comIntialized)
+		CoUninitialize();
+
+	return hr;
+}
+
+void
+StopWatchingAudioPlaybackDevices(
+	_In_opt_ AudioEndpointWatcher* pWatcher
+	)
+{
+	if (!pWatcher)
+		return;
+
+	pWatcher->mpEnumerator->UnregisterEndpointNotificationCallback(pWatcher);
+	pWatcher->mpEnumerator->Release();
+	pWatcher->Release();
+
+	CoUninitialize();
+}
@@ -0,0 +1,204 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "ApplyExecutor.h"
+
+using namespace std;
+
+CancelToken::CancelToken()
+{
+	mEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	assert(mEvent);
+}
+
+CancelToken::~CancelToken()
+{
+	if (mEvent)
+		CloseHandle(mEvent);
+}
+
+void CancelToken::Cancel()
+{
+	SetEvent(mEvent);
+}
+
+void CancelToken::Reset()
+{
+	ResetEvent(mEvent);
+}
+
+bool CancelToken::IsCancelled() const
+{
+	return WaitForSingleObject(mEvent, 0) == WAIT_OBJECT_0;
+}
+
+bool CancelToken::WaitFor(DWORD timeoutMs) const
+{
+	switch (WaitForSingleObject(mEvent, timeoutMs))
+	{
+	case WAIT_OBJECT_0:
+		return false;
+	case WAIT_FAILED:
+		Sleep(timeoutMs);
+	}
+
+	return true;
+}
+
+ApplyExecutor::ApplyExecutor()
+:
+mThread(NULL),
+mStopping(false),
+mRunning(false),
+mRunningLane(LANE_COUNT),
+mRunningDomainMask(0)
+{
+	InitializeSRWLock(&mLock);
+	InitializeConditionVariable(&mWake);
+}
+
+ApplyExecutor::~ApplyExecutor()
+{
+	Shutdown();
+}
+
+bool ApplyExecutor::Start()
+{
+	if (mThread)
+		return true;
+
+	mStopping = false;
+	mThread = CreateThread(NULL, 0, ThreadProc, this, 0, NULL);
+	return mThread != NULL;
+}
+
+// Drops anything pending, cancels the running task at its next state boundary and
+// waits for the thread to finish.
+void ApplyExecutor::Shutdown()
+{
+	if (!mThread)
+		return;
+
+	AcquireSRWLockExclusive(&mLock);
+	mStopping = true;
+	for (auto& lane : mLanes)
+		lane.clear();
+	mRunningCancel.Cancel();
+	ReleaseSRWLockExclusive(&mLock);
+	WakeConditionVariable(&mWake);
+
+	WaitForSingleObject(mThread, INFINITE);
+	CloseHandle(mThread);
+	mThread = NULL;
+}
+
+void ApplyExecutor::Submit(Lane lane, ULONG domainMask, const wstring& description, Task task)
+{
+	AcquireSRWLockExclusive(&mLock);
+
+	if (mStopping)
+	{
+		ReleaseSRWLockExclusive(&mLock);
+		return;
+	}
+
+	deque<Request>& pending = mLanes[lane];
+	for (auto it = pending.begin(); it != pending.end();)
+	{
+		if ((it->mDomainMask & ~domainMask) == 0)
+		{
+			LogMessage(L"Superseded pending request: " + it->mDescription);
+			it = pending.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	if (mRunning && mRunningLane == lane && (mRunningDomainMask & ~domainMask) == 0)
+		mRunningCancel.Cancel();
+
+	// Speculative work never delays a real request; it is simply queued again later.
+	if (mRunning && mRunningLane == LANE_BACKGROUND && lane < LANE_BACKGROUND)
+		mRunningCancel.Cancel();
+
+	pending.push_back(Request{ domainMask, description, std::move(task) });
+
+	ReleaseSRWLockExclusive(&mLock);
+	WakeConditionVariable(&mWake);
+}
+
+DWORD WINAPI ApplyExecutor::ThreadProc(LPVOID lpParam)
+{
+	((ApplyExecutor*)lpParam)->Run();
+	return 0;
+}
+
+void ApplyExecutor::Run()
+{
+	for (;;)
+	{
+		Request request;
+
+		AcquireSRWLockExclusive(&mLock);
+		mRunning = false;
+
+		for (;;)
+		{
+			if (mStopping)
+			{
+				ReleaseSRWLockExclusive(&mLock);
+				return;
+			}
+
+			int lane = 0;
+			while (lane < LANE_COUNT && mLanes[lane].empty())
+				++lane;
+
+			if (lane < LANE_COUNT)
+			{
+				request = std::move(mLanes[lane].front());
+				mLanes[lane].pop_front();
+				mRunning = true;
+				mRunningLane = (Lane)lane;
+				mRunningDomainMask = request.mDomainMask;
+				mRunningCancel.Reset();
+				break;
+			}
+
+			SleepConditionVariableSRW(&mWake, &mLock, INFINITE, 0);
+		}
+
+		ReleaseSRWLockExclusive(&mLock);
+
+		try
+		{
+			request.mTask(mRunningCancel);
+		}
+		catch (const std::exception& e)
+		{
+			ErrorMsg(L"Request '" + request.mDescription + L"' failed: " + Widen(e.what()));
+		}
+	}
+}
@@ -0,0 +1,104 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <functional>
+#include <deque>
+#include <string>
+
+// Manual-reset flag that a running task polls at its state boundaries. Waits on it
+// return early once cancelled, so settle delays don't outlive the request.
+class CancelToken
+{
+public:
+	CancelToken();
+	~CancelToken();
+	CancelToken(const CancelToken&) = delete;
+	CancelToken& operator=(const CancelToken&) = delete;
+
+	void Cancel();
+	void Reset();
+	bool IsCancelled() const;
+
+	// Waits up to timeoutMs. Returns false if cancelled before the time elapsed.
+	bool WaitFor(DWORD timeoutMs) const;
+
+	// Signaled once cancelled, for waits on several things at once.
+	HANDLE GetWaitHandle() const { return mEvent; }
+
+private:
+	HANDLE mEvent;
+};
+
+/* Runs display/audio transitions on a dedicated thread so the tray never blocks.
+
+   Requests are queued on priority lanes and the highest non-empty lane is served first.
+   Each request carries a domain mask (display, audio, ...). A new request on a lane
+   drops every pending request on that lane whose domains it fully covers, so a burst of
+   hotkeys collapses into the final target state, and it cancels the running request if
+   it covers that one too.
+*/
+class ApplyExecutor
+{
+public:
+	enum Lane
+	{
+		LANE_RESTORE,    // restore / exit actions
+		LANE_USER,       // hotkeys, tray menu, double-click
+		LANE_BACKGROUND, // speculative work, only when nothing else is queued
+		LANE_COUNT
+	};
+
+	typedef std::function<void(const CancelToken&)> Task;
+
+	ApplyExecutor();
+	~ApplyExecutor();
+
+	bool Start();
+	void Shutdown();
+
+	void Submit(Lane lane, ULONG domainMask, const std::wstring& description, Task task);
+
+private:
+	struct Request
+	{
+		ULONG mDomainMask;
+		std::wstring mDescription;
+		Task mTask;
+	};
+
+	static DWORD WINAPI ThreadProc(LPVOID lpParam);
+	void Run();
+
+	SRWLOCK mLock;
+	CONDITION_VARIABLE mWake;
+	HANDLE mThread;
+	bool mStopping;
+	std::deque<Request> mLanes[LANE_COUNT];
+
+	bool mRunning;
+	Lane mRunningLane;
+	ULONG mRunningDomainMask;
+	CancelToken mRunningCancel;
+};
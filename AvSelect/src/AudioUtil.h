@@ -24,9 +24,16 @@
 #define _defaultaudiodevice_h_
 
 #include <Windows.h>
+#include <functional>
 #include <vector>
 #include <string>
 
+struct AudioPlaybackDevice
+{
+	std::wstring mFriendlyName;
+	std::wstring mId;
+};
+
 HRESULT
 SetDefaultAudioPlaybackDeviceById(
 	_In_z_ LPCWSTR devID
@@ -44,4 +51,25 @@ FindAudioPlaybackDevice(
 	_Inout_ std::vector<std::wstring>* pDeviceNameList
 	);
 
+HRESULT
+EnumerateAudioPlaybackDevices(
+	_Out_ std::vector<AudioPlaybackDevice>* pDeviceList
+	);
+
+class AudioEndpointWatcher;
+
+// onChange is called on the audio service's thread whenever a playback endpoint is added,
+// removed or becomes active or inactive. COM stays initialized on the calling thread
+// until StopWatchingAudioPlaybackDevices, which must be called from the same thread.
+HRESULT
+WatchAudioPlaybackDevices(
+	_In_ std::function<void()> onChange,
+	_Outptr_ AudioEndpointWatcher** ppWatcher
+	);
+
+void
+StopWatchingAudioPlaybackDevices(
+	_In_opt_ AudioEndpointWatcher* pWatcher
+	);
+
 #endif
@@ -25,13 +25,40 @@
 #include "DisplaySettings.h"
 #include "Util.h"
 #include "AvSelect.h"
+#include "ApplyExecutor.h"
+#include "TransitionGraph.h"
+#include "TransitionScratch.h"
+#include "PlanCache.h"
+#include "TargetNameCache.h"
+#include "DisplayBackend.h"
+#include "DisplayTransaction.h"
+#include "TopologyModel.h"
+#include "SingleFlight.h"
+#include "DeadlineCall.h"
+#include "DisplaySettingsTable.h"
+#include "HotplugEngine.h"
+#include "DriftGuard.h"
+#include "RestoreJournal.h"
+#include "TopologyHistory.h"
+#include "ProfileStack.h"
+#include "ProcessHost.h"
+#include <Dbt.h>
 #include <list>
+#include <unordered_map>
 #include <fstream>
 
 #define TRAYICONID	1                  // ID number for the Notify Icon
 #define MIN_SETTLE_TIME 200
 #define MIN_DISPLAY_CHANGE_SETTLE_TIME 1000
 #define ENABLE_DISPLAY_SETTLE_TIME 3000
+#define PLAN_CACHE_FILE_NAME L"plancache.bin"
+#define RESTORE_JOURNAL_FILE_NAME L"restore.journal"
+#define PROFILE_STACK_FILE_NAME L"profile.stack"
+#define CONFIRM_DISPLAY_CHANGE_CAPTION L"AvSelector Tray - Confirm display change"
+#define PC_CONFIGURATION_CAPTION L"PC Configuration"
+#define DISPLAY_HISTORY_MESSAGE_NAME L"AvSelectDisplayHistory-001"
+#define HOSTED_EXIT_EVENT_PREFIX L"AvSelectHostedExit-001-"
+#define HOST_REQUEST_COPYDATA_ID 0x48525641 // 'AVRH'
 
 using namespace std;
 
@@ -53,11 +80,64 @@ wstring	g_UpdateXmlMsg = L"Please correct your config.xml file.";
 HINSTANCE  g_Instance;  // current instance
 NOTIFYICONDATA g_NotifIconData; // notify icon data
 UserConfig g_Config;
+DeadlineDisplayBackend g_DeadlineBackend;
 wfstream g_log;
+// Held for every write to g_log, which comes from the executor, the watchdogs and the
+// hotplug, drift and process host threads as well as this one.
+SRWLOCK g_LogLock = SRWLOCK_INIT;
 BOOLEAN g_AboutBoxVisible = FALSE;
 HANDLE g_Started = NULL;
-HANDLE g_AbortAudioThreadEvent = NULL;
 bool g_enableMessageBoxErrors = true;
+ApplyExecutor g_Executor;
+TransitionScratch g_TransitionScratch;
+PlanCache g_PlanCache;
+HotplugEngine g_HotplugEngine;
+AudioEndpointWatcher* g_pAudioEndpointWatcher = NULL;
+DriftGuard g_DriftGuard;
+RestoreJournal g_RestoreJournal;
+TopologyHistory g_TopologyHistory;
+ProfileStack g_ProfileStack;
+bool g_HoldsProfileLayer = false;
+ProcessHost g_ProcessHost;
+bool g_HostingInTray = false;
+// Set by -simulatedisplays, so -simulatehotplug has something to plug into.
+SimulatedDisplayBackend* g_pSimulatedBackend = NULL;
+bool g_SimulateHotplug = false;
+
+enum StateDomain {
+	StateDomain_Display = (1 << 0),
+	StateDomain_Audio = (1 << 1),
+	// Hosting work only ever supersedes more of its own kind.
+	StateDomain_Hosting = (1 << 2),
+};
+
+// A -run: the program to host and the profile to hold while it runs.
+struct HostRequest
+{
+	wstring mCommandLine;
+	wstring mWorkingDirectory;
+	wstring mProfile;
+	bool mUntilExit = false;
+	// The instance that handed the request over, waiting for the program to exit.
+	DWORD mRequesterId = 0;
+};
+
+// A child of g_ProcessHost, by session.
+struct HostedChild
+{
+	bool mHoldsLayer = false;
+	// Set once the child has exited and its layer is off, for the requester.
+	HANDLE mExitEvent = NULL;
+};
+
+SRWLOCK g_HostedLock = SRWLOCK_INIT;
+map<UINT32, HostedChild> g_HostedChildren;
+vector<HostRequest> g_PendingHostRequests;
+vector<pair<UINT32, HostedChild>> g_PendingHostedExits;
+
+// Undo (negative) and redo steps from other instances not yet taken; see QueueDisplayHistoryStep.
+SRWLOCK g_HistoryStepLock = SRWLOCK_INIT;
+int g_PendingHistorySteps = 0;
 
 struct {
 	DisplayConfig* pInitialDisplayConfig;
@@ -73,8 +153,22 @@ LRESULT CALLBACK About(HWND, UINT, WPARAM, LPARAM);
 
 void LogMessage(wstring msg)
 {
+	AcquireSRWLockExclusive(&g_LogLock);
 	if (g_log.is_open())
 		g_log << msg << std::endl;
+	ReleaseSRWLockExclusive(&g_LogLock);
+}
+
+// The whole state goes in as one message, so no other thread's lines land inside it.
+static void LogDisplayState(const DisplayConfig& config)
+{
+	wstringstream ss;
+	config.LogState(ss);
+
+	wstring state = ss.str();
+	if (!state.empty() && state.back() == L'\n')
+		state.pop_back();
+	LogMessage(state);
 }
 
 void ErrorMsg(wstring msg)
@@ -92,20 +186,130 @@ void XmlConfigErrorMsg(wstring msg)
 	ErrorMsg(msg);
 }
 
-bool ChangeDefaultAudioDevice(wstring name, bool suppressError)
+struct AudioEndpointList
+{
+	HRESULT mHr;
+	vector<AudioPlaybackDevice> mDevices;
+};
+
+struct DefaultAudioEndpoint
+{
+	HRESULT mHr;
+	wstring mFriendlyName;
+};
+
+// Overlapping transitions, menu opens and restores share one endpoint enumeration and
+// one default endpoint lookup between them.
+SingleFlight<AudioEndpointList> g_AudioEndpointQuery;
+SingleFlight<DefaultAudioEndpoint> g_DefaultAudioEndpointQuery;
+
+// The audio service can stall like a display driver can; each call gets a deadline.
+HRESULT AudioCallTimedOut(const wchar_t* pCallName)
+{
+	LogMessage(wstring(pCallName) + L" did not return within " + 
+		std::to_wstring(g_Config.GetAudioTimeoutMs()) + L"ms.");
+	return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+}
+
+SingleFlight<AudioEndpointList>::ResultPtr QueryAudioEndpoints()
+{
+	return g_AudioEndpointQuery.Do([]()
+	{
+		AudioEndpointList endpoints;
+
+		if (!CallWithDeadline<AudioEndpointList>([]()
+			{
+				AudioEndpointList endpoints;
+				endpoints.mHr = EnumerateAudioPlaybackDevices(&endpoints.mDevices);
+				return endpoints;
+			}, g_Config.GetAudioTimeoutMs(), NULL, &endpoints))
+		{
+			endpoints.mHr = AudioCallTimedOut(L"EnumerateAudioPlaybackDevices");
+		}
+
+		return endpoints;
+	});
+}
+
+SingleFlight<DefaultAudioEndpoint>::ResultPtr QueryDefaultAudioEndpoint()
+{
+	return g_DefaultAudioEndpointQuery.Do([]()
+	{
+		DefaultAudioEndpoint endpoint;
+
+		if (!CallWithDeadline<DefaultAudioEndpoint>([]()
+			{
+				DefaultAudioEndpoint endpoint;
+				PWSTR friendlyName = NULL;
+				endpoint.mHr = GetDefaultAudioPlaybackDevice(&friendlyName);
+
+				if (SUCCEEDED(endpoint.mHr))
+				{
+					endpoint.mFriendlyName = friendlyName;
+					delete[] friendlyName;
+				}
+
+				return endpoint;
+			}, g_Config.GetAudioTimeoutMs(), NULL, &endpoint))
+		{
+			endpoint.mHr = AudioCallTimedOut(L"GetDefaultAudioPlaybackDevice");
+		}
+
+		return endpoint;
+	});
+}
+
+// How much the single-flight queries saved over the session.
+void LogQueryStats()
+{
+	UINT64 queries, joins;
+	wstringstream ss;
+
+	DisplayConfig::GetQueryStats(&queries, &joins);
+	ss << L"Topology queries: " << queries << L" run, " << joins << L" joined. ";
+
+	g_AudioEndpointQuery.GetStats(&queries, &joins);
+	ss << L"Audio endpoint enumerations: " << queries << L" run, " << joins << L" joined. ";
+
+	g_DefaultAudioEndpointQuery.GetStats(&queries, &joins);
+	ss << L"Default endpoint lookups: " << queries << L" run, " << joins << L" joined.";
+
+	LogMessage(ss.str());
+}
+
+bool ChangeDefaultAudioDevice(wstring name, bool suppressError, const CancelToken* pCancel = NULL)
 {
 	if (name == L"") 
 		XmlConfigErrorMsg(L"Error updating state DefaultAudioDevice: AudioDeviceFriendlyName must be supplied.");
 		
 	vector<wstring> deviceList;
-	PWSTR deviceId = NULL;
+	SingleFlight<AudioEndpointList>::ResultPtr pEndpoints = QueryAudioEndpoints();
+	const AudioPlaybackDevice* pMatch = NULL;
+
+	for (const AudioPlaybackDevice& device : pEndpoints->mDevices)
+	{
+		deviceList.push_back(device.mFriendlyName);
+		if (!pMatch && WildcardMatch(device.mFriendlyName.c_str(), name.c_str()))
+			pMatch = &device;
+	}
 
-	HRESULT hr = FindAudioPlaybackDevice(name.c_str(), &deviceId, &deviceList);
+	HRESULT hr = FAILED(pEndpoints->mHr) ? pEndpoints->mHr : (pMatch ? S_OK : S_FALSE);
+
+	if (pMatch)
+	{
+		wstring deviceId = pMatch->mId;
 
-	if (SUCCEEDED(hr) && hr != S_FALSE)
-		hr = SetDefaultAudioPlaybackDeviceById(deviceId);
+		if (!CallWithDeadline<HRESULT>([deviceId]()
+			{
+				return SetDefaultAudioPlaybackDeviceById(deviceId.c_str());
+			}, g_Config.GetAudioTimeoutMs(), pCancel, &hr))
+		{
+			hr = (pCancel && pCancel->IsCancelled()) ? 
+				HRESULT_FROM_WIN32(ERROR_CANCELLED) : AudioCallTimedOut(L"SetDefaultAudioPlaybackDeviceById");
+		}
 
-	delete deviceId;
+		g_DefaultAudioEndpointQuery.Forget();
+	}
 
 	if (!suppressError && (FAILED(hr) || hr == S_FALSE))
 	{
@@ -131,26 +335,38 @@ bool ChangeDefaultAudioDevice(wstring name, bool suppressError)
 	return true;
 }
 
-DisplayConfig::DeviceId FindTarget(const DisplayConfig& config, UserConfig::Field field, 
-	ParamList additionalArgs = ParamList())
+static const ParamList sTargetParams = {
+	{ "FriendlyName", false },
+	{ "UiIndex", false },
+	{ "AdapterLuid", false },
+	{ "Id", false }
+};
+
+static const ParamList sNoAdditionalParams;
+
+static const ParamList sLocationParams = { { "X", true }, { "Y", true } };
+
+static string GetAcceptedTargetParams(const ParamList& additionalArgs)
 {
-	ParamList paramList = {
-		{ "FriendlyName", false },
-		{ "UiIndex", false },
-		{ "AdapterLuid", false },
-		{ "Id", false }
-	};
+	string acceptedElements;
+
+	for (const ParamList* pList : { &sTargetParams, &additionalArgs })
+		for (const auto& item : *pList)
+			acceptedElements += item.first + " ";
 
-	paramList.insert(paramList.end(), additionalArgs.begin(), additionalArgs.end());
+	return acceptedElements;
+}
 
-	CheckRequiredValues(field, paramList);
+DisplayConfig::DeviceId FindTarget(const DisplayConfig& config, const UserConfig::Field& field, 
+	const ParamList& additionalArgs = sNoAdditionalParams)
+{
+	CheckRequiredValues(field, sTargetParams, additionalArgs);
 
-	wstring name;
+	const wstring& name = field.GetWideValue("FriendlyName");
 	unsigned long long adapterLuidRaw = 0;
 	unsigned long id = ULONG_MAX;
 	unsigned long uiIndex = 0;
 
-	ReadValue(&field, "FriendlyName", name);
 	ReadValue(&field, "AdapterLuid", adapterLuidRaw);
 	ReadValue(&field, "Id", id);
 	ReadValue(&field, "UiIndex", uiIndex);
@@ -159,44 +375,43 @@ DisplayConfig::DeviceId FindTarget(const DisplayConfig& config, UserConfig::Fiel
 	adapterLuid.LowPart = adapterLuidRaw & ULONG_MAX;
 	adapterLuid.HighPart = adapterLuidRaw >> 32;
 
-	list<const DisplayConfig::TargetAuxInfo*> candidates;
+	if (field.GetValueCount() == 0)
+		throw InvalidArgumentException(string() + "Error in " + field.ToString() +
+			"; Target must be specified. Select a target using one or more of these attributes: " + 
+			GetAcceptedTargetParams(additionalArgs) + ".");
+
+	// Only the count and the match matter; no list of candidates is built.
+	size_t candidateCount = 0;
+	const DisplayConfig::TargetAuxInfo* pCandidate = NULL;
+
 	for (const DisplayConfig::TargetAuxInfo& target : config.GetAuxInfo())
 	{
-		if ((name == L"" || WildcardMatch(target.mFriendlyName.c_str(), name.c_str())) &&
+		if ((name.empty() || WildcardMatch(target.mFriendlyName.c_str(), name.c_str())) &&
 			(adapterLuidRaw == 0 || !memcmp(&target.mId.mAdapterId, &adapterLuid, sizeof(adapterLuid))) &&
 			(id == ULONG_MAX || target.mId.mId == id))
 			//(uiIndex == 0 || target.mUiIndex == uiIndex))
 		{
-			candidates.emplace_front(&target);
+			++candidateCount;
+			pCandidate = &target;
 		}
 	}
 
-	string pAcceptedElements = "";
-
-	for (auto item : paramList)
-		pAcceptedElements += item.first + " ";
-
-	if (field.GetValueList().size() == 0)
-		throw InvalidArgumentException(string() + "Error in " + field.ToString() +
-			"; Target must be specified. Select a target using one or more of these attributes: " + 
-			pAcceptedElements + ".");
-
-	switch(candidates.size())
+	switch(candidateCount)
 	{
 	case 0:
 		return DisplayConfig::DeviceId{};
 	case 1:
-		return candidates.back()->mId;
+		return pCandidate->mId;
 	default:
 		throw InvalidArgumentException(string() + "Error in " + field.ToString() +
 			"; Target is ambiguous. Multiple targets on this system match. " +
 			"The list of targets must be narrowed to exactly 1 using these attributes " + 
-			pAcceptedElements + ".");
+			GetAcceptedTargetParams(additionalArgs) + ".");
 	}
 }
 
-DisplayConfig::DeviceId FindRequiredTarget(const DisplayConfig& config, UserConfig::Field field,
-	ParamList additionalArgs = ParamList())
+DisplayConfig::DeviceId FindRequiredTarget(const DisplayConfig& config, const UserConfig::Field& field,
+	const ParamList& additionalArgs = sNoAdditionalParams)
 {
 	DisplayConfig::DeviceId returnVal = FindTarget(config, field, additionalArgs);
 	if (!returnVal.IsValid())
@@ -207,7 +422,9 @@ DisplayConfig::DeviceId FindRequiredTarget(const DisplayConfig& config, UserConf
 	return returnVal;
 }
 
-DisplayConfig::DisplaySettings ParseDisplaySettings(DisplayConfig& config, const UserConfig::State& state)
+// Everything in a DisplaySettings state but the targets it names, which can only be found
+// among the displays connected at the time.
+static DisplayConfig::DisplaySettings CompileDisplaySettings(const UserConfig::State& state)
 {
 	DisplayConfig::DisplaySettings settings;
 	int bitsPerPixel = 0;
@@ -282,15 +499,50 @@ DisplayConfig::DisplaySettings ParseDisplaySettings(DisplayConfig& config, const
 	const UserConfig::Field* pLocationRelativeToTarget = state.GetField("LocationRelativeToTarget");
 	if (pLocationRelativeToTarget)
 	{
-		ParamList additionalParams = { { "X", true }, { "Y", true } };
-		settings.mPositionAnchor = FindRequiredTarget(config, *pLocationRelativeToTarget, additionalParams);
+		// As FindTarget would first, so a bad field reads the same as it always has.
+		CheckRequiredValues(*pLocationRelativeToTarget, sTargetParams, sLocationParams);
 		settings.mPosition = POINTL();
 		ReadValue(pLocationRelativeToTarget, "X", settings.mPosition->x, true);
 		ReadValue(pLocationRelativeToTarget, "Y", settings.mPosition->y, true);
 	}
 
-	const UserConfig::Field* pCloneTarget = state.GetField("CloneTarget");
-	if (pCloneTarget)
+	return settings;
+}
+
+// Every DisplaySettings state of the config, compiled when it's loaded rather than on every
+// pick. A state that doesn't compile is left out, to fail with its error when it's picked.
+static std::unordered_map<const UserConfig::State*, DisplayConfig::DisplaySettings> g_CompiledDisplaySettings;
+
+static void CompileConfigDisplaySettings()
+{
+	g_CompiledDisplaySettings.clear();
+
+	for (const UserConfig::MenuItem& item : g_Config.GetMenuItems())
+	{
+		for (const UserConfig::State& state : item.GetTargetStates())
+		{
+			if (state.GetType() != "DisplaySettings")
+				continue;
+
+			try
+			{
+				g_CompiledDisplaySettings.emplace(&state, CompileDisplaySettings(state));
+			}
+			catch (const std::exception&) {}
+		}
+	}
+}
+
+DisplayConfig::DisplaySettings ParseDisplaySettings(const DisplayConfig& config, const UserConfig::State& state)
+{
+	auto compiled = g_CompiledDisplaySettings.find(&state);
+	DisplayConfig::DisplaySettings settings =
+		compiled != g_CompiledDisplaySettings.end() ? compiled->second : CompileDisplaySettings(state);
+
+	if (const UserConfig::Field* pLocationRelativeToTarget = state.GetField("LocationRelativeToTarget"))
+		settings.mPositionAnchor = FindRequiredTarget(config, *pLocationRelativeToTarget, sLocationParams);
+
+	if (const UserConfig::Field* pCloneTarget = state.GetField("CloneTarget"))
 		settings.mCloneOf = FindRequiredTarget(config, *pCloneTarget);
 
 	return settings;
@@ -299,7 +551,8 @@ DisplayConfig::DisplaySettings ParseDisplaySettings(DisplayConfig& config, const
 wstring GetPcConfigurationText()
 {
 	wstringstream ss;
-	DisplayConfig config;
+	TopologyModel::SnapshotPtr pSnapshot = g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS);
+	const DisplayConfig& config = pSnapshot->mConfig;
 	wstring endl = L"\r\n";
 
 	ss << "Targets (Display Devices):" << endl;
@@ -340,128 +593,215 @@ wstring GetPcConfigurationText()
 
 	ss << "Audio Devices:" << endl;
 
-	vector<wstring> deviceNameList;
-	FindAudioPlaybackDevice(L"", NULL, &deviceNameList);
-	for (wstring device : deviceNameList)
+	for (const AudioPlaybackDevice& device : QueryAudioEndpoints()->mDevices)
 	{
-		ss << "FriendlyName: " << device << endl;
+		ss << "FriendlyName: " << device.mFriendlyName << endl;
 	}
 	LogMessage(ss.str());
 
 	return ss.str();
 }
 
-void ApplyDisplayConfig(DisplayConfig& config)
+// Failures that depend on the configuration itself, rather than on the moment it was
+// tried in (a locked workstation, a driver busy resetting).
+bool IsDefiniteVerdict(LONG rc)
 {
-	LONG rc = config.Apply(false);
-
-	if (rc != ERROR_SUCCESS)
-		ErrorMsg(L"Failed to update display configuration. Error Code:" + std::to_wstring(rc));
+	return rc == ERROR_SUCCESS || rc == ERROR_INVALID_PARAMETER || rc == ERROR_NOT_SUPPORTED || rc == ERROR_GEN_FAILURE;
 }
 
-struct SetDefaultAudioDeviceParam
+/* Validates before applying so a configuration the driver won't take fails without a
+   mode switch. The verdict is remembered for this payload over this topology
+   (fingerprint), so a known-good plan goes straight to apply the next time. Once pCancel
+   is set, a stalled driver call is given up on rather than waited out.
+*/
+bool ApplyDisplayConfig(DisplayConfig& config, UINT64 fingerprint, const CancelToken* pCancel)
 {
-	int mDelayMs = 0;
-	std::wstring mAudioDeviceName;
-	bool mBeep = false;
-	bool mHideErrors = false;
-};
+	UINT64 payloadHash = config.GetPayloadHash();
+	LONG rc = ERROR_SUCCESS;
+
+	if (!g_PlanCache.FindVerdict(payloadHash, fingerprint, &rc))
+	{
+		rc = config.Validate(pCancel);
+		if (IsDefiniteVerdict(rc))
+			g_PlanCache.InsertVerdict(payloadHash, fingerprint, rc);
+	}
+
+	if (rc == ERROR_SUCCESS)
+	{
+		rc = config.Apply(false, pCancel);
+		if (rc != ERROR_SUCCESS && IsDefiniteVerdict(rc))
+			g_PlanCache.InsertVerdict(payloadHash, fingerprint, rc);
+	}
 
-DWORD WINAPI SetDefaultAudioDevice(LPVOID lpParam)
+	if (rc == ERROR_CANCELLED)
+		LogMessage(L"Display change cancelled by a newer request.");
+	else if (rc != ERROR_SUCCESS)
+		ErrorMsg(L"Failed to update display configuration. " + config.DescribeApplyError(rc) + 
+			L" Error Code:" + std::to_wstring(rc));
+
+	return rc == ERROR_SUCCESS;
+}
+
+/* With ConfirmDisplayChangeSeconds set, the change is applied in a transaction and only
+   kept once the user confirms it. If the prompt can't be answered in time (e.g. it's on
+   a display that just went dark) the watchdog rolls back and dismisses it.
+*/
+bool ApplyDisplayConfigWithConfirmation(DisplayConfig& config, UINT64 fingerprint, const CancelToken* pCancel)
 {
-	SetDefaultAudioDeviceParam* pParam = (SetDefaultAudioDeviceParam*)lpParam;
+	UINT32 confirmSeconds = g_Config.GetConfirmDisplayChangeSeconds();
+
+	if (!confirmSeconds || !g_enableMessageBoxErrors)
+		return ApplyDisplayConfig(config, fingerprint, pCancel);
 
-	if (pParam->mDelayMs)
+	DisplayTransaction transaction;
+	transaction.Begin();
+
+	if (!ApplyDisplayConfig(config, fingerprint, pCancel))
 	{
-		switch (WaitForSingleObject(g_AbortAudioThreadEvent, pParam->mDelayMs))
-		{
-		case WAIT_OBJECT_0:
-			goto Out; // Abandon this task
-		case WAIT_FAILED:
-			Sleep(pParam->mDelayMs);
-		}
+		transaction.Rollback();
+		return false;
 	}
 
-	if (ChangeDefaultAudioDevice(pParam->mAudioDeviceName, pParam->mHideErrors) &&
-		pParam->mBeep && 
+	transaction.ArmWatchdog(confirmSeconds * 1000, [](LONG)
+	{
+		HWND hPrompt = FindWindow(L"#32770", CONFIRM_DISPLAY_CHANGE_CAPTION);
+		if (hPrompt)
+			PostMessage(hPrompt, WM_CLOSE, 0, 0);
+	});
+
+	wstringstream ss;
+	ss << L"Keep these display settings? They will be reverted in " << confirmSeconds << L" seconds.";
+
+	int answer = MessageBox(NULL, ss.str().c_str(), CONFIRM_DISPLAY_CHANGE_CAPTION, 
+		MB_OKCANCEL | MB_ICONQUESTION | MB_TOPMOST | MB_SETFOREGROUND);
+
+	if (answer == IDOK && transaction.Commit())
+		return true;
+
+	LONG rc = transaction.Rollback();
+	if (rc != ERROR_SUCCESS)
+		ErrorMsg(L"Failed to restore the previous display configuration. Error Code:" + std::to_wstring(rc));
+	else
+		LogMessage(L"Display change reverted.");
+
+	return false;
+}
+
+void SetDefaultAudioDevice(const SetDefaultAudioDeviceParam& param, const CancelToken* pCancel)
+{
+	if (ChangeDefaultAudioDevice(*param.mpAudioDeviceName, param.mHideErrors, pCancel) &&
+		param.mBeep && 
 		g_Started)
 	{
 		PlaySoundW((LPCWSTR)SND_ALIAS_SYSTEMDEFAULT, NULL, SND_ALIAS_ID);
 	}
+}
 
-	Out:
+// Returns false if pCancel was set before timeoutMs elapsed.
+bool WaitUnlessCancelled(const CancelToken* pCancel, DWORD timeoutMs)
+{
+	if (pCancel)
+		return pCancel->WaitFor(timeoutMs);
 
-	delete pParam;
-	return 0;
+	Sleep(timeoutMs);
+	return true;
 }
 
-void HandleUserConfigMenuItemPicked(const UserConfig::MenuItem& menuItem)
+// Inactive targets only show up in the full view. Fetch it the first time a state names
+// a target the active-only snapshot doesn't have.
+void UpgradeIfTargetInactive(DisplayConfig& config, const UserConfig::Field& target,
+	const ParamList& additionalArgs = sNoAdditionalParams)
 {
-	std::unique_ptr<DisplayConfig> pDisplayConfig;
+	if (!config.HasAllPaths() && !FindTarget(config, target, additionalArgs).IsValid())
+		config.UpgradeToAllPaths();
+}
 
-	try {
-		pDisplayConfig.reset(new DisplayConfig);
-	} catch (const std::exception& e) {
-		XmlConfigErrorMsg(Widen(e.what()));
+// Identifies a MenuItem across runs, by its place in the whole of config.xml, so that a
+// -set that parsed only that item keys it as the tray does. Any edit to config.xml
+// retires every earlier key.
+UINT64 GetMenuItemKey(const UserConfig::MenuItem& menuItem)
+{
+	return Fnv1a64Value(g_Config.GetContentHash(), (UINT64)menuItem.GetIndex());
+}
+
+bool IsDisplayHistoryState(const UserConfig::State& state)
+{
+	return state.GetType() == "UndoDisplayChange" || state.GetType() == "RedoDisplayChange";
+}
+
+// A MenuItem with an UndoDisplayChange or RedoDisplayChange state does only that. Finds
+// how far it goes, negative for undo.
+bool GetMenuItemHistorySteps(const UserConfig::MenuItem& menuItem, int* pSteps)
+{
+	for (const UserConfig::State& state : menuItem.GetTargetStates())
+	{
+		if (!IsDisplayHistoryState(state))
+			continue;
+
+		UINT32 steps = 1;
+		ReadValue(state.GetField("Steps"), "Value", steps);
+		if (!steps || steps > TopologyHistory::MAX_STEPS)
+			throw runtime_error("Steps must be between 1 and " + to_string(TopologyHistory::MAX_STEPS));
+
+		*pSteps = state.GetType() == "UndoDisplayChange" ? -(int)steps : (int)steps;
+		return true;
 	}
 
-	LogMessage(L"Option chosen: " + Widen(menuItem.GetName()));
+	return false;
+}
+
+/* Plans menuItem's states, in order, against *pDisplayConfig and collects its audio
+   switches into *pAudioStates. Either may be NULL to skip that kind of state.
 
-	if (!SetEvent(g_AbortAudioThreadEvent))
-		ErrorMsg(L"SetEvent failed: " + to_wstring(GetLastError()));
-	else if (!ResetEvent(g_AbortAudioThreadEvent))
-		ErrorMsg(L"ResetEvent failed: " + to_wstring(GetLastError()));
+   A speculative plan runs in the background ahead of any request: it shows no errors,
+   skips audio and gives up at the first state that fails, so that only plans a real
+   request would have produced cleanly get cached.
 
-	if (g_log.is_open() && pDisplayConfig)
-		pDisplayConfig->LogState(g_log);
+   Returns true only if every state planned without error and nothing was cancelled.
+*/
+bool PlanMenuItem(const UserConfig::MenuItem& menuItem, DisplayConfig* pDisplayConfig, 
+	vector<SetDefaultAudioDeviceParam>* pAudioStates, const CancelToken* pCancel, bool speculative)
+{
+	bool planned = true;
 
-	for (UserConfig::State state : menuItem.GetTargetStates())
+	for (const UserConfig::State& state : menuItem.GetTargetStates())
 	{
+		if (pCancel && pCancel->IsCancelled())
+			return false;
+
 		try 
 		{
-			LogMessage(L"State transition: " + Widen(state.GetType()));
+			if (!speculative && g_log.is_open())
+				LogMessage(L"State transition: " + Widen(state.GetType()));
 
 			if (state.GetType() == "DefaultAudioDevice")
 			{
-				SetDefaultAudioDeviceParam* pParam = new SetDefaultAudioDeviceParam;
-				ZeroMemory(pParam, sizeof(*pParam));
+				if (!pAudioStates) continue;
+
+				SetDefaultAudioDeviceParam param;
 
-				bool applyDisplayChanges = false;
 				const UserConfig::Field* pDependantOnDisplay = state.GetField("WaitUntilDisplayEnabledComplete");
-				if (pDisplayConfig && pDisplayConfig->ChangesWillEnableDisplay() &&
-					ReadValue(pDependantOnDisplay, "Value", applyDisplayChanges) &&
-					applyDisplayChanges)
+				if (ReadValue(pDependantOnDisplay, "Value", param.mWaitForDisplay) && param.mWaitForDisplay)
 				{
-					ApplyDisplayConfig(*pDisplayConfig);
-					const UserConfig::Field* pDependantOnDisplay = state.GetField("WaitUntilDisplayEnabledComplete");
-					pParam->mDelayMs = ENABLE_DISPLAY_SETTLE_TIME;
-					ReadValue(pDependantOnDisplay, "DelayMs", pParam->mDelayMs);
+					param.mDelayMs = ENABLE_DISPLAY_SETTLE_TIME;
+					ReadValue(pDependantOnDisplay, "DelayMs", param.mDelayMs);
 				}
 
-				pParam->mBeep = true;
+				param.mBeep = true;
 				const UserConfig::Field* pBeep = state.GetField("PlayTestSound");
-				ReadValue(pBeep, "Value", pParam->mBeep, true);
-
-				UserConfig::Field device = GetRequiredField(state, "AudioDevice");
-				string name;
-				ReadValue(&device, "FriendlyName", name, true);
-				pParam->mAudioDeviceName = Widen(name);
-				pParam->mHideErrors = state.IsOptional();
+				ReadValue(pBeep, "Value", param.mBeep, true);
 
-				HANDLE h = CreateThread(NULL, 0, SetDefaultAudioDevice, pParam, 0, NULL);
+				const UserConfig::Field& device = GetRequiredField(state, "AudioDevice");
+				param.mpAudioDeviceName = &device.GetWideValue("FriendlyName");
+				param.mHideErrors = state.IsOptional();
 
-				if (h)
-					CloseHandle(h);
-				else
-				{
-					ErrorMsg(L"Failed to Create thread for updating DefaultAudioDevice");
-					delete pParam;
-				}
+				pAudioStates->push_back(param);
 			}
 			else if (state.GetType() == "PrimaryDisplay")
 			{
 				if (!pDisplayConfig) continue;
-				UserConfig::Field target = GetRequiredField(state, "Target");
+				const UserConfig::Field& target = GetRequiredField(state, "Target");
+				UpgradeIfTargetInactive(*pDisplayConfig, target);
 
 				DisplayConfig::DeviceId targetDeviceId =
 					state.IsOptional() ?
@@ -473,16 +813,34 @@ void HandleUserConfigMenuItemPicked(const UserConfig::MenuItem& menuItem)
 			{
 				if (!pDisplayConfig) continue;
 
-				UserConfig::Field target = GetRequiredField(state, "Target");
+				const UserConfig::Field& target = GetRequiredField(state, "Target");
+				UpgradeIfTargetInactive(*pDisplayConfig, target);
+				if (const UserConfig::Field* pAnchor = state.GetField("LocationRelativeToTarget"))
+					UpgradeIfTargetInactive(*pDisplayConfig, *pAnchor, sLocationParams);
+				if (const UserConfig::Field* pCloneTarget = state.GetField("CloneTarget"))
+					UpgradeIfTargetInactive(*pDisplayConfig, *pCloneTarget);
+
 				DisplayConfig::DeviceId targetDeviceId = 
 					state.IsOptional() ?
 						FindTarget(*pDisplayConfig, target) :
 						FindRequiredTarget(*pDisplayConfig, target);
-				DisplayConfig::DisplaySettings& settings = ParseDisplaySettings(*pDisplayConfig, state);
+				const DisplayConfig::DisplaySettings& settings = ParseDisplaySettings(*pDisplayConfig, state);
 				pDisplayConfig->UpdateDisplaySettings(targetDeviceId, settings);
 			}
+			else if (IsDisplayHistoryState(state))
+			{
+				// Where these lead depends on the history, not just the topology, so they
+				// are never planned ahead. A real pick goes through StepDisplayHistory.
+				planned = false;
+				if (speculative)
+					break;
+			}
 			else
 			{
+				planned = false;
+				if (speculative)
+					break;
+
 				string msg = "Don't know how to update the state type called '";
 				msg += state.GetType() + "'\n";
 				msg += "Recognized state types: DefaultAudioDevice, PrimaryMonitor.\n";
@@ -490,6 +848,10 @@ void HandleUserConfigMenuItemPicked(const UserConfig::MenuItem& menuItem)
 			}
 		} catch (const std::exception& e)
 		{
+			planned = false;
+			if (speculative)
+				break;
+
 			XmlConfigErrorMsg(Widen(e.what()));
 			if (!state.ContinueOnError())
 			{
@@ -498,132 +860,1085 @@ void HandleUserConfigMenuItemPicked(const UserConfig::MenuItem& menuItem)
 		}
 	}
 
-	bool wait = false;
-	bool waitForEnable = false;
+	return planned && !(pCancel && pCancel->IsCancelled());
+}
+
+// Makes the displays as they are now the ones the drift guard keeps. Reads them back
+// rather than trusting the plan, since the driver has the last word.
+void PinAppliedDisplays()
+{
+	if (!g_Config.GetPinProfile())
+	{
+		g_DriftGuard.Resume();
+		return;
+	}
+
+	try {
+		g_DriftGuard.Pin(g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS)->mConfig);
+	} catch (const std::exception& e) {
+		LogMessage(L"Could not pin the applied displays: " + Widen(e.what()));
+		g_DriftGuard.Resume();
+	}
+}
+
+// Adds the displays as they are now to the undo history; with historySteps, commits that
+// jump from live instead. Reads them back for the same reason as PinAppliedDisplays.
+void RecordDisplayHistory(const DisplayConfig::TopologyState* pLive = NULL, int historySteps = 0)
+{
+	try {
+		DisplayConfig::TopologyState applied =
+			g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS)->mConfig.GetTopologyState();
+
+		if (historySteps)
+			g_TopologyHistory.Move(*pLive, historySteps, applied);
+		else
+			g_TopologyHistory.Record(applied);
+	} catch (const std::exception& e) {
+		LogMessage(L"Could not record the display history: " + Widen(e.what()));
+	}
+}
+
+// Applies config with the drift guard held off, then records and pins whatever the
+// displays ended up as.
+bool ApplyDisplayTransition(DisplayConfig& config, UINT64 fingerprint, const CancelToken* pCancel,
+	const DisplayConfig::TopologyState* pLive = NULL, int historySteps = 0)
+{
+	g_DriftGuard.Suspend();
+	bool applied = ApplyDisplayConfigWithConfirmation(config, fingerprint, pCancel);
+
+	// Even a failed apply may have changed something.
+	g_TopologyModel.Invalidate();
+
+	if (!applied)
+	{
+		g_DriftGuard.Resume();
+		return false;
+	}
+
+	RecordDisplayHistory(pLive, historySteps);
+	PinAppliedDisplays();
+
+	if (g_log.is_open())
+		LogDisplayState(config);
+
+	return true;
+}
+
+/* Moves the displays steps entries through the undo history, negative for back. However
+   far that is, the displays go there with one diff from where they are now. False if
+   cancelled before the history cursor moved, so the steps are still to be taken.
+*/
+bool StepDisplayHistory(int steps, const CancelToken* pCancel)
+{
+	LogMessage(wstring(steps < 0 ? L"Undoing " : L"Redoing ") + to_wstring(abs(steps)) + L" display change(s).");
+
+	try {
+		TopologyModel::SnapshotPtr pSnapshot = g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS);
+		DisplayConfig config(pSnapshot->mConfig);
+		DisplayConfig::TopologyState live = config.GetTopologyState();
+		DisplayConfig::TopologyState target;
+
+		if (!g_TopologyHistory.Peek(live, steps, &target))
+		{
+			LogMessage(steps < 0 ? L"Nothing that far back to undo." : L"Nothing that far ahead to redo.");
+			return true;
+		}
+
+		config.MoveToTopologyState(target);
+
+		if (pCancel && pCancel->IsCancelled())
+			return false;
+
+		// Nothing to apply, but the cursor still moves.
+		if (!config.HasChanged())
+		{
+			RecordDisplayHistory(&live, steps);
+			return true;
+		}
+
+		if (ApplyDisplayTransition(config, pSnapshot->mFingerprint, pCancel, &live, steps))
+			WaitUnlessCancelled(pCancel, MIN_DISPLAY_CHANGE_SETTLE_TIME);
+	} catch (const std::exception& e) {
+		XmlConfigErrorMsg(Widen(e.what()));
+	}
+
+	return true;
+}
+
+/* Display states are planned first, in order, against a single DisplayConfig, or taken
+   from g_PlanCache when this item was already planned against the current topology. The
+   transition then runs as a graph: one display apply followed by its settle delay, and
+   the audio switches. Audio that waits for a display this item enables depends on the
+   apply; everything else runs alongside it.
+
+   pCancel is checked at each state boundary; once set, no further states are planned
+   and nothing that hasn't started yet will run.
+
+   onReady, if given, runs once the displays are applied and the audio switched, while
+   the displays settle. It's skipped if the transition is cancelled or fails first.
+
+   Everything a pick plans into lives in g_TransitionScratch, and nothing is logged unless
+   there's a log to write it to, so a warmed pick that hits a current snapshot and a
+   cached plan doesn't allocate before its nodes run. AvSelectHarness checks that.
+*/
+void HandleUserConfigMenuItemPicked(const UserConfig::MenuItem& menuItem, const CancelToken* pCancel = NULL,
+	const std::function<void()>& onReady = nullptr)
+{
+	TransitionScratch& scratch = g_TransitionScratch;
+	DisplayConfig* pDisplayConfig = NULL;
+	UINT64 fingerprint = 0;
+
+	try {
+		TopologyModel::SnapshotPtr pSnapshot = g_TopologyModel.Acquire();
+		pDisplayConfig = &scratch.CopySnapshot(pSnapshot->mConfig);
+		fingerprint = pSnapshot->mFingerprint;
+	} catch (const std::exception& e) {
+		XmlConfigErrorMsg(Widen(e.what()));
+	}
+
+	if (g_log.is_open())
+		LogMessage(L"Option chosen: " + menuItem.GetWideName());
+	g_RestoreJournal.RecordTransition(menuItem.GetWideName());
+
+	try {
+		int historySteps;
+		if (GetMenuItemHistorySteps(menuItem, &historySteps))
+		{
+			StepDisplayHistory(historySteps, pCancel);
+			if (onReady)
+				onReady();
+			return;
+		}
+	} catch (const std::exception& e) {
+		XmlConfigErrorMsg(Widen(e.what()));
+		return;
+	}
+
+	if (g_log.is_open() && pDisplayConfig)
+		LogDisplayState(*pDisplayConfig);
+
+	vector<SetDefaultAudioDeviceParam>& audioStates = scratch.mAudioStates;
+	audioStates.clear();
+	UINT64 menuItemKey = GetMenuItemKey(menuItem);
+	PlanCache::PlanPtr pPlan = pDisplayConfig ? g_PlanCache.Find(menuItemKey, fingerprint) : NULL;
+
+	// The fingerprint only covers active paths, so a plan that enables a target is checked
+	// against the full view before it's trusted.
+	if (pPlan && pPlan->mEnablesDisplay)
+		pDisplayConfig->UpgradeToAllPaths();
+
+	if (pPlan && !pDisplayConfig->CanLoadPlan(*pPlan))
+	{
+		LogMessage(L"Cached display plan no longer matches the connected displays.");
+		pPlan = NULL;
+	}
+
+	if (pPlan)
+	{
+		if (g_log.is_open())
+			LogMessage(L"Using cached display plan.");
+		pDisplayConfig->LoadPlan(*pPlan);
+		PlanMenuItem(menuItem, NULL, &audioStates, pCancel, false);
+	}
+	else if (PlanMenuItem(menuItem, pDisplayConfig, &audioStates, pCancel, false) && pDisplayConfig)
+	{
+		g_PlanCache.Insert(menuItemKey, fingerprint, 
+			std::make_shared<const DisplayConfig::Plan>(pDisplayConfig->GetPlan()));
+	}
+
+	if (pCancel && pCancel->IsCancelled())
+	{
+		LogMessage(L"Cancelled Option: " + menuItem.GetWideName());
+		return;
+	}
+
+	TransitionGraph& graph = scratch.mGraph;
+	graph.Clear();
+	bool displayChanging = pDisplayConfig && pDisplayConfig->HasChanged();
+	bool displayEnabling = displayChanging && pDisplayConfig->ChangesWillEnableDisplay();
+	TransitionGraph::NodeId applyNode = 0;
+
+	if (displayChanging)
+	{
+		applyNode = graph.AddNode(L"DisplayConfig apply", [pDisplayConfig, fingerprint, pCancel]()
+		{
+			return ApplyDisplayTransition(*pDisplayConfig, fingerprint, pCancel);
+		});
+
+		// Let the display settle before the next transition is picked up. A newer request
+		// cancels the wait.
+		DWORD settleMs = MIN_DISPLAY_CHANGE_SETTLE_TIME;
+		if (displayEnabling)
+			settleMs += ENABLE_DISPLAY_SETTLE_TIME;
+
+		TransitionGraph::NodeId settleNode = graph.AddNode(L"DisplayConfig settle", [pCancel, settleMs]()
+		{
+			return WaitUnlessCancelled(pCancel, settleMs);
+		});
+		graph.AddDependency(settleNode, applyNode);
+	}
+
+	vector<TransitionGraph::NodeId>& readyDependencies = scratch.mReadyDependencies;
+	readyDependencies.clear();
+	if (displayChanging)
+		readyDependencies.push_back(applyNode);
+
+	for (const SetDefaultAudioDeviceParam& param : audioStates)
+	{
+		bool dependsOnDisplay = param.mWaitForDisplay && displayEnabling;
+
+		TransitionGraph::NodeId audioNode = graph.AddNode(L"DefaultAudioDevice", *param.mpAudioDeviceName, 
+			[&param, dependsOnDisplay, pCancel]()
+		{
+			if (dependsOnDisplay && !WaitUnlessCancelled(pCancel, param.mDelayMs))
+				return false;
+
+			SetDefaultAudioDevice(param, pCancel);
+			return true;
+		});
+
+		if (dependsOnDisplay)
+			graph.AddDependency(audioNode, applyNode);
+		readyDependencies.push_back(audioNode);
+	}
+
+	if (onReady)
+	{
+		TransitionGraph::NodeId readyNode = graph.AddNode(L"Ready", [&onReady]()
+		{
+			onReady();
+			return true;
+		});
+
+		for (TransitionGraph::NodeId dependency : readyDependencies)
+			graph.AddDependency(readyNode, dependency);
+	}
+
+	graph.Run(pCancel);
+	graph.Clear();
+
+	if (g_log.is_open())
+		LogMessage(L"Finished Option: " + menuItem.GetWideName());
+}
+
+ULONG GetMenuItemDomains(const UserConfig::MenuItem& menuItem)
+{
+	ULONG domains = 0;
+
+	for (const UserConfig::State& state : menuItem.GetTargetStates())
+	{
+		if (state.GetType() == "DefaultAudioDevice")
+			domains |= StateDomain_Audio;
+		else
+			domains |= StateDomain_Display;
+	}
+
+	return domains;
+}
+
+// Plans every display item against the topology as it is now, so the next pick from it
+// is a cache hit.
+void PlanAllMenuItems(const CancelToken& cancel)
+{
+	TopologyModel::SnapshotPtr pBase;
+
+	try {
+		pBase = g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS);
+	} catch (const std::exception&) {
+		return;
+	}
+
+	UINT64 fingerprint = pBase->mFingerprint;
+	const vector<UserConfig::MenuItem>& menuItems = g_Config.GetMenuItems();
+
+	for (size_t i = 0; i < menuItems.size() && !cancel.IsCancelled(); ++i)
+	{
+		if (!(GetMenuItemDomains(menuItems[i]) & StateDomain_Display) || g_PlanCache.Find(GetMenuItemKey(menuItems[i]), fingerprint))
+			continue;
+
+		DisplayConfig config(pBase->mConfig);
+		if (!PlanMenuItem(menuItems[i], &config, NULL, &cancel, true))
+			continue;
+
+		g_PlanCache.Insert(GetMenuItemKey(menuItems[i]), fingerprint, std::make_shared<const DisplayConfig::Plan>(config.GetPlan()));
+
+		// Validating doesn't touch the displays, so the verdict can be ready in advance too.
+		if (config.HasChanged())
+		{
+			LONG rc = config.Validate(&cancel);
+			if (IsDefiniteVerdict(rc))
+				g_PlanCache.InsertVerdict(config.GetPayloadHash(), fingerprint, rc);
+		}
+	}
+
+	if (!cancel.IsCancelled())
+		g_PlanCache.Save();
+}
+
+void QueueSpeculativePlanning()
+{
+	g_Executor.Submit(ApplyExecutor::LANE_BACKGROUND, StateDomain_Display, L"Speculative planning",
+		[](const CancelToken& cancel) { PlanAllMenuItems(cancel); });
+}
+
+// Hands the item to the apply executor so the UI thread returns immediately.
+void QueueUserConfigMenuItem(const UserConfig::MenuItem& menuItem)
+{
+	const UserConfig::MenuItem* pMenuItem = &menuItem;
+
+	g_Executor.Submit(ApplyExecutor::LANE_USER, GetMenuItemDomains(menuItem), Widen(menuItem.GetName()),
+		[pMenuItem](const CancelToken& cancel) 
+	{
+		// A pick that sets the displays supersedes any undo or redo it cancelled.
+		if (GetMenuItemDomains(*pMenuItem) & StateDomain_Display)
+		{
+			AcquireSRWLockExclusive(&g_HistoryStepLock);
+			g_PendingHistorySteps = 0;
+			ReleaseSRWLockExclusive(&g_HistoryStepLock);
+		}
+
+		HandleUserConfigMenuItemPicked(*pMenuItem, &cancel);
+
+		// The topology has most likely moved on; plan ahead for the one we're in now.
+		QueueSpeculativePlanning();
+	});
+}
+
+/* -undo and -redo add up rather than supersede one another: each adds to the steps
+   pending, and whichever queued step runs takes them all. A step cancelled by the next
+   one before it moved anything puts its steps back for that one to take.
+*/
+void QueueDisplayHistoryStep(int steps)
+{
+	AcquireSRWLockExclusive(&g_HistoryStepLock);
+	g_PendingHistorySteps += steps;
+	ReleaseSRWLockExclusive(&g_HistoryStepLock);
+
+	g_Executor.Submit(ApplyExecutor::LANE_USER, StateDomain_Display, steps < 0 ? L"Undo display change" : L"Redo display change",
+		[](const CancelToken& cancel)
+	{
+		AcquireSRWLockExclusive(&g_HistoryStepLock);
+		int pending = g_PendingHistorySteps;
+		g_PendingHistorySteps = 0;
+		ReleaseSRWLockExclusive(&g_HistoryStepLock);
+
+		// An undo and a redo cancelled out.
+		if (!pending)
+			return;
+
+		if (!StepDisplayHistory(pending, &cancel))
+		{
+			AcquireSRWLockExclusive(&g_HistoryStepLock);
+			g_PendingHistorySteps += pending;
+			ReleaseSRWLockExclusive(&g_HistoryStepLock);
+			return;
+		}
+
+		QueueSpeculativePlanning();
+	});
+}
+
+// Opens the journal for this process's baseline, unless another instance has it.
+void OpenRestoreJournal()
+{
+	if (g_RestoreJournal.IsOpen())
+		return;
+
+	RestoreJournal::Baseline leftover;
+	if (g_RestoreJournal.Open(RESTORE_JOURNAL_FILE_NAME, &leftover) && !leftover.IsEmpty())
+		LogMessage(L"Restore journal had a baseline nobody restored; it's replaced by this one.");
+}
+
+void JournalDisplayBaseline()
+{
+	OpenRestoreJournal();
+	g_RestoreJournal.RecordDisplayBaseline(
+		g_RestoreState.pInitialDisplayConfig->GetTopologyState(), g_RestoreState.pInitialDisplayConfig->GetPlan());
+}
+
+void JournalAudioBaseline()
+{
+	OpenRestoreJournal();
+	g_RestoreJournal.RecordAudioBaseline(g_RestoreState.pDefaultDevice);
+}
+
+// if pMenuItemName is provided, limit the scope of saving state to things affected by pMenuItemName
+void SaveState(wstring menuItemName = L"")
+{
+	if (menuItemName != L"")
+	{
+#pragma warning( disable : 4244 )
+		string menuItemNameA(menuItemName.begin(), menuItemName.end());
+		const UserConfig::MenuItem* pMenuItem = g_Config.GetMenuItem(menuItemNameA);
+
+		for (auto& state : pMenuItem->GetTargetStates())
+		{
+			if (!g_RestoreState.pInitialDisplayConfig && (
+				state.GetType() == "PrimaryDisplay" ||
+				state.GetType() == "DisplaySettings"))
+			{
+				g_RestoreState.pInitialDisplayConfig = new DisplayConfig(
+					g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS)->mConfig);
+				JournalDisplayBaseline();
+			}
+
+			if (!g_RestoreState.pDefaultDevice && (
+				state.GetType() == "DefaultAudioDevice"))
+			{
+				if (FAILED(GetDefaultAudioPlaybackDevice(&g_RestoreState.pDefaultDevice)))
+					throw runtime_error("Cannot get default audio device.");
+				JournalAudioBaseline();
+			}
+		}
+	}
+	else
+	{
+		g_RestoreState.pInitialDisplayConfig = new DisplayConfig(
+			g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS)->mConfig);
+		JournalDisplayBaseline();
+
+		if (SUCCEEDED(GetDefaultAudioPlaybackDevice(&g_RestoreState.pDefaultDevice)))
+			JournalAudioBaseline();
+	}
+}
+
+// Only the targets that moved since the baseline are touched.
+void RestoreInitialState()
+{
+	if (g_RestoreState.pDefaultDevice)
+	{
+		ChangeDefaultAudioDevice(g_RestoreState.pDefaultDevice, false);
+		delete g_RestoreState.pDefaultDevice;
+		g_RestoreState.pDefaultDevice = NULL;
+	}
+
+	if (g_RestoreState.pInitialDisplayConfig)
+	{
+		LONG rc = DisplayTransaction::RestoreTopology(
+			g_RestoreState.pInitialDisplayConfig->GetTopologyState(), g_RestoreState.pInitialDisplayConfig->GetPlan());
+		if (rc != ERROR_SUCCESS)
+			LogMessage(L"Could not restore the initial displays: " + g_RestoreState.pInitialDisplayConfig->DescribeApplyError(rc));
+
+		g_TopologyModel.Invalidate();
+		delete g_RestoreState.pInitialDisplayConfig;
+		g_RestoreState.pInitialDisplayConfig = NULL;
+	}
+
+	g_RestoreJournal.RecordRestored();
+	g_RestoreJournal.Close();
+}
+
+/* A previous instance that died before RestoreInitialState left its baseline in the
+   journal. Put it back now, diffed against the live topology like a normal restore.
+   An instance that's still running holds the journal, so its baseline is never taken.
+*/
+void ReplayRestoreJournal()
+{
+	RestoreJournal::Baseline leftover;
+
+	if (!g_RestoreJournal.Open(RESTORE_JOURNAL_FILE_NAME, &leftover))
+		return;
+
+	if (!leftover.IsEmpty())
+	{
+		LogMessage(L"Restoring the state an earlier instance left behind, " + 
+			to_wstring(leftover.mTransitions) + L" transitions ago.");
+
+		if (leftover.mHasAudio)
+			ChangeDefaultAudioDevice(leftover.mAudioDevice, true);
+
+		if (leftover.mHasDisplay)
+		{
+			LONG rc = DisplayTransaction::RestoreTopology(leftover.mDisplay, leftover.mDisplayPlan);
+			if (rc != ERROR_SUCCESS)
+				LogMessage(L"Could not restore the earlier displays. Error Code:" + to_wstring(rc));
+			g_TopologyModel.Invalidate();
+		}
+
+		g_RestoreJournal.RecordRestored();
+	}
+
+	g_RestoreJournal.Close();
+}
+
+void Apply(wstring menuItemName, const std::function<void()>& onReady = nullptr)
+{
+	string menuItemNameA(menuItemName.begin(), menuItemName.end());
+	const UserConfig::MenuItem* pMenuItem = g_Config.GetMenuItem(menuItemNameA);
+
+	if (!pMenuItem)
+	{
+		string narrow(menuItemName.begin(), menuItemName.end());
+		throw runtime_error(string() + "Menu item name: " + narrow + " not found.");
+		return;
+	}
+
+	HandleUserConfigMenuItemPicked(*pMenuItem, NULL, onReady);
+	Sleep(MIN_SETTLE_TIME);
+}
+
+/* What a -setuntilexit layer covers: every target the item's display states name, and
+   any other target the apply moved (e.g. when a new primary shifted it), each as the
+   apply left it. Naming a target claims it even if it was already as asked.
+*/
+DisplayConfig::TopologyDiff GetProfileLayerDisplay(const UserConfig::MenuItem& menuItem,
+	const DisplayConfig& before, const DisplayConfig& after)
+{
+	DisplayConfig::TopologyState afterState = after.GetTopologyState();
+	DisplayConfig::TopologyDiff layer = DisplayConfig::DiffTopology(before.GetTopologyState(), afterState);
+
+	for (const UserConfig::State& state : menuItem.GetTargetStates())
+	{
+		if (state.GetType() != "DisplaySettings" && state.GetType() != "PrimaryDisplay")
+			continue;
+
+		DisplayConfig::DeviceId target;
+		try {
+			target = FindTarget(after, GetRequiredField(state, "Target"));
+		} catch (const std::exception&) {}
+
+		if (!target.IsValid() ||
+			std::find(layer.mDisable.begin(), layer.mDisable.end(), target) != layer.mDisable.end() ||
+			std::any_of(layer.mChange.begin(), layer.mChange.end(),
+				[&target](const DisplayConfig::TargetState& changed) { return changed.mTarget == target; }))
+		{
+			continue;
+		}
+
+		auto current = std::find_if(afterState.begin(), afterState.end(),
+			[&target](const DisplayConfig::TargetState& candidate) { return candidate.mTarget == target; });
+
+		if (current != afterState.end())
+			layer.mChange.push_back(*current);
+		else
+			layer.mDisable.push_back(target);
+	}
+
+	return layer;
+}
+
+// Puts back what the profile stack says lies under the layers that were dropped.
+void ApplyProfileRestore(const ProfileStack::Restore& restore)
+{
+	if (restore.IsEmpty())
+		return;
+
+	if (restore.mHasAudio)
+		ChangeDefaultAudioDevice(restore.mAudioDevice, true);
+
+	LONG rc = ERROR_SUCCESS;
+
+	if (restore.mRestoreBase)
+	{
+		rc = DisplayTransaction::RestoreTopology(restore.mBaseDisplay, restore.mBasePlan);
+	}
+	else if (!restore.mDisplay.IsEmpty())
+	{
+		try {
+			DisplayConfig config(g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS)->mConfig);
+			DisplayConfig::TopologyState desired = config.GetTopologyState();
+			DisplayConfig::PatchTopology(desired, restore.mDisplay);
+			config.MoveToTopologyState(desired);
+
+			if (config.HasChanged())
+				rc = config.Apply(true);
+		} catch (const std::exception& e) {
+			LogMessage(L"Profile stack: " + Widen(e.what()));
+			rc = ERROR_GEN_FAILURE;
+		}
+	}
+
+	if (rc != ERROR_SUCCESS)
+		LogMessage(L"Could not put back the displays under the dropped profiles. Error Code:" + to_wstring(rc));
+
+	g_TopologyModel.Invalidate();
+}
+
+/* -setuntilexit: applies the item as a layer on the profile stack, to be taken off again
+   by ReleaseProfileLayer. The base is taken by whichever session finds the stack empty.
+
+   With launch, the layer belongs to the hosted program it starts, which is launched as
+   soon as the profile is applied. launch returns the program's session, or 0 if it
+   didn't start, in which case the layer comes straight off again.
+*/
+void ApplyProfileLayer(const wstring& menuItemName, const std::function<UINT32()>& launch = nullptr)
+{
+	string menuItemNameA(menuItemName.begin(), menuItemName.end());
+	const UserConfig::MenuItem* pMenuItem = g_Config.GetMenuItem(menuItemNameA);
+
+	if (!pMenuItem)
+		throw runtime_error(string() + "Menu item name: " + menuItemNameA + " not found.");
+
+	UINT32 session = 0;
+	bool launched = false;
+	std::function<void()> onReady = [&launch, &session, &launched]()
+	{
+		if (launch && !launched)
+		{
+			launched = true;
+			session = launch();
+		}
+	};
+
+	if (!g_ProfileStack.Open(PROFILE_STACK_FILE_NAME) || !g_ProfileStack.Lock())
+	{
+		// On its own, this session can still put back what it found.
+		SaveState(menuItemName);
+		Apply(menuItemName, onReady);
+		onReady();
+		return;
+	}
+
+	try
+	{
+		ProfileStack::Restore pruned;
+		g_ProfileStack.Prune(&pruned);
+		ApplyProfileRestore(pruned);
+
+		TopologyModel::SnapshotPtr pBefore = g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS);
+
+		if (g_ProfileStack.IsEmpty())
+		{
+			SingleFlight<DefaultAudioEndpoint>::ResultPtr pAudio = QueryDefaultAudioEndpoint();
+			g_ProfileStack.SetBase(pBefore->mConfig.GetTopologyState(), pBefore->mConfig.GetPlan(),
+				SUCCEEDED(pAudio->mHr), pAudio->mFriendlyName);
+		}
+
+		Apply(menuItemName, onReady);
+		// In case the transition ended before it got there.
+		onReady();
+
+		ProfileStack::Owner owner = ProfileStack::Owner::GetCurrent(session);
+
+		if (g_ProfileStack.Share(owner, menuItemName))
+		{
+			LogMessage(L"Profile stack: sharing the layer for " + menuItemName);
+		}
+		else
+		{
+			TopologyModel::SnapshotPtr pAfter = g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS);
+			bool hasAudio = (GetMenuItemDomains(*pMenuItem) & StateDomain_Audio) != 0;
+			wstring audioDevice;
+
+			if (hasAudio)
+			{
+				SingleFlight<DefaultAudioEndpoint>::ResultPtr pAudio = QueryDefaultAudioEndpoint();
+				hasAudio = SUCCEEDED(pAudio->mHr);
+				audioDevice = pAudio->mFriendlyName;
+			}
+
+			g_ProfileStack.Push(owner, menuItemName, 
+				GetProfileLayerDisplay(*pMenuItem, pBefore->mConfig, pAfter->mConfig), hasAudio, audioDevice);
+			LogMessage(L"Profile stack: " + menuItemName + L" is layer " + to_wstring(g_ProfileStack.GetLayerCount()));
+		}
+
+		if (!launch)
+		{
+			g_HoldsProfileLayer = true;
+		}
+		else if (!session)
+		{
+			ProfileStack::Restore restore;
+			g_ProfileStack.Release(owner, &restore);
+			ApplyProfileRestore(restore);
+		}
+	}
+	catch (...)
+	{
+		g_ProfileStack.Unlock();
+		throw;
+	}
+
+	g_ProfileStack.Unlock();
+}
+
+// Session 0 is this instance's own -setuntilexit; others are hosted programs.
+void ReleaseProfileLayer(UINT32 session)
+{
+	if (!g_ProfileStack.Lock())
+		return;
+
+	ProfileStack::Restore restore;
+	g_ProfileStack.Release(ProfileStack::Owner::GetCurrent(session), &restore);
+	ApplyProfileRestore(restore);
+	g_ProfileStack.Unlock();
+}
+
+void ReleaseHostedChild(UINT32 session, const HostedChild& child)
+{
+	if (child.mHoldsLayer)
+		ReleaseProfileLayer(session);
+
+	if (child.mExitEvent)
+	{
+		SetEvent(child.mExitEvent);
+		CloseHandle(child.mExitEvent);
+	}
+}
+
+// At exit: this instance's layer, and those of hosted programs still running, which
+// outlive the host.
+void ReleaseProfileLayers()
+{
+	AcquireSRWLockExclusive(&g_HostedLock);
+	map<UINT32, HostedChild> children;
+	children.swap(g_HostedChildren);
+	vector<pair<UINT32, HostedChild>> exits;
+	exits.swap(g_PendingHostedExits);
+	ReleaseSRWLockExclusive(&g_HostedLock);
+
+	for (const auto& exited : exits)
+		ReleaseHostedChild(exited.first, exited.second);
+
+	for (const auto& child : children)
+		ReleaseHostedChild(child.first, child.second);
+
+	if (g_HoldsProfileLayer)
+	{
+		ReleaseProfileLayer(0);
+		g_HoldsProfileLayer = false;
+	}
+}
+
+// Takes off the layers of sessions that ended without releasing them.
+void PruneProfileStack()
+{
+	if (GetFileAttributes(PROFILE_STACK_FILE_NAME) == INVALID_FILE_ATTRIBUTES)
+		return;
+
+	if (!g_ProfileStack.Open(PROFILE_STACK_FILE_NAME) || !g_ProfileStack.Lock())
+		return;
+
+	ProfileStack::Restore restore;
+	g_ProfileStack.Prune(&restore);
+	ApplyProfileRestore(restore);
+	g_ProfileStack.Unlock();
+}
+
+void ReportHostedLaunchError(const wstring& commandLine, DWORD error)
+{
+	wstring errorText;
+
+	switch (error)
+	{
+	case ERROR_FILE_NOT_FOUND:
+		errorText = L"executable file not found.";
+		break;
+	case ProcessHost::LAUNCH_TOO_MANY_CHILDREN:
+		errorText = L"too many programs are already running under AvSelect.";
+		break;
+	default:
+		errorText = to_wstring(error);
+	}
+
+	ErrorMsg(wstring() + L"CreateProcess on: \r\n" + commandLine +
+		L"\r\nFailed With Error:" + errorText);
+}
+
+/* Applies the request's profile and starts its program as soon as the displays are set,
+   so the program's own startup overlaps the displays settling. With -setuntilexit the
+   profile is a layer on the profile stack belonging to the program, taken off again
+   when it exits. hExitEvent, if given, is set then, or straight away if it never starts.
+   Returns whether the program started.
+*/
+bool LaunchHosted(const HostRequest& request, HANDLE hExitEvent)
+{
+	UINT32 session = 0;
+	bool launched = false;
+
+	auto launch = [&request, hExitEvent, &session, &launched]() -> UINT32
+	{
+		if (launched)
+			return session;
+		launched = true;
+
+		UINT32 processId = 0;
+		UINT32 error = 0;
+
+		// Held across the launch so that an exit, however quick, finds the record.
+		AcquireSRWLockExclusive(&g_HostedLock);
+		session = g_ProcessHost.Launch(request.mCommandLine, request.mWorkingDirectory, &processId, &error);
+		if (session)
+			g_HostedChildren[session] = HostedChild{ request.mUntilExit, hExitEvent };
+		ReleaseSRWLockExclusive(&g_HostedLock);
+
+		if (session)
+			LogMessage(L"Hosting process " + to_wstring(processId) + L" as session " + to_wstring(session) + L": " + request.mCommandLine);
+		else
+			ReportHostedLaunchError(request.mCommandLine, error);
+
+		return session;
+	};
+
+	try
+	{
+		if (request.mUntilExit)
+			ApplyProfileLayer(request.mProfile, launch);
+		else if (request.mProfile != L"")
+			Apply(request.mProfile, [&launch]() { launch(); });
+	}
+	catch (const runtime_error& ex)
+	{
+		// As before, a profile that can't be applied means no program either.
+		ErrorMsg(Widen(ex.what()));
+		launched = true;
+	}
+
+	launch();
+
+	if (!session && hExitEvent)
+	{
+		SetEvent(hExitEvent);
+		CloseHandle(hExitEvent);
+	}
+
+	return session != 0;
+}
+
+void OnHostedChildExit(UINT32 session, UINT32 exitCode)
+{
+	AcquireSRWLockExclusive(&g_HostedLock);
+	auto found = g_HostedChildren.find(session);
+	bool tracked = found != g_HostedChildren.end();
+	HostedChild child;
+	if (tracked)
+	{
+		child = found->second;
+		g_HostedChildren.erase(found);
+	}
+	ReleaseSRWLockExclusive(&g_HostedLock);
+
+	if (!tracked)
+		return;
+
+	LogMessage(L"Hosted session " + to_wstring(session) + L" exited with code " + to_wstring(exitCode));
+
+	if (!g_HostingInTray)
+	{
+		ReleaseHostedChild(session, child);
+		return;
+	}
+
+	// Restoring the displays is too slow for the host's thread, and belongs with the
+	// tray's other transitions anyway. Submissions collapse, so each task takes
+	// whatever has piled up.
+	AcquireSRWLockExclusive(&g_HostedLock);
+	g_PendingHostedExits.push_back(make_pair(session, child));
+	ReleaseSRWLockExclusive(&g_HostedLock);
+
+	g_Executor.Submit(ApplyExecutor::LANE_RESTORE, StateDomain_Hosting, L"Release hosted profiles",
+		[](const CancelToken&)
+	{
+		AcquireSRWLockExclusive(&g_HostedLock);
+		vector<pair<UINT32, HostedChild>> exits;
+		exits.swap(g_PendingHostedExits);
+		ReleaseSRWLockExclusive(&g_HostedLock);
+
+		for (const auto& exited : exits)
+			ReleaseHostedChild(exited.first, exited.second);
+	});
+}
+
+// A -run handed over by another instance; see HandOffHostRequest.
+void QueueHostRequest(const HostRequest& request)
+{
+	if (!g_ProcessHost.IsStarted() && !g_ProcessHost.Start(ProcessApi::Get(), OnHostedChildExit))
+	{
+		ErrorMsg(L"Could not start watching hosted programs.");
+		return;
+	}
+
+	AcquireSRWLockExclusive(&g_HostedLock);
+	g_PendingHostRequests.push_back(request);
+	ReleaseSRWLockExclusive(&g_HostedLock);
 
-	if (pDisplayConfig) {
-		bool wait = pDisplayConfig->HasChanged();
-		bool waitForEnable = pDisplayConfig->ChangesWillEnableDisplay();
-		ApplyDisplayConfig(*pDisplayConfig);
+	g_Executor.Submit(ApplyExecutor::LANE_USER, StateDomain_Hosting, L"Host " + request.mCommandLine,
+		[](const CancelToken&)
+	{
+		AcquireSRWLockExclusive(&g_HostedLock);
+		vector<HostRequest> requests;
+		requests.swap(g_PendingHostRequests);
+		ReleaseSRWLockExclusive(&g_HostedLock);
 
-		if (g_log.is_open())
-			pDisplayConfig->LogState(g_log);
-	}
+		for (const HostRequest& pending : requests)
+		{
+			HANDLE hExitEvent = OpenEvent(EVENT_MODIFY_STATE, FALSE,
+				(HOSTED_EXIT_EVENT_PREFIX + to_wstring(pending.mRequesterId)).c_str());
+			LaunchHosted(pending, hExitEvent);
+		}
 
-	LogMessage(L"Finished Option: " + Widen(menuItem.GetName()));
+		QueueSpeculativePlanning();
+	});
+}
 
-	if (wait)
-		Sleep(MIN_DISPLAY_CHANGE_SETTLE_TIME);
-	if (waitForEnable)
-		Sleep(ENABLE_DISPLAY_SETTLE_TIME);
+void AppendPayloadString(vector<BYTE>& payload, const wstring& text)
+{
+	UINT32 length = (UINT32)text.length();
+	AppendPayload(payload, &length, 1);
+	AppendPayload(payload, text.c_str(), length);
 }
 
-// if pMenuItemName is provided, limit the scope of saving state to things affected by pMenuItemName
-void SaveState(wstring menuItemName = L"")
+bool ReadPayloadString(const BYTE*& pData, const BYTE* pEnd, wstring* pText)
 {
-	if (menuItemName != L"")
-	{
-#pragma warning( disable : 4244 )
-		string menuItemNameA(menuItemName.begin(), menuItemName.end());
-		const UserConfig::MenuItem* pMenuItem = g_Config.GetMenuItem(menuItemNameA);
+	UINT32 length = 0;
+	if (!ReadPayload(pData, pEnd, &length, 1) || (size_t)(pEnd - pData) / sizeof(WCHAR) < length)
+		return false;
 
-		for (auto& state : pMenuItem->GetTargetStates())
-		{
-			if (!g_RestoreState.pInitialDisplayConfig && (
-				Widen(state.GetType()) == L"PrimaryDisplay" ||
-				Widen(state.GetType()) == L"DisplaySettings"))
-			{
-				g_RestoreState.pInitialDisplayConfig = new DisplayConfig();
-			}
+	pText->resize(length);
+	return length == 0 || ReadPayload(pData, pEnd, &(*pText)[0], length);
+}
 
-			if (!g_RestoreState.pDefaultDevice && (
-				Widen(state.GetType()) == L"DefaultAudioDevice"))
-			{
-				if (FAILED(GetDefaultAudioPlaybackDevice(&g_RestoreState.pDefaultDevice)))
-					throw runtime_error("Cannot get default audio device.");
-			}
-		}
-	}
-	else
-	{
-		g_RestoreState.pInitialDisplayConfig = new DisplayConfig();
-		GetDefaultAudioPlaybackDevice(&g_RestoreState.pDefaultDevice);
-	}
+vector<BYTE> SerializeHostRequest(const HostRequest& request)
+{
+	vector<BYTE> payload;
+	UINT32 untilExit = request.mUntilExit ? 1 : 0;
+	AppendPayload(payload, &untilExit, 1);
+	AppendPayload(payload, &request.mRequesterId, 1);
+	AppendPayloadString(payload, request.mCommandLine);
+	AppendPayloadString(payload, request.mWorkingDirectory);
+	AppendPayloadString(payload, request.mProfile);
+	return payload;
 }
 
-void RestoreInitialState()
+bool DeserializeHostRequest(const BYTE* pData, size_t size, HostRequest* pRequest)
 {
-	if (g_RestoreState.pDefaultDevice)
+	const BYTE* pEnd = pData + size;
+	UINT32 untilExit = 0;
+
+	if (!ReadPayload(pData, pEnd, &untilExit, 1) ||
+		!ReadPayload(pData, pEnd, &pRequest->mRequesterId, 1) ||
+		!ReadPayloadString(pData, pEnd, &pRequest->mCommandLine) ||
+		!ReadPayloadString(pData, pEnd, &pRequest->mWorkingDirectory) ||
+		!ReadPayloadString(pData, pEnd, &pRequest->mProfile) ||
+		pData != pEnd)
 	{
-		ChangeDefaultAudioDevice(g_RestoreState.pDefaultDevice, false);
-		delete g_RestoreState.pDefaultDevice;
-		g_RestoreState.pDefaultDevice = NULL;
+		return false;
 	}
 
-	if (g_RestoreState.pInitialDisplayConfig)
-	{
-		g_RestoreState.pInitialDisplayConfig->Apply(true);
-		delete g_RestoreState.pInitialDisplayConfig;
-		g_RestoreState.pInitialDisplayConfig = NULL;
-	}
+	pRequest->mUntilExit = untilExit != 0;
+	return pRequest->mRequesterId != 0 && pRequest->mCommandLine != L"";
 }
 
-void Apply(wstring menuItemName)
+/* Compiles the DisplaySettings states of every MenuItem against the snapshot. Resolving
+   targets and parsing the settings is most of the cost of drawing the check marks, and
+   neither changes until the topology does, so the table is kept until the fingerprint
+   moves. Targets the active-only snapshot doesn't have are looked for among every
+   connected target; plugging one in doesn't move the fingerprint, so a table that had to
+   look is kept only for the epoch it looked in. Only the tray thread calls this.
+*/
+const DisplaySettingsTable& GetDisplaySettingsTable(const TopologyModel::SnapshotPtr& pSnapshot)
 {
-	string menuItemNameA(menuItemName.begin(), menuItemName.end());
-	const UserConfig::MenuItem* pMenuItem = g_Config.GetMenuItem(menuItemNameA);
+	static DisplaySettingsTable sTable;
+	static UINT64 sFingerprint = 0;
+	static bool sValid = false;
+	static bool sUsedAllPaths = false;
+	static UINT64 sEpoch = 0;
 
-	if (!pMenuItem)
+	const vector<UserConfig::MenuItem>& menuItems = g_Config.GetMenuItems();
+	UINT64 fingerprint = pSnapshot ? Fnv1a64Value(pSnapshot->mFingerprint, g_Config.GetContentHash()) : 0;
+
+	if (sValid && sFingerprint == fingerprint && sTable.GetItemCount() == menuItems.size() &&
+		(!sUsedAllPaths || sEpoch == pSnapshot->mEpoch))
+		return sTable;
+
+	sTable.Reset(menuItems.size());
+	TopologyModel::SnapshotPtr pAllPaths;
+
+	for (size_t i = 0; i < menuItems.size(); ++i)
 	{
-		string narrow(menuItemName.begin(), menuItemName.end());
-		throw runtime_error(string() + "Menu item name: " + narrow + " not found.");
-		return;
+		for (const UserConfig::State& state : menuItems[i].GetTargetStates())
+		{
+			if (state.IsOptional() || state.GetType() != "DisplaySettings")
+				continue;
+
+			try
+			{
+				if (!pSnapshot) throw std::runtime_error("");
+				const DisplayConfig& config = pSnapshot->mConfig;
+				const UserConfig::Field& target = GetRequiredField(state, "Target");
+				DisplayConfig::DeviceId targetDeviceId = FindTarget(config, target);
+
+				// Connected but inactive is added as an invalid target, which only matches
+				// a state that wants it disabled. Not connected at all, the item fails.
+				if (!targetDeviceId.IsValid())
+				{
+					if (!pAllPaths)
+						pAllPaths = g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS);
+					FindRequiredTarget(pAllPaths->mConfig, target);
+				}
+
+				sTable.Add(i, targetDeviceId, ParseDisplaySettings(config, state));
+			} catch (const std::exception&) { sTable.SetFailed(i); break; }
+		}
 	}
 
-	HandleUserConfigMenuItemPicked(*pMenuItem);
-	Sleep(MIN_SETTLE_TIME);
+	sFingerprint = fingerprint;
+	sValid = pSnapshot != NULL;
+	sUsedAllPaths = pAllPaths != NULL;
+	sEpoch = pSnapshot ? pSnapshot->mEpoch : 0;
+	return sTable;
 }
 
 void ShowContextMenu(HWND hWnd)
 {
-	std::unique_ptr<DisplayConfig> pDisplayConfig;
+	TopologyModel::SnapshotPtr pSnapshot;
 
 	try {
-		pDisplayConfig.reset(new DisplayConfig);
+		pSnapshot = g_TopologyModel.Acquire();
 	} catch (...) {}
 
+	const DisplayConfig* pDisplayConfig = pSnapshot ? &pSnapshot->mConfig : NULL;
+
+	// Looked up once for the whole menu, and only if some item needs it.
+	SingleFlight<DefaultAudioEndpoint>::ResultPtr pDefaultAudio;
+
 	POINT pt;
 	GetCursorPos(&pt);
 	HMENU hMenu = CreatePopupMenu();
 	if(!hMenu)
 		return;
 
+	const DisplaySettingsTable& displaySettings = GetDisplaySettingsTable(pSnapshot);
+	vector<bool> displaySettingsCurrent = displaySettings.Evaluate(
+		pDisplayConfig ? pDisplayConfig->GetTopologyState() : DisplayConfig::TopologyState());
+
 	int dynamicCommandIndex = 0;
 	for (const UserConfig::MenuItem& item : g_Config.GetMenuItems())
 	{
 		ULONG flags = MF_BYPOSITION | MF_CHECKED;
 
+		if (!displaySettingsCurrent[dynamicCommandIndex])
+			flags &= ~MF_CHECKED;
+
 		for (const UserConfig::State& state : item.GetTargetStates())
 		{
-			if (state.IsOptional())
+			if (state.IsOptional() || !(flags & MF_CHECKED))
 			{
 				continue;
 			}
 
+			// An undo is an action, not a state the PC can be in.
+			if (IsDisplayHistoryState(state))
+			{
+				flags &= ~MF_CHECKED;
+				break;
+			}
+
 			try
 			{
 				if (state.GetType() == "DefaultAudioDevice")
 				{
 					if (!pDisplayConfig) throw std::runtime_error("");
-					UserConfig::Field device = GetRequiredField(state, "AudioDevice");
+					const UserConfig::Field& device = GetRequiredField(state, "AudioDevice");
 					string name;
 					ReadValue(&device, "FriendlyName", name, true);
 
-					PWSTR defaultDevice = NULL;
-					HRESULT hr = GetDefaultAudioPlaybackDevice(&defaultDevice);
-					if (SUCCEEDED(hr))
+					if (!pDefaultAudio)
+						pDefaultAudio = QueryDefaultAudioEndpoint();
+
+					if (SUCCEEDED(pDefaultAudio->mHr))
 					{
-						if (!WildcardMatch(defaultDevice, Widen(name).c_str()))
+						if (!WildcardMatch(pDefaultAudio->mFriendlyName.c_str(), Widen(name).c_str()))
 						{
 							flags &= ~MF_CHECKED;
 							break;
@@ -633,7 +1948,7 @@ void ShowContextMenu(HWND hWnd)
 				else if (state.GetType() == "PrimaryDisplay")
 				{
 					if (!pDisplayConfig) throw std::runtime_error("");
-					UserConfig::Field target = GetRequiredField(state, "Target");
+					const UserConfig::Field& target = GetRequiredField(state, "Target");
 					DisplayConfig::DeviceId targetDeviceId = FindRequiredTarget(*pDisplayConfig, target);
 					
 					if (targetDeviceId != pDisplayConfig->GetPrimaryTarget())
@@ -642,19 +1957,6 @@ void ShowContextMenu(HWND hWnd)
 						break;
 					}
 				}
-				else if (state.GetType() == "DisplaySettings")
-				{
-					if (!pDisplayConfig) throw std::runtime_error("");
-					UserConfig::Field target = GetRequiredField(state, "Target");
-					DisplayConfig::DeviceId targetDeviceId = FindRequiredTarget(*pDisplayConfig, target);
-					DisplayConfig::DisplaySettings& settings = ParseDisplaySettings(*pDisplayConfig, state);
-
-					if (!pDisplayConfig->AreDisplaySettingsCurrent(targetDeviceId, settings))
-					{
-						flags &= ~MF_CHECKED;
-						break;
-					}
-				}
 			} catch (const std::exception&) { flags &= ~MF_CHECKED; }
 		}
 
@@ -672,6 +1974,13 @@ void ShowContextMenu(HWND hWnd)
 	DestroyMenu(hMenu);
 }
 
+// Lets a second instance step this one's display history, since only this one has it.
+UINT GetDisplayHistoryMessage()
+{
+	static UINT sMessage = RegisterWindowMessage(DISPLAY_HISTORY_MESSAGE_NAME);
+	return sMessage;
+}
+
 // Message handler for the app, and PC Config window
 INT_PTR CALLBACK DlgProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 {
@@ -692,14 +2001,14 @@ INT_PTR CALLBACK DlgProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 		wmEvent = LOWORD(wParam);
 
 		if (wmEvent < g_Config.GetMenuItems().size())
-			HandleUserConfigMenuItemPicked(g_Config.GetMenuItems()[wmEvent]);
+			QueueUserConfigMenuItem(g_Config.GetMenuItems()[wmEvent]);
 		break;
 	case WM_APP:
 		switch(lParam)
 		{
 		case WM_LBUTTONDBLCLK:
 			if (g_Config.GetDoubleClickAction())
-				HandleUserConfigMenuItemPicked(*g_Config.GetDoubleClickAction());
+				QueueUserConfigMenuItem(*g_Config.GetDoubleClickAction());
 			break;
 		case WM_RBUTTONDOWN:
 		case WM_CONTEXTMENU:
@@ -735,11 +2044,34 @@ INT_PTR CALLBACK DlgProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 				unsigned int dynamicChoice = wmId - StaticMenuId_Max;
 
 				if (dynamicChoice < g_Config.GetMenuItems().size()) {
-					HandleUserConfigMenuItemPicked(g_Config.GetMenuItems()[dynamicChoice]);
+					QueueUserConfigMenuItem(g_Config.GetMenuItems()[dynamicChoice]);
 				}
 			}
 		}
 		return 1;
+	case WM_DEVICECHANGE:
+		// A monitor came or went; names cached for its connector no longer apply.
+		if (wParam == DBT_DEVNODES_CHANGED)
+		{
+			g_TargetNameCache.Invalidate();
+			g_TopologyModel.Invalidate();
+			g_HotplugEngine.OnDeviceEvent();
+			g_DriftGuard.OnDisplayChange();
+		}
+		break;
+	case WM_DISPLAYCHANGE:
+		g_TopologyModel.Invalidate();
+		g_HotplugEngine.OnDeviceEvent();
+		g_DriftGuard.OnDisplayChange();
+		break;
+	case WM_POWERBROADCAST:
+		// Drivers are most likely to have reset something on the way back from sleep.
+		if (wParam == PBT_APMRESUMEAUTOMATIC)
+		{
+			g_TopologyModel.Invalidate();
+			g_DriftGuard.OnDisplayChange();
+		}
+		break;
 	case WM_SIZE:
 	{
 		HWND hText = GetDlgItem(hWnd, IDC_CONFIGTEXT);
@@ -747,6 +2079,22 @@ INT_PTR CALLBACK DlgProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 		SetWindowPos(hText, 0, 0, 0, LOWORD(lParam), HIWORD(lParam), SWP_NOMOVE);
 		break;
 	}
+	case WM_COPYDATA:
+	{
+		// -run from another instance, which waits on the exit event it named.
+		const COPYDATASTRUCT* pCopy = (const COPYDATASTRUCT*)lParam;
+		HostRequest request;
+
+		if (pCopy->dwData != HOST_REQUEST_COPYDATA_ID ||
+			!DeserializeHostRequest((const BYTE*)pCopy->lpData, pCopy->cbData, &request))
+		{
+			break;
+		}
+
+		QueueHostRequest(request);
+		SetWindowLongPtr(hWnd, DWLP_MSGRESULT, TRUE);
+		return TRUE;
+	}
 	case WM_CLOSE:
 		ShowWindow(hWnd, SW_HIDE);
 		break;
@@ -755,6 +2103,11 @@ INT_PTR CALLBACK DlgProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 		Shell_NotifyIcon(NIM_DELETE,&g_NotifIconData);
 		PostQuitMessage(0);
 		break;
+	default:
+		// -undo and -redo from another instance.
+		if (message == GetDisplayHistoryMessage() && message)
+			QueueDisplayHistoryStep((int)(INT_PTR)wParam);
+		break;
 	}
 	return 0;
 }
@@ -813,6 +2166,11 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
 	if (g_Config.GetShouldRestoreOnExit())
 		SaveState();
 
+	if (!g_Executor.Start())
+		return FALSE;
+
+	QueueSpeculativePlanning();
+
 	// prepare for XP style controls
 	InitCommonControls();
 
@@ -871,42 +2229,77 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
 	return TRUE;
 }
 
-void HostProcess(wstring command, wstring workingDirectory)
+/* When the tray is running, it hosts the program, alongside any others it's hosting,
+   and this instance waits for the program to exit, as if it were hosting it itself.
+   Returns false if there's no tray to take it.
+*/
+bool HandOffHostRequest(HostRequest request)
 {
-	PWCHAR pBuffer = new WCHAR[command.length() + 1];
-	wcscpy_s(pBuffer, command.length() + 1, command.c_str());
+	HWND hTray = FindWindow(L"#32770", PC_CONFIGURATION_CAPTION);
+	if (!hTray)
+		return false;
 
-	STARTUPINFO si = {0};
-	PROCESS_INFORMATION pi = {0};
-	si.cb = sizeof(si);
+	DWORD trayId = 0;
+	GetWindowThreadProcessId(hTray, &trayId);
+	HANDLE hTrayProcess = OpenProcess(SYNCHRONIZE, FALSE, trayId);
 
-	if (CreateProcess(NULL, pBuffer, NULL, NULL, FALSE, 0, NULL,
-		workingDirectory.c_str(), &si, &pi))
-	{
-		CloseHandle(pi.hThread);
-		 
-		if (WaitForSingleObject(pi.hProcess, INFINITE) == WAIT_FAILED)
-			ErrorMsg(L"Wait for hosted Process failed, exiting...");
+	request.mRequesterId = GetCurrentProcessId();
+	HANDLE hExitEvent = CreateEvent(NULL, TRUE, FALSE,
+		(HOSTED_EXIT_EVENT_PREFIX + to_wstring(request.mRequesterId)).c_str());
 
-		CloseHandle(pi.hProcess);
-	}
-	else
+	if (!hTrayProcess || !hExitEvent)
 	{
-		wstring error;
+		if (hTrayProcess)
+			CloseHandle(hTrayProcess);
+		if (hExitEvent)
+			CloseHandle(hExitEvent);
+		return false;
+	}
 
-		switch (GetLastError())
-		{
-		case ERROR_FILE_NOT_FOUND:
-			error = L"executable file not found.";
-		default:
-			error = to_wstring(GetLastError());
-		}
+	vector<BYTE> payload = SerializeHostRequest(request);
+	COPYDATASTRUCT copy = {0};
+	copy.dwData = HOST_REQUEST_COPYDATA_ID;
+	copy.cbData = (DWORD)payload.size();
+	copy.lpData = &payload[0];
+
+	bool accepted = SendMessage(hTray, WM_COPYDATA, 0, (LPARAM)&copy) == TRUE;
+
+	if (accepted)
+	{
+		LogMessage(L"Handed " + request.mCommandLine + L" to the tray");
 
-		ErrorMsg(wstring() + L"CreateProcess on: \r\n" + pBuffer +
-			L"\r\nFailed With Error:" + error);
+		// If the tray goes, the program is on its own.
+		HANDLE handles[] = { hExitEvent, hTrayProcess };
+		if (WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, INFINITE) == WAIT_FAILED)
+			ErrorMsg(L"Wait for hosted Process failed, exiting...");
 	}
 
-	delete pBuffer;
+	CloseHandle(hExitEvent);
+	CloseHandle(hTrayProcess);
+	return accepted;
+}
+
+void RunHosted(const HostRequest& request)
+{
+	if (HandOffHostRequest(request))
+		return;
+
+	if (!g_ProcessHost.Start(ProcessApi::Get(), OnHostedChildExit))
+		throw runtime_error("could not start watching the hosted program");
+
+	if (LaunchHosted(request, NULL) && !g_ProcessHost.WaitUntilIdle(ProcessApi::INFINITE_WAIT))
+		ErrorMsg(L"Wait for hosted Process failed, exiting...");
+
+	g_ProcessHost.Stop();
+}
+
+void SendDisplayHistoryStep(int steps)
+{
+	HWND hTray = FindWindow(L"#32770", PC_CONFIGURATION_CAPTION);
+	if (!hTray || !GetDisplayHistoryMessage())
+		throw runtime_error("-undo and -redo need AvSelect running in the tray");
+
+	PostMessage(hTray, GetDisplayHistoryMessage(), (WPARAM)(INT_PTR)steps, 0);
 }
 
 BOOLEAN ParseCommandLine(LPWSTR commandLine)
@@ -924,16 +2317,52 @@ BOOLEAN ParseCommandLine(LPWSTR commandLine)
 		wstring stateToApply;
 		bool saveState = false;
 
+		// Already opened by wWinMain, before anything could want to log.
 		if (argCount > 1 && !_wcsicmp(szArgList[1], L"-log"))
+			++currentArg;
+
+		// Runs against an in-memory copy of the current displays, so transitions can be
+		// tried without switching anything.
+		if (argCount > currentArg && !_wcsicmp(szArgList[currentArg], L"-simulatedisplays"))
 		{
-			g_log.open("log.txt", fstream::out);
-			if (!g_log.is_open())
+			static SimulatedDisplayBackend simulatedBackend;
+			if (simulatedBackend.SeedFrom(DisplayBackend::Get()) != ERROR_SUCCESS)
+				throw runtime_error("-simulatedisplays could not read the current display configuration");
+
+			g_DeadlineBackend.SetInner(&simulatedBackend);
+			g_pSimulatedBackend = &simulatedBackend;
+			++currentArg;
+
+			// Unplugs and replugs a simulated display, to exercise the AutoApply rules.
+			if (argCount > currentArg && !_wcsicmp(szArgList[currentArg], L"-simulatehotplug"))
 			{
-				CHAR Buffer[MAX_PATH];
-				strerror_s(&Buffer[0], ARRAYSIZE(Buffer), errno);
-				ErrorMsg(L"Could not open log file: " + Widen(&Buffer[0]));
+				g_SimulateHotplug = true;
+				++currentArg;
+			}
+
+			// Fails the next count applies, to exercise the error and rollback paths.
+			if (argCount > currentArg && !_wcsicmp(szArgList[currentArg], L"-simulateapplyfail"))
+			{
+				++currentArg;
+				if (argCount <= currentArg || !iswdigit(szArgList[currentArg][0]))
+					throw runtime_error("-simulateapplyfail takes the number of applies to fail");
+
+				simulatedBackend.FailNextApplies(_wtoi(szArgList[currentArg]), ERROR_GEN_FAILURE);
+				++currentArg;
+			}
+
+			// Stalls the next count display calls for ms each, to exercise the deadlines
+			// (DisplayQueryTimeoutMs, DisplayApplyTimeoutMs).
+			if (argCount > currentArg && !_wcsicmp(szArgList[currentArg], L"-simulatestall"))
+			{
+				++currentArg;
+				if (argCount <= currentArg + 1 || 
+					!iswdigit(szArgList[currentArg][0]) || !iswdigit(szArgList[currentArg + 1][0]))
+					throw runtime_error("-simulatestall takes the number of calls to stall and the stall in ms");
+
+				simulatedBackend.StallNextCalls(_wtoi(szArgList[currentArg]), _wtoi(szArgList[currentArg + 1]));
+				currentArg += 2;
 			}
-			++currentArg;
 		}
 
 		if (argCount > currentArg + 2 && !_wcsicmp(szArgList[1], L"-nomessageboxes"))
@@ -942,6 +2371,26 @@ BOOLEAN ParseCommandLine(LPWSTR commandLine)
 			++currentArg;
 		}
 
+		// -undo [steps] and -redo [steps] hand off to the instance in the tray.
+		if (argCount > currentArg && 
+			(!_wcsicmp(szArgList[currentArg], L"-undo") || !_wcsicmp(szArgList[currentArg], L"-redo")))
+		{
+			int steps = 1;
+			bool undo = !_wcsicmp(szArgList[currentArg], L"-undo");
+			++currentArg;
+
+			if (argCount > currentArg && iswdigit(szArgList[currentArg][0]))
+			{
+				steps = _wtoi(szArgList[currentArg]);
+				if (steps < 1 || steps > TopologyHistory::MAX_STEPS)
+					throw runtime_error("-undo and -redo take between 1 and " + to_string(TopologyHistory::MAX_STEPS) + " steps");
+				++currentArg;
+			}
+
+			SendDisplayHistoryStep(undo ? -steps : steps);
+			rval = FALSE;
+		}
+
 		if (argCount >= currentArg + 2 && !_wcsicmp(szArgList[currentArg], L"-set"))
 		{
 			stateToApply = szArgList[currentArg + 1];
@@ -1004,14 +2453,19 @@ BOOLEAN ParseCommandLine(LPWSTR commandLine)
 
 		LocalFree(szArgList);
 
-		if (saveState)
-			SaveState(stateToApply);
-
-		if (stateToApply != L"")
-			Apply(stateToApply);
-
 		if (runCommand != L"")
-			HostProcess(runCommand, runWorkingDir);
+		{
+			HostRequest request;
+			request.mCommandLine = runCommand;
+			request.mWorkingDirectory = runWorkingDir;
+			request.mProfile = stateToApply;
+			request.mUntilExit = saveState;
+			RunHosted(request);
+		}
+		else if (saveState)
+			ApplyProfileLayer(stateToApply);
+		else if (stateToApply != L"")
+			Apply(stateToApply);
 	}
 	catch (const runtime_error& ex)
 	{
@@ -1022,11 +2476,226 @@ BOOLEAN ParseCommandLine(LPWSTR commandLine)
 	return rval;
 }
 
-BOOLEAN ParseConfig()
+bool ReadConnectedDevices(AutoProfileIndex::Connected* pConnected)
+{
+	TopologyModel::SnapshotPtr pSnapshot = g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS);
+
+	for (const DisplayConfig::TargetAuxInfo& target : pSnapshot->mConfig.GetAuxInfo())
+		pConnected->mDisplays.push_back(target.mFriendlyName);
+
+	// Joins any enumeration a transition already has under way.
+	SingleFlight<AudioEndpointList>::ResultPtr pEndpoints = QueryAudioEndpoints();
+	if (FAILED(pEndpoints->mHr))
+		return false;
+
+	for (const AudioPlaybackDevice& device : pEndpoints->mDevices)
+		pConnected->mEndpoints.push_back(device.mFriendlyName);
+
+	return true;
+}
+
+// Pulls out the first connected display that isn't the primary, then plugs it back in,
+// each time with the burst of events a real plug-in raises.
+DWORD WINAPI SimulateHotplugThreadProc(LPVOID)
+{
+	const UINT32 STORM_EVENTS = 8;
+	const DWORD STORM_INTERVAL_MS = 100;
+	DWORD pauseMs = STORM_EVENTS * STORM_INTERVAL_MS + g_Config.GetHotplugSettleMs() + 2000;
+
+	DisplayConfig::DeviceId target;
+
+	try
+	{
+		TopologyModel::SnapshotPtr pSnapshot = g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS);
+		DisplayConfig::DeviceId primary = pSnapshot->mConfig.GetPrimaryTarget();
+
+		for (const DisplayConfig::TargetAuxInfo& info : pSnapshot->mConfig.GetAuxInfo())
+		{
+			if (info.mId != primary)
+			{
+				target = info.mId;
+				break;
+			}
+		}
+	} catch (const std::exception& e) {
+		LogMessage(L"Simulated hotplug: " + Widen(e.what()));
+	}
+
+	if (!target.IsValid())
+	{
+		LogMessage(L"Simulated hotplug: no secondary display to unplug.");
+		return 0;
+	}
+
+	for (bool connected : { false, true })
+	{
+		Sleep(pauseMs);
+
+		LogMessage(wstring(L"Simulated hotplug: ") + (connected ? L"plugging in " : L"unplugging ") + target.ToWString());
+		g_pSimulatedBackend->SetTargetConnected(target.mAdapterId, target.mId, connected);
+		g_TargetNameCache.Invalidate();
+		g_TopologyModel.Invalidate();
+		g_HotplugEngine.SimulateEventStorm(STORM_EVENTS, STORM_INTERVAL_MS);
+	}
+
+	return 0;
+}
+
+void StartHotplugEngine()
+{
+	vector<AutoProfileIndex::Patterns> patterns(g_Config.GetMenuItems().size());
+
+	for (size_t i = 0; i < patterns.size(); ++i)
+	{
+		const UserConfig::MenuItem& item = g_Config.GetMenuItems()[i];
+		patterns[i].mDisplays.assign(item.GetAutoApplyTargets().begin(), item.GetAutoApplyTargets().end());
+		patterns[i].mEndpoints.assign(item.GetAutoApplyEndpoints().begin(), item.GetAutoApplyEndpoints().end());
+	}
+
+	bool started = g_HotplugEngine.Start(patterns, g_Config.GetHotplugSettleMs(),
+		ReadConnectedDevices,
+		[](const HotplugEngine::Decision& decision)
+	{
+		LogMessage(L"Connected devices changed (" + to_wstring(decision.mDisplayCount) + L" displays, " +
+			to_wstring(decision.mEndpointCount) + L" audio endpoints) after " + to_wstring(decision.mEvents) +
+			L" events; decided " + to_wstring(decision.mSinceFirstEventUs / 1000) + L"ms after the first, rule lookup took " +
+			to_wstring(decision.mLookupUs) + L"us.");
+
+		if (decision.mMenuItem == AutoProfileIndex::NO_MATCH)
+			return;
+
+		const UserConfig::MenuItem& item = g_Config.GetMenuItems()[decision.mMenuItem];
+		LogMessage(L"Devices plugged in or removed; applying " + Widen(item.GetName()));
+		QueueUserConfigMenuItem(item);
+	});
+
+	// Endpoints come and go without a device node change, e.g. when HDMI audio follows
+	// its display being enabled.
+	if (started && FAILED(WatchAudioPlaybackDevices([]() { g_HotplugEngine.OnDeviceEvent(); }, &g_pAudioEndpointWatcher)))
+		LogMessage(L"Audio endpoint changes won't be noticed until a display changes.");
+
+	if (started && g_SimulateHotplug && g_pSimulatedBackend)
+	{
+		HANDLE hThread = CreateThread(NULL, 0, SimulateHotplugThreadProc, NULL, 0, NULL);
+		if (hThread)
+			CloseHandle(hThread);
+	}
+}
+
+void StartDriftGuard()
+{
+	if (!g_Config.GetPinProfile())
+		return;
+
+	g_DriftGuard.Start(g_Config.GetPinCheckSeconds() * 1000, g_Config.GetHotplugSettleMs(), []()
+	{
+		g_Executor.Submit(ApplyExecutor::LANE_BACKGROUND, StateDomain_Display, L"Restore pinned profile",
+			[](const CancelToken& cancel) 
+		{
+			g_DriftGuard.Enforce(&cancel);
+		});
+	});
+
+	// Until a MenuItem is picked, keep the displays as they were found.
+	PinAppliedDisplays();
+}
+
+void LogHotplugStats()
+{
+	HotplugEngine::Stats hotplug = g_HotplugEngine.GetStats();
+
+	if (hotplug.mEvents)
+		LogMessage(L"Hotplug: " + to_wstring(hotplug.mEvents) + L" device events settled into " +
+			to_wstring(hotplug.mEvaluations) + L" evaluations and " + to_wstring(hotplug.mDecisions) +
+			L" decisions, " + to_wstring(hotplug.mLookupUs) + L"us in rule lookups.");
+
+	UINT64 checks, drifts, reapplies;
+	g_DriftGuard.GetStats(&checks, &drifts, &reapplies);
+
+	if (checks)
+		LogMessage(L"Pinned profile: " + to_wstring(checks) + L" checks, " + to_wstring(drifts) +
+			L" drifts found, " + to_wstring(reapplies) + L" restores.");
+}
+
+void OpenLog()
+{
+	g_log.open("log.txt", fstream::out);
+	if (!g_log.is_open())
+	{
+		CHAR Buffer[MAX_PATH];
+		strerror_s(&Buffer[0], ARRAYSIZE(Buffer), errno);
+		ErrorMsg(L"Could not open log file: " + Widen(&Buffer[0]));
+	}
+}
+
+/* Whether the command line applies at most one MenuItem and exits without a tray, and
+   which, so that only that one need be parsed. -setuntilexit on its own stays in the tray.
+   *pLog is whether it starts with -log.
+*/
+bool GetOneShotMenuItem(wstring* pMenuItemName, bool* pLog)
 {
+	*pLog = false;
+
+	int argCount;
+	LPWSTR* szArgList = CommandLineToArgvW(GetCommandLine(), &argCount);
+	if (!szArgList)
+		return false;
+
+	int currentArg = 1;
+	if (argCount > currentArg && !_wcsicmp(szArgList[currentArg], L"-log"))
+	{
+		*pLog = true;
+		++currentArg;
+	}
+
+	bool oneShot = false;
+
+	if (argCount > currentArg)
+	{
+		LPCWSTR pSwitch = szArgList[currentArg];
+
+		if (!_wcsicmp(pSwitch, L"-undo") || !_wcsicmp(pSwitch, L"-redo") ||
+			!_wcsicmp(pSwitch, L"-runworkingdir") || !_wcsicmp(pSwitch, L"-run"))
+		{
+			oneShot = true;
+		}
+		else if (argCount > currentArg + 1 && !_wcsicmp(pSwitch, L"-set"))
+		{
+			*pMenuItemName = szArgList[currentArg + 1];
+			oneShot = true;
+		}
+		else if (argCount > currentArg + 1 && !_wcsicmp(pSwitch, L"-setuntilexit"))
+		{
+			*pMenuItemName = szArgList[currentArg + 1];
+
+			for (int i = currentArg + 2; i < argCount; ++i)
+				oneShot = oneShot || !_wcsicmp(szArgList[i], L"-run");
+		}
+	}
+
+	LocalFree(szArgList);
+	return oneShot;
+}
+
+// pOneShotMenuItem, if given, is the only MenuItem the command line will use.
+BOOLEAN ParseConfig(const wstring* pOneShotMenuItem = NULL)
+{
+#ifdef AVSELECT_EMBEDDED_CONFIG
+	// Built with its config compiled in, checked when the build generated it.
+	g_Config.LoadEmbedded(g_EmbeddedConfig);
+	CompileConfigDisplaySettings();
+	return TRUE;
+#else
+	// Keyed by state, so none of it can outlive the config it was compiled from.
+	g_CompiledDisplaySettings.clear();
+
 	try
 	{
-		g_Config.ParseFile("config.xml");
+		if (pOneShotMenuItem)
+			g_Config.ParseFileFor("config.xml", string(pOneShotMenuItem->begin(), pOneShotMenuItem->end()));
+		else
+			g_Config.ParseFile("config.xml");
+		CompileConfigDisplaySettings();
 		return TRUE;
 	}
 	catch (const std::exception& ex)
@@ -1036,6 +2705,7 @@ BOOLEAN ParseConfig()
 		ErrorMsg(msg.c_str());
 		return FALSE;
 	}
+#endif
 }
 
 int APIENTRY wWinMain(
@@ -1046,21 +2716,45 @@ int APIENTRY wWinMain(
 {
 	MSG msg = {0};
 	HACCEL hAccelTable;
+	wstring oneShotMenuItem;
+	bool log;
+	bool oneShot = GetOneShotMenuItem(&oneShotMenuItem, &log);
+
+	// Before the config is parsed and the journal replayed, so what they report is kept.
+	if (log)
+		OpenLog();
 
-	ParseConfig();
+	if (ParseConfig(oneShot ? &oneShotMenuItem : NULL))
+		g_PlanCache.Load(PLAN_CACHE_FILE_NAME);
 
-	g_AbortAudioThreadEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	assert(g_AbortAudioThreadEvent);
+	// Nothing touches the displays except under a deadline.
+	g_DeadlineBackend.SetInner(&DisplayBackend::Get());
+	g_DeadlineBackend.SetBudgets(g_Config.GetDisplayQueryTimeoutMs(), g_Config.GetDisplayApplyTimeoutMs());
+	DisplayBackend::Install(&g_DeadlineBackend);
+
+	ReplayRestoreJournal();
+	PruneProfileStack();
 
 	if (!ParseCommandLine(lpCmdLine))
 		goto Out;
 
+	// The tray needs every item, in case the command line wasn't as one-shot as it looked.
+	if (g_Config.IsPartial() && !ParseConfig())
+		goto Out;
+
 	LogMessage(L"Starting up...");
 
 	// Perform application initialization:
 	if (!InitInstance(hInstance, nCmdShow))
 		goto Out;
 
+	StartHotplugEngine();
+	StartDriftGuard();
+	g_HostingInTray = true;
+
+	// The displays as they were found are as far back as undo goes.
+	RecordDisplayHistory();
+
 	hAccelTable = LoadAccelerators(hInstance, (LPCTSTR)ICON_TV);
 
 	// Main message loop:
@@ -1078,19 +2772,31 @@ int APIENTRY wWinMain(
 
 	LogMessage(L"Shutting down...");
 
+	StopWatchingAudioPlaybackDevices(g_pAudioEndpointWatcher);
+	g_pAudioEndpointWatcher = NULL;
+	g_HotplugEngine.Stop();
+	g_DriftGuard.Stop();
+	g_ProcessHost.Stop();
+	g_Executor.Shutdown();
+
 	if (g_Config.GetOnTrayExitAction())
 		Apply(Widen(g_Config.GetOnTrayExitAction()->GetName()));
 
+	ReleaseProfileLayers();
 	RestoreInitialState();
 
+	g_PlanCache.Save();
+	LogQueryStats();
+	LogHotplugStats();
+
 	if (g_Started)
 		CloseHandle(g_Started);
 
-	if (g_AbortAudioThreadEvent)
-		CloseHandle(g_AbortAudioThreadEvent);
-
+	// A deadline worker left behind by a stalled driver may still log.
+	AcquireSRWLockExclusive(&g_LogLock);
 	if (g_log.is_open())
 		g_log.close();
+	ReleaseSRWLockExclusive(&g_LogLock);
 
 	return (int)msg.wParam;
 }
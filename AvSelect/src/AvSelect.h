@@ -29,23 +29,26 @@ EXT_DEFINE_EXCEPTION(MissingArgumentException, std::runtime_error);
 EXT_DEFINE_EXCEPTION(InvalidArgumentException, std::runtime_error);
 
 std::wstring Widen(std::string s);
+void LogMessage(std::wstring msg);
+void ErrorMsg(std::wstring msg);
 
 typedef std::vector<std::pair<std::string, bool>> ParamList;
 
-void CheckRequiredValues(const UserConfig::Field field, ParamList valueList);
-UserConfig::Field GetRequiredField(const UserConfig::State state, std::string name);
-
-bool ReadValue(const UserConfig::Field* pField, std::string valueName, std::string& parsedValue, bool required = false);
-bool ReadValue(const UserConfig::Field* pField, std::string valueName, std::wstring& parsedValue, bool required = false);
-bool ReadValue(const UserConfig::Field* pField, std::string valueName, int& parsedValue, bool required = false);
-bool ReadValue(const UserConfig::Field* pField, std::string valueName, unsigned long& parsedValue, bool required = false);
-bool ReadValue(const UserConfig::Field* pField, std::string valueName, unsigned long long& parsedValue, bool required = false);
-bool ReadValue(const UserConfig::Field* pField, std::string valueName, bool& parsedValue, bool required = false);
-bool ReadValue(const UserConfig::Field* pField, std::string valueName, DISPLAYCONFIG_RATIONAL& rational, UINT32 defaultDenominator,
+void CheckRequiredValues(const UserConfig::Field& field, const ParamList& valueList);
+void CheckRequiredValues(const UserConfig::Field& field, const ParamList& valueList, const ParamList& moreValues);
+const UserConfig::Field& GetRequiredField(const UserConfig::State& state, std::string_view name);
+
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, std::string& parsedValue, bool required = false);
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, std::wstring& parsedValue, bool required = false);
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, int& parsedValue, bool required = false);
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, unsigned long& parsedValue, bool required = false);
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, unsigned long long& parsedValue, bool required = false);
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, bool& parsedValue, bool required = false);
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, DISPLAYCONFIG_RATIONAL& rational, UINT32 defaultDenominator,
 	bool required = false);
 
-inline bool ReadValue(const UserConfig::Field* pField, std::string valueName, UINT32& parsedValue, bool required = false)
+inline bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, UINT32& parsedValue, bool required = false)
 { return ReadValue(pField, valueName, (unsigned long&)parsedValue, required); }
 
-inline bool ReadValue(const UserConfig::Field* pField, std::string valueName, LONG& parsedValue, bool required = false)
+inline bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, LONG& parsedValue, bool required = false)
 { return ReadValue(pField, valueName, (int&)parsedValue, required); }
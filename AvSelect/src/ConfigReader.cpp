@@ -0,0 +1,446 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include <algorithm>
+#include "ConfigReader.h"
+#include "Util.h"
+#include "rapidxml\rapidxml.hpp"
+
+using namespace std;
+
+static bool IsXmlSpace(int c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool IsNameChar(int c)
+{
+	return c != EOF && !IsXmlSpace(c) && !strchr("/>=?<\"'&", c);
+}
+
+using rapidxml::internal::scan_whitespace;
+using rapidxml::internal::scan_text;
+
+template<int Mode>
+static bool StopsScan(char c, char c1, char c2)
+{
+	return Mode == scan_whitespace ? !IsXmlSpace((unsigned char)c) : c == c1 || c == c2;
+}
+
+// The first character from p on where a scan in Mode stops, or pEnd. The character at pEnd
+// must stop the scan too, as the block's terminating zero does.
+template<int Mode>
+static const char* Scan(const char* p, const char* pEnd, char c1, char c2)
+{
+	// Most runs between tags are a character or two, which aren't worth a SIMD load.
+	for (const char* pShort = p + 16; p < pEnd && p < pShort; ++p)
+	{
+		if (StopsScan<Mode>(*p, c1, c2))
+			return p;
+	}
+
+	if (p < pEnd)
+		p = rapidxml::internal::simd_skip<Mode, const char>(p, c1, c2);
+
+	// Finishes without SIMD, and past any zero that's in the file itself.
+	while (p < pEnd && !StopsScan<Mode>(*p, c1, c2))
+		++p;
+
+	return p;
+}
+
+static void AppendUtf8(string* pOut, unsigned long code)
+{
+	if (code < 0x80)
+	{
+		*pOut += (char)code;
+	}
+	else if (code < 0x800)
+	{
+		*pOut += (char)(0xC0 | (code >> 6));
+		*pOut += (char)(0x80 | (code & 0x3F));
+	}
+	else if (code < 0x10000)
+	{
+		*pOut += (char)(0xE0 | (code >> 12));
+		*pOut += (char)(0x80 | ((code >> 6) & 0x3F));
+		*pOut += (char)(0x80 | (code & 0x3F));
+	}
+	else
+	{
+		*pOut += (char)(0xF0 | (code >> 18));
+		*pOut += (char)(0x80 | ((code >> 12) & 0x3F));
+		*pOut += (char)(0x80 | ((code >> 6) & 0x3F));
+		*pOut += (char)(0x80 | (code & 0x3F));
+	}
+}
+
+ConfigReader::ConfigReader(std::istream& stream)
+:
+mStream(stream),
+mPos(0),
+mEnd(0),
+mContentHash(FNV1A64_OFFSET_BASIS),
+mLine(1),
+mPendingEnd(false)
+{
+}
+
+bool ConfigReader::Fill()
+{
+	if (mPos < mEnd)
+		return true;
+
+	mStream.read(mBlock, BLOCK_SIZE);
+	mPos = 0;
+	mEnd = (size_t)mStream.gcount();
+	mBlock[mEnd] = '\0';
+	mContentHash = Fnv1a64(mContentHash, mBlock, mEnd);
+	return mEnd > 0;
+}
+
+// Moves past the next length characters, which are all in the block.
+void ConfigReader::Consume(size_t length)
+{
+	mLine += (unsigned int)count(mBlock + mPos, mBlock + mPos + length, '\n');
+	mPos += length;
+}
+
+int ConfigReader::Peek()
+{
+	return Fill() ? (unsigned char)mBlock[mPos] : EOF;
+}
+
+int ConfigReader::Get()
+{
+	if (!Fill())
+		return EOF;
+
+	int c = (unsigned char)mBlock[mPos++];
+	if (c == '\n')
+		++mLine;
+	return c;
+}
+
+void ConfigReader::SkipWhitespace()
+{
+	while (Fill())
+	{
+		const char* p = mBlock + mPos;
+		Consume(Scan<scan_whitespace>(p, mBlock + mEnd, 0, 0) - p);
+
+		if (mPos < mEnd)
+			return;
+	}
+}
+
+void ConfigReader::SkipPast(const char* pTerminator)
+{
+	size_t length = strlen(pTerminator);
+	size_t matched = 0;
+
+	while (matched < length)
+	{
+		if (matched == 0 && Fill())
+		{
+			const char* p = mBlock + mPos;
+			Consume(Scan<scan_text>(p, mBlock + mEnd, pTerminator[0], pTerminator[0]) - p);
+
+			if (mPos == mEnd)
+				continue;
+		}
+
+		int c = Get();
+		if (c == EOF)
+			Fail(string() + "expected '" + pTerminator + "' before the end of the file");
+
+		if (c == pTerminator[matched])
+			++matched;
+		else
+			matched = (c == pTerminator[0]) ? 1 : 0;
+	}
+}
+
+// Consumes pText if it comes next. A partial match is consumed too, which is only ever
+// an error for the callers.
+bool ConfigReader::Match(const char* pText)
+{
+	for (; *pText; ++pText)
+	{
+		if (Peek() != (unsigned char)*pText)
+			return false;
+		Get();
+	}
+
+	return true;
+}
+
+void ConfigReader::Expect(char expected)
+{
+	if (Get() != (unsigned char)expected)
+		Fail(string() + "expected '" + expected + "'");
+}
+
+void ConfigReader::ReadName(std::string* pName)
+{
+	pName->clear();
+	while (Fill())
+	{
+		const char* p = mBlock + mPos;
+		const char* pStop = p;
+		while (pStop < mBlock + mEnd && IsNameChar((unsigned char)*pStop))
+			++pStop;
+
+		pName->append(p, pStop);
+		Consume(pStop - p);
+
+		if (mPos < mEnd)
+			break;
+	}
+
+	if (pName->empty())
+		Fail("expected a name");
+}
+
+// After '&'. Anything that isn't a reference it knows is kept as it was written.
+void ConfigReader::ReadReference(std::string* pOut)
+{
+	string name;
+	while (name.length() < 10 && (isalnum(Peek()) || Peek() == '#'))
+		name += (char)Get();
+
+	if (Peek() == ';')
+	{
+		if (name == "amp" || name == "lt" || name == "gt" || name == "quot" || name == "apos")
+		{
+			Get();
+			*pOut += name == "amp" ? '&' : name == "lt" ? '<' : name == "gt" ? '>' : name == "quot" ? '"' : '\'';
+			return;
+		}
+
+		if (name.length() > 1 && name[0] == '#')
+		{
+			bool hex = name[1] == 'x';
+			char* pEnd = NULL;
+			unsigned long code = strtoul(name.c_str() + (hex ? 2 : 1), &pEnd, hex ? 16 : 10);
+
+			if (*pEnd || code == 0 || code > 0x10FFFF)
+				Fail("invalid character reference &" + name + ";");
+
+			Get();
+			AppendUtf8(pOut, code);
+			return;
+		}
+	}
+
+	*pOut += '&';
+	*pOut += name;
+}
+
+void ConfigReader::Fail(const std::string& message) const
+{
+	throw runtime_error("line " + to_string(mLine) + ": " + message);
+}
+
+const ConfigReader::Attribute* ConfigReader::GetAttribute(std::string_view name) const
+{
+	for (const Attribute& attribute : mAttributes)
+	{
+		if (attribute.mName == name)
+			return &attribute;
+	}
+
+	return NULL;
+}
+
+ConfigReader::Token ConfigReader::Next()
+{
+	if (mPendingEnd)
+	{
+		mPendingEnd = false;
+		mName = mOpen.back();
+		mOpen.pop_back();
+		return Token_End;
+	}
+
+	for (;;)
+	{
+		int c = Peek();
+
+		if (c == EOF)
+		{
+			if (!mOpen.empty())
+				Fail("<" + mOpen.back() + "> isn't closed before the end of the file");
+			return Token_Eof;
+		}
+
+		if (c != '<')
+		{
+			mText.clear();
+			bool blank = true;
+
+			while (Fill())
+			{
+				const char* p = mBlock + mPos;
+				const char* pStop = Scan<scan_text>(p, mBlock + mEnd, '<', '&');
+				// '<', '&' and the terminating zero all stop a whitespace scan before pStop.
+				blank = blank && Scan<scan_whitespace>(p, pStop, 0, 0) == pStop;
+				mText.append(p, pStop);
+				Consume(pStop - p);
+
+				if (mPos == mEnd)
+					continue;
+				if (mBlock[mPos] == '<')
+					break;
+
+				Get();
+				blank = false;
+				ReadReference(&mText);
+			}
+
+			if (blank)
+				continue;
+			if (mOpen.empty())
+				Fail("expected '<'");
+			return Token_Text;
+		}
+
+		Get();
+
+		if (Match("?"))
+		{
+			SkipPast("?>");
+			continue;
+		}
+
+		if (Match("!"))
+		{
+			if (Match("--"))
+			{
+				SkipPast("-->");
+				continue;
+			}
+
+			if (!Match("[CDATA["))
+				Fail("DOCTYPEs and other declarations aren't supported");
+
+			mText.clear();
+			while (mText.length() < 3 || mText.compare(mText.length() - 3, 3, "]]>"))
+			{
+				if ((c = Get()) == EOF)
+					Fail("expected ']]>' before the end of the file");
+				mText += (char)c;
+			}
+			mText.resize(mText.length() - 3);
+
+			if (mOpen.empty())
+				Fail("expected '<'");
+			return Token_Text;
+		}
+
+		if (Match("/"))
+		{
+			ReadName(&mName);
+			SkipWhitespace();
+			Expect('>');
+
+			if (mOpen.empty() || mOpen.back() != mName)
+				Fail("</" + mName + "> doesn't close " + (mOpen.empty() ? string("anything") : "<" + mOpen.back() + ">"));
+
+			mOpen.pop_back();
+			return Token_End;
+		}
+
+		ReadName(&mName);
+		mAttributes.clear();
+
+		for (;;)
+		{
+			bool separated = IsXmlSpace(Peek());
+			SkipWhitespace();
+
+			if (Match("/"))
+			{
+				Expect('>');
+				mPendingEnd = true;
+				break;
+			}
+
+			if (Match(">"))
+				break;
+
+			if (!separated)
+				Fail("expected whitespace before the attributes of <" + mName + ">");
+
+			mAttributes.push_back(Attribute());
+			Attribute& attribute = mAttributes.back();
+
+			ReadName(&attribute.mName);
+			SkipWhitespace();
+			Expect('=');
+			SkipWhitespace();
+
+			int quote = Get();
+			if (quote != '"' && quote != '\'')
+				Fail("expected ' or \" to start the value of " + attribute.mName);
+
+			for (;;)
+			{
+				if (!Fill())
+					Fail("expected the value of " + attribute.mName + " to end with " + (char)quote);
+
+				const char* p = mBlock + mPos;
+				const char* pStop = Scan<scan_text>(p, mBlock + mEnd, (char)quote, '&');
+				attribute.mValue.append(p, pStop);
+				Consume(pStop - p);
+
+				if (mPos == mEnd)
+					continue;
+				if (Get() == quote)
+					break;
+
+				ReadReference(&attribute.mValue);
+			}
+		}
+
+		mOpen.push_back(mName);
+		return Token_Start;
+	}
+}
+
+void ConfigReader::SkipElement()
+{
+	size_t depth = mOpen.size();
+
+	while (mOpen.size() >= depth)
+		Next();
+}
+
+UINT64 ConfigReader::FinishContentHash()
+{
+	mPos = mEnd;
+	while (Fill())
+		mPos = mEnd;
+
+	return mContentHash;
+}
@@ -0,0 +1,114 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* A forward-only XML reader for loading config.xml without building a DOM.
+
+   Next() steps to the next start tag, end tag or run of text, reading the stream a block
+   at a time. An empty element <X/> reads as a start tag followed by an end tag. Only the
+   current tag and the names of the elements enclosing it are held, so memory grows with
+   nesting depth, not with the file.
+
+   Comments, processing instructions and the XML declaration are skipped, and whitespace
+   between tags is dropped. Character references are expanded as they're read. End tags
+   must match their start tags. DOCTYPEs aren't supported. Errors throw runtime_error
+   with the line number.
+
+   Runs of whitespace, text and attribute values are found with the same SSE2/AVX2 scans
+   rapidxml uses, a block at a time, rather than a character at a time.
+*/
+class ConfigReader
+{
+public:
+	enum Token
+	{
+		Token_Start,
+		Token_End,
+		Token_Text,
+		Token_Eof,
+	};
+
+	struct Attribute
+	{
+		std::string mName;
+		std::string mValue;
+	};
+
+	explicit ConfigReader(std::istream& stream);
+	ConfigReader(const ConfigReader&) = delete;
+	ConfigReader& operator=(const ConfigReader&) = delete;
+
+	Token Next();
+
+	// The element a Token_Start or Token_End is for.
+	const std::string& GetName() const { return mName; }
+	const std::vector<Attribute>& GetAttributes() const { return mAttributes; }
+	const Attribute* GetAttribute(std::string_view name) const;
+	// A Token_Text, and the element it's in.
+	const std::string& GetText() const { return mText; }
+	const std::string& GetTextParent() const { return mOpen.back(); }
+
+	// Reads past the end of the element just started, whatever it holds.
+	void SkipElement();
+
+	// Reads the rest of the stream without parsing it, and returns the FNV-1a hash of
+	// everything read, start to end.
+	UINT64 FinishContentHash();
+
+private:
+	static const size_t BLOCK_SIZE = 4096;
+
+	int Peek();
+	int Get();
+	bool Fill();
+	void Consume(size_t length);
+	void SkipWhitespace();
+	void SkipPast(const char* pTerminator);
+	bool Match(const char* pText);
+	void Expect(char expected);
+	void ReadName(std::string* pName);
+	void ReadReference(std::string* pOut);
+	[[noreturn]] void Fail(const std::string& message) const;
+
+	std::istream& mStream;
+	// Zero-terminated after the last character read, with room for the SIMD scans' aligned
+	// loads to run on to the end of the 32 byte line the terminator is in.
+	alignas(32) char mBlock[BLOCK_SIZE + 32];
+	size_t mPos;
+	size_t mEnd;
+	UINT64 mContentHash;
+	unsigned int mLine;
+
+	std::string mName;
+	std::vector<Attribute> mAttributes;
+	std::string mText;
+	std::vector<std::string> mOpen;
+	// After <X/>, the end tag is still to be reported.
+	bool mPendingEnd;
+};
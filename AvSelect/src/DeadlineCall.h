@@ -0,0 +1,87 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <functional>
+#include <memory>
+#include "ApplyExecutor.h"
+
+/* Runs a call that may block indefinitely (a stalled display driver, a wedged audio
+   service) on a worker thread and stops waiting for it after budgetMs, or once pCancel
+   is set. The caller gets a timeout instead of a hang; the worker is left to finish in
+   the background and frees its own state.
+
+   call must not throw, and must not refer to anything that won't outlive an abandoned
+   worker: capture by value. A budget of 0 runs call inline with no deadline.
+*/
+template <typename Result>
+struct DeadlineCallState
+{
+	std::function<Result()> mCall;
+	Result mResult;
+};
+
+template <typename Result>
+DWORD WINAPI DeadlineCallThreadProc(LPVOID lpParam)
+{
+	std::unique_ptr<std::shared_ptr<DeadlineCallState<Result>>> ppState(
+		(std::shared_ptr<DeadlineCallState<Result>>*)lpParam);
+
+	(*ppState)->mResult = (*ppState)->mCall();
+	return 0;
+}
+
+// Returns false if the call didn't complete in time; *pResult is then untouched.
+template <typename Result>
+bool CallWithDeadline(const std::function<Result()>& call, DWORD budgetMs, const CancelToken* pCancel, Result* pResult)
+{
+	if (!budgetMs)
+	{
+		*pResult = call();
+		return true;
+	}
+
+	std::shared_ptr<DeadlineCallState<Result>> pState = std::make_shared<DeadlineCallState<Result>>();
+	pState->mCall = call;
+
+	std::shared_ptr<DeadlineCallState<Result>>* ppWorkerState = new std::shared_ptr<DeadlineCallState<Result>>(pState);
+	HANDLE hWorker = CreateThread(NULL, 0, DeadlineCallThreadProc<Result>, ppWorkerState, 0, NULL);
+
+	if (!hWorker)
+	{
+		delete ppWorkerState;
+		*pResult = call();
+		return true;
+	}
+
+	HANDLE handles[] = { hWorker, pCancel ? pCancel->GetWaitHandle() : NULL };
+	DWORD wait = WaitForMultipleObjects(pCancel ? 2 : 1, handles, FALSE, budgetMs);
+	CloseHandle(hWorker);
+
+	if (wait != WAIT_OBJECT_0)
+		return false;
+
+	*pResult = pState->mResult;
+	return true;
+}
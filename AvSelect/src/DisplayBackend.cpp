@@ -0,0 +1,566 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "DisplayBackend.h"
+#include "DeadlineCall.h"
+
+#include <algorithm>
+#include <map>
+
+using namespace std;
+
+static Win32DisplayBackend sWin32Backend;
+static DisplayBackend* spBackend = &sWin32Backend;
+
+DisplayBackend& DisplayBackend::Get()
+{
+	return *spBackend;
+}
+
+// Not synchronized: install before anything queries the displays.
+void DisplayBackend::Install(DisplayBackend* pBackend)
+{
+	spBackend = pBackend ? pBackend : &sWin32Backend;
+}
+
+LONG Win32DisplayBackend::Query(UINT32 flags, 
+	vector<DISPLAYCONFIG_PATH_INFO>& paths, vector<DISPLAYCONFIG_MODE_INFO>& modes, const CancelToken* pCancel)
+{
+	for (UINT32 tryBufferSize = 32;; tryBufferSize <<= 1)
+	{
+		paths.resize(tryBufferSize);
+		modes.resize(tryBufferSize);
+		UINT32 numPathArrayElements = tryBufferSize;
+		UINT32 numModeArrayElements = tryBufferSize;
+
+		LONG rc = QueryDisplayConfig(
+			flags,
+			&numPathArrayElements,
+			paths.data(),
+			&numModeArrayElements,
+			modes.data(),
+			NULL);
+
+		if (rc == ERROR_SUCCESS)
+		{
+			paths.resize(numPathArrayElements);
+			modes.resize(numModeArrayElements);
+		}
+
+		if (rc != ERROR_INSUFFICIENT_BUFFER || tryBufferSize > 8192)
+			return rc;
+	}
+}
+
+LONG Win32DisplayBackend::GetDeviceInfo(DISPLAYCONFIG_DEVICE_INFO_HEADER* pRequest, const CancelToken* pCancel)
+{
+	return DisplayConfigGetDeviceInfo(pRequest);
+}
+
+LONG Win32DisplayBackend::Set(const vector<DISPLAYCONFIG_PATH_INFO>& paths, 
+	const vector<DISPLAYCONFIG_MODE_INFO>& modes, UINT32 flags, const CancelToken* pCancel)
+{
+	// SetDisplayConfig doesn't modify the arrays, it just isn't declared const.
+	return SetDisplayConfig(
+		(UINT32)paths.size(),
+		const_cast<DISPLAYCONFIG_PATH_INFO*>(paths.data()),
+		(UINT32)modes.size(),
+		const_cast<DISPLAYCONFIG_MODE_INFO*>(modes.data()),
+		flags);
+}
+
+DeadlineDisplayBackend::DeadlineDisplayBackend()
+:
+mpInner(NULL),
+mQueryBudgetMs(0),
+mApplyBudgetMs(0)
+{
+}
+
+void DeadlineDisplayBackend::SetBudgets(DWORD queryBudgetMs, DWORD applyBudgetMs)
+{
+	mQueryBudgetMs = queryBudgetMs;
+	mApplyBudgetMs = applyBudgetMs;
+}
+
+// What a call that CallWithDeadline stopped waiting for reports.
+static LONG GiveUp(const wchar_t* pCall, DWORD budgetMs, const CancelToken* pCancel)
+{
+	if (pCancel && pCancel->IsCancelled())
+	{
+		LogMessage(wstring(L"Stopped waiting for ") + pCall + L"; the transition was cancelled.");
+		return ERROR_CANCELLED;
+	}
+
+	LogMessage(wstring(pCall) + L" did not return within " + std::to_wstring(budgetMs) + L"ms.");
+	return ERROR_TIMEOUT;
+}
+
+struct QueryCallResult
+{
+	LONG mRc = ERROR_TIMEOUT;
+	vector<DISPLAYCONFIG_PATH_INFO> mPaths;
+	vector<DISPLAYCONFIG_MODE_INFO> mModes;
+};
+
+LONG DeadlineDisplayBackend::Query(UINT32 flags, 
+	vector<DISPLAYCONFIG_PATH_INFO>& paths, vector<DISPLAYCONFIG_MODE_INFO>& modes, const CancelToken* pCancel)
+{
+	DisplayBackend* pInner = mpInner;
+	QueryCallResult result;
+
+	// The worker fills its own arrays; ours are only touched if it made the deadline.
+	if (!CallWithDeadline<QueryCallResult>([pInner, flags]()
+		{
+			QueryCallResult result;
+			result.mRc = pInner->Query(flags, result.mPaths, result.mModes);
+			return result;
+		}, mQueryBudgetMs, pCancel, &result))
+	{
+		return GiveUp(L"QueryDisplayConfig", mQueryBudgetMs, pCancel);
+	}
+
+	paths.swap(result.mPaths);
+	modes.swap(result.mModes);
+	return result.mRc;
+}
+
+struct DeviceInfoCallResult
+{
+	LONG mRc = ERROR_TIMEOUT;
+	vector<BYTE> mRequest;
+};
+
+LONG DeadlineDisplayBackend::GetDeviceInfo(DISPLAYCONFIG_DEVICE_INFO_HEADER* pRequest, const CancelToken* pCancel)
+{
+	DisplayBackend* pInner = mpInner;
+	vector<BYTE> request((BYTE*)pRequest, (BYTE*)pRequest + pRequest->size);
+	DeviceInfoCallResult result;
+
+	if (!CallWithDeadline<DeviceInfoCallResult>([pInner, request]()
+		{
+			DeviceInfoCallResult result;
+			result.mRequest = request;
+			result.mRc = pInner->GetDeviceInfo((DISPLAYCONFIG_DEVICE_INFO_HEADER*)result.mRequest.data());
+			return result;
+		}, mQueryBudgetMs, pCancel, &result))
+	{
+		return GiveUp(L"DisplayConfigGetDeviceInfo", mQueryBudgetMs, pCancel);
+	}
+
+	memcpy(pRequest, result.mRequest.data(), result.mRequest.size());
+	return result.mRc;
+}
+
+LONG DeadlineDisplayBackend::Set(const vector<DISPLAYCONFIG_PATH_INFO>& paths, 
+	const vector<DISPLAYCONFIG_MODE_INFO>& modes, UINT32 flags, const CancelToken* pCancel)
+{
+	DisplayBackend* pInner = mpInner;
+	LONG rc = ERROR_TIMEOUT;
+
+	if (!CallWithDeadline<LONG>([pInner, paths, modes, flags]()
+		{
+			return pInner->Set(paths, modes, flags);
+		}, mApplyBudgetMs, pCancel, &rc))
+	{
+		return GiveUp(L"SetDisplayConfig", mApplyBudgetMs, pCancel);
+	}
+
+	return rc;
+}
+
+SimulatedDisplayBackend::SimulatedDisplayBackend()
+:
+mFailuresPending(0),
+mFailureCode(ERROR_SUCCESS),
+mStallsPending(0),
+mStallMs(0)
+{
+	InitializeSRWLock(&mLock);
+}
+
+SimulatedDisplayBackend::DeviceKey SimulatedDisplayBackend::GetDeviceKey(const LUID& adapterId, UINT32 id)
+{
+	return DeviceKey(adapterId.LowPart | ((UINT64)adapterId.HighPart << 32), id);
+}
+
+LONG SimulatedDisplayBackend::SeedFrom(DisplayBackend& backend)
+{
+	vector<DISPLAYCONFIG_PATH_INFO> paths;
+	vector<DISPLAYCONFIG_MODE_INFO> modes;
+
+	LONG rc = backend.Query(QDC_ALL_PATHS, paths, modes);
+	if (rc != ERROR_SUCCESS)
+		return rc;
+
+	AcquireSRWLockExclusive(&mLock);
+
+	mPaths = paths;
+	mModes = modes;
+	mTargetNames.clear();
+	mSourceNames.clear();
+
+	for (const DISPLAYCONFIG_PATH_INFO& path : mPaths)
+	{
+		DISPLAYCONFIG_TARGET_DEVICE_NAME targetName;
+		ZeroMemory(&targetName, sizeof(targetName));
+		targetName.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_TARGET_NAME;
+		targetName.header.size = sizeof(targetName);
+		targetName.header.adapterId = path.targetInfo.adapterId;
+		targetName.header.id = path.targetInfo.id;
+		if (backend.GetDeviceInfo(&targetName.header) == ERROR_SUCCESS)
+			mTargetNames[GetDeviceKey(path.targetInfo.adapterId, path.targetInfo.id)] = targetName;
+
+		DISPLAYCONFIG_SOURCE_DEVICE_NAME sourceName;
+		ZeroMemory(&sourceName, sizeof(sourceName));
+		sourceName.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_SOURCE_NAME;
+		sourceName.header.size = sizeof(sourceName);
+		sourceName.header.adapterId = path.sourceInfo.adapterId;
+		sourceName.header.id = path.sourceInfo.id;
+		if (backend.GetDeviceInfo(&sourceName.header) == ERROR_SUCCESS)
+			mSourceNames[GetDeviceKey(path.sourceInfo.adapterId, path.sourceInfo.id)] = sourceName;
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+	return ERROR_SUCCESS;
+}
+
+void SimulatedDisplayBackend::AddDisplay(const LUID& adapterId, UINT32 sourceId, UINT32 targetId, 
+	const wstring& friendlyName, UINT32 width, UINT32 height, bool active)
+{
+	DISPLAYCONFIG_PATH_INFO path;
+	ZeroMemory(&path, sizeof(path));
+	path.sourceInfo.adapterId = adapterId;
+	path.sourceInfo.id = sourceId;
+	path.sourceInfo.modeInfoIdx = DISPLAYCONFIG_PATH_MODE_IDX_INVALID;
+	path.targetInfo.adapterId = adapterId;
+	path.targetInfo.id = targetId;
+	path.targetInfo.modeInfoIdx = DISPLAYCONFIG_PATH_MODE_IDX_INVALID;
+	path.targetInfo.outputTechnology = DISPLAYCONFIG_OUTPUT_TECHNOLOGY_HDMI;
+	path.targetInfo.rotation = DISPLAYCONFIG_ROTATION_IDENTITY;
+	path.targetInfo.scaling = DISPLAYCONFIG_SCALING_IDENTITY;
+	path.targetInfo.refreshRate.Numerator = 60;
+	path.targetInfo.refreshRate.Denominator = 1;
+	path.targetInfo.scanLineOrdering = DISPLAYCONFIG_SCANLINE_ORDERING_PROGRESSIVE;
+	path.targetInfo.targetAvailable = TRUE;
+
+	DISPLAYCONFIG_TARGET_DEVICE_NAME targetName;
+	ZeroMemory(&targetName, sizeof(targetName));
+	targetName.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_TARGET_NAME;
+	targetName.header.size = sizeof(targetName);
+	targetName.header.adapterId = adapterId;
+	targetName.header.id = targetId;
+	targetName.outputTechnology = path.targetInfo.outputTechnology;
+	lstrcpyn(targetName.monitorFriendlyDeviceName, friendlyName.c_str(), ARRAYSIZE(targetName.monitorFriendlyDeviceName));
+	lstrcpyn(targetName.monitorDevicePath, (L"\\\\?\\DISPLAY#SIM" + to_wstring(targetId)).c_str(), 
+		ARRAYSIZE(targetName.monitorDevicePath));
+
+	DISPLAYCONFIG_SOURCE_DEVICE_NAME sourceName;
+	ZeroMemory(&sourceName, sizeof(sourceName));
+	sourceName.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_SOURCE_NAME;
+	sourceName.header.size = sizeof(sourceName);
+	sourceName.header.adapterId = adapterId;
+	sourceName.header.id = sourceId;
+	lstrcpyn(sourceName.viewGdiDeviceName, (L"\\\\.\\DISPLAY" + to_wstring(sourceId + 1)).c_str(), 
+		ARRAYSIZE(sourceName.viewGdiDeviceName));
+
+	AcquireSRWLockExclusive(&mLock);
+
+	if (active)
+	{
+		LONG right = 0;
+		for (const DISPLAYCONFIG_MODE_INFO& mode : mModes)
+		{
+			if (mode.infoType == DISPLAYCONFIG_MODE_INFO_TYPE_SOURCE && 
+				mode.sourceMode.position.x + (LONG)mode.sourceMode.width > right)
+			{
+				right = mode.sourceMode.position.x + (LONG)mode.sourceMode.width;
+			}
+		}
+
+		DISPLAYCONFIG_MODE_INFO sourceMode;
+		ZeroMemory(&sourceMode, sizeof(sourceMode));
+		sourceMode.infoType = DISPLAYCONFIG_MODE_INFO_TYPE_SOURCE;
+		sourceMode.id = sourceId;
+		sourceMode.adapterId = adapterId;
+		sourceMode.sourceMode.width = width;
+		sourceMode.sourceMode.height = height;
+		sourceMode.sourceMode.pixelFormat = DISPLAYCONFIG_PIXELFORMAT_32BPP;
+		sourceMode.sourceMode.position.x = right;
+
+		DISPLAYCONFIG_MODE_INFO targetMode;
+		ZeroMemory(&targetMode, sizeof(targetMode));
+		targetMode.infoType = DISPLAYCONFIG_MODE_INFO_TYPE_TARGET;
+		targetMode.id = targetId;
+		targetMode.adapterId = adapterId;
+		DISPLAYCONFIG_VIDEO_SIGNAL_INFO& signal = targetMode.targetMode.targetVideoSignalInfo;
+		signal.activeSize.cx = signal.totalSize.cx = width;
+		signal.activeSize.cy = signal.totalSize.cy = height;
+		signal.vSyncFreq = path.targetInfo.refreshRate;
+		signal.scanLineOrdering = path.targetInfo.scanLineOrdering;
+
+		path.flags |= DISPLAYCONFIG_PATH_ACTIVE;
+		path.sourceInfo.statusFlags |= DISPLAYCONFIG_SOURCE_IN_USE;
+		path.targetInfo.statusFlags |= DISPLAYCONFIG_TARGET_IN_USE;
+		path.sourceInfo.modeInfoIdx = (UINT32)mModes.size();
+		mModes.push_back(sourceMode);
+		path.targetInfo.modeInfoIdx = (UINT32)mModes.size();
+		mModes.push_back(targetMode);
+	}
+
+	mPaths.push_back(path);
+	mTargetNames[GetDeviceKey(adapterId, targetId)] = targetName;
+	mSourceNames[GetDeviceKey(adapterId, sourceId)] = sourceName;
+
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+void SimulatedDisplayBackend::FailNextApplies(UINT32 count, LONG rc)
+{
+	AcquireSRWLockExclusive(&mLock);
+	mFailuresPending = count;
+	mFailureCode = rc;
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+void SimulatedDisplayBackend::StallNextCalls(UINT32 count, DWORD stallMs)
+{
+	AcquireSRWLockExclusive(&mLock);
+	mStallsPending = count;
+	mStallMs = stallMs;
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+bool SimulatedDisplayBackend::SetTargetConnected(const LUID& adapterId, UINT32 id, bool connected)
+{
+	bool found = false;
+	DeviceKey key = GetDeviceKey(adapterId, id);
+
+	AcquireSRWLockExclusive(&mLock);
+
+	for (DISPLAYCONFIG_PATH_INFO& path : mPaths)
+	{
+		if (GetDeviceKey(path.targetInfo.adapterId, path.targetInfo.id) != key)
+			continue;
+
+		found = true;
+		path.targetInfo.targetAvailable = connected;
+
+		if (!connected)
+		{
+			path.flags &= ~DISPLAYCONFIG_PATH_ACTIVE;
+			path.targetInfo.statusFlags &= ~DISPLAYCONFIG_TARGET_IN_USE;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+	return found;
+}
+
+void SimulatedDisplayBackend::StallIfRequested()
+{
+	DWORD stallMs = 0;
+
+	AcquireSRWLockExclusive(&mLock);
+	if (mStallsPending)
+	{
+		--mStallsPending;
+		stallMs = mStallMs;
+	}
+	ReleaseSRWLockExclusive(&mLock);
+
+	if (stallMs)
+		Sleep(stallMs);
+}
+
+LONG SimulatedDisplayBackend::Query(UINT32 flags, 
+	vector<DISPLAYCONFIG_PATH_INFO>& paths, vector<DISPLAYCONFIG_MODE_INFO>& modes, const CancelToken* pCancel)
+{
+	StallIfRequested();
+
+	AcquireSRWLockShared(&mLock);
+
+	paths.clear();
+	for (const DISPLAYCONFIG_PATH_INFO& path : mPaths)
+	{
+		if ((flags & QDC_ALL_PATHS) || (path.flags & DISPLAYCONFIG_PATH_ACTIVE))
+			paths.push_back(path);
+	}
+	modes = mModes;
+
+	// As the driver does, every path from a source that's driving a display reports the
+	// source in use, not just the active one.
+	for (DISPLAYCONFIG_PATH_INFO& path : paths)
+	{
+		for (const DISPLAYCONFIG_PATH_INFO& active : mPaths)
+		{
+			if ((active.flags & DISPLAYCONFIG_PATH_ACTIVE) &&
+				!memcmp(&active.sourceInfo.adapterId, &path.sourceInfo.adapterId, sizeof(LUID)) &&
+				active.sourceInfo.id == path.sourceInfo.id)
+			{
+				path.sourceInfo.statusFlags |= DISPLAYCONFIG_SOURCE_IN_USE;
+			}
+		}
+	}
+
+	ReleaseSRWLockShared(&mLock);
+	return ERROR_SUCCESS;
+}
+
+LONG SimulatedDisplayBackend::GetDeviceInfo(DISPLAYCONFIG_DEVICE_INFO_HEADER* pRequest, const CancelToken* pCancel)
+{
+	StallIfRequested();
+
+	LONG rc = ERROR_INVALID_PARAMETER;
+	DeviceKey key = GetDeviceKey(pRequest->adapterId, pRequest->id);
+
+	AcquireSRWLockShared(&mLock);
+
+	if (pRequest->type == DISPLAYCONFIG_DEVICE_INFO_GET_TARGET_NAME && 
+		pRequest->size >= sizeof(DISPLAYCONFIG_TARGET_DEVICE_NAME))
+	{
+		auto it = mTargetNames.find(key);
+		if (it != mTargetNames.end())
+		{
+			memcpy(pRequest, &it->second, sizeof(it->second));
+			rc = ERROR_SUCCESS;
+		}
+	}
+	else if (pRequest->type == DISPLAYCONFIG_DEVICE_INFO_GET_SOURCE_NAME && 
+		pRequest->size >= sizeof(DISPLAYCONFIG_SOURCE_DEVICE_NAME))
+	{
+		auto it = mSourceNames.find(key);
+		if (it != mSourceNames.end())
+		{
+			memcpy(pRequest, &it->second, sizeof(it->second));
+			rc = ERROR_SUCCESS;
+		}
+	}
+
+	ReleaseSRWLockShared(&mLock);
+	return rc;
+}
+
+/* Roughly what a driver checks: every active path is one we know of, each target and
+   each source is driven once, and every mode index points at a mode of the right kind
+   for the right device.
+*/
+LONG SimulatedDisplayBackend::ValidateLocked(const vector<DISPLAYCONFIG_PATH_INFO>& paths, 
+	const vector<DISPLAYCONFIG_MODE_INFO>& modes) const
+{
+	map<DeviceKey, int> targetUse;
+	bool anyActive = false;
+
+	for (const DISPLAYCONFIG_PATH_INFO& path : paths)
+	{
+		if (!(path.flags & DISPLAYCONFIG_PATH_ACTIVE))
+			continue;
+
+		anyActive = true;
+
+		auto known = find_if(mPaths.begin(), mPaths.end(), [&path](const DISPLAYCONFIG_PATH_INFO& candidate)
+		{
+			return !memcmp(&candidate.sourceInfo.adapterId, &path.sourceInfo.adapterId, sizeof(LUID)) &&
+				candidate.sourceInfo.id == path.sourceInfo.id &&
+				!memcmp(&candidate.targetInfo.adapterId, &path.targetInfo.adapterId, sizeof(LUID)) &&
+				candidate.targetInfo.id == path.targetInfo.id;
+		});
+
+		if (known == mPaths.end() || !known->targetInfo.targetAvailable)
+			return ERROR_NOT_SUPPORTED;
+
+		if (++targetUse[GetDeviceKey(path.targetInfo.adapterId, path.targetInfo.id)] > 1)
+			return ERROR_INVALID_PARAMETER;
+
+		UINT32 sourceModeIdx = path.sourceInfo.modeInfoIdx;
+		if (sourceModeIdx >= modes.size() || 
+			modes[sourceModeIdx].infoType != DISPLAYCONFIG_MODE_INFO_TYPE_SOURCE ||
+			modes[sourceModeIdx].id != path.sourceInfo.id ||
+			modes[sourceModeIdx].sourceMode.width == 0 ||
+			modes[sourceModeIdx].sourceMode.height == 0)
+		{
+			return ERROR_INVALID_PARAMETER;
+		}
+
+		UINT32 targetModeIdx = path.targetInfo.modeInfoIdx;
+		if (targetModeIdx != DISPLAYCONFIG_PATH_MODE_IDX_INVALID &&
+			(targetModeIdx >= modes.size() ||
+			modes[targetModeIdx].infoType != DISPLAYCONFIG_MODE_INFO_TYPE_TARGET ||
+			modes[targetModeIdx].id != path.targetInfo.id))
+		{
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	return anyActive ? ERROR_SUCCESS : ERROR_INVALID_PARAMETER;
+}
+
+LONG SimulatedDisplayBackend::Set(const vector<DISPLAYCONFIG_PATH_INFO>& paths, 
+	const vector<DISPLAYCONFIG_MODE_INFO>& modes, UINT32 flags, const CancelToken* pCancel)
+{
+	StallIfRequested();
+
+	AcquireSRWLockExclusive(&mLock);
+
+	LONG rc = ValidateLocked(paths, modes);
+
+	if (rc == ERROR_SUCCESS && (flags & SDC_APPLY) && mFailuresPending)
+	{
+		--mFailuresPending;
+		rc = mFailureCode;
+	}
+
+	if (rc == ERROR_SUCCESS && (flags & SDC_APPLY))
+	{
+		// The supplied active paths become the whole active topology.
+		for (DISPLAYCONFIG_PATH_INFO& known : mPaths)
+		{
+			known.flags &= ~DISPLAYCONFIG_PATH_ACTIVE;
+			known.sourceInfo.modeInfoIdx = DISPLAYCONFIG_PATH_MODE_IDX_INVALID;
+			known.targetInfo.modeInfoIdx = DISPLAYCONFIG_PATH_MODE_IDX_INVALID;
+			known.sourceInfo.statusFlags &= ~DISPLAYCONFIG_SOURCE_IN_USE;
+			known.targetInfo.statusFlags &= ~DISPLAYCONFIG_TARGET_IN_USE;
+
+			for (const DISPLAYCONFIG_PATH_INFO& path : paths)
+			{
+				if ((path.flags & DISPLAYCONFIG_PATH_ACTIVE) &&
+					!memcmp(&known.sourceInfo.adapterId, &path.sourceInfo.adapterId, sizeof(LUID)) &&
+					known.sourceInfo.id == path.sourceInfo.id &&
+					!memcmp(&known.targetInfo.adapterId, &path.targetInfo.adapterId, sizeof(LUID)) &&
+					known.targetInfo.id == path.targetInfo.id)
+				{
+					BOOL targetAvailable = known.targetInfo.targetAvailable;
+					known = path;
+					known.targetInfo.targetAvailable = targetAvailable;
+					known.sourceInfo.statusFlags |= DISPLAYCONFIG_SOURCE_IN_USE;
+					known.targetInfo.statusFlags |= DISPLAYCONFIG_TARGET_IN_USE;
+				}
+			}
+		}
+
+		mModes = modes;
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+	return rc;
+}
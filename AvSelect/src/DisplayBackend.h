@@ -0,0 +1,141 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class CancelToken;
+
+/* Everything DisplayConfig and TargetNameCache ask of the OS display configuration API.
+
+   Win32DisplayBackend forwards to QueryDisplayConfig/SetDisplayConfig. 
+   SimulatedDisplayBackend keeps a topology in memory instead, so transitions, rollback
+   and the like can be exercised without switching real displays, and can be told to
+   fail.
+*/
+class DisplayBackend
+{
+public:
+	virtual ~DisplayBackend() {}
+
+	// Fills paths/modes as QueryDisplayConfig would for flags (QDC_*). Each call gives up
+	// with ERROR_CANCELLED once pCancel is set, where the backend can wait on it at all.
+	virtual LONG Query(UINT32 flags, 
+		std::vector<DISPLAYCONFIG_PATH_INFO>& paths, std::vector<DISPLAYCONFIG_MODE_INFO>& modes,
+		const CancelToken* pCancel = NULL) = 0;
+	virtual LONG GetDeviceInfo(DISPLAYCONFIG_DEVICE_INFO_HEADER* pRequest, const CancelToken* pCancel = NULL) = 0;
+	virtual LONG Set(const std::vector<DISPLAYCONFIG_PATH_INFO>& paths, 
+		const std::vector<DISPLAYCONFIG_MODE_INFO>& modes, UINT32 flags, const CancelToken* pCancel = NULL) = 0;
+
+	// The backend in use; Win32 unless another was installed at startup.
+	static DisplayBackend& Get();
+	static void Install(DisplayBackend* pBackend);
+};
+
+class Win32DisplayBackend : public DisplayBackend
+{
+public:
+	LONG Query(UINT32 flags, 
+		std::vector<DISPLAYCONFIG_PATH_INFO>& paths, std::vector<DISPLAYCONFIG_MODE_INFO>& modes,
+		const CancelToken* pCancel = NULL) override;
+	LONG GetDeviceInfo(DISPLAYCONFIG_DEVICE_INFO_HEADER* pRequest, const CancelToken* pCancel = NULL) override;
+	LONG Set(const std::vector<DISPLAYCONFIG_PATH_INFO>& paths, 
+		const std::vector<DISPLAYCONFIG_MODE_INFO>& modes, UINT32 flags, const CancelToken* pCancel = NULL) override;
+};
+
+/* Forwards to another backend, but gives up on any call that outlives its budget and
+   reports ERROR_TIMEOUT, or ERROR_CANCELLED once its CancelToken is set, so a stalled
+   driver can't hang whichever thread asked. The stalled call finishes (or not) on its
+   own worker.
+*/
+class DeadlineDisplayBackend : public DisplayBackend
+{
+public:
+	DeadlineDisplayBackend();
+
+	void SetInner(DisplayBackend* pInner) { mpInner = pInner; }
+	// Queries and device info share one budget, validate and apply another. 0 is unbounded.
+	void SetBudgets(DWORD queryBudgetMs, DWORD applyBudgetMs);
+
+	LONG Query(UINT32 flags, 
+		std::vector<DISPLAYCONFIG_PATH_INFO>& paths, std::vector<DISPLAYCONFIG_MODE_INFO>& modes,
+		const CancelToken* pCancel = NULL) override;
+	LONG GetDeviceInfo(DISPLAYCONFIG_DEVICE_INFO_HEADER* pRequest, const CancelToken* pCancel = NULL) override;
+	LONG Set(const std::vector<DISPLAYCONFIG_PATH_INFO>& paths, 
+		const std::vector<DISPLAYCONFIG_MODE_INFO>& modes, UINT32 flags, const CancelToken* pCancel = NULL) override;
+
+private:
+	DisplayBackend* mpInner;
+	DWORD mQueryBudgetMs;
+	DWORD mApplyBudgetMs;
+};
+
+class SimulatedDisplayBackend : public DisplayBackend
+{
+public:
+	SimulatedDisplayBackend();
+
+	// Copies every path, mode and name from another backend.
+	LONG SeedFrom(DisplayBackend& backend);
+	// Adds a connected display driven from its own source, for a topology made up from
+	// scratch rather than seeded. If active, it's placed right of the active ones.
+	void AddDisplay(const LUID& adapterId, UINT32 sourceId, UINT32 targetId, const std::wstring& friendlyName,
+		UINT32 width, UINT32 height, bool active);
+
+	// The next count SDC_APPLY calls fail with rc and change nothing.
+	void FailNextApplies(UINT32 count, LONG rc);
+	// The next count calls of any kind block for stallMs (INFINITE to hang) first.
+	void StallNextCalls(UINT32 count, DWORD stallMs);
+	// Plugs a target in or pulls it out. Pulling it out also drops its active path.
+	// Returns false if no path leads to the target.
+	bool SetTargetConnected(const LUID& adapterId, UINT32 id, bool connected);
+
+	LONG Query(UINT32 flags, 
+		std::vector<DISPLAYCONFIG_PATH_INFO>& paths, std::vector<DISPLAYCONFIG_MODE_INFO>& modes,
+		const CancelToken* pCancel = NULL) override;
+	LONG GetDeviceInfo(DISPLAYCONFIG_DEVICE_INFO_HEADER* pRequest, const CancelToken* pCancel = NULL) override;
+	LONG Set(const std::vector<DISPLAYCONFIG_PATH_INFO>& paths, 
+		const std::vector<DISPLAYCONFIG_MODE_INFO>& modes, UINT32 flags, const CancelToken* pCancel = NULL) override;
+
+private:
+	typedef std::pair<UINT64, UINT32> DeviceKey;
+	static DeviceKey GetDeviceKey(const LUID& adapterId, UINT32 id);
+
+	LONG ValidateLocked(const std::vector<DISPLAYCONFIG_PATH_INFO>& paths, 
+		const std::vector<DISPLAYCONFIG_MODE_INFO>& modes) const;
+
+	SRWLOCK mLock;
+	std::vector<DISPLAYCONFIG_PATH_INFO> mPaths;
+	std::vector<DISPLAYCONFIG_MODE_INFO> mModes;
+	std::map<DeviceKey, DISPLAYCONFIG_TARGET_DEVICE_NAME> mTargetNames;
+	std::map<DeviceKey, DISPLAYCONFIG_SOURCE_DEVICE_NAME> mSourceNames;
+	UINT32 mFailuresPending;
+	LONG mFailureCode;
+	UINT32 mStallsPending;
+	DWORD mStallMs;
+
+	void StallIfRequested();
+};
@@ -24,6 +24,9 @@
 #include "DisplaySettings.h"
 #include "WinUtil.h"
 #include "Util.h"
+#include "TargetNameCache.h"
+#include "DisplayBackend.h"
+#include "SingleFlight.h"
 #include <algorithm>
 #include <numeric>
 #include <iomanip>
@@ -38,120 +41,527 @@ BOOLEAN RationalsEqual(const DISPLAYCONFIG_RATIONAL& a, const DISPLAYCONFIG_RATI
 	return numA == numB;
 }
 
-DisplayConfig::DisplayConfig()
+DisplayConfig::DisplayConfig(QueryScope scope)
 {
-	RefreshFromSystemDisplayConfig();
+	RefreshFromSystemDisplayConfig(scope);
 }
 
-DisplayConfig::DisplayConfig(const DisplayConfig& config)
-:
-mPathInfoArray(new DISPLAYCONFIG_PATH_INFO[config.mNumPathArrayElements]),
-mModeInfoArray(new DISPLAYCONFIG_MODE_INFO[config.mNumModeArrayElements]),
-mNumPathArrayElements(config.mNumPathArrayElements),
-mNumModeArrayElements(config.mNumModeArrayElements),
-mTargetInfo(config.mTargetInfo),
-mDirty(TRUE)
+struct PathQueryResult
 {
-	memcpy(mPathInfoArray.get(), config.mModeInfoArray.get(), 
-		sizeof(DISPLAYCONFIG_PATH_INFO) * mNumPathArrayElements);
-	memcpy(mModeInfoArray.get(), config.mModeInfoArray.get(),
-		sizeof(DISPLAYCONFIG_MODE_INFO) * mNumModeArrayElements);
+	LONG mRc;
+	vector<DISPLAYCONFIG_PATH_INFO> mPaths;
+	vector<DISPLAYCONFIG_MODE_INFO> mModes;
+};
+
+// One per query scope. Callers overlapping an in-flight query of the same scope get
+// its result.
+static SingleFlight<PathQueryResult> sActivePathQuery;
+static SingleFlight<PathQueryResult> sAllPathQuery;
+
+static void QueryPaths(
+	UINT32 flags,
+	vector<DISPLAYCONFIG_PATH_INFO>& paths,
+	vector<DISPLAYCONFIG_MODE_INFO>& modes)
+{
+	SingleFlight<PathQueryResult>& query = (flags & QDC_ALL_PATHS) ? sAllPathQuery : sActivePathQuery;
+
+	SingleFlight<PathQueryResult>::ResultPtr pResult = query.Do([flags]()
+	{
+		PathQueryResult result;
+		result.mRc = DisplayBackend::Get().Query(flags, result.mPaths, result.mModes);
+		return result;
+	});
+
+	if (pResult->mRc == ERROR_INSUFFICIENT_BUFFER)
+		throw std::runtime_error("QueryDisplayConfig returned over 8192 elements");
+
+	if (pResult->mRc != ERROR_SUCCESS)
+		throw std::runtime_error(string("Unexpected QueryDisplayConfig return code: ") 
+			+ std::to_string(pResult->mRc));
+
+	paths = pResult->mPaths;
+	modes = pResult->mModes;
+}
+
+void DisplayConfig::GetQueryStats(UINT64* pQueries, UINT64* pJoins)
+{
+	UINT64 activeQueries, activeJoins, allQueries, allJoins;
+	sActivePathQuery.GetStats(&activeQueries, &activeJoins);
+	sAllPathQuery.GetStats(&allQueries, &allJoins);
+
+	*pQueries = activeQueries + allQueries;
+	*pJoins = activeJoins + allJoins;
 }
 
 /* Initialize self from QueryDisplayConfig
 */
-void DisplayConfig::RefreshFromSystemDisplayConfig()
+void DisplayConfig::RefreshFromSystemDisplayConfig(QueryScope scope)
 {
 	mDirty = TRUE;
 	mChangesWillEnableDisplay = FALSE;
-	for (UINT32 tryBufferSize = 32;; tryBufferSize <<= 1)
-	{
-		std::unique_ptr<DISPLAYCONFIG_PATH_INFO[]> pathInfoArray(new DISPLAYCONFIG_PATH_INFO[tryBufferSize]);
-		std::unique_ptr<DISPLAYCONFIG_MODE_INFO[]> modeInfoArray(new DISPLAYCONFIG_MODE_INFO[tryBufferSize]);
-		mNumPathArrayElements = mNumModeArrayElements = tryBufferSize;
-
-		ULONG rc = QueryDisplayConfig(
-			QDC_ALL_PATHS,
-			&mNumPathArrayElements,
-			pathInfoArray.get(),
-			&mNumModeArrayElements,
-			modeInfoArray.get(),
-			NULL);
-
-		if (rc == ERROR_SUCCESS &&
-			mNumPathArrayElements < tryBufferSize - 1) // must have 2 extra slots for new modes)
+	mScope = scope;
+
+	QueryPaths(scope == QUERY_ALL_PATHS ? QDC_ALL_PATHS : QDC_ONLY_ACTIVE_PATHS, mPaths, mModes);
+
+	mTargetInfo.clear();
+	RefreshTargetInfo();
+
+	mDirty = false;
+}
+
+/* Appends the paths only the full query returns. Paths already present keep whatever
+   edits were made to them, and so do the modes.
+*/
+void DisplayConfig::UpgradeToAllPaths()
+{
+	if (mScope == QUERY_ALL_PATHS)
+		return;
+
+	vector<DISPLAYCONFIG_PATH_INFO> allPaths;
+	vector<DISPLAYCONFIG_MODE_INFO> allModes;
+	QueryPaths(QDC_ALL_PATHS, allPaths, allModes);
+
+	size_t numKnownPaths = mPaths.size();
+
+	for (DISPLAYCONFIG_PATH_INFO path : allPaths)
+	{
+		auto known = std::find_if(mPaths.begin(), mPaths.begin() + numKnownPaths,
+			[&path](const DISPLAYCONFIG_PATH_INFO& existing)
 		{
-			mPathInfoArray = std::move(pathInfoArray);
-			mModeInfoArray = std::move(modeInfoArray);
-			break;
-		}
+			return DeviceId(existing.sourceInfo) == path.sourceInfo && DeviceId(existing.targetInfo) == path.targetInfo;
+		});
 
-		if (rc != ERROR_INSUFFICIENT_BUFFER)
-			throw std::runtime_error(string("Unexpected QueryDisplayConfig return code: ") 
-				+ std::to_string(rc));
+		if (known != mPaths.begin() + numKnownPaths)
+			continue;
 
-		if (tryBufferSize > 8192)
-			throw std::runtime_error("QueryDisplayConfig returned over 8192 elements");
+		// Its modes belong to the other query, and if it became active since our snapshot
+		// we'd rather not know.
+		path.flags &= ~DISPLAYCONFIG_PATH_ACTIVE;
+		path.sourceInfo.modeInfoIdx = DISPLAYCONFIG_PATH_MODE_IDX_INVALID;
+		path.targetInfo.modeInfoIdx = DISPLAYCONFIG_PATH_MODE_IDX_INVALID;
+		mPaths.push_back(path);
 	}
 
+	mScope = QUERY_ALL_PATHS;
+
+	RefreshTargetInfo();
+}
+
+/* One entry per target, preferring its active path. Names already in mTargetInfo are
+   kept; the rest come from g_TargetNameCache.
+*/
+void DisplayConfig::RefreshTargetInfo()
+{
 	map<DeviceId, DISPLAYCONFIG_PATH_INFO*> targetMap;
 
-	for (UINT32 i = 0; i < mNumPathArrayElements; ++i)
+	for (UINT32 i = 0; i < mPaths.size(); ++i)
 	{
-		DeviceId targetId = mPathInfoArray.get()[i].targetInfo;
+		DeviceId targetId = mPaths[i].targetInfo;
 
-		if ((mPathInfoArray.get()[i].flags & DISPLAYCONFIG_PATH_ACTIVE) ||
+		if ((mPaths[i].flags & DISPLAYCONFIG_PATH_ACTIVE) ||
 			targetMap.find(targetId) == targetMap.end() &&
-			mPathInfoArray.get()[i].targetInfo.targetAvailable)
+			mPaths[i].targetInfo.targetAvailable)
 		{
-			targetMap[targetId] = &mPathInfoArray.get()[i];
+			targetMap[targetId] = &mPaths[i];
 		}
 	}
 
-	mTargetInfo.clear();
+	std::vector<TargetAuxInfo> knownTargetInfo;
+	knownTargetInfo.swap(mTargetInfo);
+
+	vector<DeviceId> targets, sources;
+	vector<size_t> sourceOwners;
+
 	for (auto it = targetMap.begin(); it != targetMap.end(); ++it)
 	{
-		mTargetInfo.push_back(TargetAuxInfo());
 		DISPLAYCONFIG_PATH_INFO& current = *it->second;
-		TargetAuxInfo& currentDst = mTargetInfo.back();
 
-		union {
-			DISPLAYCONFIG_SOURCE_DEVICE_NAME source;
-			DISPLAYCONFIG_TARGET_DEVICE_NAME target;
-		} queryInfo;
+		auto known = std::find_if(knownTargetInfo.begin(), knownTargetInfo.end(),
+			[&it](const TargetAuxInfo& info) { return info.mId == it->first; });
+
+		if (known != knownTargetInfo.end())
+		{
+			mTargetInfo.push_back(*known);
+			continue;
+		}
+
+		mTargetInfo.push_back(TargetAuxInfo());
+		mTargetInfo.back().mOutputTech = current.targetInfo.outputTechnology;
+		mTargetInfo.back().mId = current.targetInfo;
+		targets.push_back(current.targetInfo);
 
 		if (current.flags & DISPLAYCONFIG_PATH_ACTIVE)
 		{
-			ZeroMemory(&queryInfo, sizeof(queryInfo));
-			queryInfo.source.header.size = sizeof(queryInfo.source);
-			queryInfo.source.header.adapterId = current.sourceInfo.adapterId;
-			queryInfo.source.header.id = current.sourceInfo.id;
-			queryInfo.source.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_SOURCE_NAME;
-			ULONG rc = DisplayConfigGetDeviceInfo(&queryInfo.source.header);
-
-			if (rc == ERROR_SUCCESS)
-				currentDst.mAttachedSourceGdiDeviceName = queryInfo.source.viewGdiDeviceName;
+			sources.push_back(current.sourceInfo);
+			sourceOwners.push_back(mTargetInfo.size() - 1);
 		}
+	}
 
-		currentDst.mOutputTech = current.targetInfo.outputTechnology;
-		currentDst.mId = current.targetInfo;
+	if (targets.empty())
+		return;
 
-		ZeroMemory(&queryInfo, sizeof(queryInfo));
-		queryInfo.target.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_TARGET_NAME;
-		queryInfo.target.header.size = sizeof(queryInfo.target);
-		queryInfo.target.header.adapterId = current.targetInfo.adapterId;
-		queryInfo.target.header.id = current.targetInfo.id;
-		ULONG rc = DisplayConfigGetDeviceInfo(&queryInfo.target.header);
+	vector<TargetNameCache::TargetNames> targetNames;
+	vector<wstring> sourceNames;
+	g_TargetNameCache.Lookup(targets, targetNames, sources, sourceNames);
 
-		if (rc == ERROR_SUCCESS)
-			currentDst.mFriendlyName = queryInfo.target.monitorFriendlyDeviceName;
+	for (size_t i = 0; i < targets.size(); ++i)
+	{
+		TargetAuxInfo* pInfo = GetAuxInfo(targets[i]);
+		pInfo->mFriendlyName = targetNames[i].mFriendlyName;
+		pInfo->mDevicePath = targetNames[i].mDevicePath;
 	}
 
+	for (size_t i = 0; i < sources.size(); ++i)
+		mTargetInfo[sourceOwners[i]].mAttachedSourceGdiDeviceName = sourceNames[i];
+
 	// std::sort(mTargetInfo.begin(), mTargetInfo.end(), TargetAuxInfoCmp);
 	// for (UINT32 i = 0; i < mTargetInfo.size(); ++i)
 	//	mTargetInfo[i].mUiIndex = i;
+}
 
-	mDirty = false;
+UINT64 DisplayConfig::GetFingerprint() const
+{
+	// Hashed per active path and combined in sorted order, since the two query scopes
+	// needn't list paths in the same order. Modes are hashed field by field through the
+	// path that references them; indices and unused union bytes are not part of the
+	// topology.
+	vector<UINT64> pathHashes;
+
+	for (UINT32 i = 0; i < mPaths.size(); ++i)
+	{
+		const DISPLAYCONFIG_PATH_INFO& path = mPaths[i];
+
+		if (!(path.flags & DISPLAYCONFIG_PATH_ACTIVE))
+			continue;
+
+		// The target's device path names its adapter as well, and unlike the LUID it
+		// survives a reboot. The LUIDs only stand in for a target without one.
+		const TargetAuxInfo* pInfo = GetAuxInfo(DeviceId(path.targetInfo));
+		bool stableIdentity = pInfo && !pInfo->mDevicePath.empty();
+
+		UINT64 hash = FNV1A64_OFFSET_BASIS;
+		if (stableIdentity)
+		{
+			hash = Fnv1a64String(hash, pInfo->mDevicePath);
+			hash = Fnv1a64Value(hash, (BYTE)!memcmp(&path.sourceInfo.adapterId, &path.targetInfo.adapterId, sizeof(LUID)));
+		}
+		else
+		{
+			hash = Fnv1a64Value(hash, path.sourceInfo.adapterId);
+			hash = Fnv1a64Value(hash, path.targetInfo.adapterId);
+		}
+		hash = Fnv1a64Value(hash, path.sourceInfo.id);
+		hash = Fnv1a64Value(hash, path.targetInfo.id);
+		hash = Fnv1a64Value(hash, path.targetInfo.outputTechnology);
+		hash = Fnv1a64Value(hash, path.targetInfo.refreshRate.Numerator);
+		hash = Fnv1a64Value(hash, path.targetInfo.refreshRate.Denominator);
+		hash = Fnv1a64Value(hash, path.targetInfo.scanLineOrdering);
+		hash = Fnv1a64Value(hash, path.targetInfo.rotation);
+		hash = Fnv1a64Value(hash, path.targetInfo.scaling);
+
+		if (pInfo)
+			hash = Fnv1a64String(hash, pInfo->mFriendlyName);
+
+		if (path.sourceInfo.modeInfoIdx < mModes.size())
+		{
+			const DISPLAYCONFIG_SOURCE_MODE& mode = mModes[path.sourceInfo.modeInfoIdx].sourceMode;
+			hash = Fnv1a64Value(hash, mode.width);
+			hash = Fnv1a64Value(hash, mode.height);
+			hash = Fnv1a64Value(hash, mode.pixelFormat);
+			hash = Fnv1a64Value(hash, mode.position);
+		}
+
+		if (path.targetInfo.modeInfoIdx < mModes.size())
+		{
+			const DISPLAYCONFIG_VIDEO_SIGNAL_INFO& signal = 
+				mModes[path.targetInfo.modeInfoIdx].targetMode.targetVideoSignalInfo;
+			hash = Fnv1a64Value(hash, signal.pixelRate);
+			hash = Fnv1a64Value(hash, signal.hSyncFreq);
+			hash = Fnv1a64Value(hash, signal.vSyncFreq);
+			hash = Fnv1a64Value(hash, signal.activeSize);
+			hash = Fnv1a64Value(hash, signal.totalSize);
+			hash = Fnv1a64Value(hash, signal.videoStandard);
+			hash = Fnv1a64Value(hash, signal.scanLineOrdering);
+		}
+
+		pathHashes.push_back(hash);
+	}
+
+	std::sort(pathHashes.begin(), pathHashes.end());
+	return Fnv1a64(FNV1A64_OFFSET_BASIS, pathHashes.data(), pathHashes.size() * sizeof(UINT64));
+}
+
+DisplayConfig::Plan DisplayConfig::GetPlan() const
+{
+	Plan plan;
+	GetApplyPayload(plan.mPaths, plan.mModes);
+	plan.mChangesDisplay = mDirty != 0;
+	plan.mEnablesDisplay = mChangesWillEnableDisplay != 0;
+
+	for (const DISPLAYCONFIG_PATH_INFO& path : plan.mPaths)
+	{
+		for (const LUID& adapterId : { path.sourceInfo.adapterId, path.targetInfo.adapterId })
+		{
+			auto known = std::find_if(plan.mAdapters.begin(), plan.mAdapters.end(),
+				[&adapterId](const std::pair<LUID, wstring>& adapter) { return !memcmp(&adapter.first, &adapterId, sizeof(LUID)); });
+			if (known != plan.mAdapters.end())
+				continue;
+
+			auto target = std::find_if(mTargetInfo.begin(), mTargetInfo.end(),
+				[&adapterId](const TargetAuxInfo& info)
+				{
+					return !info.mDevicePath.empty() && !memcmp(&info.mId.mAdapterId, &adapterId, sizeof(LUID));
+				});
+			if (target != mTargetInfo.end())
+				plan.mAdapters.push_back(make_pair(adapterId, target->mDevicePath));
+		}
+	}
+
+	return plan;
+}
+
+/* Maps *pAdapterId, an adapter the plan names, onto the one here that has the same
+   target. An adapter the plan has no device path for is taken to be unchanged. False if
+   the target the plan relies on isn't here. Looked up afresh for each id rather than
+   built into a table, so loading a cached plan doesn't allocate.
+*/
+bool DisplayConfig::MapPlanAdapter(const Plan& plan, LUID* pAdapterId) const
+{
+	for (const std::pair<LUID, wstring>& adapter : plan.mAdapters)
+	{
+		if (memcmp(&adapter.first, pAdapterId, sizeof(LUID)))
+			continue;
+
+		for (const TargetAuxInfo& info : mTargetInfo)
+		{
+			if (info.mDevicePath == adapter.second)
+			{
+				*pAdapterId = info.mId.mAdapterId;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
+bool DisplayConfig::CanLoadPlan(const Plan& plan) const
+{
+	for (const std::pair<LUID, wstring>& adapter : plan.mAdapters)
+	{
+		LUID adapterId = adapter.first;
+		if (!MapPlanAdapter(plan, &adapterId))
+			return false;
+	}
+
+	for (const DISPLAYCONFIG_PATH_INFO& planned : plan.mPaths)
+	{
+		if (!(planned.flags & DISPLAYCONFIG_PATH_ACTIVE))
+			continue;
+
+		DeviceId source(planned.sourceInfo);
+		DeviceId target(planned.targetInfo);
+		MapPlanAdapter(plan, &source.mAdapterId);
+		MapPlanAdapter(plan, &target.mAdapterId);
+
+		bool found = false;
+		for (UINT32 i = 0; i < mPaths.size() && !found; ++i)
+		{
+			const DISPLAYCONFIG_PATH_INFO& path = mPaths[i];
+			found = 
+				DeviceId(path.sourceInfo) == source && 
+				DeviceId(path.targetInfo) == target &&
+				path.targetInfo.targetAvailable;
+		}
+
+		if (!found)
+			return false;
+	}
+
+	return true;
+}
+
+// Only valid on a config whose fingerprint matches the one the plan was made from, and
+// that CanLoadPlan accepts.
+void DisplayConfig::LoadPlan(const Plan& plan)
+{
+	mPaths = plan.mPaths;
+	mModes = plan.mModes;
+
+	for (DISPLAYCONFIG_PATH_INFO& path : mPaths)
+	{
+		MapPlanAdapter(plan, &path.sourceInfo.adapterId);
+		MapPlanAdapter(plan, &path.targetInfo.adapterId);
+	}
+
+	for (DISPLAYCONFIG_MODE_INFO& mode : mModes)
+		MapPlanAdapter(plan, &mode.adapterId);
+
+	mDirty = plan.mChangesDisplay;
+	mChangesWillEnableDisplay = plan.mEnablesDisplay;
+}
+
+bool DisplayConfig::TargetState::operator==(const TargetState& other) const
+{
+	return mTarget == other.mTarget &&
+		mCloneOf == other.mCloneOf &&
+		mWidth == other.mWidth &&
+		mHeight == other.mHeight &&
+		mPosition.x == other.mPosition.x &&
+		mPosition.y == other.mPosition.y &&
+		mPixelFormat == other.mPixelFormat &&
+		RationalsEqual(mRefreshInfo.first, other.mRefreshInfo.first) &&
+		mRefreshInfo.second == other.mRefreshInfo.second &&
+		mRotation == other.mRotation &&
+		mScaling == other.mScaling &&
+		mHasTargetMode == other.mHasTargetMode &&
+		(!mHasTargetMode || !memcmp(&mTargetMode, &other.mTargetMode, sizeof(mTargetMode)));
+}
+
+DisplayConfig::TopologyState DisplayConfig::GetTopologyState() const
+{
+	TopologyState state;
+
+	for (const DISPLAYCONFIG_PATH_INFO& path : mPaths)
+	{
+		if (!(path.flags & DISPLAYCONFIG_PATH_ACTIVE) || path.sourceInfo.modeInfoIdx >= mModes.size())
+			continue;
+
+		const DISPLAYCONFIG_SOURCE_MODE& sourceMode = mModes[path.sourceInfo.modeInfoIdx].sourceMode;
+
+		TargetState target;
+		target.mTarget = path.targetInfo;
+		target.mWidth = sourceMode.width;
+		target.mHeight = sourceMode.height;
+		target.mPosition = sourceMode.position;
+		target.mPixelFormat = sourceMode.pixelFormat;
+		target.mRefreshInfo = RefreshInfo(path.targetInfo.refreshRate, path.targetInfo.scanLineOrdering);
+		target.mRotation = path.targetInfo.rotation;
+		target.mScaling = path.targetInfo.scaling;
+
+		if (path.targetInfo.modeInfoIdx < mModes.size())
+		{
+			target.mHasTargetMode = true;
+			target.mTargetMode = mModes[path.targetInfo.modeInfoIdx].targetMode;
+		}
+
+		for (const DISPLAYCONFIG_PATH_INFO& other : mPaths)
+		{
+			if ((other.flags & DISPLAYCONFIG_PATH_ACTIVE) &&
+				DeviceId(other.sourceInfo) == path.sourceInfo &&
+				DeviceId(other.targetInfo) < target.mTarget &&
+				(!target.mCloneOf.IsValid() || DeviceId(other.targetInfo) < target.mCloneOf))
+			{
+				target.mCloneOf = other.targetInfo;
+			}
+		}
+
+		state.push_back(target);
+	}
+
+	std::sort(state.begin(), state.end(), [](const TargetState& a, const TargetState& b)
+	{
+		return a.mTarget < b.mTarget;
+	});
+
+	return state;
+}
+
+DisplayConfig::TopologyDiff DisplayConfig::DiffTopology(const TopologyState& from, const TopologyState& to)
+{
+	TopologyDiff diff;
+
+	for (const TargetState& current : from)
+	{
+		auto desired = std::find_if(to.begin(), to.end(), [&current](const TargetState& candidate)
+		{
+			return candidate.mTarget == current.mTarget;
+		});
+
+		if (desired == to.end())
+			diff.mDisable.push_back(current.mTarget);
+	}
+
+	for (const TargetState& desired : to)
+	{
+		auto current = std::find_if(from.begin(), from.end(), [&desired](const TargetState& candidate)
+		{
+			return candidate.mTarget == desired.mTarget;
+		});
+
+		if (current == from.end() || *current != desired)
+			diff.mChange.push_back(desired);
+	}
+
+	std::stable_partition(diff.mChange.begin(), diff.mChange.end(), [](const TargetState& target)
+	{
+		return !target.mCloneOf.IsValid();
+	});
+
+	return diff;
+}
+
+void DisplayConfig::PatchTopology(TopologyState& state, const TopologyDiff& diff)
+{
+	auto byTarget = [](const TargetState& a, const TargetState& b)
+	{
+		return a.mTarget < b.mTarget;
+	};
+
+	state.erase(std::remove_if(state.begin(), state.end(), [&diff](const TargetState& target)
+	{
+		return std::find(diff.mDisable.begin(), diff.mDisable.end(), target.mTarget) != diff.mDisable.end();
+	}), state.end());
+
+	for (const TargetState& target : diff.mChange)
+	{
+		auto existing = std::lower_bound(state.begin(), state.end(), target, byTarget);
+
+		if (existing != state.end() && existing->mTarget == target.mTarget)
+			*existing = target;
+		else
+			state.insert(existing, target);
+	}
+}
+
+void DisplayConfig::MoveToTopologyState(const TopologyState& desired)
+{
+	ApplyTopologyDiff(DiffTopology(GetTopologyState(), desired));
+}
+
+void DisplayConfig::ApplyTopologyDiff(const TopologyDiff& diff)
+{
+	for (const DeviceId& target : diff.mDisable)
+		DisableDisplay(target);
+
+	for (const TargetState& target : diff.mChange)
+	{
+		DisplaySettings settings;
+		settings.mEnabled = true;
+		settings.mResolution = std::make_pair(target.mWidth, target.mHeight);
+		settings.mPosition = target.mPosition;
+		settings.mPixelFormat = target.mPixelFormat;
+		settings.mRefreshInfo = target.mRefreshInfo;
+
+		if (target.mCloneOf.IsValid())
+			settings.mCloneOf = target.mCloneOf;
+
+		if (target.mHasTargetMode)
+			settings.mTargetMode = target.mTargetMode;
+
+		UpdateDisplaySettings(target.mTarget, settings);
+
+		DISPLAYCONFIG_PATH_INFO* pPath = FindActivePath(target.mTarget);
+
+		if (pPath && (pPath->targetInfo.rotation != target.mRotation || pPath->targetInfo.scaling != target.mScaling))
+		{
+			pPath->targetInfo.rotation = target.mRotation;
+			pPath->targetInfo.scaling = target.mScaling;
+			mDirty = TRUE;
+		}
+	}
 }
 
 BOOLEAN DisplayConfig::AreDisplaySettingsCurrent(
@@ -179,8 +589,8 @@ BOOLEAN DisplayConfig::AreDisplaySettingsCurrent(
 		return FALSE;
 	}
 
-	DISPLAYCONFIG_SOURCE_MODE& sourceMode = 
-		mModeInfoArray.get()[pPathWithSource->sourceInfo.modeInfoIdx].sourceMode;
+	const DISPLAYCONFIG_SOURCE_MODE& sourceMode = 
+		mModes[pPathWithSource->sourceInfo.modeInfoIdx].sourceMode;
 
 	if (settings.mResolution && (
 		settings.mResolution->first != sourceMode.width || 
@@ -200,8 +610,8 @@ BOOLEAN DisplayConfig::AreDisplaySettingsCurrent(
 			if (!pAnchorPath) 
 				return false;
 
-			DISPLAYCONFIG_MODE_INFO& mode =
-				mModeInfoArray.get()[pAnchorPath->sourceInfo.modeInfoIdx];
+			const DISPLAYCONFIG_MODE_INFO& mode =
+				mModes[pAnchorPath->sourceInfo.modeInfoIdx];
 
 			assert(mode.infoType == DISPLAYCONFIG_MODE_INFO_TYPE_SOURCE);
 			desiredPosition.x += mode.sourceMode.position.x;
@@ -224,8 +634,8 @@ BOOLEAN DisplayConfig::AreDisplaySettingsCurrent(
 		return FALSE;
 	}
 	
-	DISPLAYCONFIG_TARGET_MODE& targetMode =
-		mModeInfoArray.get()[pPathWithSource->targetInfo.modeInfoIdx].targetMode;
+	const DISPLAYCONFIG_TARGET_MODE& targetMode =
+		mModes[pPathWithSource->targetInfo.modeInfoIdx].targetMode;
 
 	if (settings.mTargetMode && 
 		memcmp(&*settings.mTargetMode, &targetMode, sizeof(targetMode)))
@@ -243,18 +653,18 @@ void DisplayConfig::DisableDisplay(const DeviceId& target)
 	if (!pPath)
 		return;
 
-	for (UINT32 i = 0; i < mNumPathArrayElements; ++i)
+	for (UINT32 i = 0; i < mPaths.size(); ++i)
 	{
-		if (target == mPathInfoArray.get()[i].targetInfo)
+		if (target == mPaths[i].targetInfo)
 		{
-			mDirty |= (mPathInfoArray.get()[i].targetInfo.statusFlags & DISPLAYCONFIG_PATH_ACTIVE) != 0;
-			mPathInfoArray.get()[i].flags &= ~DISPLAYCONFIG_PATH_ACTIVE;
-			mPathInfoArray.get()[i].targetInfo.statusFlags &= ~DISPLAYCONFIG_TARGET_IN_USE;
+			mDirty |= (mPaths[i].targetInfo.statusFlags & DISPLAYCONFIG_PATH_ACTIVE) != 0;
+			mPaths[i].flags &= ~DISPLAYCONFIG_PATH_ACTIVE;
+			mPaths[i].targetInfo.statusFlags &= ~DISPLAYCONFIG_TARGET_IN_USE;
 		}
 
-		//if (DeviceId(pPath->sourceInfo) == mPathInfoArray.get()[i].sourceInfo)
+		//if (DeviceId(pPath->sourceInfo) == mPaths[i].sourceInfo)
 		//{
-		//	mPathInfoArray.get()[i].sourceInfo.statusFlags &= ~DISPLAYCONFIG_SOURCE_IN_USE;
+		//	mPaths[i].sourceInfo.statusFlags &= ~DISPLAYCONFIG_SOURCE_IN_USE;
 		//}
 	}
 }
@@ -271,10 +681,10 @@ void DisplayConfig::UpdateDisplaySettings(const DeviceId& target, const DisplayS
 		return;
 	}
 
-	UINT32 sourceModeIndex = 0;
-	UINT32 newTargetModeIndex = 0;
-	if (settings.mTargetMode) newTargetModeIndex = mNumModeArrayElements++;
-	
+	// Enabling a target, or cloning onto one, needs its inactive paths.
+	if (!FindActivePath(target) || settings.mCloneOf)
+		UpgradeToAllPaths();
+
 	const DISPLAYCONFIG_PATH_INFO* pClonePath = NULL;
 	const DISPLAYCONFIG_PATH_INFO* pAnchorPath = NULL;
 
@@ -307,23 +717,23 @@ void DisplayConfig::UpdateDisplaySettings(const DeviceId& target, const DisplayS
     
 	DISPLAYCONFIG_PATH_INFO* pPathWithSource = NULL;
 
-	for (UINT32 i = 0; i < mNumPathArrayElements; ++i)
+	for (UINT32 i = 0; i < mPaths.size(); ++i)
 	{
-		if (target == mPathInfoArray.get()[i].targetInfo)
+		if (target == mPaths[i].targetInfo)
 		{
-			mPathInfoArray.get()[i].targetInfo.statusFlags |= DISPLAYCONFIG_TARGET_IN_USE;
+			mPaths[i].targetInfo.statusFlags |= DISPLAYCONFIG_TARGET_IN_USE;
 
 			if (pClonePath)
 			{
-				if (DeviceId(pClonePath->sourceInfo) == mPathInfoArray.get()[i].sourceInfo)
-					pPathWithSource = mPathInfoArray.get() + i;
+				if (DeviceId(pClonePath->sourceInfo) == mPaths[i].sourceInfo)
+					pPathWithSource = &mPaths[i];
 				else
-					mPathInfoArray.get()[i].flags &= ~DISPLAYCONFIG_PATH_ACTIVE;
+					mPaths[i].flags &= ~DISPLAYCONFIG_PATH_ACTIVE;
 			}
 			else
 			{
-				if (mPathInfoArray.get()[i].flags & DISPLAYCONFIG_PATH_ACTIVE)
-					pPathWithSource = mPathInfoArray.get() + i;
+				if (mPaths[i].flags & DISPLAYCONFIG_PATH_ACTIVE)
+					pPathWithSource = &mPaths[i];
 			}
 		}
 	}
@@ -332,12 +742,12 @@ void DisplayConfig::UpdateDisplaySettings(const DeviceId& target, const DisplayS
     {
         // We need to find one not in use.
 
-        for (UINT32 i = 0; i < mNumPathArrayElements; ++i)
+        for (UINT32 i = 0; i < mPaths.size(); ++i)
         {
-            if (target == mPathInfoArray.get()[i].targetInfo)
+            if (target == mPaths[i].targetInfo)
             {
-                if (!pPathWithSource && !(mPathInfoArray.get()[i].sourceInfo.statusFlags & DISPLAYCONFIG_SOURCE_IN_USE))
-                    pPathWithSource = mPathInfoArray.get() + i;
+                if (!pPathWithSource && !(mPaths[i].sourceInfo.statusFlags & DISPLAYCONFIG_SOURCE_IN_USE))
+                    pPathWithSource = &mPaths[i];
             }
         }
     }
@@ -364,17 +774,19 @@ void DisplayConfig::UpdateDisplaySettings(const DeviceId& target, const DisplayS
 
 	if (settings.mResolution || settings.mPosition || settings.mPixelFormat || newModeRequired)
 	{
-		sourceModeIndex = pPathWithSource->sourceInfo.modeInfoIdx;
+		DISPLAYCONFIG_MODE_INFO modeInfo;
 
 		if (newModeRequired)
 		{
-			sourceModeIndex = mNumModeArrayElements++;
-			ZeroMemory(mModeInfoArray.get() + sourceModeIndex, sizeof (DISPLAYCONFIG_MODE_INFO));
-			mModeInfoArray.get()[sourceModeIndex].sourceMode.pixelFormat = DISPLAYCONFIG_PIXELFORMAT_32BPP;
+			ZeroMemory(&modeInfo, sizeof (DISPLAYCONFIG_MODE_INFO));
+			modeInfo.sourceMode.pixelFormat = DISPLAYCONFIG_PIXELFORMAT_32BPP;
+		}
+		else
+		{
+			modeInfo = mModes[pPathWithSource->sourceInfo.modeInfoIdx];
 		}
 
-		pPathWithSource->sourceInfo.modeInfoIdx = sourceModeIndex;
-		DISPLAYCONFIG_MODE_INFO* pModeInfo = &mModeInfoArray.get()[sourceModeIndex];
+		DISPLAYCONFIG_MODE_INFO* pModeInfo = &modeInfo;
 		pModeInfo->infoType = DISPLAYCONFIG_MODE_INFO_TYPE_SOURCE;
 		pModeInfo->adapterId = pPathWithSource->sourceInfo.adapterId;
 		pModeInfo->id = pPathWithSource->sourceInfo.id;
@@ -391,7 +803,7 @@ void DisplayConfig::UpdateDisplaySettings(const DeviceId& target, const DisplayS
 
 			if (pAnchorPath)
 			{
-				auto mode = mModeInfoArray.get()[pAnchorPath->sourceInfo.modeInfoIdx];
+				auto mode = mModes[pAnchorPath->sourceInfo.modeInfoIdx];
 				assert(mode.infoType == DISPLAYCONFIG_MODE_INFO_TYPE_SOURCE);
 				pModeInfo->sourceMode.position.x += mode.sourceMode.position.x;
 				pModeInfo->sourceMode.position.y += mode.sourceMode.position.y;
@@ -400,15 +812,23 @@ void DisplayConfig::UpdateDisplaySettings(const DeviceId& target, const DisplayS
 
 		if (settings.mPixelFormat)
 			pModeInfo->sourceMode.pixelFormat = *settings.mPixelFormat;
+
+		// Every path on a source shares its mode, so an existing one is edited in place.
+		if (newModeRequired)
+			pPathWithSource->sourceInfo.modeInfoIdx = AddMode(modeInfo);
+		else
+			mModes[pPathWithSource->sourceInfo.modeInfoIdx] = modeInfo;
 	}
 
 	if (settings.mTargetMode)
 	{
-		DISPLAYCONFIG_MODE_INFO& modeInfo = mModeInfoArray.get()[newTargetModeIndex];
+		DISPLAYCONFIG_MODE_INFO modeInfo;
+		ZeroMemory(&modeInfo, sizeof (DISPLAYCONFIG_MODE_INFO));
 		modeInfo.infoType = DISPLAYCONFIG_MODE_INFO_TYPE_TARGET;
 		modeInfo.adapterId = target.mAdapterId;
 		modeInfo.id = target.mId;
 		memcpy(&modeInfo.targetMode, &*settings.mTargetMode, sizeof(*settings.mTargetMode));
+		pPathWithSource->targetInfo.modeInfoIdx = AddMode(modeInfo);
 	}
 
 	if (!(pPathWithSource->flags & DISPLAYCONFIG_PATH_ACTIVE))
@@ -421,16 +841,16 @@ void DisplayConfig::UpdateDisplaySettings(const DeviceId& target, const DisplayS
 
 DisplayConfig::DeviceId DisplayConfig::GetPrimaryTarget() const
 {
-	for (UINT32 i = 0; i < mNumPathArrayElements; ++i)
+	for (UINT32 i = 0; i < mPaths.size(); ++i)
 	{
-		if ((mPathInfoArray.get()[i].flags & DISPLAYCONFIG_PATH_ACTIVE))
+		if ((mPaths[i].flags & DISPLAYCONFIG_PATH_ACTIVE))
 		{
-			DISPLAYCONFIG_MODE_INFO& mode =
-				mModeInfoArray.get()[mPathInfoArray.get()[i].sourceInfo.modeInfoIdx];
+			const DISPLAYCONFIG_MODE_INFO& mode =
+				mModes[mPaths[i].sourceInfo.modeInfoIdx];
 
 			assert(mode.infoType == DISPLAYCONFIG_MODE_INFO_TYPE_SOURCE);
 			if (mode.sourceMode.position.x == 0 && mode.sourceMode.position.y == 0)
-				return mPathInfoArray.get()[i].targetInfo;
+				return mPaths[i].targetInfo;
 		}
 	}
 
@@ -450,7 +870,7 @@ void DisplayConfig::SetPrimaryTarget(const DeviceId& target)
 
 	// COPY this so the old x and y are held
 	DISPLAYCONFIG_SOURCE_MODE newPrimarySourceMode =
-		mModeInfoArray.get()[pPathWithSource->sourceInfo.modeInfoIdx].sourceMode;
+		mModes[pPathWithSource->sourceInfo.modeInfoIdx].sourceMode;
 
 	if (newPrimarySourceMode.position.x == 0 && newPrimarySourceMode.position.y == 0)
 		return; // already primary!
@@ -458,29 +878,157 @@ void DisplayConfig::SetPrimaryTarget(const DeviceId& target)
 	mDirty = TRUE;
 
 	// shuffle all active source modes to reorient newPrimarySourceMode to (0, 0)
-	for (UINT32 i = 0; i < mNumModeArrayElements; ++i)
+	for (UINT32 i = 0; i < mModes.size(); ++i)
 	{
-		if (mModeInfoArray.get()[i].infoType == DISPLAYCONFIG_MODE_INFO_TYPE_SOURCE)
+		if (mModes[i].infoType == DISPLAYCONFIG_MODE_INFO_TYPE_SOURCE)
 		{
-			mModeInfoArray.get()[i].sourceMode.position.x -= newPrimarySourceMode.position.x;
-			mModeInfoArray.get()[i].sourceMode.position.y -= newPrimarySourceMode.position.y;
+			mModes[i].sourceMode.position.x -= newPrimarySourceMode.position.x;
+			mModes[i].sourceMode.position.y -= newPrimarySourceMode.position.y;
 		}
 	}
 
 	return;
 }
 
-LONG DisplayConfig::Apply(bool force)
+/* Returns the index of a mode identical to modeInfo, adding it if there is none. Edits
+   made across several states tend to produce the same target mode more than once.
+*/
+UINT32 DisplayConfig::AddMode(const DISPLAYCONFIG_MODE_INFO& modeInfo)
+{
+	for (UINT32 i = 0; i < mModes.size(); ++i)
+	{
+		if (!memcmp(&mModes[i], &modeInfo, sizeof(modeInfo)))
+			return i;
+	}
+
+	mModes.push_back(modeInfo);
+	return (UINT32)mModes.size() - 1;
+}
+
+static void RemapModeIndex(UINT32& modeInfoIdx, vector<UINT32>& remap, 
+	const vector<DISPLAYCONFIG_MODE_INFO>& modes, vector<DISPLAYCONFIG_MODE_INFO>& modesOut)
+{
+	if (modeInfoIdx == DISPLAYCONFIG_PATH_MODE_IDX_INVALID || modeInfoIdx >= modes.size())
+	{
+		modeInfoIdx = DISPLAYCONFIG_PATH_MODE_IDX_INVALID;
+		return;
+	}
+
+	if (remap[modeInfoIdx] == DISPLAYCONFIG_PATH_MODE_IDX_INVALID)
+	{
+		remap[modeInfoIdx] = (UINT32)modesOut.size();
+		modesOut.push_back(modes[modeInfoIdx]);
+	}
+
+	modeInfoIdx = remap[modeInfoIdx];
+}
+
+/* What SetDisplayConfig actually needs: the active paths and only the modes they
+   reference, renumbered. Inactive paths and modes orphaned by earlier edits are left
+   out, so the driver has less to validate.
+*/
+void DisplayConfig::GetApplyPayload(
+	vector<DISPLAYCONFIG_PATH_INFO>& paths, vector<DISPLAYCONFIG_MODE_INFO>& modes) const
+{
+	vector<UINT32> remap(mModes.size(), DISPLAYCONFIG_PATH_MODE_IDX_INVALID);
+
+	paths.clear();
+	modes.clear();
+
+	for (const DISPLAYCONFIG_PATH_INFO& path : mPaths)
+	{
+		if (!(path.flags & DISPLAYCONFIG_PATH_ACTIVE))
+			continue;
+
+		paths.push_back(path);
+		RemapModeIndex(paths.back().sourceInfo.modeInfoIdx, remap, mModes, modes);
+		RemapModeIndex(paths.back().targetInfo.modeInfoIdx, remap, mModes, modes);
+	}
+}
+
+LONG DisplayConfig::Validate(const CancelToken* pCancel) const
+{
+	vector<DISPLAYCONFIG_PATH_INFO> paths;
+	vector<DISPLAYCONFIG_MODE_INFO> modes;
+	GetApplyPayload(paths, modes);
+
+	return DisplayBackend::Get().Set(paths, modes, 
+		SDC_VALIDATE | SDC_USE_SUPPLIED_DISPLAY_CONFIG | SDC_ALLOW_CHANGES, pCancel);
+}
+
+UINT64 DisplayConfig::GetPayloadHash() const
+{
+	vector<DISPLAYCONFIG_PATH_INFO> paths;
+	vector<DISPLAYCONFIG_MODE_INFO> modes;
+	GetApplyPayload(paths, modes);
+
+	UINT64 hash = Fnv1a64(FNV1A64_OFFSET_BASIS, paths.data(), paths.size() * sizeof(DISPLAYCONFIG_PATH_INFO));
+	return Fnv1a64(hash, modes.data(), modes.size() * sizeof(DISPLAYCONFIG_MODE_INFO));
+}
+
+wstring DisplayConfig::DescribeApplyError(LONG rc) const
+{
+	wstringstream ss;
+
+	switch (rc)
+	{
+	case ERROR_INVALID_PARAMETER:
+		ss << L"The requested combination of displays, resolutions and positions is not valid.";
+		break;
+	case ERROR_NOT_SUPPORTED:
+		ss << L"The video card cannot drive this configuration, e.g. it has no source left for another display.";
+		break;
+	case ERROR_GEN_FAILURE:
+		ss << L"The display driver rejected one of the requested modes.";
+		break;
+	case ERROR_ACCESS_DENIED:
+		ss << L"Display settings cannot be changed from this session right now.";
+		break;
+	case ERROR_BAD_CONFIGURATION:
+		ss << L"The display configuration database has no entry for this configuration.";
+		break;
+	case ERROR_TIMEOUT:
+		ss << L"The display driver did not respond in time. The change may still complete.";
+		break;
+	default:
+		ss << L"The display configuration could not be changed.";
+	}
+
+	ss << L" Requested displays:";
+
+	for (const DISPLAYCONFIG_PATH_INFO& path : mPaths)
+	{
+		if (!(path.flags & DISPLAYCONFIG_PATH_ACTIVE))
+			continue;
+
+		const TargetAuxInfo* pInfo = GetAuxInfo(DeviceId(path.targetInfo));
+		ss << L" " << (pInfo && !pInfo->mFriendlyName.empty() ? pInfo->mFriendlyName : DeviceId(path.targetInfo).ToWString());
+
+		if (path.sourceInfo.modeInfoIdx < mModes.size())
+		{
+			const DISPLAYCONFIG_SOURCE_MODE& mode = mModes[path.sourceInfo.modeInfoIdx].sourceMode;
+			ss << L" (" << mode.width << L"x" << mode.height << L" at " << mode.position.x << L"," << mode.position.y << L")";
+		}
+	}
+
+	return ss.str();
+}
+
+LONG DisplayConfig::Apply(bool force, const CancelToken* pCancel)
 {
 	if (!mDirty && !force)
 		return 0;
 
-	LONG rc = SetDisplayConfig(
-		mNumPathArrayElements,
-		mPathInfoArray.get(),
-		mNumModeArrayElements,
-		mModeInfoArray.get(),
-		SDC_APPLY | SDC_SAVE_TO_DATABASE | SDC_USE_SUPPLIED_DISPLAY_CONFIG | SDC_ALLOW_CHANGES);
+	vector<DISPLAYCONFIG_PATH_INFO> paths;
+	vector<DISPLAYCONFIG_MODE_INFO> modes;
+	GetApplyPayload(paths, modes);
+
+	LONG rc = DisplayBackend::Get().Set(paths, modes, 
+		SDC_APPLY | SDC_SAVE_TO_DATABASE | SDC_USE_SUPPLIED_DISPLAY_CONFIG | SDC_ALLOW_CHANGES, pCancel);
+
+	// A query already running may have read the topology from before this.
+	sActivePathQuery.Forget();
+	sAllPathQuery.Forget();
 
 	if (rc == ERROR_SUCCESS)
 	{
@@ -493,27 +1041,32 @@ LONG DisplayConfig::Apply(bool force)
 
 const DISPLAYCONFIG_PATH_INFO* DisplayConfig::FindActivePath(const DeviceId& target) const
 {
-	DISPLAYCONFIG_PATH_INFO* pPath = NULL;
-	for (UINT32 i = 0; i < mNumPathArrayElements; ++i)
+	const DISPLAYCONFIG_PATH_INFO* pPath = NULL;
+	for (UINT32 i = 0; i < mPaths.size(); ++i)
 	{
-		if (!(mPathInfoArray.get()[i].flags & DISPLAYCONFIG_PATH_ACTIVE))
+		if (!(mPaths[i].flags & DISPLAYCONFIG_PATH_ACTIVE))
 			continue;
 
-		if (target == mPathInfoArray.get()[i].targetInfo)
-			pPath = mPathInfoArray.get() + i;
+		if (target == mPaths[i].targetInfo)
+			pPath = &mPaths[i];
 	}
 
 	return pPath;
 }
 
+DISPLAYCONFIG_PATH_INFO* DisplayConfig::FindActivePath(const DeviceId& target)
+{
+	return const_cast<DISPLAYCONFIG_PATH_INFO*>(static_cast<const DisplayConfig*>(this)->FindActivePath(target));
+}
+
 bool DisplayConfig::IsCloned(const DISPLAYCONFIG_PATH_INFO* pInfo) const
 {
-	for (UINT32 i = 0; i < mNumPathArrayElements; ++i)
+	for (UINT32 i = 0; i < mPaths.size(); ++i)
 	{
-		if (!(mPathInfoArray.get()[i].flags & DISPLAYCONFIG_PATH_ACTIVE) || &mPathInfoArray.get()[i] == pInfo)
+		if (!(mPaths[i].flags & DISPLAYCONFIG_PATH_ACTIVE) || &mPaths[i] == pInfo)
 			continue;
 
-		if (pInfo->sourceInfo.id == mPathInfoArray.get()[i].sourceInfo.id)
+		if (pInfo->sourceInfo.id == mPaths[i].sourceInfo.id)
 			return true;
 	}
 
@@ -550,15 +1103,15 @@ std::wstring DisplayConfig::DeviceId::ToWString()
 	return ss.str();
 }
 
-void DisplayConfig::LogState(std::wfstream& stream, LogStateFlags flags)
+void DisplayConfig::LogState(std::wostream& stream, LogStateFlags flags) const
 {
-	map<DeviceId, DISPLAYCONFIG_PATH_SOURCE_INFO*> sourceMap;
-	map<DeviceId, DISPLAYCONFIG_PATH_TARGET_INFO*> targetMap;
+	map<DeviceId, const DISPLAYCONFIG_PATH_SOURCE_INFO*> sourceMap;
+	map<DeviceId, const DISPLAYCONFIG_PATH_TARGET_INFO*> targetMap;
 
-	for (UINT32 i = 0; i < mNumPathArrayElements; ++i)
+	for (UINT32 i = 0; i < mPaths.size(); ++i)
 	{
-		sourceMap[mPathInfoArray.get()[i].sourceInfo] = &mPathInfoArray.get()[i].sourceInfo;
-		targetMap[mPathInfoArray.get()[i].targetInfo] = &mPathInfoArray.get()[i].targetInfo;
+		sourceMap[mPaths[i].sourceInfo] = &mPaths[i].sourceInfo;
+		targetMap[mPaths[i].targetInfo] = &mPaths[i].targetInfo;
 	}
 
 	stream << "Display Configuration:" << std::endl;
@@ -568,10 +1121,10 @@ void DisplayConfig::LogState(std::wfstream& stream, LogStateFlags flags)
 		stream << " Source: " << DeviceId(*pair.second).ToWString();
 		if (pair.second->modeInfoIdx != DISPLAYCONFIG_PATH_MODE_IDX_INVALID)
 		{
-			DISPLAYCONFIG_MODE_INFO& mode =
-				mModeInfoArray.get()[pair.second->modeInfoIdx];
+			const DISPLAYCONFIG_MODE_INFO& mode =
+				mModes[pair.second->modeInfoIdx];
 			assert(mode.infoType == DISPLAYCONFIG_MODE_INFO_TYPE_SOURCE);
-			DISPLAYCONFIG_SOURCE_MODE& sourceMode = mode.sourceMode;
+			const DISPLAYCONFIG_SOURCE_MODE& sourceMode = mode.sourceMode;
 
 			stream << " [Resolution: " << std::setw(4) << sourceMode.width << ", " 
 				<< std::setw(4) << sourceMode.height << " ";
@@ -592,10 +1145,10 @@ void DisplayConfig::LogState(std::wfstream& stream, LogStateFlags flags)
 
 			if (pair.second->modeInfoIdx != DISPLAYCONFIG_PATH_MODE_IDX_INVALID)
 			{
-				DISPLAYCONFIG_MODE_INFO& mode =
-					mModeInfoArray.get()[pair.second->modeInfoIdx];
+				const DISPLAYCONFIG_MODE_INFO& mode =
+					mModes[pair.second->modeInfoIdx];
 				assert(mode.infoType == DISPLAYCONFIG_MODE_INFO_TYPE_TARGET);
-				DISPLAYCONFIG_TARGET_MODE& targetMode = mode.targetMode;
+				const DISPLAYCONFIG_TARGET_MODE& targetMode = mode.targetMode;
 				const TargetAuxInfo* pAuxInfo = GetAuxInfo(*pair.second);
 		
 				stream << " [OutputTechnology: " << std::setw(2) << pair.second->outputTechnology;
@@ -612,13 +1165,13 @@ void DisplayConfig::LogState(std::wfstream& stream, LogStateFlags flags)
 		}
 	}
 
-	for (UINT32 i = 0; i < mNumPathArrayElements; ++i)
+	for (UINT32 i = 0; i < mPaths.size(); ++i)
 	{
-		if (!(mPathInfoArray.get()[i].flags & DISPLAYCONFIG_PATH_ACTIVE) && !(flags & ALL_PATHS))
+		if (!(mPaths[i].flags & DISPLAYCONFIG_PATH_ACTIVE) && !(flags & ALL_PATHS))
 			continue;
 
-		stream << " Active Path: " << DeviceId(mPathInfoArray.get()[i].sourceInfo).ToWString();
-		stream << " -> " << DeviceId(mPathInfoArray.get()[i].targetInfo).ToWString() << std::endl;
+		stream << " Active Path: " << DeviceId(mPaths[i].sourceInfo).ToWString();
+		stream << " -> " << DeviceId(mPaths[i].targetInfo).ToWString() << std::endl;
 	}
 
 	stream.flush();
@@ -25,6 +25,8 @@
 #include <Windows.h>
 #include <optional>
 
+class CancelToken;
+
 class DisplayConfig
 {
 public:
@@ -65,13 +67,95 @@ public:
 		DeviceId mId = {};
 		DISPLAYCONFIG_VIDEO_OUTPUT_TECHNOLOGY mOutputTech = {};;
 		std::wstring mFriendlyName;
+		std::wstring mDevicePath;
 		std::wstring mAttachedSourceGdiDeviceName;
 	};
 
-	DisplayConfig();
-	DisplayConfig(const DisplayConfig& config);
+	// The compacted path/mode arrays a MenuItem's display states produce, ready to hand to
+	// SetDisplayConfig.
+	struct Plan
+	{
+		std::vector<DISPLAYCONFIG_PATH_INFO> mPaths;
+		std::vector<DISPLAYCONFIG_MODE_INFO> mModes;
+		bool mChangesDisplay = false;
+		bool mEnablesDisplay = false;
+		// The device path of a target on each adapter the paths name. Adapter LUIDs are
+		// handed out afresh at every boot, so a plan from an earlier one is mapped onto
+		// the adapters that have those targets now.
+		std::vector<std::pair<LUID, std::wstring>> mAdapters;
+	};
+
+	// What one active target shows, independent of path and mode indices. Cloned targets
+	// name the lowest target on their source in mCloneOf.
+	struct TargetState
+	{
+		DeviceId mTarget;
+		DeviceId mCloneOf;
+		UINT32 mWidth = 0;
+		UINT32 mHeight = 0;
+		POINTL mPosition = {};
+		DISPLAYCONFIG_PIXELFORMAT mPixelFormat = {};
+		RefreshInfo mRefreshInfo = {};
+		DISPLAYCONFIG_ROTATION mRotation = {};
+		DISPLAYCONFIG_SCALING mScaling = {};
+		bool mHasTargetMode = false;
+		DISPLAYCONFIG_TARGET_MODE mTargetMode = {};
+
+		bool operator==(const TargetState& other) const;
+		bool operator!=(const TargetState& other) const { return !(*this == other); }
+	};
+
+	// The active targets, sorted by id.
+	typedef std::vector<TargetState> TopologyState;
+
+	// What it takes to get from one TopologyState to another: targets to turn off, and
+	// targets to enable or change, clone sources ahead of their clones.
+	struct TopologyDiff
+	{
+		std::vector<DeviceId> mDisable;
+		std::vector<TargetState> mChange;
+
+		bool IsEmpty() const { return mDisable.empty() && mChange.empty(); }
+	};
+
+	static TopologyDiff DiffTopology(const TopologyState& from, const TopologyState& to);
+	// The inverse of DiffTopology: turns from into to, as data only. state stays sorted.
+	static void PatchTopology(TopologyState& state, const TopologyDiff& diff);
+
+	// An active-only snapshot is enough to read and compare the current state, and is much
+	// cheaper to take. Anything that enables a target needs the full view.
+	enum QueryScope
+	{
+		QUERY_ACTIVE_PATHS,
+		QUERY_ALL_PATHS
+	};
+
+	explicit DisplayConfig(QueryScope scope = QUERY_ALL_PATHS);
+
+	void RefreshFromSystemDisplayConfig(QueryScope scope = QUERY_ALL_PATHS);
 
-	void RefreshFromSystemDisplayConfig();
+	// Adds the inactive paths and targets to an active-only snapshot, keeping any edits
+	// and the names already fetched.
+	void UpgradeToAllPaths();
+	bool HasAllPaths() const { return mScope == QUERY_ALL_PATHS; }
+
+	// Stable across queries of the same connected topology in the same state: the active
+	// paths, their targets' names and the modes in use. Both query scopes agree on it.
+	// Targets are identified by device path rather than adapter LUID, so it's stable
+	// across reboots too.
+	UINT64 GetFingerprint() const;
+
+	Plan GetPlan() const;
+	// Whether every path the plan activates still exists here, once its adapters are
+	// mapped onto this boot's.
+	bool CanLoadPlan(const Plan& plan) const;
+	void LoadPlan(const Plan& plan);
+
+	TopologyState GetTopologyState() const;
+	// Edits only the targets that differ from desired. Check GetTopologyState afterwards;
+	// some clone rearrangements can't be expressed as per-target settings.
+	void MoveToTopologyState(const TopologyState& desired);
+	void ApplyTopologyDiff(const TopologyDiff& diff);
 
 	BOOLEAN AreDisplaySettingsCurrent(const DeviceId& target, const DisplaySettings& settings) const;
 	void UpdateDisplaySettings(const DeviceId& target, const DisplaySettings& settings);
@@ -85,23 +169,39 @@ public:
 		ALL_TARGETS = (1 << 2)
 	};
 
-	void LogState(std::wfstream& stream, LogStateFlags allPaths = NONE);
+	void LogState(std::wostream& stream, LogStateFlags allPaths = NONE) const;
 	
-	LONG Apply(bool force = true);
+	// Asks the driver whether it would accept Apply, without touching the displays.
+	// Either gives up with ERROR_CANCELLED once pCancel is set.
+	LONG Validate(const CancelToken* pCancel = NULL) const;
+	LONG Apply(bool force = true, const CancelToken* pCancel = NULL);
+
+	// Identifies what Apply would hand the driver.
+	UINT64 GetPayloadHash() const;
+	// Explains a Validate/Apply failure in terms of this configuration.
+	std::wstring DescribeApplyError(LONG rc) const;
+
+	// How many topology queries actually ran, and how many callers joined one already
+	// running instead.
+	static void GetQueryStats(UINT64* pQueries, UINT64* pJoins);
 
 private:
+	QueryScope mScope;
 	BOOLEAN mDirty;
 	BOOLEAN mChangesWillEnableDisplay;
-	std::unique_ptr<DISPLAYCONFIG_PATH_INFO[]> mPathInfoArray;
-	std::unique_ptr<DISPLAYCONFIG_MODE_INFO[]> mModeInfoArray;
-	UINT32 mNumPathArrayElements;
-	UINT32 mNumModeArrayElements;
+	std::vector<DISPLAYCONFIG_PATH_INFO> mPaths;
+	std::vector<DISPLAYCONFIG_MODE_INFO> mModes;
 	std::vector<TargetAuxInfo> mTargetInfo;
 
+	void RefreshTargetInfo();
+	UINT32 AddMode(const DISPLAYCONFIG_MODE_INFO& modeInfo);
+	void GetApplyPayload(std::vector<DISPLAYCONFIG_PATH_INFO>& paths, std::vector<DISPLAYCONFIG_MODE_INFO>& modes) const;
 	void DisableDisplay(const DeviceId& target);
 	const DISPLAYCONFIG_PATH_INFO* FindActivePath(const DeviceId& target) const;
+	DISPLAYCONFIG_PATH_INFO* FindActivePath(const DeviceId& target);
 	bool IsCloned(const DISPLAYCONFIG_PATH_INFO* pInfo) const;
 	static bool TargetAuxInfoCmp(const TargetAuxInfo&, const TargetAuxInfo&);
+	bool MapPlanAdapter(const Plan& plan, LUID* pAdapterId) const;
 
 	DisplayConfig::TargetAuxInfo* DisplayConfig::GetAuxInfo(const DeviceId& id);
 	
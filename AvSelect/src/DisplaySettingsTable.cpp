@@ -0,0 +1,208 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "DisplaySettingsTable.h"
+#include <algorithm>
+
+using namespace std;
+
+#define NO_TARGET UINT32_MAX
+
+void DisplaySettingsTable::Reset(size_t items)
+{
+	mFailed.assign(items, false);
+	mItem.clear();
+	mPresence.clear();
+	mTarget.clear();
+	mCloneOf.clear();
+	mAnchor.clear();
+	mWidth.clear();
+	mHeight.clear();
+	mX.clear();
+	mY.clear();
+	mPixelFormat.clear();
+	mRefreshNumerator.clear();
+	mRefreshDenominator.clear();
+	mScanLineOrdering.clear();
+	mTargetMode.clear();
+}
+
+void DisplaySettingsTable::SetFailed(size_t item)
+{
+	assert(item < mFailed.size());
+	mFailed[item] = true;
+}
+
+void DisplaySettingsTable::Add(size_t item, const DisplayConfig::DeviceId& target, 
+	const DisplayConfig::DisplaySettings& settings)
+{
+	assert(item < mFailed.size());
+
+	UINT32 presence = 0;
+
+	if (settings.mEnabled)
+		presence |= HAS_ENABLED | (*settings.mEnabled ? WANTS_ENABLED : 0);
+	if (settings.mCloneOf)
+		presence |= HAS_CLONE_OF;
+	if (settings.mResolution)
+		presence |= HAS_RESOLUTION;
+	if (settings.mPosition)
+		presence |= HAS_POSITION | (settings.mPositionAnchor ? HAS_ANCHOR : 0);
+	if (settings.mPixelFormat)
+		presence |= HAS_PIXEL_FORMAT;
+	if (settings.mRefreshInfo)
+		presence |= HAS_REFRESH;
+	if (settings.mTargetMode)
+		presence |= HAS_TARGET_MODE;
+
+	mItem.push_back((UINT32)item);
+	mPresence.push_back(presence);
+	mTarget.push_back(target);
+	mCloneOf.push_back(settings.mCloneOf.value_or(DisplayConfig::DeviceId()));
+	mAnchor.push_back(settings.mPositionAnchor.value_or(DisplayConfig::DeviceId()));
+	mWidth.push_back(settings.mResolution ? settings.mResolution->first : 0);
+	mHeight.push_back(settings.mResolution ? settings.mResolution->second : 0);
+	mX.push_back(settings.mPosition ? settings.mPosition->x : 0);
+	mY.push_back(settings.mPosition ? settings.mPosition->y : 0);
+	mPixelFormat.push_back(settings.mPixelFormat ? (UINT32)*settings.mPixelFormat : 0);
+	mRefreshNumerator.push_back(settings.mRefreshInfo ? settings.mRefreshInfo->first.Numerator : 0);
+	mRefreshDenominator.push_back(settings.mRefreshInfo ? settings.mRefreshInfo->first.Denominator : 1);
+	mScanLineOrdering.push_back(settings.mRefreshInfo ? (UINT32)settings.mRefreshInfo->second : 0);
+	mTargetMode.push_back(settings.mTargetMode.value_or(DISPLAYCONFIG_TARGET_MODE()));
+}
+
+static UINT32 FindCurrentIndex(const DisplayConfig::TopologyState& current, const DisplayConfig::DeviceId& id)
+{
+	auto it = std::lower_bound(current.begin(), current.end(), id,
+		[](const DisplayConfig::TargetState& state, const DisplayConfig::DeviceId& id)
+	{
+		return state.mTarget < id;
+	});
+
+	return (it != current.end() && it->mTarget == id) ? (UINT32)(it - current.begin()) : NO_TARGET;
+}
+
+vector<bool> DisplaySettingsTable::Evaluate(const DisplayConfig::TopologyState& current) const
+{
+	const size_t rows = mItem.size();
+	const size_t targets = current.size();
+
+	// The current state by target, as columns too. A target's clone group is the lowest
+	// target on its source; the group size says whether it's cloned at all.
+	vector<UINT32> curWidth(targets), curHeight(targets), curPixelFormat(targets);
+	vector<LONG> curX(targets), curY(targets);
+	vector<UINT32> curRefreshNumerator(targets), curRefreshDenominator(targets), curScanLineOrdering(targets);
+	vector<UINT32> curGroup(targets), curGroupSize(targets, 0);
+
+	for (size_t t = 0; t < targets; ++t)
+	{
+		const DisplayConfig::TargetState& state = current[t];
+		curWidth[t] = state.mWidth;
+		curHeight[t] = state.mHeight;
+		curPixelFormat[t] = (UINT32)state.mPixelFormat;
+		curX[t] = state.mPosition.x;
+		curY[t] = state.mPosition.y;
+		curRefreshNumerator[t] = state.mRefreshInfo.first.Numerator;
+		curRefreshDenominator[t] = state.mRefreshInfo.first.Denominator;
+		curScanLineOrdering[t] = (UINT32)state.mRefreshInfo.second;
+
+		UINT32 group = state.mCloneOf.IsValid() ? FindCurrentIndex(current, state.mCloneOf) : NO_TARGET;
+		curGroup[t] = (group == NO_TARGET) ? (UINT32)t : group;
+		++curGroupSize[curGroup[t]];
+	}
+
+	// Resolve each row's targets to indices into the current columns once.
+	vector<UINT32> target(rows), cloneOf(rows), anchor(rows);
+
+	for (size_t r = 0; r < rows; ++r)
+	{
+		target[r] = mTarget[r].IsValid() ? FindCurrentIndex(current, mTarget[r]) : NO_TARGET;
+		cloneOf[r] = (mPresence[r] & HAS_CLONE_OF) ? FindCurrentIndex(current, mCloneOf[r]) : NO_TARGET;
+		anchor[r] = (mPresence[r] & HAS_ANCHOR) ? FindCurrentIndex(current, mAnchor[r]) : NO_TARGET;
+	}
+
+	// The sweep proper: a flat compare per column, ORed into one mismatch flag per row.
+	vector<UINT32> mismatch(rows, 0);
+
+	for (size_t r = 0; r < rows; ++r)
+	{
+		UINT32 presence = mPresence[r];
+		UINT32 t = target[r];
+
+		if (t == NO_TARGET)
+		{
+			mismatch[r] = (presence & WANTS_ENABLED) != 0;
+			continue;
+		}
+
+		UINT32 bad = 0;
+
+		bad |= (presence & HAS_ENABLED) && !(presence & WANTS_ENABLED);
+
+		bad |= (presence & HAS_CLONE_OF) ?
+			(cloneOf[r] == NO_TARGET || curGroup[cloneOf[r]] != curGroup[t]) :
+			(curGroupSize[curGroup[t]] > 1);
+
+		bad |= (presence & HAS_RESOLUTION) &&
+			((mWidth[r] ^ curWidth[t]) | (mHeight[r] ^ curHeight[t])) != 0;
+
+		LONG anchorX = (anchor[r] != NO_TARGET) ? curX[anchor[r]] : 0;
+		LONG anchorY = (anchor[r] != NO_TARGET) ? curY[anchor[r]] : 0;
+		bad |= (presence & HAS_ANCHOR) && anchor[r] == NO_TARGET;
+		bad |= (presence & HAS_POSITION) &&
+			((mX[r] + anchorX) != curX[t] || (mY[r] + anchorY) != curY[t]);
+
+		bad |= (presence & HAS_PIXEL_FORMAT) && mPixelFormat[r] != curPixelFormat[t];
+
+		// Cross-multiplied, so 60/1 and 60000/1000 compare equal like RationalsEqual.
+		bad |= (presence & HAS_REFRESH) &&
+			((UINT64)mRefreshNumerator[r] * curRefreshDenominator[t] != 
+				(UINT64)curRefreshNumerator[t] * mRefreshDenominator[r] ||
+			mScanLineOrdering[r] != curScanLineOrdering[t]);
+
+		mismatch[r] = bad;
+	}
+
+	for (size_t r = 0; r < rows; ++r)
+	{
+		if ((mPresence[r] & HAS_TARGET_MODE) && !mismatch[r] && target[r] != NO_TARGET)
+		{
+			const DisplayConfig::TargetState& state = current[target[r]];
+			mismatch[r] = !state.mHasTargetMode ||
+				memcmp(&mTargetMode[r], &state.mTargetMode, sizeof(DISPLAYCONFIG_TARGET_MODE)) != 0;
+		}
+	}
+
+	vector<bool> matches(mFailed.size());
+
+	for (size_t item = 0; item < mFailed.size(); ++item)
+		matches[item] = !mFailed[item];
+
+	for (size_t r = 0; r < rows; ++r)
+	{
+		if (mismatch[r])
+			matches[mItem[r]] = false;
+	}
+
+	return matches;
+}
@@ -0,0 +1,85 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <vector>
+#include "DisplaySettings.h"
+
+/* Every DisplaySettings state of every MenuItem, compiled once against a snapshot and laid
+   out column by column, so the check marks for a whole menu come from one pass over flat
+   arrays instead of an AreDisplaySettingsCurrent call per state.
+
+   Evaluate gives the same answer AreDisplaySettingsCurrent would for each state, ANDed
+   together per item. Items with no DisplaySettings states always match.
+*/
+class DisplaySettingsTable
+{
+public:
+	// Empties the table and sizes it for items MenuItems, none of them failed.
+	void Reset(size_t items);
+
+	// Adds one state of menu item 'item'. An invalid target is one that isn't active.
+	void Add(size_t item, const DisplayConfig::DeviceId& target, const DisplayConfig::DisplaySettings& settings);
+	// Marks an item as never current, e.g. because one of its states failed to parse.
+	void SetFailed(size_t item);
+
+	size_t GetItemCount() const { return mFailed.size(); }
+	size_t GetRowCount() const { return mItem.size(); }
+
+	// One bit per item: set where all of its states already hold in current.
+	std::vector<bool> Evaluate(const DisplayConfig::TopologyState& current) const;
+
+private:
+	// Which columns a row sets; the rest are don't-care.
+	enum Presence : UINT32
+	{
+		HAS_ENABLED = (1 << 0),
+		WANTS_ENABLED = (1 << 1),
+		HAS_CLONE_OF = (1 << 2),
+		HAS_RESOLUTION = (1 << 3),
+		HAS_POSITION = (1 << 4),
+		HAS_ANCHOR = (1 << 5),
+		HAS_PIXEL_FORMAT = (1 << 6),
+		HAS_REFRESH = (1 << 7),
+		HAS_TARGET_MODE = (1 << 8),
+	};
+
+	std::vector<bool> mFailed;
+
+	std::vector<UINT32> mItem;
+	std::vector<UINT32> mPresence;
+	std::vector<DisplayConfig::DeviceId> mTarget;
+	std::vector<DisplayConfig::DeviceId> mCloneOf;
+	std::vector<DisplayConfig::DeviceId> mAnchor;
+	std::vector<UINT32> mWidth;
+	std::vector<UINT32> mHeight;
+	std::vector<LONG> mX;
+	std::vector<LONG> mY;
+	std::vector<UINT32> mPixelFormat;
+	std::vector<UINT32> mRefreshNumerator;
+	std::vector<UINT32> mRefreshDenominator;
+	std::vector<UINT32> mScanLineOrdering;
+	// Rare enough to keep out of line; indexed by row, meaningful only with HAS_TARGET_MODE.
+	std::vector<DISPLAYCONFIG_TARGET_MODE> mTargetMode;
+};
@@ -0,0 +1,198 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "DisplayTransaction.h"
+#include "TopologyModel.h"
+
+using namespace std;
+
+DisplayTransaction::DisplayTransaction()
+:
+mOutcome(PENDING),
+mRollbackResult(ERROR_SUCCESS),
+mCommitted(CreateEvent(NULL, TRUE, FALSE, NULL)),
+mWatchdog(NULL),
+mTimeoutMs(0)
+{
+	InitializeSRWLock(&mLock);
+}
+
+DisplayTransaction::~DisplayTransaction()
+{
+	if (mWatchdog)
+	{
+		// An unresolved transaction going out of scope is abandoned, not committed.
+		WaitForSingleObject(mWatchdog, INFINITE);
+		CloseHandle(mWatchdog);
+	}
+
+	if (mCommitted)
+		CloseHandle(mCommitted);
+}
+
+void DisplayTransaction::Begin()
+{
+	TopologyModel::SnapshotPtr pCurrent = g_TopologyModel.Acquire();
+
+	AcquireSRWLockExclusive(&mLock);
+	mSnapshot = pCurrent->mConfig.GetTopologyState();
+	mSnapshotPlan = pCurrent->mConfig.GetPlan();
+	mSnapshotPlan.mChangesDisplay = true;
+	mOutcome = PENDING;
+	ReleaseSRWLockExclusive(&mLock);
+
+	ResetEvent(mCommitted);
+}
+
+bool DisplayTransaction::ArmWatchdog(DWORD timeoutMs, RollbackCallback onRolledBack)
+{
+	if (mWatchdog || !mCommitted)
+		return false;
+
+	mTimeoutMs = timeoutMs;
+	mOnRolledBack = onRolledBack;
+	mWatchdog = CreateThread(NULL, 0, WatchdogThreadProc, this, 0, NULL);
+
+	return mWatchdog != NULL;
+}
+
+DWORD WINAPI DisplayTransaction::WatchdogThreadProc(LPVOID lpParam)
+{
+	DisplayTransaction* pThis = (DisplayTransaction*)lpParam;
+
+	if (WaitForSingleObject(pThis->mCommitted, pThis->mTimeoutMs) != WAIT_TIMEOUT)
+		return 0;
+
+	if (pThis->GetOutcome() != PENDING)
+		return 0;
+
+	LogMessage(L"Display change was not confirmed in time, rolling back.");
+	LONG rc = pThis->Rollback();
+
+	// Committed between the timeout and the rollback.
+	if (rc == ERROR_INVALID_STATE)
+		return 0;
+
+	if (pThis->mOnRolledBack)
+		pThis->mOnRolledBack(rc);
+
+	return 0;
+}
+
+bool DisplayTransaction::Commit()
+{
+	AcquireSRWLockExclusive(&mLock);
+	if (mOutcome == PENDING)
+		mOutcome = COMMITTED;
+	bool committed = mOutcome == COMMITTED;
+	ReleaseSRWLockExclusive(&mLock);
+
+	SetEvent(mCommitted);
+	return committed;
+}
+
+// Whichever of the caller and the watchdog gets here first rolls back; the other gets
+// the same result.
+LONG DisplayTransaction::Rollback()
+{
+	AcquireSRWLockExclusive(&mLock);
+
+	if (mOutcome == COMMITTED)
+	{
+		ReleaseSRWLockExclusive(&mLock);
+		return ERROR_INVALID_STATE;
+	}
+
+	if (mOutcome == PENDING)
+	{
+		mOutcome = ROLLED_BACK;
+		mRollbackResult = RestoreSnapshot();
+		g_TopologyModel.Invalidate();
+	}
+
+	LONG rc = mRollbackResult;
+	ReleaseSRWLockExclusive(&mLock);
+
+	SetEvent(mCommitted);
+	return rc;
+}
+
+DisplayTransaction::Outcome DisplayTransaction::GetOutcome() const
+{
+	AcquireSRWLockShared(&mLock);
+	Outcome outcome = mOutcome;
+	ReleaseSRWLockShared(&mLock);
+	return outcome;
+}
+
+LONG DisplayTransaction::RestoreSnapshot() const
+{
+	return RestoreTopology(mSnapshot, mSnapshotPlan);
+}
+
+/* One fresh active-only query (the published snapshot may predate the change), the
+   edits for the targets that drifted, one apply. If the per-target edits can't
+   reproduce the state (e.g. a clone was split) the whole plan is loaded instead, still
+   in the same apply.
+*/
+LONG DisplayTransaction::RestoreTopology(const DisplayConfig::TopologyState& state, const DisplayConfig::Plan& plan)
+{
+	try
+	{
+		DisplayConfig live(DisplayConfig::QUERY_ACTIVE_PATHS);
+
+		if (live.GetTopologyState() == state)
+			return ERROR_SUCCESS;
+
+		DisplayConfig restored = live;
+		bool exact = false;
+
+		try
+		{
+			restored.MoveToTopologyState(state);
+			exact = restored.GetTopologyState() == state;
+		}
+		catch (const std::runtime_error& e)
+		{
+			LogMessage(L"Restore diff failed: " + Widen(e.what()));
+		}
+
+		if (!exact)
+		{
+			restored = live;
+			restored.UpgradeToAllPaths();
+
+			if (!restored.CanLoadPlan(plan))
+				return ERROR_DEVICE_NOT_CONNECTED;
+
+			restored.LoadPlan(plan);
+		}
+
+		return restored.Apply(true);
+	}
+	catch (const std::runtime_error& e)
+	{
+		LogMessage(L"Restore failed: " + Widen(e.what()));
+		return ERROR_GEN_FAILURE;
+	}
+}
@@ -0,0 +1,81 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <functional>
+#include "DisplaySettings.h"
+
+/* Begin, apply, then Commit; anything else puts the displays back.
+
+   Begin snapshots the active topology. Once armed, the watchdog rolls back unless
+   Commit arrives within the timeout, so a change that leaves the only usable monitor
+   dark undoes itself. Rollback diffs the live topology against the snapshot, edits only
+   what differs and applies once; if nothing differs, nothing is applied.
+*/
+class DisplayTransaction
+{
+public:
+	enum Outcome
+	{
+		PENDING,
+		COMMITTED,
+		ROLLED_BACK
+	};
+
+	// Called on the watchdog thread after it rolled back, with the apply result.
+	typedef std::function<void(LONG)> RollbackCallback;
+
+	DisplayTransaction();
+	~DisplayTransaction();
+	DisplayTransaction(const DisplayTransaction&) = delete;
+	DisplayTransaction& operator=(const DisplayTransaction&) = delete;
+
+	void Begin();
+	bool ArmWatchdog(DWORD timeoutMs, RollbackCallback onRolledBack = NULL);
+
+	// False if the transaction was already rolled back.
+	bool Commit();
+	LONG Rollback();
+
+	Outcome GetOutcome() const;
+
+	// Puts the displays back to state, editing only the targets that differ from the live
+	// topology, and falls back to loading plan whole. Applies at most once.
+	static LONG RestoreTopology(const DisplayConfig::TopologyState& state, const DisplayConfig::Plan& plan);
+
+private:
+	static DWORD WINAPI WatchdogThreadProc(LPVOID lpParam);
+	LONG RestoreSnapshot() const;
+
+	mutable SRWLOCK mLock;
+	Outcome mOutcome;
+	LONG mRollbackResult;
+	DisplayConfig::TopologyState mSnapshot;
+	DisplayConfig::Plan mSnapshotPlan;
+
+	HANDLE mCommitted;
+	HANDLE mWatchdog;
+	DWORD mTimeoutMs;
+	RollbackCallback mOnRolledBack;
+};
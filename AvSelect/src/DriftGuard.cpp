@@ -0,0 +1,307 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "DriftGuard.h"
+#include "TopologyModel.h"
+#include "Util.h"
+#include <algorithm>
+#include <numeric>
+
+using namespace std;
+
+DriftGuard::DriftGuard()
+:
+mCheckIntervalMs(0),
+mSettleMs(0),
+mThread(NULL),
+mStop(CreateEvent(NULL, TRUE, FALSE, NULL)),
+mEvent(CreateEvent(NULL, FALSE, FALSE, NULL)),
+mPinned(false),
+mSuspendCount(0),
+mPinnedSnapshotFingerprint(0),
+mPinnedStateFingerprint(0),
+mGivenUpFingerprint(0),
+mChecks(0),
+mDrifts(0),
+mReapplies(0)
+{
+	InitializeSRWLock(&mLock);
+}
+
+DriftGuard::~DriftGuard()
+{
+	Stop();
+	CloseHandle(mStop);
+	CloseHandle(mEvent);
+}
+
+bool DriftGuard::Start(DWORD checkIntervalMs, DWORD settleMs, ReapplyCallback reapply)
+{
+	if (mThread)
+		return true;
+
+	mCheckIntervalMs = checkIntervalMs ? checkIntervalMs : INFINITE;
+	mSettleMs = settleMs;
+	mReapply = reapply;
+
+	ResetEvent(mStop);
+	mThread = CreateThread(NULL, 0, ThreadProc, this, 0, NULL);
+	return mThread != NULL;
+}
+
+void DriftGuard::Stop()
+{
+	if (!mThread)
+		return;
+
+	SetEvent(mStop);
+	WaitForSingleObject(mThread, INFINITE);
+	CloseHandle(mThread);
+	mThread = NULL;
+}
+
+void DriftGuard::Pin(const DisplayConfig& config)
+{
+	DisplayConfig::TopologyState state = config.GetTopologyState();
+
+	vector<DisplayConfig::DeviceId> relevantTargets;
+	for (const DisplayConfig::TargetAuxInfo& target : config.GetAuxInfo())
+		relevantTargets.push_back(target.mId);
+	std::sort(relevantTargets.begin(), relevantTargets.end());
+
+	AcquireSRWLockExclusive(&mLock);
+	mPinnedState.swap(state);
+	mRelevantTargets.swap(relevantTargets);
+	mPinnedSnapshotFingerprint = config.GetFingerprint();
+	mPinnedStateFingerprint = GetStateFingerprint(mPinnedState);
+	mGivenUpFingerprint = 0;
+	mPinned = true;
+	if (mSuspendCount)
+		--mSuspendCount;
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+void DriftGuard::Suspend()
+{
+	AcquireSRWLockExclusive(&mLock);
+	++mSuspendCount;
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+void DriftGuard::Resume()
+{
+	AcquireSRWLockExclusive(&mLock);
+	if (mSuspendCount)
+		--mSuspendCount;
+	ReleaseSRWLockExclusive(&mLock);
+
+	// Whatever happened meanwhile may have moved the displays off the pin.
+	OnDisplayChange();
+}
+
+void DriftGuard::OnDisplayChange()
+{
+	SetEvent(mEvent);
+}
+
+void DriftGuard::GetStats(UINT64* pChecks, UINT64* pDrifts, UINT64* pReapplies) const
+{
+	*pChecks = mChecks.load();
+	*pDrifts = mDrifts.load();
+	*pReapplies = mReapplies.load();
+}
+
+DWORD WINAPI DriftGuard::ThreadProc(LPVOID lpParam)
+{
+	((DriftGuard*)lpParam)->Run();
+	return 0;
+}
+
+void DriftGuard::Run()
+{
+	HANDLE waits[] = { mStop, mEvent };
+
+	for (;;)
+	{
+		DWORD rc = WaitForMultipleObjects(ARRAYSIZE(waits), waits, FALSE, mCheckIntervalMs);
+
+		if (rc == WAIT_OBJECT_0 + 1)
+		{
+			// Read the displays only once they've stopped changing.
+			while ((rc = WaitForMultipleObjects(ARRAYSIZE(waits), waits, FALSE, mSettleMs)) == WAIT_OBJECT_0 + 1)
+				;
+
+			if (rc != WAIT_TIMEOUT)
+				return;
+		}
+		else if (rc == WAIT_TIMEOUT)
+		{
+			// Nothing told us the displays changed; some reverts don't. Look for ourselves.
+			g_TopologyModel.Invalidate();
+		}
+		else
+		{
+			return;
+		}
+
+		Check();
+	}
+}
+
+DisplayConfig::TopologyState DriftGuard::GetRelevantState(const DisplayConfig::TopologyState& state) const
+{
+	DisplayConfig::TopologyState relevant;
+
+	for (const DisplayConfig::TargetState& target : state)
+	{
+		if (std::binary_search(mRelevantTargets.begin(), mRelevantTargets.end(), target.mTarget))
+			relevant.push_back(target);
+	}
+
+	return relevant;
+}
+
+// Covers what the pin is about: which targets are on, how they're cloned, and their
+// mode. Refresh rates are reduced first, since drivers report the same rate as
+// different fractions.
+UINT64 DriftGuard::GetStateFingerprint(const DisplayConfig::TopologyState& state)
+{
+	UINT64 hash = Fnv1a64Value(FNV1A64_OFFSET_BASIS, state.size());
+
+	for (const DisplayConfig::TargetState& target : state)
+	{
+		DISPLAYCONFIG_RATIONAL refresh = target.mRefreshInfo.first;
+		UINT32 divisor = std::gcd(refresh.Numerator, refresh.Denominator);
+		if (divisor)
+		{
+			refresh.Numerator /= divisor;
+			refresh.Denominator /= divisor;
+		}
+
+		hash = Fnv1a64Value(hash, target.mTarget);
+		hash = Fnv1a64Value(hash, target.mCloneOf);
+		hash = Fnv1a64Value(hash, target.mWidth);
+		hash = Fnv1a64Value(hash, target.mHeight);
+		hash = Fnv1a64Value(hash, target.mPosition);
+		hash = Fnv1a64Value(hash, target.mPixelFormat);
+		hash = Fnv1a64Value(hash, refresh);
+		hash = Fnv1a64Value(hash, target.mRefreshInfo.second);
+		hash = Fnv1a64Value(hash, target.mRotation);
+		hash = Fnv1a64Value(hash, target.mScaling);
+	}
+
+	return hash;
+}
+
+void DriftGuard::Check()
+{
+	++mChecks;
+
+	TopologyModel::SnapshotPtr pSnapshot;
+
+	try {
+		pSnapshot = g_TopologyModel.Acquire();
+	} catch (const std::exception&) {
+		return;
+	}
+
+	AcquireSRWLockExclusive(&mLock);
+
+	bool drifted = false;
+
+	if (mPinned && !mSuspendCount &&
+		pSnapshot->mFingerprint != mPinnedSnapshotFingerprint)
+	{
+		UINT64 fingerprint = GetStateFingerprint(GetRelevantState(pSnapshot->mConfig.GetTopologyState()));
+		drifted = fingerprint != mPinnedStateFingerprint && fingerprint != mGivenUpFingerprint;
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+
+	if (drifted)
+	{
+		++mDrifts;
+		LogMessage(L"Displays drifted from the pinned profile.");
+		mReapply();
+	}
+}
+
+bool DriftGuard::Enforce(const CancelToken* pCancel)
+{
+	AcquireSRWLockExclusive(&mLock);
+	bool pinned = mPinned && !mSuspendCount;
+	DisplayConfig::TopologyState pinnedState = mPinnedState;
+	ReleaseSRWLockExclusive(&mLock);
+
+	if (!pinned || (pCancel && pCancel->IsCancelled()))
+		return true;
+
+	// Putting a target back may mean turning it on, which takes the full view.
+	g_TopologyModel.Invalidate();
+	TopologyModel::SnapshotPtr pSnapshot;
+
+	try {
+		pSnapshot = g_TopologyModel.Acquire(DisplayConfig::QUERY_ALL_PATHS);
+	} catch (const std::exception& e) {
+		LogMessage(L"Could not read the displays to restore the pinned profile: " + Widen(e.what()));
+		return false;
+	}
+
+	DisplayConfig config(pSnapshot->mConfig);
+	DisplayConfig::TopologyDiff diff = DisplayConfig::DiffTopology(
+		GetRelevantState(config.GetTopologyState()), pinnedState);
+
+	if (diff.IsEmpty())
+		return true;
+
+	++mReapplies;
+	LogMessage(L"Restoring the pinned profile: " + to_wstring(diff.mDisable.size()) + L" targets to turn off, " +
+		to_wstring(diff.mChange.size()) + L" to change.");
+
+	config.ApplyTopologyDiff(diff);
+	LONG rc = config.HasChanged() ? config.Apply() : ERROR_SUCCESS;
+	g_TopologyModel.Invalidate();
+
+	// If the displays still aren't where they were pinned, the driver won't go back;
+	// don't fight it every time something else changes.
+	bool restored = false;
+
+	try
+	{
+		pSnapshot = g_TopologyModel.Acquire();
+		UINT64 fingerprint = GetStateFingerprint(GetRelevantState(pSnapshot->mConfig.GetTopologyState()));
+
+		AcquireSRWLockExclusive(&mLock);
+		restored = fingerprint == mPinnedStateFingerprint;
+		if (!restored)
+			mGivenUpFingerprint = fingerprint;
+		ReleaseSRWLockExclusive(&mLock);
+	} catch (const std::exception&) {}
+
+	if (!restored && rc != ERROR_SUCCESS)
+		LogMessage(L"Could not restore the pinned profile: " + config.DescribeApplyError(rc));
+	else if (!restored)
+		LogMessage(L"The driver kept its own settings over the pinned profile; leaving them.");
+
+	return restored;
+}
@@ -0,0 +1,103 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include "DisplaySettings.h"
+#include "ApplyExecutor.h"
+
+/* Pinned-profile mode. Remembers the display state the last MenuItem left behind and
+   puts it back when a driver or Windows quietly changes it, e.g. after resume or when a
+   game exits.
+
+   A check is cheap. It reads the shared active-only snapshot, which only costs a query if
+   something invalidated it, and stops there if the snapshot fingerprint still matches
+   the one taken at pin time. Otherwise it hashes just the targets that were connected
+   when the pin was taken. Displays plugged in since then are left alone.
+
+   Checks run on the guard's thread, once display events have settled and every
+   checkIntervalMs (0 for events only). In between it sleeps in a single wait. A check
+   only finds drift; the fix goes through the reapply callback, which is expected to queue
+   Enforce wherever display changes run. Queuing it again before it ran is harmless.
+*/
+class DriftGuard
+{
+public:
+	typedef std::function<void()> ReapplyCallback;
+
+	DriftGuard();
+	~DriftGuard();
+	DriftGuard(const DriftGuard&) = delete;
+	DriftGuard& operator=(const DriftGuard&) = delete;
+
+	bool Start(DWORD checkIntervalMs, DWORD settleMs, ReapplyCallback reapply);
+	void Stop();
+
+	// Pins the state in config, which should be current and have all paths. Targets it
+	// doesn't know about are never touched.
+	void Pin(const DisplayConfig& config);
+	// Holds off while something else is changing the displays. Pin or Resume ends it;
+	// Resume keeps the old pin.
+	void Suspend();
+	void Resume();
+
+	void OnDisplayChange();
+
+	// Moves the pinned targets back where they were with the smallest diff. Returns false
+	// if that failed; the same drift isn't retried until the displays change again.
+	bool Enforce(const CancelToken* pCancel);
+
+	void GetStats(UINT64* pChecks, UINT64* pDrifts, UINT64* pReapplies) const;
+
+private:
+	static DWORD WINAPI ThreadProc(LPVOID lpParam);
+	void Run();
+	void Check();
+
+	DisplayConfig::TopologyState GetRelevantState(const DisplayConfig::TopologyState& state) const;
+	static UINT64 GetStateFingerprint(const DisplayConfig::TopologyState& state);
+
+	DWORD mCheckIntervalMs;
+	DWORD mSettleMs;
+	ReapplyCallback mReapply;
+
+	HANDLE mThread;
+	HANDLE mStop;
+	HANDLE mEvent;
+
+	mutable SRWLOCK mLock;
+	bool mPinned;
+	UINT32 mSuspendCount;
+	DisplayConfig::TopologyState mPinnedState;
+	std::vector<DisplayConfig::DeviceId> mRelevantTargets;
+	UINT64 mPinnedSnapshotFingerprint;
+	UINT64 mPinnedStateFingerprint;
+	UINT64 mGivenUpFingerprint;
+
+	std::atomic<UINT64> mChecks;
+	std::atomic<UINT64> mDrifts;
+	std::atomic<UINT64> mReapplies;
+};
@@ -0,0 +1,72 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+/* Turns a config.xml into the tables a build defining AVSELECT_EMBEDDED_CONFIG compiles
+   in, for machines whose config never changes. AvSelect.vcxproj runs it before compiling
+   when its EmbedConfig property is set, so a config that doesn't parse fails the build
+   rather than the first start.
+
+   EmbedConfig <config.xml> <output file>
+*/
+
+#include "stdafx.h"
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+	if (argc != 3)
+	{
+		cerr << "usage: EmbedConfig <config.xml> <output file>" << endl;
+		return 2;
+	}
+
+	UserConfig config;
+	ostringstream tables;
+
+	try
+	{
+		config.ParseFile(argv[1]);
+		config.WriteEmbedded(tables);
+	}
+	catch (const exception& ex)
+	{
+		// In the form MSBuild reports as an error against the file.
+		cerr << argv[1] << " : error : " << ex.what() << endl;
+		return 1;
+	}
+
+	ofstream stream(argv[2], ios::binary);
+	stream << tables.str();
+	stream.close();
+
+	if (!stream)
+	{
+		cerr << argv[2] << " : error : could not be written." << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,588 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+/* Runs the display code against SimulatedDisplayBackend, so the paths that only matter
+   when something goes wrong (a change nobody confirms, a driver that refuses or stalls)
+   get exercised without switching real displays. Each check prints what it expected and
+   whether it held; the exit code is the number of expectations that failed.
+
+   AvSelectHarness [check ...]    Runs the named checks, or all of them.
+*/
+
+#include "stdafx.h"
+#include "ApplyExecutor.h"
+#include "DisplayBackend.h"
+#include "DisplaySettingsTable.h"
+#include "DisplayTransaction.h"
+#include "SingleFlight.h"
+#include "TopologyModel.h"
+#include "UserConfig.h"
+#include "Util.h"
+#include <fstream>
+#include <functional>
+#include <iostream>
+
+using namespace std;
+
+// AvSelect.cpp is linked in, so checks can pick MenuItems the way the tray does. Its
+// LogMessage writes only to log.txt, which the harness never opens.
+extern UserConfig g_Config;
+extern bool g_enableMessageBoxErrors;
+void HandleUserConfigMenuItemPicked(const UserConfig::MenuItem& menuItem, const CancelToken* pCancel,
+	const function<void()>& onReady);
+const DisplaySettingsTable& GetDisplaySettingsTable(const TopologyModel::SnapshotPtr& pSnapshot);
+UINT64 GetMenuItemKey(const UserConfig::MenuItem& menuItem);
+
+static int sFailures = 0;
+
+static void Expect(bool condition, const wchar_t* what)
+{
+	wcout << (condition ? L"  ok     " : L"  FAILED ") << what << endl;
+	if (!condition)
+		++sFailures;
+}
+
+static const LUID SIM_ADAPTER = { 1, 0 };
+static const DisplayConfig::DeviceId PRIMARY(SIM_ADAPTER, 100);
+static const DisplayConfig::DeviceId SECONDARY(SIM_ADAPTER, 101);
+static const DisplayConfig::DeviceId PROJECTOR(SIM_ADAPTER, 102);
+
+// Two active displays side by side, installed as the backend every query goes to.
+static void InstallTwoDisplays(SimulatedDisplayBackend& backend)
+{
+	backend.AddDisplay(SIM_ADAPTER, 0, PRIMARY.mId, L"Primary", 1920, 1080, true);
+	backend.AddDisplay(SIM_ADAPTER, 1, SECONDARY.mId, L"Secondary", 1280, 1024, true);
+	DisplayBackend::Install(&backend);
+	g_TopologyModel.Invalidate();
+}
+
+// Loads menuItems, the MenuItem elements of a config.xml, into g_Config. With pOnly,
+// only that one is parsed, as for -set.
+static void LoadConfig(const char* menuItems, const char* pOnly = NULL)
+{
+	const char* CONFIG_FILE_NAME = "AvSelectHarness.config.xml";
+
+	ofstream(CONFIG_FILE_NAME, ios::binary) <<
+		"<AvSelectorConfig>\n"
+		"  <MenuItems>\n" << menuItems <<
+		"  </MenuItems>\n"
+		"</AvSelectorConfig>\n";
+	if (pOnly)
+		g_Config.ParseFileFor(CONFIG_FILE_NAME, pOnly);
+	else
+		g_Config.ParseFile(CONFIG_FILE_NAME);
+	remove(CONFIG_FILE_NAME);
+}
+
+static DisplayConfig::TopologyState GetLiveState()
+{
+	return DisplayConfig(DisplayConfig::QUERY_ACTIVE_PATHS).GetTopologyState();
+}
+
+// Turns target off, or on at 1280x720 right of the primary, in one apply.
+static LONG ApplyEnabled(const DisplayConfig::DeviceId& target, bool enabled)
+{
+	DisplayConfig config;
+	DisplayConfig::DisplaySettings settings;
+	settings.mEnabled = enabled;
+	if (enabled)
+	{
+		settings.mResolution = make_pair(1280u, 720u);
+		settings.mPosition = POINTL{ 1920, 0 };
+	}
+	config.UpdateDisplaySettings(target, settings);
+
+	LONG rc = config.Apply(true);
+	g_TopologyModel.Invalidate();
+	return rc;
+}
+
+
+/* What ApplyDisplayConfigWithConfirmation does when the prompt goes unanswered, and what
+   happens when the driver refuses the change or the rollback.
+*/
+static void CheckRollback()
+{
+	static SimulatedDisplayBackend backend;
+	InstallTwoDisplays(backend);
+
+	DisplayConfig::TopologyState before = GetLiveState();
+	Expect(before.size() == 2, L"both simulated displays start out active");
+
+	HANDLE hRolledBack = CreateEvent(NULL, TRUE, FALSE, NULL);
+	LONG rollbackRc = ERROR_INVALID_FUNCTION;
+
+	{
+		DisplayTransaction transaction;
+		transaction.Begin();
+
+		Expect(ApplyEnabled(SECONDARY, false) == ERROR_SUCCESS && GetLiveState().size() == 1, L"the change is applied");
+
+		transaction.ArmWatchdog(100, [&](LONG rc)
+		{
+			rollbackRc = rc;
+			SetEvent(hRolledBack);
+		});
+
+		Expect(WaitForSingleObject(hRolledBack, 5000) == WAIT_OBJECT_0, L"the watchdog rolls back an unconfirmed change");
+		Expect(rollbackRc == ERROR_SUCCESS, L"the rollback applies cleanly");
+		Expect(transaction.GetOutcome() == DisplayTransaction::ROLLED_BACK, L"the transaction ends rolled back");
+		Expect(!transaction.Commit(), L"a confirmation after the rollback is refused");
+	}
+
+	CloseHandle(hRolledBack);
+	Expect(GetLiveState() == before, L"the displays are back as they were");
+
+	backend.FailNextApplies(1, ERROR_GEN_FAILURE);
+	Expect(ApplyEnabled(SECONDARY, false) == ERROR_GEN_FAILURE, L"an injected apply failure is reported");
+	Expect(GetLiveState() == before, L"a failed apply changes nothing");
+
+	{
+		DisplayTransaction transaction;
+		transaction.Begin();
+		ApplyEnabled(SECONDARY, false);
+
+		backend.FailNextApplies(1, ERROR_GEN_FAILURE);
+		Expect(transaction.Rollback() == ERROR_GEN_FAILURE, L"a rollback the driver refuses is reported");
+		Expect(transaction.Rollback() == ERROR_GEN_FAILURE, L"a second rollback gets the same result, not another try");
+	}
+
+	Expect(GetLiveState().size() == 1, L"a refused rollback leaves the change in place");
+}
+
+/* RestoreTopology edits only the targets that differ, but loads the snapshot's plan
+   whole when those edits can't get there: here the secondary and a projector share a
+   source, and the per-target edits can't hand the source back while the projector still
+   holds it. The plan can't help either once the secondary is unplugged.
+*/
+static void CheckRestoreFallback()
+{
+	static SimulatedDisplayBackend backend;
+	backend.AddDisplay(SIM_ADAPTER, 1, PROJECTOR.mId, L"Projector", 1280, 720, false);
+	InstallTwoDisplays(backend);
+
+	DisplayConfig::TopologyState before = GetLiveState();
+	DisplayConfig::Plan plan = DisplayConfig().GetPlan();
+	plan.mChangesDisplay = true;
+
+	Expect(ApplyEnabled(SECONDARY, false) == ERROR_SUCCESS && ApplyEnabled(PROJECTOR, true) == ERROR_SUCCESS,
+		L"the projector takes over the secondary's source");
+
+	DisplayConfig live(DisplayConfig::QUERY_ACTIVE_PATHS);
+	bool editsThrew = false;
+	try
+	{
+		live.MoveToTopologyState(before);
+	}
+	catch (const runtime_error&)
+	{
+		editsThrew = true;
+	}
+	Expect(editsThrew, L"per-target edits can't restore the snapshot");
+
+	Expect(DisplayTransaction::RestoreTopology(before, plan) == ERROR_SUCCESS, L"the plan fallback applies");
+	g_TopologyModel.Invalidate();
+	Expect(GetLiveState() == before, L"the plan fallback restores the snapshot");
+
+	ApplyEnabled(SECONDARY, false);
+	ApplyEnabled(PROJECTOR, true);
+	backend.SetTargetConnected(SIM_ADAPTER, SECONDARY.mId, false);
+
+	Expect(DisplayTransaction::RestoreTopology(before, plan) == ERROR_DEVICE_NOT_CONNECTED, 
+		L"a plan needing an unplugged display is not applied");
+	Expect(GetLiveState().size() == 2 && GetLiveState()[1].mTarget == PROJECTOR, 
+		L"nothing changes when the plan can't load");
+}
+
+/* Windows hands the adapter a new LUID at every boot. The same displays still have the
+   same fingerprint, and a plan made before the reboot loads onto the new LUID.
+*/
+static void CheckReboot()
+{
+	static const LUID REBOOTED_ADAPTER = { 7, 0 };
+	static SimulatedDisplayBackend before, after;
+
+	InstallTwoDisplays(before);
+	DisplayConfig planned(DisplayConfig::QUERY_ACTIVE_PATHS);
+	UINT64 fingerprint = planned.GetFingerprint();
+	DisplayConfig::DisplaySettings settings;
+	settings.mEnabled = false;
+	planned.UpdateDisplaySettings(SECONDARY, settings);
+	DisplayConfig::Plan plan = planned.GetPlan();
+
+	after.AddDisplay(REBOOTED_ADAPTER, 0, PRIMARY.mId, L"Primary", 1920, 1080, true);
+	after.AddDisplay(REBOOTED_ADAPTER, 1, SECONDARY.mId, L"Secondary", 1280, 1024, true);
+	DisplayBackend::Install(&after);
+	g_TopologyModel.Invalidate();
+
+	DisplayConfig rebooted(DisplayConfig::QUERY_ACTIVE_PATHS);
+	Expect(rebooted.GetFingerprint() == fingerprint, L"the fingerprint survives the new LUID");
+	Expect(rebooted.CanLoadPlan(plan), L"the plan from before the reboot can load");
+
+	rebooted.LoadPlan(plan);
+	Expect(rebooted.Apply(true) == ERROR_SUCCESS, L"the loaded plan applies");
+	g_TopologyModel.Invalidate();
+
+	DisplayConfig::TopologyState live = GetLiveState();
+	Expect(live.size() == 1 && live[0].mTarget == DisplayConfig::DeviceId(REBOOTED_ADAPTER, PRIMARY.mId),
+		L"it turns off the secondary on the new LUID");
+}
+
+/* A stalled driver call behind DeadlineDisplayBackend costs the caller its budget, not
+   the stall, and nothing at all once the caller is cancelled. It doesn't hold up the
+   calls after it. A timed-out apply isn't undone: it lands whenever the stalled worker
+   gets to it, as it would with a real driver.
+*/
+static void CheckStall()
+{
+	const DWORD QUERY_BUDGET_MS = 100;
+	const DWORD APPLY_BUDGET_MS = 200;
+	const DWORD STALL_MS = 1000;
+
+	static SimulatedDisplayBackend backend;
+	static DeadlineDisplayBackend deadlineBackend;
+	InstallTwoDisplays(backend);
+	deadlineBackend.SetInner(&backend);
+	deadlineBackend.SetBudgets(QUERY_BUDGET_MS, APPLY_BUDGET_MS);
+	DisplayBackend::Install(&deadlineBackend);
+
+	backend.StallNextCalls(1, STALL_MS);
+	DWORD start = GetTickCount();
+	bool timedOut = false;
+	try
+	{
+		DisplayConfig config(DisplayConfig::QUERY_ACTIVE_PATHS);
+	}
+	catch (const runtime_error&)
+	{
+		timedOut = true;
+	}
+	Expect(timedOut && GetTickCount() - start < STALL_MS, L"a stalled query fails once its budget is spent");
+	Expect(GetLiveState().size() == 2, L"the next query isn't held up by the stalled one");
+
+	DisplayConfig config;
+	DisplayConfig::DisplaySettings settings;
+	settings.mEnabled = false;
+	config.UpdateDisplaySettings(SECONDARY, settings);
+
+	backend.StallNextCalls(1, STALL_MS);
+	start = GetTickCount();
+	Expect(config.Apply(true) == ERROR_TIMEOUT && GetTickCount() - start < STALL_MS, 
+		L"a stalled apply reports ERROR_TIMEOUT once its budget is spent");
+	g_TopologyModel.Invalidate();
+	Expect(GetLiveState().size() == 2, L"the timed-out apply hasn't landed yet");
+
+	CancelToken cancel;
+	cancel.Cancel();
+	backend.StallNextCalls(1, STALL_MS);
+	start = GetTickCount();
+	Expect(config.Validate(&cancel) == ERROR_CANCELLED && GetTickCount() - start < APPLY_BUDGET_MS,
+		L"a cancelled transition stops waiting on a stalled driver without spending its budget");
+
+	Sleep(STALL_MS + APPLY_BUDGET_MS);
+	Expect(GetLiveState().size() == 1, L"the timed-out apply lands when the driver gets to it");
+}
+
+/* One MenuItem picked over and over through HandleUserConfigMenuItemPicked. The first
+   pick turns the secondary off; the second plans against the result, finds nothing left
+   to change and caches that plan. Every pick after those hits a current snapshot and the
+   cached plan, and must not allocate. Counted only where AVSELECT_COUNT_ALLOCATIONS is
+   defined, as it is for this project.
+*/
+static void CheckAllocations()
+{
+	const int WARMUP_PICKS = 2;
+	const int PICKS = 5;
+
+	LoadConfig(
+		"    <MenuItem Name=\"Primary only\">\n"
+		"      <TargetStates>\n"
+		"        <State Type=\"DisplaySettings\">\n"
+		"          <Target FriendlyName=\"Secondary\" />\n"
+		"          <Enabled Value=\"False\" />\n"
+		"        </State>\n"
+		"      </TargetStates>\n"
+		"    </MenuItem>\n");
+
+	static SimulatedDisplayBackend backend;
+	InstallTwoDisplays(backend);
+
+	const UserConfig::MenuItem& menuItem = g_Config.GetMenuItems()[0];
+	int readyCount = 0;
+	function<void()> onReady = [&readyCount]() { ++readyCount; };
+	UINT64 warmAllocations = 0;
+
+	for (int pick = 0; pick < PICKS; ++pick)
+	{
+		UINT64 allocationsBefore = GetAllocationCount();
+		HandleUserConfigMenuItemPicked(menuItem, NULL, onReady);
+		UINT64 allocations = GetAllocationCount() - allocationsBefore;
+
+		wcout << L"    pick " << pick + 1 << L": " << allocations << L" allocations" << endl;
+		if (pick >= WARMUP_PICKS)
+			warmAllocations += allocations;
+	}
+
+	DisplayConfig::TopologyState live = GetLiveState();
+	Expect(live.size() == 1 && live[0].mTarget == PRIMARY, L"the picks leave only the primary on");
+	Expect(readyCount == PICKS, L"every pick got as far as onReady");
+
+#ifdef AVSELECT_COUNT_ALLOCATIONS
+	Expect(warmAllocations == 0, L"a warmed pick allocates nothing");
+#else
+	wcout << L"    (not counted: AVSELECT_COUNT_ALLOCATIONS is not defined)" << endl;
+#endif
+}
+
+/* The tray menu's check marks come from a snapshot of the active targets only. A target
+   that's connected but off still matches a state that wants it off; one that isn't
+   connected at all, or is misspelled, leaves its item unchecked whatever the state asks.
+*/
+static void CheckCheckMarks()
+{
+	static SimulatedDisplayBackend backend;
+	backend.AddDisplay(SIM_ADAPTER, 2, PROJECTOR.mId, L"Projector", 1280, 720, false);
+	InstallTwoDisplays(backend);
+
+	LoadConfig(
+		"    <MenuItem Name=\"Projector off\">\n"
+		"      <TargetStates>\n"
+		"        <State Type=\"DisplaySettings\">\n"
+		"          <Target FriendlyName=\"Projector\" />\n"
+		"          <Enabled Value=\"False\" />\n"
+		"        </State>\n"
+		"      </TargetStates>\n"
+		"    </MenuItem>\n"
+		"    <MenuItem Name=\"Projector on\">\n"
+		"      <TargetStates>\n"
+		"        <State Type=\"DisplaySettings\">\n"
+		"          <Target FriendlyName=\"Projector\" />\n"
+		"          <Enabled Value=\"True\" />\n"
+		"        </State>\n"
+		"      </TargetStates>\n"
+		"    </MenuItem>\n"
+		"    <MenuItem Name=\"Unplugged off\">\n"
+		"      <TargetStates>\n"
+		"        <State Type=\"DisplaySettings\">\n"
+		"          <Target FriendlyName=\"Television\" />\n"
+		"          <Enabled Value=\"False\" />\n"
+		"        </State>\n"
+		"      </TargetStates>\n"
+		"    </MenuItem>\n");
+
+	TopologyModel::SnapshotPtr pSnapshot = g_TopologyModel.Acquire();
+	vector<bool> checked = GetDisplaySettingsTable(pSnapshot).Evaluate(pSnapshot->mConfig.GetTopologyState());
+
+	Expect(checked[0], L"a connected display that's off is checked when the item wants it off");
+	Expect(!checked[1], L"and unchecked when the item wants it on");
+	Expect(!checked[2], L"a display that isn't connected leaves its item unchecked");
+
+	backend.AddDisplay(SIM_ADAPTER, 3, 103, L"Television", 1920, 1080, false);
+	g_TopologyModel.Invalidate();
+	pSnapshot = g_TopologyModel.Acquire();
+	checked = GetDisplaySettingsTable(pSnapshot).Evaluate(pSnapshot->mConfig.GetTopologyState());
+
+	Expect(checked[2], L"plugging it in, still off, checks the item without the active targets changing");
+}
+
+/* A -set parses only the MenuItem it applies, which leaves that item first of those
+   loaded. Its plans are still keyed by where it sits in the whole of config.xml, so it
+   neither loads another item's cached plan nor replaces it.
+*/
+static void CheckPartialParse()
+{
+	const char* MENU_ITEMS =
+		"    <MenuItem Name=\"Primary only\">\n"
+		"      <TargetStates>\n"
+		"        <State Type=\"DisplaySettings\">\n"
+		"          <Target FriendlyName=\"Secondary\" />\n"
+		"          <Enabled Value=\"False\" />\n"
+		"        </State>\n"
+		"      </TargetStates>\n"
+		"    </MenuItem>\n"
+		"    <MenuItem Name=\"Both\">\n"
+		"      <TargetStates>\n"
+		"        <State Type=\"DisplaySettings\">\n"
+		"          <Target FriendlyName=\"Secondary\" />\n"
+		"          <Enabled Value=\"True\" />\n"
+		"        </State>\n"
+		"      </TargetStates>\n"
+		"    </MenuItem>\n";
+
+	LoadConfig(MENU_ITEMS);
+	UINT64 firstKey = GetMenuItemKey(g_Config.GetMenuItems()[0]);
+	UINT64 secondKey = GetMenuItemKey(g_Config.GetMenuItems()[1]);
+
+	LoadConfig(MENU_ITEMS, "Both");
+	const UserConfig::MenuItem* pItem = g_Config.GetMenuItem("Both");
+
+	Expect(g_Config.IsPartial() && g_Config.GetMenuItems().size() == 1, L"only the named item is parsed");
+	Expect(pItem && GetMenuItemKey(*pItem) == secondKey, L"it keeps the key the whole config gives it");
+	Expect(pItem && GetMenuItemKey(*pItem) != firstKey, L"rather than the first item's");
+}
+
+struct ConcurrentCall
+{
+	HANDLE mGo;
+	const function<void()>* mpCall;
+	LONG* mpFailures;
+};
+
+static DWORD WINAPI ConcurrentCallThreadProc(LPVOID lpParam)
+{
+	ConcurrentCall* pCall = (ConcurrentCall*)lpParam;
+	WaitForSingleObject(pCall->mGo, INFINITE);
+
+	try
+	{
+		(*pCall->mpCall)();
+	}
+	catch (const exception&)
+	{
+		InterlockedIncrement(pCall->mpFailures);
+	}
+
+	return 0;
+}
+
+// Starts count threads making the same call at once and waits for them all. Returns how
+// many threw.
+static LONG RunConcurrently(UINT32 count, const function<void()>& call)
+{
+	LONG failures = 0;
+	ConcurrentCall param = { CreateEvent(NULL, TRUE, FALSE, NULL), &call, &failures };
+	vector<HANDLE> threads;
+
+	for (UINT32 i = 0; i < count; ++i)
+		threads.push_back(CreateThread(NULL, 0, ConcurrentCallThreadProc, &param, 0, NULL));
+
+	SetEvent(param.mGo);
+	WaitForMultipleObjects((DWORD)threads.size(), threads.data(), TRUE, INFINITE);
+
+	for (HANDLE hThread : threads)
+		CloseHandle(hThread);
+	CloseHandle(param.mGo);
+	return failures;
+}
+
+static void ReportQueries(const wchar_t* what, UINT32 calls, UINT64 queries, UINT64 joins)
+{
+	wcout << L"    " << what << L": " << calls << L" calls, " << queries << L" queries run, " 
+		<< joins << L" joined" << endl;
+}
+
+/* Overlapping callers asking a stalled driver for the topology should cost one query
+   between them, whether they go through the shared snapshot or query directly. The
+   audio lookups share the same SingleFlight, so a stalled stand-in for the audio
+   service checks what they'd see.
+*/
+static void CheckQueryStats()
+{
+	const UINT32 CALLERS = 8;
+	const DWORD STALL_MS = 200;
+
+	static SimulatedDisplayBackend backend;
+	InstallTwoDisplays(backend);
+
+	UINT64 queriesBefore, joinsBefore, queries, joins;
+	DisplayConfig::GetQueryStats(&queriesBefore, &joinsBefore);
+
+	g_TopologyModel.Invalidate();
+	backend.StallNextCalls(1, STALL_MS);
+	Expect(RunConcurrently(CALLERS, []() { g_TopologyModel.Acquire(); }) == 0, L"every Acquire gets a snapshot");
+
+	DisplayConfig::GetQueryStats(&queries, &joins);
+	ReportQueries(L"Acquire", CALLERS, queries - queriesBefore, joins - joinsBefore);
+	Expect(queries - queriesBefore == 1, L"overlapping Acquires share one topology query");
+
+	queriesBefore = queries;
+	joinsBefore = joins;
+	backend.StallNextCalls(1, STALL_MS);
+	Expect(RunConcurrently(CALLERS, []() { DisplayConfig config(DisplayConfig::QUERY_ACTIVE_PATHS); }) == 0,
+		L"every direct query succeeds");
+
+	DisplayConfig::GetQueryStats(&queries, &joins);
+	ReportQueries(L"DisplayConfig", CALLERS, queries - queriesBefore, joins - joinsBefore);
+	Expect(queries - queriesBefore < CALLERS && queries + joins - queriesBefore - joinsBefore == CALLERS, 
+		L"callers overlapping a stalled query join it instead of queuing their own");
+
+	SingleFlight<wstring> defaultEndpointQuery;
+	Expect(RunConcurrently(CALLERS, [&defaultEndpointQuery, STALL_MS]()
+	{
+		defaultEndpointQuery.Do([STALL_MS]()
+		{
+			Sleep(STALL_MS);
+			return wstring(L"Speakers");
+		});
+	}) == 0, L"every default endpoint lookup succeeds");
+
+	defaultEndpointQuery.GetStats(&queries, &joins);
+	ReportQueries(L"Default endpoint", CALLERS, queries, joins);
+	Expect(queries < CALLERS && queries + joins == CALLERS, L"lookups overlapping a stalled one join it");
+}
+
+struct Check
+{
+	const char* mName;
+	void (*mRun)();
+};
+
+static const Check CHECKS[] =
+{
+	{ "rollback", CheckRollback },
+	{ "stall", CheckStall },
+	{ "restorefallback", CheckRestoreFallback },
+	{ "reboot", CheckReboot },
+	{ "querystats", CheckQueryStats },
+	{ "allocations", CheckAllocations },
+	{ "checkmarks", CheckCheckMarks },
+	{ "partialparse", CheckPartialParse },
+};
+
+int main(int argc, char* argv[])
+{
+	g_enableMessageBoxErrors = false;
+
+	for (const Check& check : CHECKS)
+	{
+		bool selected = argc == 1;
+		for (int i = 1; i < argc && !selected; ++i)
+			selected = !_stricmp(argv[i], check.mName);
+
+		if (!selected)
+			continue;
+
+		wcout << Widen(check.mName) << endl;
+
+		try
+		{
+			check.mRun();
+		}
+		catch (const exception& ex)
+		{
+			Expect(false, (L"no exception (" + Widen(ex.what()) + L")").c_str());
+		}
+	}
+
+	wcout << (sFailures ? to_wstring(sFailures) + L" failed." : wstring(L"All passed.")) << endl;
+	return sFailures;
+}
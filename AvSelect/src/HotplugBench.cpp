@@ -0,0 +1,269 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+/* Measures HotplugEngine and AutoProfileIndex away from Windows: how long after a burst of
+   device events the engine decides, and how long a rule lookup takes against many rules.
+   It also checks that displays and audio endpoints arriving and leaving pick the rules
+   they should. Prints the timings; the exit code is the number of expectations that
+   failed.
+
+   HotplugBench [settleMs]    Built by the Makefile next to AvSelect.sln.
+*/
+
+#include "HotplugEngine.h"
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static int sFailures = 0;
+
+static void Expect(bool condition, const char* what)
+{
+	cout << (condition ? "  ok     " : "  FAILED ") << what << endl;
+	if (!condition)
+		++sFailures;
+}
+
+static AutoProfileIndex::Patterns MakePatterns(vector<wstring> displays, vector<wstring> endpoints)
+{
+	AutoProfileIndex::Patterns patterns;
+	patterns.mDisplays = displays;
+	patterns.mEndpoints = endpoints;
+	return patterns;
+}
+
+static size_t FindFor(const AutoProfileIndex& index, vector<wstring> displays, vector<wstring> endpoints)
+{
+	AutoProfileIndex::Connected connected;
+	connected.mDisplays = displays;
+	connected.mEndpoints = endpoints;
+
+	vector<wstring> keys;
+	AutoProfileIndex::MakeKeys(connected, &keys);
+	return index.Find(keys);
+}
+
+static void CheckMatching()
+{
+	cout << "matching" << endl;
+
+	vector<AutoProfileIndex::Patterns> patterns;
+	patterns.push_back(MakePatterns({}, {}));
+	patterns.push_back(MakePatterns({ L"LG TV SSCR" }, {}));
+	patterns.push_back(MakePatterns({ L"LG TV SSCR" }, { L"*NVIDIA High Definition Audio)" }));
+	patterns.push_back(MakePatterns({}, { L"Headphones (USB Audio)" }));
+	patterns.push_back(MakePatterns({ L"Projector*" }, {}));
+
+	AutoProfileIndex index;
+	index.Build(patterns);
+
+	Expect(FindFor(index, { L"Acer X34" }, { L"Speakers" }) == AutoProfileIndex::NO_MATCH, "nothing matches the desk alone");
+	Expect(FindFor(index, { L"Acer X34", L"lg tv sscr" }, { L"Speakers" }) == 1, "the TV matches by display, in any case");
+	Expect(FindFor(index, { L"Acer X34", L"LG TV SSCR" }, { L"LG TV (NVIDIA High Definition Audio)" }) == 2,
+		"the TV's audio endpoint arriving picks the more specific rule");
+	Expect(FindFor(index, { L"Acer X34", L"LG TV SSCR" }, {}) == 1, "the endpoint leaving falls back to the display rule");
+	Expect(FindFor(index, { L"Acer X34" }, { L"Headphones (USB Audio)" }) == 3, "an endpoint alone can pick a rule");
+	Expect(FindFor(index, { L"Headphones (USB Audio)" }, {}) == AutoProfileIndex::NO_MATCH,
+		"a display named like an endpoint doesn't count as one");
+	Expect(FindFor(index, { L"Projector 4K" }, {}) == 4, "wildcards match displays");
+	Expect(FindFor(index, {}, { L"Projector 4K" }) == AutoProfileIndex::NO_MATCH, "display wildcards don't match endpoints");
+}
+
+static void BenchLookup()
+{
+	cout << "lookup" << endl;
+
+	// A config far larger than anyone writes, so the time is measurable.
+	const size_t RULES = 2000;
+	vector<AutoProfileIndex::Patterns> patterns;
+
+	for (size_t i = 0; i < RULES; ++i)
+	{
+		wstring n = to_wstring(i);
+		if (i % 4 == 0)
+			patterns.push_back(MakePatterns({ L"Display " + n }, {}));
+		else if (i % 4 == 1)
+			patterns.push_back(MakePatterns({ L"Display " + n, L"Display " + to_wstring(i + 1) }, { L"Endpoint " + n }));
+		else if (i % 4 == 2)
+			patterns.push_back(MakePatterns({ L"Display " + n + L"*" }, {}));
+		else
+			patterns.push_back(MakePatterns({}, { L"Endpoint " + n, L"*Headphones*" }));
+	}
+
+	AutoProfileIndex index;
+	index.Build(patterns);
+
+	AutoProfileIndex::Connected connected;
+	connected.mDisplays = { L"Display 1", L"Display 2", L"Display 7", L"Display 1001", L"Display 2002" };
+	connected.mEndpoints = { L"Endpoint 1", L"Speakers", L"Headphones (USB)" };
+
+	vector<wstring> keys;
+	AutoProfileIndex::MakeKeys(connected, &keys);
+
+	const int ITERATIONS = 2000;
+	size_t found = AutoProfileIndex::NO_MATCH;
+
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < ITERATIONS; ++i)
+		found = index.Find(keys);
+	auto end = chrono::steady_clock::now();
+
+	cout << "    " << RULES << " rules, " << keys.size() << " connected: " <<
+		chrono::duration_cast<chrono::nanoseconds>(end - start).count() / ITERATIONS << "ns per lookup" << endl;
+
+	Expect(found == 1, "the rule with the most patterns that holds wins");
+}
+
+// Stands in for the OS: the connected set the engine's query sees.
+struct FakeDevices
+{
+	mutex mLock;
+	AutoProfileIndex::Connected mConnected;
+
+	bool Query(AutoProfileIndex::Connected* pConnected)
+	{
+		lock_guard<mutex> lock(mLock);
+		*pConnected = mConnected;
+		return true;
+	}
+};
+
+struct Decisions
+{
+	mutex mLock;
+	condition_variable mChanged;
+	vector<HotplugEngine::Decision> mDecisions;
+
+	bool WaitFor(size_t count, chrono::milliseconds timeout)
+	{
+		unique_lock<mutex> lock(mLock);
+		return mChanged.wait_for(lock, timeout, [this, count]() { return mDecisions.size() >= count; });
+	}
+};
+
+static void BenchDebounce(uint32_t settleMs)
+{
+	cout << "debounce" << endl;
+
+	const uint32_t STORM_EVENTS = 8;
+	const uint32_t STORM_INTERVAL_MS = 20;
+
+	vector<AutoProfileIndex::Patterns> patterns;
+	patterns.push_back(MakePatterns({ L"LG TV SSCR" }, {}));
+	patterns.push_back(MakePatterns({ L"LG TV SSCR" }, { L"*High Definition Audio*" }));
+
+	FakeDevices devices;
+	devices.mConnected.mDisplays = { L"Acer X34" };
+
+	Decisions decisions;
+	HotplugEngine engine;
+
+	bool started = engine.Start(patterns, settleMs,
+		[&devices](AutoProfileIndex::Connected* pConnected) { return devices.Query(pConnected); },
+		[&decisions](const HotplugEngine::Decision& decision)
+	{
+		lock_guard<mutex> lock(decisions.mLock);
+		decisions.mDecisions.push_back(decision);
+		decisions.mChanged.notify_all();
+	});
+
+	Expect(started, "the engine starts when a rule exists");
+
+	chrono::milliseconds timeout(STORM_EVENTS * STORM_INTERVAL_MS + settleMs * 4 + 1000);
+
+	// The TV, then its HDMI audio a little later, then both going away.
+	struct Step
+	{
+		vector<wstring> mDisplays;
+		vector<wstring> mEndpoints;
+		size_t mExpected;
+		const char* mWhat;
+	};
+
+	const Step STEPS[] = {
+		{ { L"Acer X34", L"LG TV SSCR" }, {}, 0, "display arrival picks the display rule" },
+		{ { L"Acer X34", L"LG TV SSCR" }, { L"LG TV (High Definition Audio Device)" }, 1, "endpoint arrival picks the endpoint rule" },
+		{ { L"Acer X34", L"LG TV SSCR" }, {}, 0, "endpoint removal falls back to the display rule" },
+		{ { L"Acer X34" }, {}, AutoProfileIndex::NO_MATCH, "display removal matches nothing" },
+	};
+
+	uint64_t worstOverrunUs = 0, totalOverrunUs = 0;
+
+	for (size_t i = 0; i < sizeof(STEPS) / sizeof(STEPS[0]); ++i)
+	{
+		{
+			lock_guard<mutex> lock(devices.mLock);
+			devices.mConnected.mDisplays = STEPS[i].mDisplays;
+			devices.mConnected.mEndpoints = STEPS[i].mEndpoints;
+		}
+
+		engine.SimulateEventStorm(STORM_EVENTS, STORM_INTERVAL_MS);
+
+		if (!decisions.WaitFor(i + 1, timeout))
+		{
+			Expect(false, STEPS[i].mWhat);
+			break;
+		}
+
+		HotplugEngine::Decision decision;
+		{
+			lock_guard<mutex> lock(decisions.mLock);
+			decision = decisions.mDecisions[i];
+		}
+
+		Expect(decision.mMenuItem == STEPS[i].mExpected, STEPS[i].mWhat);
+		Expect(decision.mEvents == STORM_EVENTS, "the whole storm settles into one decision");
+
+		uint64_t overrunUs = decision.mSinceLastEventUs > settleMs * 1000ULL ? decision.mSinceLastEventUs - settleMs * 1000ULL : 0;
+		totalOverrunUs += overrunUs;
+		if (overrunUs > worstOverrunUs)
+			worstOverrunUs = overrunUs;
+
+		cout << "    " << decision.mSinceFirstEventUs / 1000 << "ms after the first event, " <<
+			decision.mSinceLastEventUs / 1000 << "ms after the last, lookup " << decision.mLookupUs << "us" << endl;
+	}
+
+	engine.Stop();
+
+	HotplugEngine::Stats stats = engine.GetStats();
+	cout << "    " << stats.mEvents << " events, " << stats.mEvaluations << " evaluations; past the " << settleMs <<
+		"ms settle time by " << totalOverrunUs / 4 << "us on average, " << worstOverrunUs << "us at worst" << endl;
+
+	Expect(stats.mEvaluations == 4, "one evaluation per storm");
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t settleMs = argc > 1 ? (uint32_t)stoul(argv[1]) : 100;
+
+	CheckMatching();
+	BenchLookup();
+	BenchDebounce(settleMs);
+
+	cout << (sFailures ? to_string(sFailures) + " failed." : string("All passed.")) << endl;
+	return sFailures;
+}
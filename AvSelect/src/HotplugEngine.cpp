@@ -0,0 +1,422 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+// Not built with the precompiled header: nothing here needs Windows.h.
+#include "HotplugEngine.h"
+#include <algorithm>
+#include <cwctype>
+
+using namespace std;
+
+// Every name and pattern is kept behind the kind of device it names, so a display and an
+// endpoint that share a name are still told apart, and a wildcard can't cross kinds.
+static const wchar_t DISPLAY_KEY[] = L"display:";
+static const wchar_t ENDPOINT_KEY[] = L"endpoint:";
+
+static const uint64_t FNV1A64_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+static const uint64_t FNV1A64_PRIME = 0x100000001b3ULL;
+
+static wstring MakeKey(const wchar_t* pKind, const wstring& name)
+{
+	wstring key(pKind);
+	key.reserve(key.size() + name.size());
+
+	for (wchar_t c : name)
+		key.push_back((wchar_t)towlower(c));
+
+	return key;
+}
+
+static bool HasWildcards(const wstring& pattern)
+{
+	return pattern.find_first_of(L"*?") != wstring::npos;
+}
+
+// ? matches any one character and * any run, as WildcardMatch does. Both sides are
+// already lower case.
+static bool KeyMatches(const wstring& key, const wstring& pattern)
+{
+	size_t k = 0, p = 0;
+	size_t starPattern = wstring::npos, starKey = 0;
+
+	while (k < key.size())
+	{
+		if (p < pattern.size() && (pattern[p] == L'?' || pattern[p] == key[k]))
+		{
+			++k;
+			++p;
+		}
+		else if (p < pattern.size() && pattern[p] == L'*')
+		{
+			starPattern = p++;
+			starKey = k;
+		}
+		else if (starPattern != wstring::npos)
+		{
+			p = starPattern + 1;
+			k = ++starKey;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	while (p < pattern.size() && pattern[p] == L'*')
+		++p;
+
+	return p == pattern.size();
+}
+
+static uint64_t Fnv1a64Key(uint64_t hash, const wstring& key)
+{
+	// The terminator goes in too, so "ab","c" and "a","bc" differ.
+	for (size_t i = 0; i <= key.size(); ++i)
+	{
+		uint32_t c = i < key.size() ? (uint32_t)key[i] : 0;
+
+		for (int byte = 0; byte < 4; ++byte)
+		{
+			hash ^= (c >> (byte * 8)) & 0xFF;
+			hash *= FNV1A64_PRIME;
+		}
+	}
+
+	return hash;
+}
+
+static uint64_t MicrosecondsBetween(chrono::steady_clock::time_point from, chrono::steady_clock::time_point to)
+{
+	return (uint64_t)chrono::duration_cast<chrono::microseconds>(to - from).count();
+}
+
+void AutoProfileIndex::Build(const vector<Patterns>& patternsByMenuItem)
+{
+	mRules.clear();
+	mRulesByExactName.clear();
+
+	auto patternCount = [&patternsByMenuItem](size_t menuItem)
+	{
+		return patternsByMenuItem[menuItem].mDisplays.size() + patternsByMenuItem[menuItem].mEndpoints.size();
+	};
+
+	vector<size_t> order;
+	for (size_t i = 0; i < patternsByMenuItem.size(); ++i)
+	{
+		if (patternCount(i))
+			order.push_back(i);
+	}
+
+	// Most specific first, so Find can stop at the first rule that holds.
+	std::stable_sort(order.begin(), order.end(), [&patternCount](size_t a, size_t b)
+	{
+		return patternCount(a) > patternCount(b);
+	});
+
+	for (size_t menuItem : order)
+	{
+		Rule rule;
+		rule.mMenuItem = menuItem;
+		rule.mExactCount = 0;
+
+		vector<wstring> exactNames;
+		auto addPatterns = [&rule, &exactNames](const wchar_t* pKind, const vector<wstring>& patterns)
+		{
+			for (const wstring& pattern : patterns)
+			{
+				if (HasWildcards(pattern))
+					rule.mWildcards.push_back(MakeKey(pKind, pattern));
+				else
+					exactNames.push_back(MakeKey(pKind, pattern));
+			}
+		};
+
+		addPatterns(DISPLAY_KEY, patternsByMenuItem[menuItem].mDisplays);
+		addPatterns(ENDPOINT_KEY, patternsByMenuItem[menuItem].mEndpoints);
+
+		// A rule naming the same device twice still only needs it once.
+		std::sort(exactNames.begin(), exactNames.end());
+		exactNames.erase(std::unique(exactNames.begin(), exactNames.end()), exactNames.end());
+
+		for (const wstring& name : exactNames)
+			mRulesByExactName[name].push_back((uint32_t)mRules.size());
+
+		rule.mExactCount = (uint32_t)exactNames.size();
+		mRules.push_back(rule);
+	}
+}
+
+void AutoProfileIndex::MakeKeys(const Connected& connected, vector<wstring>* pKeys)
+{
+	pKeys->clear();
+	pKeys->reserve(connected.mDisplays.size() + connected.mEndpoints.size());
+
+	for (const wstring& name : connected.mDisplays)
+		pKeys->push_back(MakeKey(DISPLAY_KEY, name));
+
+	for (const wstring& name : connected.mEndpoints)
+		pKeys->push_back(MakeKey(ENDPOINT_KEY, name));
+
+	std::sort(pKeys->begin(), pKeys->end());
+	pKeys->erase(std::unique(pKeys->begin(), pKeys->end()), pKeys->end());
+}
+
+size_t AutoProfileIndex::Find(const vector<wstring>& connectedKeys) const
+{
+	vector<uint32_t> exactHits(mRules.size(), 0);
+
+	for (const wstring& key : connectedKeys)
+	{
+		auto it = mRulesByExactName.find(key);
+		if (it == mRulesByExactName.end())
+			continue;
+
+		for (uint32_t rule : it->second)
+			++exactHits[rule];
+	}
+
+	for (size_t i = 0; i < mRules.size(); ++i)
+	{
+		const Rule& rule = mRules[i];
+
+		if (exactHits[i] != rule.mExactCount)
+			continue;
+
+		bool holds = std::all_of(rule.mWildcards.begin(), rule.mWildcards.end(), [&connectedKeys](const wstring& pattern)
+		{
+			return std::any_of(connectedKeys.begin(), connectedKeys.end(), [&pattern](const wstring& key)
+			{
+				return KeyMatches(key, pattern);
+			});
+		});
+
+		if (holds)
+			return rule.mMenuItem;
+	}
+
+	return NO_MATCH;
+}
+
+HotplugEngine::HotplugEngine()
+:
+mSettle(0),
+mStopping(false),
+mPending(false),
+mStats(),
+mLastFingerprint(0)
+{
+}
+
+HotplugEngine::~HotplugEngine()
+{
+	Stop();
+}
+
+bool HotplugEngine::Start(const vector<AutoProfileIndex::Patterns>& patternsByMenuItem, uint32_t settleMs,
+	ConnectedQuery query, DecisionCallback decide)
+{
+	if (mThread.joinable())
+		return true;
+
+	mIndex.Build(patternsByMenuItem);
+	if (mIndex.IsEmpty())
+		return false;
+
+	mSettle = chrono::milliseconds(settleMs);
+	mQuery = query;
+	mDecide = decide;
+	mDecisions.clear();
+
+	AutoProfileIndex::Connected connected;
+	vector<wstring> keys;
+	if (!ReadConnected(&mLastFingerprint, &connected, &keys))
+		mLastFingerprint = 0;
+
+	{
+		lock_guard<mutex> lock(mLock);
+		mStopping = false;
+		mPending = false;
+	}
+
+	mThread = thread([this]() { Run(); });
+	return true;
+}
+
+void HotplugEngine::Stop()
+{
+	vector<thread> storms;
+	{
+		lock_guard<mutex> lock(mLock);
+		storms.swap(mStorms);
+	}
+
+	for (thread& storm : storms)
+		storm.join();
+
+	if (!mThread.joinable())
+		return;
+
+	{
+		lock_guard<mutex> lock(mLock);
+		mStopping = true;
+	}
+
+	mWake.notify_all();
+	mThread.join();
+}
+
+void HotplugEngine::OnDeviceEvent()
+{
+	{
+		lock_guard<mutex> lock(mLock);
+		++mStats.mEvents;
+		mPending = true;
+		mLastEvent = Clock::now();
+	}
+
+	mWake.notify_one();
+}
+
+void HotplugEngine::SimulateEventStorm(uint32_t eventCount, uint32_t intervalMs)
+{
+	thread storm([this, eventCount, intervalMs]()
+	{
+		for (uint32_t i = 0; i < eventCount; ++i)
+		{
+			if (i)
+				this_thread::sleep_for(chrono::milliseconds(intervalMs));
+			OnDeviceEvent();
+		}
+	});
+
+	lock_guard<mutex> lock(mLock);
+	mStorms.push_back(std::move(storm));
+}
+
+HotplugEngine::Stats HotplugEngine::GetStats() const
+{
+	lock_guard<mutex> lock(mLock);
+	return mStats;
+}
+
+void HotplugEngine::Run()
+{
+	unique_lock<mutex> lock(mLock);
+	auto woken = [this]() { return mStopping || mPending; };
+
+	for (;;)
+	{
+		mWake.wait(lock, woken);
+		if (mStopping)
+			return;
+
+		Clock::time_point firstEvent = mLastEvent;
+		uint64_t eventsBefore = mStats.mEvents - 1;
+
+		// Each further event restarts the wait, so a storm settles into one evaluation.
+		do
+		{
+			mPending = false;
+		} while (mWake.wait_for(lock, mSettle, woken) && !mStopping);
+
+		if (mStopping)
+			return;
+
+		Clock::time_point lastEvent = mLastEvent;
+		uint64_t events = mStats.mEvents - eventsBefore;
+		++mStats.mEvaluations;
+
+		lock.unlock();
+		Evaluate(firstEvent, lastEvent, events);
+		lock.lock();
+	}
+}
+
+bool HotplugEngine::ReadConnected(uint64_t* pFingerprint, AutoProfileIndex::Connected* pConnected,
+	vector<wstring>* pKeys)
+{
+	pConnected->mDisplays.clear();
+	pConnected->mEndpoints.clear();
+
+	try
+	{
+		if (!mQuery(pConnected))
+			return false;
+	} catch (const std::exception&) {
+		return false;
+	}
+
+	AutoProfileIndex::MakeKeys(*pConnected, pKeys);
+
+	uint64_t fingerprint = FNV1A64_OFFSET_BASIS;
+	for (const wstring& key : *pKeys)
+		fingerprint = Fnv1a64Key(fingerprint, key);
+
+	*pFingerprint = fingerprint;
+	return true;
+}
+
+void HotplugEngine::Evaluate(Clock::time_point firstEvent, Clock::time_point lastEvent, uint64_t events)
+{
+	uint64_t fingerprint;
+	AutoProfileIndex::Connected connected;
+	vector<wstring> keys;
+
+	if (!ReadConnected(&fingerprint, &connected, &keys) || fingerprint == mLastFingerprint)
+		return;
+
+	mLastFingerprint = fingerprint;
+
+	Clock::time_point start = Clock::now();
+
+	size_t menuItem;
+	auto known = mDecisions.find(fingerprint);
+
+	if (known != mDecisions.end())
+	{
+		menuItem = known->second;
+	}
+	else
+	{
+		menuItem = mIndex.Find(keys);
+		mDecisions[fingerprint] = menuItem;
+	}
+
+	Clock::time_point end = Clock::now();
+
+	Decision decision;
+	decision.mMenuItem = menuItem;
+	decision.mDisplayCount = connected.mDisplays.size();
+	decision.mEndpointCount = connected.mEndpoints.size();
+	decision.mEvents = events;
+	decision.mSinceFirstEventUs = MicrosecondsBetween(firstEvent, end);
+	decision.mSinceLastEventUs = MicrosecondsBetween(lastEvent, end);
+	decision.mLookupUs = MicrosecondsBetween(start, end);
+
+	{
+		lock_guard<mutex> lock(mLock);
+		++mStats.mDecisions;
+		mStats.mLookupUs += decision.mLookupUs;
+	}
+
+	mDecide(decision);
+}
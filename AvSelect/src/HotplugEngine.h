@@ -0,0 +1,171 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/* The MenuItems with an <AutoApply> rule, indexed so the connected displays and audio
+   endpoints can be matched against all of them at once. A rule holds when each of its
+   patterns matches some connected device of its kind. Patterns without wildcards are
+   looked up by name; only rules whose exact names are all present get their wildcards
+   tried.
+
+   When several rules hold, the one with the most patterns wins, then the one first in
+   config.xml, so "TV and projector" beats "TV" when both are plugged in.
+
+   Only standard types are used here, so the index and HotplugEngine build and can be
+   measured on Linux; AvSelect.cpp supplies the patterns and the connected devices.
+*/
+class AutoProfileIndex
+{
+public:
+	static const size_t NO_MATCH = (size_t)-1;
+
+	// The AutoApply patterns of one MenuItem. Both empty if it has no rule.
+	struct Patterns
+	{
+		std::vector<std::wstring> mDisplays;
+		std::vector<std::wstring> mEndpoints;
+	};
+
+	// What is plugged in: display FriendlyNames and active audio endpoint names.
+	struct Connected
+	{
+		std::vector<std::wstring> mDisplays;
+		std::vector<std::wstring> mEndpoints;
+	};
+
+	// One entry per MenuItem, in config.xml order.
+	void Build(const std::vector<Patterns>& patternsByMenuItem);
+	bool IsEmpty() const { return mRules.empty(); }
+
+	// Lower cases, sorts and merges connected into the keys Find takes.
+	static void MakeKeys(const Connected& connected, std::vector<std::wstring>* pKeys);
+
+	size_t Find(const std::vector<std::wstring>& connectedKeys) const;
+
+private:
+	struct Rule
+	{
+		size_t mMenuItem;
+		std::uint32_t mExactCount;
+		std::vector<std::wstring> mWildcards;
+	};
+
+	std::vector<Rule> mRules;
+	std::unordered_map<std::wstring, std::vector<std::uint32_t>> mRulesByExactName;
+};
+
+/* Applies the matching AutoApply MenuItem when displays or audio endpoints arrive or are
+   removed.
+
+   OnDeviceEvent is cheap and may be called for every WM_DISPLAYCHANGE, device node change
+   and endpoint notification. The engine's thread waits for the events to stop for
+   settleMs, then reads the connected devices once. Nothing happens unless that set
+   differs from the one last seen, so the changes an apply itself causes don't feed back.
+   The decision for each set is remembered.
+*/
+class HotplugEngine
+{
+public:
+	// Fills in every connected device. False if they can't be read.
+	typedef std::function<bool(AutoProfileIndex::Connected* pConnected)> ConnectedQuery;
+
+	// One per change in the connected set, whether or not a rule matched.
+	struct Decision
+	{
+		size_t mMenuItem;
+		size_t mDisplayCount;
+		size_t mEndpointCount;
+		std::uint64_t mEvents;
+		// From the first and the last event of the burst to the decision.
+		std::uint64_t mSinceFirstEventUs;
+		std::uint64_t mSinceLastEventUs;
+		std::uint64_t mLookupUs;
+	};
+	typedef std::function<void(const Decision& decision)> DecisionCallback;
+
+	struct Stats
+	{
+		std::uint64_t mEvents;
+		std::uint64_t mEvaluations;
+		std::uint64_t mDecisions;
+		std::uint64_t mLookupUs;
+	};
+
+	HotplugEngine();
+	~HotplugEngine();
+	HotplugEngine(const HotplugEngine&) = delete;
+	HotplugEngine& operator=(const HotplugEngine&) = delete;
+
+	// The devices connected at this point are the baseline; only a change from them
+	// decides anything. Does nothing if no MenuItem has an AutoApply rule.
+	bool Start(const std::vector<AutoProfileIndex::Patterns>& patternsByMenuItem, std::uint32_t settleMs,
+		ConnectedQuery query, DecisionCallback decide);
+	void Stop();
+
+	void OnDeviceEvent();
+
+	// Stands in for the OS: raises eventCount events intervalMs apart from another
+	// thread, the way one plug-in does. Stop waits for it to finish.
+	void SimulateEventStorm(std::uint32_t eventCount, std::uint32_t intervalMs);
+
+	Stats GetStats() const;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	void Run();
+	void Evaluate(Clock::time_point firstEvent, Clock::time_point lastEvent, std::uint64_t events);
+	bool ReadConnected(std::uint64_t* pFingerprint, AutoProfileIndex::Connected* pConnected,
+		std::vector<std::wstring>* pKeys);
+
+	AutoProfileIndex mIndex;
+	std::chrono::milliseconds mSettle;
+	ConnectedQuery mQuery;
+	DecisionCallback mDecide;
+
+	std::thread mThread;
+
+	// Guards everything below up to the engine-thread state.
+	mutable std::mutex mLock;
+	std::condition_variable mWake;
+	bool mStopping;
+	bool mPending;
+	Clock::time_point mLastEvent;
+	Stats mStats;
+	std::vector<std::thread> mStorms;
+
+	// Only touched by the engine's thread once it's running.
+	std::uint64_t mLastFingerprint;
+	std::map<std::uint64_t, size_t> mDecisions;
+};
@@ -0,0 +1,449 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "PlanCache.h"
+#include "Util.h"
+#include <vector>
+
+using namespace std;
+
+#define PLAN_CACHE_MAGIC 0x43505641 // 'AVPC'
+#define PLAN_CACHE_VERSION 2
+
+// On-disk layout: a header, then per entry a PlanCacheEntry followed by its path and
+// mode arrays exactly as QueryDisplayConfig returned them, then a PlanCacheAdapter and
+// its device path for each of the plan's adapters.
+struct PlanCacheHeader
+{
+	UINT32 mMagic;
+	UINT32 mVersion;
+	UINT32 mNumEntries;
+	UINT32 mReserved;
+	UINT64 mChecksum; // FNV-1a of everything after the header
+};
+
+struct PlanCacheEntry
+{
+	UINT64 mMenuItemKey;
+	UINT64 mFingerprint;
+	UINT32 mNumPaths;
+	UINT32 mNumModes;
+	UINT32 mChangesDisplay;
+	UINT32 mEnablesDisplay;
+	UINT32 mNumAdapters;
+	UINT32 mReserved;
+};
+
+struct PlanCacheAdapter
+{
+	LUID mAdapterId;
+	UINT32 mDevicePathLength; // In WCHARs, with no terminator
+	UINT32 mReserved;
+};
+
+// The size of the entry at pData, or 0 if it runs past pEnd.
+static size_t GetEntrySize(const BYTE* pData, const BYTE* pEnd)
+{
+	PlanCacheEntry entry;
+	size_t available = pEnd - pData;
+	if (available < sizeof(entry))
+		return 0;
+
+	memcpy(&entry, pData, sizeof(entry));
+	size_t size = sizeof(PlanCacheEntry) + 
+		(size_t)entry.mNumPaths * sizeof(DISPLAYCONFIG_PATH_INFO) + 
+		(size_t)entry.mNumModes * sizeof(DISPLAYCONFIG_MODE_INFO);
+
+	for (UINT32 i = 0; i < entry.mNumAdapters; ++i)
+	{
+		PlanCacheAdapter adapter;
+		if (available < size + sizeof(adapter))
+			return 0;
+
+		memcpy(&adapter, pData + size, sizeof(adapter));
+		size += sizeof(adapter) + (size_t)adapter.mDevicePathLength * sizeof(WCHAR);
+	}
+
+	return available < size ? 0 : size;
+}
+
+static void AppendEntry(vector<BYTE>& buffer, UINT64 menuItemKey, UINT64 fingerprint, const DisplayConfig::Plan& plan)
+{
+	PlanCacheEntry entry = { 0 };
+	entry.mMenuItemKey = menuItemKey;
+	entry.mFingerprint = fingerprint;
+	entry.mNumPaths = (UINT32)plan.mPaths.size();
+	entry.mNumModes = (UINT32)plan.mModes.size();
+	entry.mChangesDisplay = plan.mChangesDisplay;
+	entry.mEnablesDisplay = plan.mEnablesDisplay;
+	entry.mNumAdapters = (UINT32)plan.mAdapters.size();
+
+	const BYTE* pEntry = (const BYTE*)&entry;
+	const BYTE* pPaths = (const BYTE*)plan.mPaths.data();
+	const BYTE* pModes = (const BYTE*)plan.mModes.data();
+	buffer.insert(buffer.end(), pEntry, pEntry + sizeof(entry));
+	buffer.insert(buffer.end(), pPaths, pPaths + plan.mPaths.size() * sizeof(DISPLAYCONFIG_PATH_INFO));
+	buffer.insert(buffer.end(), pModes, pModes + plan.mModes.size() * sizeof(DISPLAYCONFIG_MODE_INFO));
+
+	for (const pair<LUID, wstring>& planned : plan.mAdapters)
+	{
+		PlanCacheAdapter adapter = { 0 };
+		adapter.mAdapterId = planned.first;
+		adapter.mDevicePathLength = (UINT32)planned.second.length();
+
+		const BYTE* pAdapter = (const BYTE*)&adapter;
+		const BYTE* pDevicePath = (const BYTE*)planned.second.data();
+		buffer.insert(buffer.end(), pAdapter, pAdapter + sizeof(adapter));
+		buffer.insert(buffer.end(), pDevicePath, pDevicePath + planned.second.length() * sizeof(WCHAR));
+	}
+}
+
+// Copies a mapped entry out, rejecting one whose paths reference modes it doesn't have.
+// GetEntrySize has already checked it fits in the file.
+static PlanCache::PlanPtr ReadEntry(const BYTE* pData)
+{
+	PlanCacheEntry entry;
+	memcpy(&entry, pData, sizeof(entry));
+	pData += sizeof(entry);
+
+	shared_ptr<DisplayConfig::Plan> pPlan = make_shared<DisplayConfig::Plan>();
+	pPlan->mPaths.resize(entry.mNumPaths);
+	pPlan->mModes.resize(entry.mNumModes);
+	memcpy(pPlan->mPaths.data(), pData, entry.mNumPaths * sizeof(DISPLAYCONFIG_PATH_INFO));
+	pData += entry.mNumPaths * sizeof(DISPLAYCONFIG_PATH_INFO);
+	memcpy(pPlan->mModes.data(), pData, entry.mNumModes * sizeof(DISPLAYCONFIG_MODE_INFO));
+	pData += entry.mNumModes * sizeof(DISPLAYCONFIG_MODE_INFO);
+
+	for (UINT32 i = 0; i < entry.mNumAdapters; ++i)
+	{
+		PlanCacheAdapter adapter;
+		memcpy(&adapter, pData, sizeof(adapter));
+		pData += sizeof(adapter);
+
+		wstring devicePath(adapter.mDevicePathLength, L'\0');
+		memcpy(&devicePath[0], pData, adapter.mDevicePathLength * sizeof(WCHAR));
+		pData += adapter.mDevicePathLength * sizeof(WCHAR);
+		pPlan->mAdapters.push_back(make_pair(adapter.mAdapterId, devicePath));
+	}
+
+	pPlan->mChangesDisplay = entry.mChangesDisplay != 0;
+	pPlan->mEnablesDisplay = entry.mEnablesDisplay != 0;
+
+	for (const DISPLAYCONFIG_PATH_INFO& path : pPlan->mPaths)
+	{
+		if (!(path.flags & DISPLAYCONFIG_PATH_ACTIVE))
+			continue;
+
+		if ((path.sourceInfo.modeInfoIdx != DISPLAYCONFIG_PATH_MODE_IDX_INVALID && path.sourceInfo.modeInfoIdx >= entry.mNumModes) ||
+			(path.targetInfo.modeInfoIdx != DISPLAYCONFIG_PATH_MODE_IDX_INVALID && path.targetInfo.modeInfoIdx >= entry.mNumModes))
+		{
+			return NULL;
+		}
+	}
+
+	return pPlan;
+}
+
+PlanCache::PlanCache()
+:
+mDirty(false),
+mFile(INVALID_HANDLE_VALUE),
+mMapping(NULL),
+mpView(NULL),
+mViewSize(0)
+{
+	InitializeSRWLock(&mLock);
+}
+
+PlanCache::~PlanCache()
+{
+	UnmapFileLocked();
+}
+
+PlanCache::PlanPtr PlanCache::Find(UINT64 menuItemKey, UINT64 fingerprint)
+{
+	Key key(menuItemKey, fingerprint);
+	PlanPtr plan;
+
+	AcquireSRWLockShared(&mLock);
+	auto it = mPlans.find(key);
+	if (it != mPlans.end())
+		plan = it->second;
+	ReleaseSRWLockShared(&mLock);
+
+	if (plan)
+		return plan;
+
+	AcquireSRWLockExclusive(&mLock);
+	auto mapped = mMappedEntries.find(key);
+	if (mapped != mMappedEntries.end())
+	{
+		plan = ReadEntry(mapped->second);
+		mMappedEntries.erase(mapped);
+		if (plan)
+			InsertLocked(key, plan);
+	}
+	ReleaseSRWLockExclusive(&mLock);
+
+	return plan;
+}
+
+void PlanCache::Insert(UINT64 menuItemKey, UINT64 fingerprint, PlanPtr plan)
+{
+	AcquireSRWLockExclusive(&mLock);
+	InsertLocked(Key(menuItemKey, fingerprint), plan);
+	mDirty = true;
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+void PlanCache::InsertLocked(const Key& key, PlanPtr plan)
+{
+	auto inserted = mPlans.insert(make_pair(key, plan));
+	if (inserted.second)
+	{
+		mInsertionOrder.push_back(key);
+		if (mInsertionOrder.size() > MAX_ENTRIES)
+		{
+			mPlans.erase(mInsertionOrder.front());
+			mInsertionOrder.pop_front();
+		}
+	}
+	else
+	{
+		inserted.first->second = plan;
+	}
+}
+
+bool PlanCache::FindVerdict(UINT64 payloadHash, UINT64 fingerprint, LONG* pResult) const
+{
+	AcquireSRWLockShared(&mLock);
+	auto it = mVerdicts.find(Key(payloadHash, fingerprint));
+	bool found = it != mVerdicts.end();
+	if (found)
+		*pResult = it->second;
+	ReleaseSRWLockShared(&mLock);
+
+	return found;
+}
+
+void PlanCache::InsertVerdict(UINT64 payloadHash, UINT64 fingerprint, LONG result)
+{
+	Key key(payloadHash, fingerprint);
+
+	AcquireSRWLockExclusive(&mLock);
+
+	if (mVerdicts.insert(make_pair(key, result)).second)
+	{
+		mVerdictInsertionOrder.push_back(key);
+		if (mVerdictInsertionOrder.size() > MAX_ENTRIES)
+		{
+			mVerdicts.erase(mVerdictInsertionOrder.front());
+			mVerdictInsertionOrder.pop_front();
+		}
+	}
+	else
+	{
+		mVerdicts[key] = result;
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+void PlanCache::Clear()
+{
+	AcquireSRWLockExclusive(&mLock);
+	mPlans.clear();
+	mInsertionOrder.clear();
+	mVerdicts.clear();
+	mVerdictInsertionOrder.clear();
+	mMappedEntries.clear();
+	mDirty = true;
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+bool PlanCache::Load(const wstring& fileName)
+{
+	AcquireSRWLockExclusive(&mLock);
+	UnmapFileLocked();
+	mFileName = fileName;
+	bool loaded = MapFileLocked();
+	ReleaseSRWLockExclusive(&mLock);
+
+	return loaded;
+}
+
+bool PlanCache::MapFileLocked()
+{
+	mFile = CreateFileW(mFileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(mFile, &fileSize) || 
+		fileSize.QuadPart < (LONGLONG)sizeof(PlanCacheHeader) ||
+		fileSize.QuadPart > 64 * 1024 * 1024)
+	{
+		UnmapFileLocked();
+		return false;
+	}
+
+	mMapping = CreateFileMappingW(mFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mMapping)
+		mpView = (const BYTE*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+
+	if (!mpView)
+	{
+		UnmapFileLocked();
+		return false;
+	}
+
+	const BYTE* pEnd = mpView + fileSize.QuadPart;
+	const BYTE* pData = mpView + sizeof(PlanCacheHeader);
+	PlanCacheHeader header;
+	memcpy(&header, mpView, sizeof(header));
+
+	if (header.mMagic != PLAN_CACHE_MAGIC || 
+		header.mVersion != PLAN_CACHE_VERSION ||
+		header.mChecksum != Fnv1a64(FNV1A64_OFFSET_BASIS, pData, pEnd - pData))
+	{
+		LogMessage(L"Ignoring stale plan cache " + mFileName);
+		UnmapFileLocked();
+		return false;
+	}
+
+	mViewSize = (size_t)fileSize.QuadPart;
+
+	for (UINT32 i = 0; i < header.mNumEntries; ++i)
+	{
+		size_t entrySize = GetEntrySize(pData, pEnd);
+		if (!entrySize)
+			break;
+
+		PlanCacheEntry entry;
+		memcpy(&entry, pData, sizeof(entry));
+		mMappedEntries[Key(entry.mMenuItemKey, entry.mFingerprint)] = pData;
+		pData += entrySize;
+	}
+
+	return true;
+}
+
+void PlanCache::UnmapFileLocked()
+{
+	mMappedEntries.clear();
+
+	if (mpView)
+		UnmapViewOfFile(mpView);
+	if (mMapping)
+		CloseHandle(mMapping);
+	if (mFile != INVALID_HANDLE_VALUE)
+		CloseHandle(mFile);
+
+	mpView = NULL;
+	mViewSize = 0;
+	mMapping = NULL;
+	mFile = INVALID_HANDLE_VALUE;
+}
+
+/* Writes every plan still worth keeping: entries from the file that were never looked up
+   come first, so that when trimming to MAX_ENTRIES the oldest are dropped.
+*/
+bool PlanCache::Save()
+{
+	AcquireSRWLockExclusive(&mLock);
+
+	if (!mDirty || mFileName.empty())
+	{
+		ReleaseSRWLockExclusive(&mLock);
+		return true;
+	}
+
+	vector<vector<BYTE>> entries;
+
+	for (const auto& mapped : mMappedEntries)
+	{
+		if (mPlans.find(mapped.first) != mPlans.end())
+			continue;
+
+		entries.emplace_back(mapped.second, mapped.second + GetEntrySize(mapped.second, mpView + mViewSize));
+	}
+
+	for (const Key& key : mInsertionOrder)
+	{
+		entries.emplace_back();
+		AppendEntry(entries.back(), key.first, key.second, *mPlans[key]);
+	}
+
+	size_t firstEntry = entries.size() > MAX_ENTRIES ? entries.size() - MAX_ENTRIES : 0;
+
+	vector<BYTE> data;
+	for (size_t i = firstEntry; i < entries.size(); ++i)
+		data.insert(data.end(), entries[i].begin(), entries[i].end());
+
+	PlanCacheHeader header = { 0 };
+	header.mMagic = PLAN_CACHE_MAGIC;
+	header.mVersion = PLAN_CACHE_VERSION;
+	header.mNumEntries = (UINT32)(entries.size() - firstEntry);
+	header.mChecksum = Fnv1a64(FNV1A64_OFFSET_BASIS, data.data(), data.size());
+
+	wstring tempFileName = mFileName + L".tmp";
+	bool saved = false;
+	DWORD error = ERROR_SUCCESS;
+
+	HANDLE hTemp = CreateFileW(tempFileName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hTemp == INVALID_HANDLE_VALUE)
+	{
+		error = GetLastError();
+	}
+	else
+	{
+		DWORD written = 0;
+		saved =
+			WriteFile(hTemp, &header, sizeof(header), &written, NULL) && written == sizeof(header) &&
+			WriteFile(hTemp, data.data(), (DWORD)data.size(), &written, NULL) && written == data.size();
+		CloseHandle(hTemp);
+
+		// The mapped view pins the old file; everything in it has been copied above.
+		UnmapFileLocked();
+
+		saved = saved && MoveFileExW(tempFileName.c_str(), mFileName.c_str(), 
+			MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+
+		if (!saved)
+		{
+			error = GetLastError();
+			DeleteFileW(tempFileName.c_str());
+		}
+
+		MapFileLocked();
+	}
+
+	if (saved)
+		mDirty = false;
+	else
+		LogMessage(L"Could not save plan cache " + mFileName + L". Error Code:" + to_wstring(error));
+
+	ReleaseSRWLockExclusive(&mLock);
+	return saved;
+}
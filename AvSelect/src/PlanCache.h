@@ -0,0 +1,91 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include "DisplaySettings.h"
+
+/* Display plans computed for a MenuItem, keyed by the item and the fingerprint of the
+   topology they were planned against. A hit lets a transition skip the
+   FindTarget/UpdateDisplaySettings work and go straight to Apply.
+
+   The cache can be backed by a file so plans survive restarts and one-shot -set runs.
+   Load maps the file read-only and indexes it; an entry is only copied out the first
+   time it's looked up. Save rewrites the file (through a temporary, so a crash never
+   leaves it half-written) when anything new was planned.
+
+   Safe to use from the executor thread and the tray thread at the same time.
+*/
+class PlanCache
+{
+public:
+	typedef std::shared_ptr<const DisplayConfig::Plan> PlanPtr;
+
+	PlanCache();
+	~PlanCache();
+	PlanCache(const PlanCache&) = delete;
+	PlanCache& operator=(const PlanCache&) = delete;
+
+	PlanPtr Find(UINT64 menuItemKey, UINT64 fingerprint);
+	void Insert(UINT64 menuItemKey, UINT64 fingerprint, PlanPtr plan);
+	void Clear();
+
+	// SDC_VALIDATE results, keyed by DisplayConfig::GetPayloadHash and the fingerprint of
+	// the topology the payload would be applied over. Kept in memory only; a driver update
+	// can change the answer.
+	bool FindVerdict(UINT64 payloadHash, UINT64 fingerprint, LONG* pResult) const;
+	void InsertVerdict(UINT64 payloadHash, UINT64 fingerprint, LONG result);
+
+	// A missing, stale or corrupt file just means an empty cache.
+	bool Load(const std::wstring& fileName);
+	bool Save();
+
+private:
+	typedef std::pair<UINT64, UINT64> Key;
+
+	// Plenty for every item across the few topologies a machine actually cycles through.
+	static const size_t MAX_ENTRIES = 256;
+
+	void InsertLocked(const Key& key, PlanPtr plan);
+	bool MapFileLocked();
+	void UnmapFileLocked();
+
+	mutable SRWLOCK mLock;
+	std::map<Key, PlanPtr> mPlans;
+	std::deque<Key> mInsertionOrder;
+	bool mDirty;
+
+	std::map<Key, LONG> mVerdicts;
+	std::deque<Key> mVerdictInsertionOrder;
+
+	std::wstring mFileName;
+	HANDLE mFile;
+	HANDLE mMapping;
+	const BYTE* mpView;
+	size_t mViewSize;
+	std::map<Key, const BYTE*> mMappedEntries;
+};
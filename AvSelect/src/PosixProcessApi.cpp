@@ -0,0 +1,239 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+// The POSIX side of ProcessApi. Not part of the Windows build; it lets ProcessHost and
+// friends be driven against real processes on Linux.
+
+#ifndef _WIN32
+
+#include "ProcessApi.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+static PosixProcessApi sPosixProcessApi;
+static ProcessApi* spProcessApi = &sPosixProcessApi;
+
+ProcessApi& ProcessApi::Get()
+{
+	return *spProcessApi;
+}
+
+void ProcessApi::Install(ProcessApi* pApi)
+{
+	spProcessApi = pApi ? pApi : &sPosixProcessApi;
+}
+
+static string ToUtf8(const wstring& value)
+{
+	string utf8;
+
+	for (wchar_t c : value)
+	{
+		uint32_t code = (uint32_t)c;
+
+		if (code < 0x80)
+		{
+			utf8 += (char)code;
+		}
+		else if (code < 0x800)
+		{
+			utf8 += (char)(0xC0 | (code >> 6));
+			utf8 += (char)(0x80 | (code & 0x3F));
+		}
+		else if (code < 0x10000)
+		{
+			utf8 += (char)(0xE0 | (code >> 12));
+			utf8 += (char)(0x80 | ((code >> 6) & 0x3F));
+			utf8 += (char)(0x80 | (code & 0x3F));
+		}
+		else
+		{
+			utf8 += (char)(0xF0 | (code >> 18));
+			utf8 += (char)(0x80 | ((code >> 12) & 0x3F));
+			utf8 += (char)(0x80 | ((code >> 6) & 0x3F));
+			utf8 += (char)(0x80 | (code & 0x3F));
+		}
+	}
+
+	return utf8;
+}
+
+PosixProcessApi::PosixProcessApi()
+{
+	if (pipe(mWakePipe) != 0)
+	{
+		mWakePipe[0] = mWakePipe[1] = -1;
+		return;
+	}
+
+	for (int fd : mWakePipe)
+	{
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+}
+
+PosixProcessApi::~PosixProcessApi()
+{
+	for (int fd : mWakePipe)
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+uint32_t PosixProcessApi::Launch(const wstring& commandLine, const wstring& workingDirectory,
+	Process* pProcess, uint32_t* pProcessId)
+{
+	string command = ToUtf8(commandLine);
+	string directory = ToUtf8(workingDirectory);
+
+	// The child reports a failed chdir or exec through this pipe; a clean exec closes it.
+	int status[2];
+	if (pipe(status) != 0)
+		return errno;
+	fcntl(status[1], F_SETFD, FD_CLOEXEC);
+
+	pid_t pid = fork();
+
+	if (pid < 0)
+	{
+		int error = errno;
+		close(status[0]);
+		close(status[1]);
+		return error;
+	}
+
+	if (pid == 0)
+	{
+		close(status[0]);
+
+		if (directory.empty() || chdir(directory.c_str()) == 0)
+			execl("/bin/sh", "sh", "-c", command.c_str(), (char*)NULL);
+
+		int error = errno;
+		ssize_t written = write(status[1], &error, sizeof(error));
+		(void)written;
+		_exit(127);
+	}
+
+	close(status[1]);
+
+	int error = 0;
+	ssize_t got;
+	do
+	{
+		got = read(status[0], &error, sizeof(error));
+	} while (got < 0 && errno == EINTR);
+	close(status[0]);
+
+	if (got == sizeof(error))
+	{
+		waitpid(pid, NULL, 0);
+		return error;
+	}
+
+	*pProcess = pid;
+	*pProcessId = (uint32_t)pid;
+	return 0;
+}
+
+int PosixProcessApi::WaitAny(const vector<Process>& processes, uint32_t timeoutMs)
+{
+	int waitedMs = 0;
+
+	for (;;)
+	{
+		{
+			lock_guard<mutex> lock(mLock);
+
+			for (size_t i = 0; i < processes.size(); ++i)
+			{
+				if (mExited.count(processes[i]))
+					return (int)i;
+
+				int status = 0;
+				if (waitpid((pid_t)processes[i], &status, WNOHANG) == (pid_t)processes[i])
+				{
+					mExited[processes[i]] = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+					return (int)i;
+				}
+			}
+		}
+
+		if (timeoutMs != INFINITE_WAIT && (uint32_t)waitedMs >= timeoutMs)
+			return WAIT_RESULT_TIMEOUT;
+
+		int sliceMs = POLL_INTERVAL_MS;
+		if (timeoutMs != INFINITE_WAIT && timeoutMs - waitedMs < (uint32_t)sliceMs)
+			sliceMs = (int)(timeoutMs - waitedMs);
+
+		pollfd wake = { mWakePipe[0], POLLIN, 0 };
+		int ready = poll(&wake, 1, sliceMs);
+
+		if (ready < 0 && errno != EINTR)
+			return WAIT_RESULT_FAILED;
+
+		if (ready > 0)
+		{
+			char drain[64];
+			while (read(mWakePipe[0], drain, sizeof(drain)) > 0)
+			{
+			}
+			return WAIT_RESULT_WOKEN;
+		}
+
+		waitedMs += sliceMs;
+	}
+}
+
+void PosixProcessApi::Wake()
+{
+	char wake = 1;
+	ssize_t written = write(mWakePipe[1], &wake, 1);
+	(void)written;
+}
+
+uint32_t PosixProcessApi::Release(Process process)
+{
+	lock_guard<mutex> lock(mLock);
+
+	auto exited = mExited.find(process);
+	if (exited == mExited.end())
+		return 0;
+
+	uint32_t exitCode = exited->second;
+	mExited.erase(exited);
+	return exitCode;
+}
+
+size_t PosixProcessApi::GetWaitLimit() const
+{
+	return (size_t)-1;
+}
+
+#endif
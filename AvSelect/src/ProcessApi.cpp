@@ -0,0 +1,115 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "ProcessApi.h"
+
+using namespace std;
+
+static Win32ProcessApi sWin32ProcessApi;
+static ProcessApi* spProcessApi = &sWin32ProcessApi;
+
+ProcessApi& ProcessApi::Get()
+{
+	return *spProcessApi;
+}
+
+// Not synchronized: install before anything is hosted.
+void ProcessApi::Install(ProcessApi* pApi)
+{
+	spProcessApi = pApi ? pApi : &sWin32ProcessApi;
+}
+
+Win32ProcessApi::Win32ProcessApi()
+:
+mWake(CreateEvent(NULL, FALSE, FALSE, NULL))
+{
+}
+
+Win32ProcessApi::~Win32ProcessApi()
+{
+	CloseHandle(mWake);
+}
+
+uint32_t Win32ProcessApi::Launch(const wstring& commandLine, const wstring& workingDirectory,
+	Process* pProcess, uint32_t* pProcessId)
+{
+	// CreateProcess may write to the command line.
+	vector<WCHAR> buffer(commandLine.begin(), commandLine.end());
+	buffer.push_back(L'\0');
+
+	STARTUPINFO si = { 0 };
+	PROCESS_INFORMATION pi = { 0 };
+	si.cb = sizeof(si);
+
+	if (!CreateProcess(NULL, buffer.data(), NULL, NULL, FALSE, 0, NULL,
+		workingDirectory.empty() ? NULL : workingDirectory.c_str(), &si, &pi))
+	{
+		return GetLastError();
+	}
+
+	CloseHandle(pi.hThread);
+	*pProcess = (Process)pi.hProcess;
+	*pProcessId = pi.dwProcessId;
+	return ERROR_SUCCESS;
+}
+
+int Win32ProcessApi::WaitAny(const vector<Process>& processes, uint32_t timeoutMs)
+{
+	if (processes.size() > GetWaitLimit())
+		return WAIT_RESULT_FAILED;
+
+	HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+	for (size_t i = 0; i < processes.size(); ++i)
+		handles[i] = (HANDLE)processes[i];
+	handles[processes.size()] = mWake;
+
+	DWORD wait = WaitForMultipleObjects((DWORD)processes.size() + 1, handles, FALSE, timeoutMs);
+
+	if (wait == WAIT_TIMEOUT)
+		return WAIT_RESULT_TIMEOUT;
+
+	if (wait >= WAIT_OBJECT_0 + processes.size() + 1)
+		return WAIT_RESULT_FAILED;
+
+	size_t index = wait - WAIT_OBJECT_0;
+	return index == processes.size() ? WAIT_RESULT_WOKEN : (int)index;
+}
+
+void Win32ProcessApi::Wake()
+{
+	SetEvent(mWake);
+}
+
+uint32_t Win32ProcessApi::Release(Process process)
+{
+	DWORD exitCode = 0;
+	GetExitCodeProcess((HANDLE)process, &exitCode);
+	CloseHandle((HANDLE)process);
+	return exitCode;
+}
+
+size_t Win32ProcessApi::GetWaitLimit() const
+{
+	// One slot is the wake event.
+	return MAXIMUM_WAIT_OBJECTS - 1;
+}
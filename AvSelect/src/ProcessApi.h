@@ -0,0 +1,128 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <map>
+#include <mutex>
+#endif
+
+/* Everything ProcessHost asks of the OS to start programs and notice when they exit.
+
+   Win32ProcessApi uses CreateProcess and one WaitForMultipleObjects over every child.
+   PosixProcessApi runs the command through /bin/sh and polls waitpid, so launching and
+   reaping can be built and exercised on Linux. Only standard types cross this
+   interface, so that this header builds on both.
+*/
+class ProcessApi
+{
+public:
+	// A process handle on Windows, a pid on POSIX.
+	typedef std::intptr_t Process;
+
+	enum WaitResult
+	{
+		WAIT_RESULT_TIMEOUT = -1,
+		WAIT_RESULT_WOKEN = -2,
+		WAIT_RESULT_FAILED = -3,
+	};
+
+	static const std::uint32_t INFINITE_WAIT = 0xFFFFFFFF;
+
+	virtual ~ProcessApi() {}
+
+	// Starts commandLine, in workingDirectory unless it's empty. Returns 0 or an OS error
+	// code.
+	virtual std::uint32_t Launch(const std::wstring& commandLine, const std::wstring& workingDirectory,
+		Process* pProcess, std::uint32_t* pProcessId) = 0;
+
+	// Blocks until one of processes exits, Wake is called or timeoutMs pass. Returns the
+	// index of a process that exited, or a WaitResult. An exited process stays valid
+	// until Release.
+	virtual int WaitAny(const std::vector<Process>& processes, std::uint32_t timeoutMs) = 0;
+
+	// Ends the current or next WaitAny early, from any thread.
+	virtual void Wake() = 0;
+
+	// Frees process once WaitAny has reported it, and returns its exit code.
+	virtual std::uint32_t Release(Process process) = 0;
+
+	// The most processes one WaitAny can watch.
+	virtual size_t GetWaitLimit() const = 0;
+
+	// The API in use; the platform's own unless another was installed at startup.
+	static ProcessApi& Get();
+	static void Install(ProcessApi* pApi);
+};
+
+#ifdef _WIN32
+
+class Win32ProcessApi : public ProcessApi
+{
+public:
+	Win32ProcessApi();
+	~Win32ProcessApi();
+
+	std::uint32_t Launch(const std::wstring& commandLine, const std::wstring& workingDirectory,
+		Process* pProcess, std::uint32_t* pProcessId) override;
+	int WaitAny(const std::vector<Process>& processes, std::uint32_t timeoutMs) override;
+	void Wake() override;
+	std::uint32_t Release(Process process) override;
+	size_t GetWaitLimit() const override;
+
+private:
+	HANDLE mWake;
+};
+
+#else
+
+class PosixProcessApi : public ProcessApi
+{
+public:
+	PosixProcessApi();
+	~PosixProcessApi();
+
+	std::uint32_t Launch(const std::wstring& commandLine, const std::wstring& workingDirectory,
+		Process* pProcess, std::uint32_t* pProcessId) override;
+	int WaitAny(const std::vector<Process>& processes, std::uint32_t timeoutMs) override;
+	void Wake() override;
+	std::uint32_t Release(Process process) override;
+	size_t GetWaitLimit() const override;
+
+private:
+	// How often children are polled while nothing wakes the wait.
+	static const int POLL_INTERVAL_MS = 20;
+
+	int mWakePipe[2];
+	std::mutex mLock;
+	// Exit statuses reaped by WaitAny and not yet released.
+	std::map<Process, std::uint32_t> mExited;
+};
+
+#endif
@@ -0,0 +1,205 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+// Not built with the precompiled header, so it builds on Linux as well.
+#include "ProcessHost.h"
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+// Supplied by whatever hosts the ProcessHost: AvSelect.cpp, or a test.
+void LogMessage(std::wstring msg);
+
+static uint32_t GetLastOsError()
+{
+#ifdef _WIN32
+	return GetLastError();
+#else
+	return errno;
+#endif
+}
+
+ProcessHost::ProcessHost()
+:
+mpApi(NULL),
+mIdle(true),
+mStopping(false),
+mNextSession(1)
+{
+}
+
+ProcessHost::~ProcessHost()
+{
+	Stop();
+}
+
+bool ProcessHost::Start(ProcessApi& api, ExitCallback onExit)
+{
+	if (mThread.joinable())
+		return true;
+
+	mpApi = &api;
+	mOnExit = onExit;
+	mStopping = false;
+
+	mThread = thread([this]() { Run(); });
+	return true;
+}
+
+void ProcessHost::Stop()
+{
+	if (!mThread.joinable())
+		return;
+
+	{
+		lock_guard<mutex> lock(mLock);
+		mStopping = true;
+	}
+
+	mpApi->Wake();
+	mThread.join();
+
+	// Nobody will reap them now.
+	lock_guard<mutex> lock(mLock);
+	for (const Child& child : mChildren)
+		mpApi->Release(child.mProcess);
+	mChildren.clear();
+	mIdle = true;
+	mIdleChanged.notify_all();
+}
+
+uint32_t ProcessHost::Launch(const wstring& commandLine, const wstring& workingDirectory,
+	uint32_t* pProcessId, uint32_t* pError)
+{
+	unique_lock<mutex> lock(mLock);
+
+	uint32_t session = 0;
+	*pError = 0;
+
+	if (!mThread.joinable() || mStopping)
+	{
+		*pError = LAUNCH_NOT_WATCHING;
+	}
+	else if (mChildren.size() >= mpApi->GetWaitLimit())
+	{
+		*pError = LAUNCH_TOO_MANY_CHILDREN;
+	}
+	else
+	{
+		Child child;
+		uint32_t processId = 0;
+		*pError = mpApi->Launch(commandLine, workingDirectory, &child.mProcess, &processId);
+
+		if (*pError == 0)
+		{
+			session = child.mSession = mNextSession++;
+			if (!mNextSession)
+				mNextSession = 1;
+
+			mChildren.push_back(child);
+			mIdle = false;
+			*pProcessId = processId;
+		}
+	}
+
+	lock.unlock();
+
+	// The wait in progress doesn't cover the new child yet.
+	if (session)
+		mpApi->Wake();
+
+	return session;
+}
+
+bool ProcessHost::WaitUntilIdle(uint32_t timeoutMs)
+{
+	unique_lock<mutex> lock(mLock);
+
+	if (timeoutMs == ProcessApi::INFINITE_WAIT)
+	{
+		mIdleChanged.wait(lock, [this]() { return mIdle; });
+		return true;
+	}
+
+	return mIdleChanged.wait_for(lock, chrono::milliseconds(timeoutMs), [this]() { return mIdle; });
+}
+
+size_t ProcessHost::GetChildCount() const
+{
+	lock_guard<mutex> lock(mLock);
+	return mChildren.size();
+}
+
+void ProcessHost::Run()
+{
+	vector<ProcessApi::Process> processes;
+
+	for (;;)
+	{
+		{
+			lock_guard<mutex> lock(mLock);
+			if (mStopping)
+				return;
+
+			processes.clear();
+			for (const Child& child : mChildren)
+				processes.push_back(child.mProcess);
+		}
+
+		int index = mpApi->WaitAny(processes, ProcessApi::INFINITE_WAIT);
+
+		if (index == ProcessApi::WAIT_RESULT_FAILED)
+		{
+			LogMessage(L"Waiting on hosted processes failed. Error Code:" + to_wstring(GetLastOsError()));
+			this_thread::sleep_for(chrono::seconds(1));
+			continue;
+		}
+
+		if (index < 0)
+			continue;
+
+		uint32_t session;
+		{
+			lock_guard<mutex> lock(mLock);
+			auto exited = std::find_if(mChildren.begin(), mChildren.end(), [&](const Child& child)
+			{
+				return child.mProcess == processes[index];
+			});
+			session = exited->mSession;
+			mChildren.erase(exited);
+		}
+
+		uint32_t exitCode = mpApi->Release(processes[index]);
+
+		if (mOnExit)
+			mOnExit(session, exitCode);
+
+		// Only now, so whoever waits for idle also sees what the callback did.
+		lock_guard<mutex> lock(mLock);
+		if (mChildren.empty())
+		{
+			mIdle = true;
+			mIdleChanged.notify_all();
+		}
+	}
+}
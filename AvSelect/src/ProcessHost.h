@@ -0,0 +1,102 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ProcessApi.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#endif
+
+/* Programs started for -run, watched from a single thread however many there are.
+
+   Each child gets a session number, which callers use to tie their own state (a profile
+   layer, a caller waiting on it) to the child. When one exits, the exit callback runs on
+   the host's thread with its session and exit code, before the next wait; it should
+   hand anything slow off elsewhere.
+
+   One wait covers at most ProcessApi::GetWaitLimit children; past that Launch fails.
+   Everything the OS does goes through ProcessApi, so this builds and runs on Linux
+   against PosixProcessApi too.
+*/
+class ProcessHost
+{
+public:
+	typedef std::function<void(std::uint32_t session, std::uint32_t exitCode)> ExitCallback;
+
+	// What Launch reports when the host isn't running, or already watches all it can.
+#ifdef _WIN32
+	static const std::uint32_t LAUNCH_NOT_WATCHING = ERROR_INVALID_STATE;
+	static const std::uint32_t LAUNCH_TOO_MANY_CHILDREN = ERROR_NOT_ENOUGH_QUOTA;
+#else
+	static const std::uint32_t LAUNCH_NOT_WATCHING = EINVAL;
+	static const std::uint32_t LAUNCH_TOO_MANY_CHILDREN = EAGAIN;
+#endif
+
+	ProcessHost();
+	~ProcessHost();
+	ProcessHost(const ProcessHost&) = delete;
+	ProcessHost& operator=(const ProcessHost&) = delete;
+
+	bool Start(ProcessApi& api, ExitCallback onExit);
+	// Stops watching. Children keep running, and their exits go unreported.
+	void Stop();
+	bool IsStarted() const { return mThread.joinable(); }
+
+	// Returns the child's session, never 0, or 0 with *pError set.
+	std::uint32_t Launch(const std::wstring& commandLine, const std::wstring& workingDirectory,
+		std::uint32_t* pProcessId, std::uint32_t* pError);
+
+	// Returns true once no child is left and every exit callback has returned, or false
+	// if timeoutMs pass first. ProcessApi::INFINITE_WAIT waits for as long as it takes.
+	bool WaitUntilIdle(std::uint32_t timeoutMs);
+
+	size_t GetChildCount() const;
+
+private:
+	struct Child
+	{
+		std::uint32_t mSession;
+		ProcessApi::Process mProcess;
+	};
+
+	void Run();
+
+	ProcessApi* mpApi;
+	ExitCallback mOnExit;
+	std::thread mThread;
+
+	mutable std::mutex mLock;
+	std::condition_variable mIdleChanged;
+	bool mIdle;
+	bool mStopping;
+	std::uint32_t mNextSession;
+	std::vector<Child> mChildren;
+};
@@ -0,0 +1,176 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+/* Runs ProcessHost against PosixProcessApi and real child processes: exits reported with
+   their codes and sessions, launch failures, the wait limit, idle waits and stopping with
+   children still running. Prints what it expected and whether it held; the exit code is
+   the number of expectations that failed.
+
+   ProcessHostCheck    Built by the Makefile next to AvSelect.sln.
+*/
+
+#include "ProcessHost.h"
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+static int sFailures = 0;
+
+void LogMessage(wstring msg)
+{
+	wcout << L"    log: " << msg << endl;
+}
+
+static void Expect(bool condition, const char* what)
+{
+	cout << (condition ? "  ok     " : "  FAILED ") << what << endl;
+	if (!condition)
+		++sFailures;
+}
+
+// Passes everything through, but watches at most mLimit processes at once.
+class LimitedProcessApi : public ProcessApi
+{
+public:
+	LimitedProcessApi(ProcessApi& inner, size_t limit) : mInner(inner), mLimit(limit) {}
+
+	uint32_t Launch(const wstring& commandLine, const wstring& workingDirectory,
+		Process* pProcess, uint32_t* pProcessId) override
+	{
+		return mInner.Launch(commandLine, workingDirectory, pProcess, pProcessId);
+	}
+	int WaitAny(const vector<Process>& processes, uint32_t timeoutMs) override { return mInner.WaitAny(processes, timeoutMs); }
+	void Wake() override { mInner.Wake(); }
+	uint32_t Release(Process process) override { return mInner.Release(process); }
+	size_t GetWaitLimit() const override { return mLimit; }
+
+private:
+	ProcessApi& mInner;
+	size_t mLimit;
+};
+
+// What the exit callback saw, by session.
+struct Exits
+{
+	mutex mLock;
+	map<uint32_t, uint32_t> mCodes;
+
+	ProcessHost::ExitCallback Callback()
+	{
+		return [this](uint32_t session, uint32_t exitCode)
+		{
+			lock_guard<mutex> lock(mLock);
+			mCodes[session] = exitCode;
+		};
+	}
+
+	bool Has(uint32_t session, uint32_t exitCode)
+	{
+		lock_guard<mutex> lock(mLock);
+		auto found = mCodes.find(session);
+		return found != mCodes.end() && found->second == exitCode;
+	}
+};
+
+static uint32_t Launch(ProcessHost& host, const wchar_t* pCommandLine, uint32_t* pError, const wchar_t* pDirectory = L"")
+{
+	uint32_t processId = 0;
+	return host.Launch(pCommandLine, pDirectory, &processId, pError);
+}
+
+static void CheckExits()
+{
+	cout << "exits" << endl;
+
+	ProcessHost host;
+	Exits exits;
+	uint32_t error = 0;
+
+	Expect(!Launch(host, L"true", &error) && error == ProcessHost::LAUNCH_NOT_WATCHING, "nothing launches before Start");
+	Expect(host.Start(ProcessApi::Get(), exits.Callback()), "the host starts");
+
+	auto start = chrono::steady_clock::now();
+	uint32_t quick = Launch(host, L"exit 3", &error);
+	Expect(quick != 0 && error == 0, "a child launches");
+	Expect(host.WaitUntilIdle(5000), "the host goes idle once it exits");
+	auto end = chrono::steady_clock::now();
+
+	cout << "    exit reported " << chrono::duration_cast<chrono::milliseconds>(end - start).count() <<
+		"ms after the launch" << endl;
+	Expect(exits.Has(quick, 3), "its exit code reaches the callback under its session");
+
+	uint32_t slow = Launch(host, L"sleep 0.3; exit 5", &error);
+	uint32_t fast = Launch(host, L"sleep 0.1; exit 4", &error);
+	uint32_t killed = Launch(host, L"kill -9 $$", &error);
+	Expect(slow && fast && killed && slow != fast && fast != killed, "several children get their own sessions");
+	Expect(host.GetChildCount() >= 2, "they are watched together");
+	Expect(host.WaitUntilIdle(5000), "the host goes idle once they all exit");
+	Expect(exits.Has(slow, 5) && exits.Has(fast, 4), "each exit code goes to its own session");
+	Expect(exits.Has(killed, 128 + 9), "a child killed by a signal reports 128 + the signal");
+
+	error = 0;
+	Expect(!Launch(host, L"true", &error, L"/nonexistent/directory") && error == ENOENT,
+		"a working directory that doesn't exist fails the launch");
+
+	host.Stop();
+	Expect(!host.IsStarted(), "the host stops");
+}
+
+static void CheckLimitAndStop()
+{
+	cout << "limit" << endl;
+
+	LimitedProcessApi api(ProcessApi::Get(), 2);
+	ProcessHost host;
+	Exits exits;
+	uint32_t error = 0;
+
+	host.Start(api, exits.Callback());
+
+	uint32_t first = Launch(host, L"sleep 2", &error);
+	uint32_t second = Launch(host, L"sleep 2", &error);
+	Expect(first && second, "children up to the wait limit launch");
+	Expect(!Launch(host, L"true", &error) && error == ProcessHost::LAUNCH_TOO_MANY_CHILDREN, "one past the limit is refused");
+	Expect(!host.WaitUntilIdle(100), "the host isn't idle while they run");
+
+	auto start = chrono::steady_clock::now();
+	host.Stop();
+	auto end = chrono::steady_clock::now();
+
+	Expect(chrono::duration_cast<chrono::milliseconds>(end - start).count() < 1000, "Stop doesn't wait for the children");
+	Expect(host.WaitUntilIdle(0) && host.GetChildCount() == 0, "a stopped host is idle");
+	Expect(!exits.Has(first, 0) && !exits.Has(second, 0), "exits after Stop go unreported");
+}
+
+int main()
+{
+	CheckExits();
+	CheckLimitAndStop();
+
+	cout << (sFailures ? to_string(sFailures) + " failed." : string("All passed.")) << endl;
+	return sFailures;
+}
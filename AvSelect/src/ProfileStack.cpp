@@ -0,0 +1,512 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "ProfileStack.h"
+#include "Util.h"
+#include <algorithm>
+
+using namespace std;
+
+#define PROFILE_STACK_MAGIC 0x53505641 // 'AVPS'
+#define PROFILE_STACK_VERSION 1
+#define PROFILE_STACK_MUTEX_NAME L"AvSelectProfileStack-001"
+
+struct ProfileStackHeader
+{
+	UINT32 mMagic;
+	UINT32 mVersion;
+	UINT32 mNumLayers;
+	UINT32 mReserved;
+	UINT64 mChecksum; // FNV-1a of everything after the header
+};
+
+struct ProfileStackBaseCounts
+{
+	UINT32 mHasDisplay;
+	UINT32 mNumTargets;
+	UINT32 mNumPaths;
+	UINT32 mNumModes;
+	UINT32 mChangesDisplay;
+	UINT32 mEnablesDisplay;
+	UINT32 mHasAudio;
+	UINT32 mAudioLength;
+};
+
+struct ProfileStackLayerCounts
+{
+	UINT32 mNameLength;
+	UINT32 mNumOwners;
+	UINT32 mNumDisable;
+	UINT32 mNumChange;
+	UINT32 mHasAudio;
+	UINT32 mAudioLength;
+};
+
+static bool ReadString(const BYTE*& pData, const BYTE* pEnd, wstring* pString, UINT32 length)
+{
+	pString->resize(length);
+	return ReadPayload(pData, pEnd, &(*pString)[0], length);
+}
+
+ProfileStack::Owner ProfileStack::Owner::GetCurrent(UINT32 session)
+{
+	Owner owner;
+	owner.mProcessId = GetCurrentProcessId();
+	owner.mSession = session;
+
+	FILETIME created, exited, kernel, user;
+	if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+		owner.mStartTime = ((UINT64)created.dwHighDateTime << 32) | created.dwLowDateTime;
+
+	return owner;
+}
+
+bool ProfileStack::Owner::operator==(const Owner& other) const
+{
+	return mProcessId == other.mProcessId && mSession == other.mSession && mStartTime == other.mStartTime;
+}
+
+ProfileStack::ProfileStack()
+:
+mMutex(NULL),
+mLocked(false),
+mHasBaseDisplay(false),
+mHasBaseAudio(false)
+{
+}
+
+ProfileStack::~ProfileStack()
+{
+	if (mMutex)
+		CloseHandle(mMutex);
+}
+
+bool ProfileStack::Open(const wstring& fileName)
+{
+	if (mMutex)
+		return true;
+
+	mFileName = fileName;
+	mMutex = CreateMutex(NULL, FALSE, PROFILE_STACK_MUTEX_NAME);
+
+	if (!mMutex)
+		LogMessage(L"Could not open the profile stack. Error Code:" + to_wstring(GetLastError()));
+
+	return mMutex != NULL;
+}
+
+bool ProfileStack::Lock()
+{
+	if (!mMutex)
+		return false;
+
+	// An instance that died holding the mutex left the file as it was before its change,
+	// or replaced it whole; either is fine to carry on from.
+	DWORD wait = WaitForSingleObject(mMutex, INFINITE);
+	if (wait != WAIT_OBJECT_0 && wait != WAIT_ABANDONED)
+		return false;
+
+	mLocked = true;
+
+	if (!Read())
+	{
+		LogMessage(L"Profile stack " + mFileName + L" is unreadable; starting a new one.");
+		mHasBaseDisplay = mHasBaseAudio = false;
+		mBaseDisplay.clear();
+		mBasePlan = DisplayConfig::Plan();
+		mBaseAudioDevice.clear();
+		mLayers.clear();
+	}
+
+	return true;
+}
+
+void ProfileStack::Unlock()
+{
+	if (!mLocked)
+		return;
+
+	if (mLayers.empty())
+		DeleteFileW(mFileName.c_str());
+	else if (!Write())
+		LogMessage(L"Could not save the profile stack " + mFileName + L". Error Code:" + to_wstring(GetLastError()));
+
+	mLocked = false;
+	ReleaseMutex(mMutex);
+}
+
+bool ProfileStack::IsEmpty() const
+{
+	return mLayers.empty();
+}
+
+size_t ProfileStack::GetLayerCount() const
+{
+	return mLayers.size();
+}
+
+void ProfileStack::SetBase(const DisplayConfig::TopologyState& display, const DisplayConfig::Plan& plan,
+	bool hasAudio, const wstring& audioDevice)
+{
+	if (!mLayers.empty())
+		return;
+
+	mHasBaseDisplay = true;
+	mBaseDisplay = display;
+	mBasePlan = plan;
+	mHasBaseAudio = hasAudio;
+	mBaseAudioDevice = audioDevice;
+}
+
+bool ProfileStack::Share(const Owner& owner, const wstring& name)
+{
+	if (mLayers.empty() || mLayers.back().mName != name)
+		return false;
+
+	mLayers.back().mOwners.push_back(owner);
+	return true;
+}
+
+void ProfileStack::Push(const Owner& owner, const wstring& name, const DisplayConfig::TopologyDiff& display,
+	bool hasAudio, const wstring& audioDevice)
+{
+	Layer layer;
+	layer.mName = name;
+	layer.mOwners.push_back(owner);
+	layer.mDisplay = display;
+	layer.mHasAudio = hasAudio;
+	layer.mAudioDevice = audioDevice;
+	mLayers.push_back(std::move(layer));
+}
+
+void ProfileStack::Release(const Owner& owner, Restore* pRestore)
+{
+	DropOwners(&owner, pRestore);
+	DropOwners(NULL, pRestore);
+}
+
+void ProfileStack::Prune(Restore* pRestore)
+{
+	DropOwners(NULL, pRestore);
+}
+
+bool ProfileStack::IsOwnerAlive(const Owner& owner)
+{
+	HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | SYNCHRONIZE, FALSE, owner.mProcessId);
+
+	if (!hProcess)
+		return GetLastError() == ERROR_ACCESS_DENIED;
+
+	bool alive = WaitForSingleObject(hProcess, 0) == WAIT_TIMEOUT;
+
+	FILETIME created, exited, kernel, user;
+	if (alive && owner.mStartTime && GetProcessTimes(hProcess, &created, &exited, &kernel, &user))
+		alive = (((UINT64)created.dwHighDateTime << 32) | created.dwLowDateTime) == owner.mStartTime;
+
+	CloseHandle(hProcess);
+	return alive;
+}
+
+void ProfileStack::DropOwners(const Owner* pOwner, Restore* pRestore)
+{
+	auto effectiveAudio = [this](wstring* pDevice)
+	{
+		for (auto layer = mLayers.rbegin(); layer != mLayers.rend(); ++layer)
+		{
+			if (layer->mHasAudio)
+			{
+				*pDevice = layer->mAudioDevice;
+				return true;
+			}
+		}
+
+		*pDevice = mBaseAudioDevice;
+		return mHasBaseAudio;
+	};
+
+	wstring audioBefore;
+	bool hadAudio = effectiveAudio(&audioBefore);
+
+	vector<Layer> dropped;
+	for (size_t i = 0; i < mLayers.size();)
+	{
+		vector<Owner>& owners = mLayers[i].mOwners;
+
+		if (pOwner)
+		{
+			auto found = std::find(owners.begin(), owners.end(), *pOwner);
+			if (found != owners.end())
+				owners.erase(found);
+		}
+		else
+		{
+			owners.erase(std::remove_if(owners.begin(), owners.end(), [](const Owner& owner)
+			{
+				return !IsOwnerAlive(owner);
+			}), owners.end());
+		}
+
+		if (owners.empty())
+		{
+			dropped.push_back(std::move(mLayers[i]));
+			mLayers.erase(mLayers.begin() + i);
+		}
+		else
+		{
+			++i;
+		}
+	}
+
+	if (dropped.empty())
+		return;
+
+	ResolveDropped(dropped, pRestore);
+
+	wstring audioAfter;
+	bool hasAudio = effectiveAudio(&audioAfter);
+	if (hadAudio && hasAudio && audioAfter != audioBefore)
+	{
+		pRestore->mHasAudio = true;
+		pRestore->mAudioDevice = audioAfter;
+	}
+}
+
+void ProfileStack::ResolveDropped(const vector<Layer>& dropped, Restore* pRestore) const
+{
+	if (mLayers.empty())
+	{
+		pRestore->mRestoreBase = mHasBaseDisplay;
+		pRestore->mBaseDisplay = mBaseDisplay;
+		pRestore->mBasePlan = mBasePlan;
+		pRestore->mDisplay = DisplayConfig::TopologyDiff();
+		return;
+	}
+
+	DisplayConfig::TopologyDiff& restore = pRestore->mDisplay;
+
+	auto resolve = [this, &restore](const DisplayConfig::DeviceId& target)
+	{
+		// An earlier Release may already have resolved it, against a taller stack.
+		restore.mDisable.erase(std::remove(restore.mDisable.begin(), restore.mDisable.end(), target), restore.mDisable.end());
+		restore.mChange.erase(std::remove_if(restore.mChange.begin(), restore.mChange.end(), 
+			[&target](const DisplayConfig::TargetState& state) { return state.mTarget == target; }), restore.mChange.end());
+
+		for (auto layer = mLayers.rbegin(); layer != mLayers.rend(); ++layer)
+		{
+			const DisplayConfig::TopologyDiff& display = layer->mDisplay;
+
+			for (const DisplayConfig::TargetState& state : display.mChange)
+			{
+				if (state.mTarget == target)
+				{
+					restore.mChange.push_back(state);
+					return;
+				}
+			}
+
+			if (std::find(display.mDisable.begin(), display.mDisable.end(), target) != display.mDisable.end())
+			{
+				restore.mDisable.push_back(target);
+				return;
+			}
+		}
+
+		for (const DisplayConfig::TargetState& state : mBaseDisplay)
+		{
+			if (state.mTarget == target)
+			{
+				restore.mChange.push_back(state);
+				return;
+			}
+		}
+
+		restore.mDisable.push_back(target);
+	};
+
+	for (const Layer& layer : dropped)
+	{
+		for (const DisplayConfig::DeviceId& target : layer.mDisplay.mDisable)
+			resolve(target);
+
+		for (const DisplayConfig::TargetState& state : layer.mDisplay.mChange)
+			resolve(state.mTarget);
+	}
+
+	std::stable_partition(restore.mChange.begin(), restore.mChange.end(), [](const DisplayConfig::TargetState& target)
+	{
+		return !target.mCloneOf.IsValid();
+	});
+}
+
+bool ProfileStack::Read()
+{
+	mHasBaseDisplay = mHasBaseAudio = false;
+	mBaseDisplay.clear();
+	mBasePlan = DisplayConfig::Plan();
+	mBaseAudioDevice.clear();
+	mLayers.clear();
+
+	HANDLE hFile = CreateFileW(mFileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return GetLastError() == ERROR_FILE_NOT_FOUND;
+
+	vector<BYTE> data;
+	LARGE_INTEGER size;
+	DWORD read = 0;
+	bool readAll = GetFileSizeEx(hFile, &size) && size.QuadPart >= sizeof(ProfileStackHeader) && size.QuadPart < MAXDWORD;
+
+	if (readAll)
+	{
+		data.resize((size_t)size.QuadPart);
+		readAll = ReadFile(hFile, data.data(), (DWORD)data.size(), &read, NULL) && read == data.size();
+	}
+
+	CloseHandle(hFile);
+
+	if (!readAll)
+		return false;
+
+	ProfileStackHeader header;
+	memcpy(&header, data.data(), sizeof(header));
+
+	const BYTE* pData = data.data() + sizeof(header);
+	const BYTE* pEnd = data.data() + data.size();
+
+	if (header.mMagic != PROFILE_STACK_MAGIC || header.mVersion != PROFILE_STACK_VERSION ||
+		header.mChecksum != Fnv1a64(FNV1A64_OFFSET_BASIS, pData, pEnd - pData))
+	{
+		return false;
+	}
+
+	ProfileStackBaseCounts base;
+	if (!ReadPayload(pData, pEnd, &base, 1))
+		return false;
+
+	mBaseDisplay.resize(base.mNumTargets);
+	mBasePlan.mPaths.resize(base.mNumPaths);
+	mBasePlan.mModes.resize(base.mNumModes);
+	mBasePlan.mChangesDisplay = base.mChangesDisplay != 0;
+	mBasePlan.mEnablesDisplay = base.mEnablesDisplay != 0;
+	mHasBaseDisplay = base.mHasDisplay != 0;
+	mHasBaseAudio = base.mHasAudio != 0;
+
+	if (!ReadPayload(pData, pEnd, mBaseDisplay.data(), base.mNumTargets) ||
+		!ReadPayload(pData, pEnd, mBasePlan.mPaths.data(), base.mNumPaths) ||
+		!ReadPayload(pData, pEnd, mBasePlan.mModes.data(), base.mNumModes) ||
+		!ReadString(pData, pEnd, &mBaseAudioDevice, base.mAudioLength))
+	{
+		return false;
+	}
+
+	for (UINT32 i = 0; i < header.mNumLayers; ++i)
+	{
+		ProfileStackLayerCounts counts;
+		if (!ReadPayload(pData, pEnd, &counts, 1))
+			return false;
+
+		Layer layer;
+		layer.mOwners.resize(counts.mNumOwners);
+		layer.mDisplay.mDisable.resize(counts.mNumDisable);
+		layer.mDisplay.mChange.resize(counts.mNumChange);
+		layer.mHasAudio = counts.mHasAudio != 0;
+
+		if (!ReadString(pData, pEnd, &layer.mName, counts.mNameLength) ||
+			!ReadPayload(pData, pEnd, layer.mOwners.data(), counts.mNumOwners) ||
+			!ReadPayload(pData, pEnd, layer.mDisplay.mDisable.data(), counts.mNumDisable) ||
+			!ReadPayload(pData, pEnd, layer.mDisplay.mChange.data(), counts.mNumChange) ||
+			!ReadString(pData, pEnd, &layer.mAudioDevice, counts.mAudioLength))
+		{
+			return false;
+		}
+
+		mLayers.push_back(std::move(layer));
+	}
+
+	return true;
+}
+
+bool ProfileStack::Write() const
+{
+	vector<BYTE> data;
+
+	ProfileStackBaseCounts base;
+	base.mHasDisplay = mHasBaseDisplay;
+	base.mNumTargets = (UINT32)mBaseDisplay.size();
+	base.mNumPaths = (UINT32)mBasePlan.mPaths.size();
+	base.mNumModes = (UINT32)mBasePlan.mModes.size();
+	base.mChangesDisplay = mBasePlan.mChangesDisplay;
+	base.mEnablesDisplay = mBasePlan.mEnablesDisplay;
+	base.mHasAudio = mHasBaseAudio;
+	base.mAudioLength = (UINT32)mBaseAudioDevice.size();
+
+	AppendPayload(data, &base, 1);
+	AppendPayload(data, mBaseDisplay.data(), mBaseDisplay.size());
+	AppendPayload(data, mBasePlan.mPaths.data(), mBasePlan.mPaths.size());
+	AppendPayload(data, mBasePlan.mModes.data(), mBasePlan.mModes.size());
+	AppendPayload(data, mBaseAudioDevice.c_str(), mBaseAudioDevice.size());
+
+	for (const Layer& layer : mLayers)
+	{
+		ProfileStackLayerCounts counts;
+		counts.mNameLength = (UINT32)layer.mName.size();
+		counts.mNumOwners = (UINT32)layer.mOwners.size();
+		counts.mNumDisable = (UINT32)layer.mDisplay.mDisable.size();
+		counts.mNumChange = (UINT32)layer.mDisplay.mChange.size();
+		counts.mHasAudio = layer.mHasAudio;
+		counts.mAudioLength = (UINT32)layer.mAudioDevice.size();
+
+		AppendPayload(data, &counts, 1);
+		AppendPayload(data, layer.mName.c_str(), layer.mName.size());
+		AppendPayload(data, layer.mOwners.data(), layer.mOwners.size());
+		AppendPayload(data, layer.mDisplay.mDisable.data(), layer.mDisplay.mDisable.size());
+		AppendPayload(data, layer.mDisplay.mChange.data(), layer.mDisplay.mChange.size());
+		AppendPayload(data, layer.mAudioDevice.c_str(), layer.mAudioDevice.size());
+	}
+
+	ProfileStackHeader header = { 0 };
+	header.mMagic = PROFILE_STACK_MAGIC;
+	header.mVersion = PROFILE_STACK_VERSION;
+	header.mNumLayers = (UINT32)mLayers.size();
+	header.mChecksum = Fnv1a64(FNV1A64_OFFSET_BASIS, data.data(), data.size());
+
+	// Written aside and swapped in, so a crash mid-write leaves the old stack readable.
+	wstring tempFileName = mFileName + L".tmp";
+
+	HANDLE hTemp = CreateFileW(tempFileName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hTemp == INVALID_HANDLE_VALUE)
+		return false;
+
+	DWORD written = 0;
+	bool saved =
+		WriteFile(hTemp, &header, sizeof(header), &written, NULL) && written == sizeof(header) &&
+		WriteFile(hTemp, data.data(), (DWORD)data.size(), &written, NULL) && written == data.size();
+	CloseHandle(hTemp);
+
+	saved = saved && MoveFileExW(tempFileName.c_str(), mFileName.c_str(), 
+		MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+
+	if (!saved)
+		DeleteFileW(tempFileName.c_str());
+
+	return saved;
+}
@@ -0,0 +1,142 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+#include "DisplaySettings.h"
+
+/* The profiles -setuntilexit sessions are holding, as layers over the state the PC was
+   in before the first of them. The effective state of a target is the one the topmost
+   layer that touched it left behind, or the base if none did; the effective audio
+   device is likewise the topmost layer's that set one.
+
+   A session that ends releases its layer, and only the targets that layer touched are
+   worked out again, so the caller applies one diff that leaves every other session's
+   displays alone. The base itself is only put back when the last layer is gone.
+
+   Layers are reference counted. A session that asks for the profile already on top
+   shares that layer instead of stacking a copy, and it stays until both have ended.
+
+   The stack lives in a file, and every instance works on it between Lock and Unlock,
+   which hold a named mutex and read and write the file. Holding it across the apply
+   also makes concurrent sessions take turns. A layer whose owners have all exited
+   without releasing it is dropped the next time anyone locks the stack.
+*/
+class ProfileStack
+{
+public:
+	// A process, and a session within it. The start time tells a recycled process id
+	// apart from the one that took the reference.
+	struct Owner
+	{
+		DWORD mProcessId = 0;
+		UINT32 mSession = 0;
+		UINT64 mStartTime = 0;
+
+		static Owner GetCurrent(UINT32 session = 0);
+		bool operator==(const Owner& other) const;
+	};
+
+	// What the caller should change after layers were dropped. With mRestoreBase, the
+	// stack is empty and the base state should be put back whole; otherwise mDisplay
+	// gives the effective state of every target the dropped layers had touched.
+	struct Restore
+	{
+		bool mRestoreBase = false;
+		DisplayConfig::TopologyState mBaseDisplay;
+		DisplayConfig::Plan mBasePlan;
+
+		DisplayConfig::TopologyDiff mDisplay;
+		bool mHasAudio = false;
+		std::wstring mAudioDevice;
+
+		bool IsEmpty() const { return !mRestoreBase && mDisplay.IsEmpty() && !mHasAudio; }
+	};
+
+	ProfileStack();
+	~ProfileStack();
+	ProfileStack(const ProfileStack&) = delete;
+	ProfileStack& operator=(const ProfileStack&) = delete;
+
+	bool Open(const std::wstring& fileName);
+
+	// Waits for other instances to finish with the stack, then reads it. Returns false
+	// if the stack can't be locked; nothing else may be called then.
+	bool Lock();
+	// Writes the stack back, or deletes the file once it's empty.
+	void Unlock();
+
+	bool IsEmpty() const;
+	// Only taken while the stack is empty.
+	void SetBase(const DisplayConfig::TopologyState& display, const DisplayConfig::Plan& plan,
+		bool hasAudio, const std::wstring& audioDevice);
+
+	// Adds owner to the top layer if it's for the same profile. Returns false if it isn't,
+	// and a layer needs to be pushed.
+	bool Share(const Owner& owner, const std::wstring& name);
+	// display holds the targets the profile touched, as it left them.
+	void Push(const Owner& owner, const std::wstring& name, const DisplayConfig::TopologyDiff& display,
+		bool hasAudio, const std::wstring& audioDevice);
+
+	// Drops owner's references, and the layers of owners that are gone. Both add to
+	// *pRestore.
+	void Release(const Owner& owner, Restore* pRestore);
+	void Prune(Restore* pRestore);
+
+	size_t GetLayerCount() const;
+
+private:
+	struct Layer
+	{
+		std::wstring mName;
+		std::vector<Owner> mOwners;
+		DisplayConfig::TopologyDiff mDisplay;
+		bool mHasAudio = false;
+		std::wstring mAudioDevice;
+	};
+
+	static bool IsOwnerAlive(const Owner& owner);
+
+	// Removes owner (or, without one, every dead owner) and the layers left without any.
+	void DropOwners(const Owner* pOwner, Restore* pRestore);
+	// Works out the effective state of the targets and audio the dropped layers covered,
+	// from the layers still on the stack and the base.
+	void ResolveDropped(const std::vector<Layer>& dropped, Restore* pRestore) const;
+
+	bool Read();
+	bool Write() const;
+
+	std::wstring mFileName;
+	HANDLE mMutex;
+	bool mLocked;
+
+	bool mHasBaseDisplay;
+	DisplayConfig::TopologyState mBaseDisplay;
+	DisplayConfig::Plan mBasePlan;
+	bool mHasBaseAudio;
+	std::wstring mBaseAudioDevice;
+	// Bottom first.
+	std::vector<Layer> mLayers;
+};
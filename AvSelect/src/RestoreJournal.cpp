@@ -0,0 +1,406 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "RestoreJournal.h"
+#include "Util.h"
+
+using namespace std;
+
+#define RESTORE_JOURNAL_MAGIC 0x4a525641 // 'AVRJ'
+#define RESTORE_JOURNAL_VERSION 1
+
+struct RestoreJournalHeader
+{
+	UINT32 mMagic;
+	UINT32 mVersion;
+	UINT32 mSize;
+	UINT32 mReserved;
+};
+
+// Followed by mSize bytes of payload, padded to 8.
+struct RestoreJournalRecord
+{
+	UINT32 mType;
+	UINT32 mSize;
+	UINT64 mChecksum; // FNV-1a of the type, the size and the payload
+};
+
+struct DisplayBaselineCounts
+{
+	UINT32 mNumTargets;
+	UINT32 mNumPaths;
+	UINT32 mNumModes;
+	UINT32 mChangesDisplay;
+	UINT32 mEnablesDisplay;
+};
+
+static UINT32 AlignRecordSize(UINT32 size)
+{
+	return (size + 7) & ~7;
+}
+
+static UINT64 GetRecordChecksum(UINT32 type, UINT32 size, const BYTE* pPayload)
+{
+	UINT64 hash = Fnv1a64Value(Fnv1a64Value(FNV1A64_OFFSET_BASIS, type), size);
+	return Fnv1a64(hash, pPayload, size);
+}
+
+static vector<BYTE> GetDisplayBaselinePayload(const DisplayConfig::TopologyState& state, const DisplayConfig::Plan& plan)
+{
+	DisplayBaselineCounts counts;
+	counts.mNumTargets = (UINT32)state.size();
+	counts.mNumPaths = (UINT32)plan.mPaths.size();
+	counts.mNumModes = (UINT32)plan.mModes.size();
+	counts.mChangesDisplay = plan.mChangesDisplay;
+	counts.mEnablesDisplay = plan.mEnablesDisplay;
+
+	vector<BYTE> payload;
+	AppendPayload(payload, &counts, 1);
+	AppendPayload(payload, state.data(), state.size());
+	AppendPayload(payload, plan.mPaths.data(), plan.mPaths.size());
+	AppendPayload(payload, plan.mModes.data(), plan.mModes.size());
+	return payload;
+}
+
+static wstring ReadString(const BYTE* pData, UINT32 size)
+{
+	return wstring((const WCHAR*)pData, size / sizeof(WCHAR));
+}
+
+RestoreJournal::RestoreJournal()
+:
+mFile(INVALID_HANDLE_VALUE),
+mMapping(NULL),
+mpView(NULL),
+mUsed(0)
+{
+	InitializeSRWLock(&mLock);
+}
+
+RestoreJournal::~RestoreJournal()
+{
+	Close();
+}
+
+bool RestoreJournal::IsOpen() const
+{
+	AcquireSRWLockShared(&mLock);
+	bool open = mpView != NULL;
+	ReleaseSRWLockShared(&mLock);
+	return open;
+}
+
+bool RestoreJournal::Open(const wstring& fileName, Baseline* pLeftover)
+{
+	*pLeftover = Baseline();
+
+	AcquireSRWLockExclusive(&mLock);
+
+	if (mpView)
+	{
+		ReleaseSRWLockExclusive(&mLock);
+		return true;
+	}
+
+	mFile = CreateFileW(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 
+		NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (mFile == INVALID_HANDLE_VALUE)
+	{
+		DWORD error = GetLastError();
+		ReleaseSRWLockExclusive(&mLock);
+
+		if (error == ERROR_SHARING_VIOLATION)
+			LogMessage(L"Restore journal " + fileName + L" is in use by another instance; running without it.");
+		else
+			LogMessage(L"Could not open restore journal " + fileName + L". Error Code:" + to_wstring(error));
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	bool fresh = !GetFileSizeEx(mFile, &fileSize) || fileSize.QuadPart != JOURNAL_SIZE;
+
+	if (fresh)
+	{
+		LARGE_INTEGER size;
+		size.QuadPart = JOURNAL_SIZE;
+		SetFilePointerEx(mFile, size, NULL, FILE_BEGIN);
+		SetEndOfFile(mFile);
+	}
+
+	mMapping = CreateFileMappingW(mFile, NULL, PAGE_READWRITE, 0, JOURNAL_SIZE, NULL);
+	if (mMapping)
+		mpView = (BYTE*)MapViewOfFile(mMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, JOURNAL_SIZE);
+
+	if (!mpView)
+	{
+		DWORD error = GetLastError();
+		ReleaseSRWLockExclusive(&mLock);
+		Close();
+		LogMessage(L"Could not map restore journal " + fileName + L". Error Code:" + to_wstring(error));
+		return false;
+	}
+
+	RestoreJournalHeader header;
+	memcpy(&header, mpView, sizeof(header));
+
+	if (fresh ||
+		header.mMagic != RESTORE_JOURNAL_MAGIC || 
+		header.mVersion != RESTORE_JOURNAL_VERSION || 
+		header.mSize != JOURNAL_SIZE)
+	{
+		header.mMagic = RESTORE_JOURNAL_MAGIC;
+		header.mVersion = RESTORE_JOURNAL_VERSION;
+		header.mSize = JOURNAL_SIZE;
+		header.mReserved = 0;
+		memset(mpView, 0, JOURNAL_SIZE);
+		memcpy(mpView, &header, sizeof(header));
+		mUsed = sizeof(header);
+		mBaseline = Baseline();
+	}
+	else
+	{
+		Replay(&mBaseline);
+		*pLeftover = mBaseline;
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+	return true;
+}
+
+void RestoreJournal::Close()
+{
+	AcquireSRWLockExclusive(&mLock);
+
+	if (mpView)
+	{
+		FlushViewOfFile(mpView, 0);
+		UnmapViewOfFile(mpView);
+		mpView = NULL;
+	}
+
+	if (mMapping)
+	{
+		CloseHandle(mMapping);
+		mMapping = NULL;
+	}
+
+	if (mFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(mFile);
+		mFile = INVALID_HANDLE_VALUE;
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+// Leaves mUsed at the end of the last intact record.
+void RestoreJournal::Replay(Baseline* pBaseline)
+{
+	UINT32 offset = sizeof(RestoreJournalHeader);
+
+	while (offset + sizeof(RestoreJournalRecord) <= JOURNAL_SIZE)
+	{
+		RestoreJournalRecord record;
+		memcpy(&record, mpView + offset, sizeof(record));
+
+		const BYTE* pData = mpView + offset + sizeof(record);
+		const BYTE* pEnd = pData + record.mSize;
+
+		if (record.mType == RECORD_END ||
+			record.mSize > JOURNAL_SIZE - offset - sizeof(record) ||
+			record.mChecksum != GetRecordChecksum(record.mType, record.mSize, pData))
+		{
+			break;
+		}
+
+		if (record.mType == RECORD_DISPLAY_BASELINE)
+		{
+			DisplayBaselineCounts counts;
+			Baseline display;
+
+			if (ReadPayload(pData, pEnd, &counts, 1))
+			{
+				display.mDisplay.resize(counts.mNumTargets);
+				display.mDisplayPlan.mPaths.resize(counts.mNumPaths);
+				display.mDisplayPlan.mModes.resize(counts.mNumModes);
+				display.mDisplayPlan.mChangesDisplay = counts.mChangesDisplay != 0;
+				display.mDisplayPlan.mEnablesDisplay = counts.mEnablesDisplay != 0;
+
+				if (ReadPayload(pData, pEnd, display.mDisplay.data(), counts.mNumTargets) &&
+					ReadPayload(pData, pEnd, display.mDisplayPlan.mPaths.data(), counts.mNumPaths) &&
+					ReadPayload(pData, pEnd, display.mDisplayPlan.mModes.data(), counts.mNumModes))
+				{
+					pBaseline->mHasDisplay = true;
+					pBaseline->mDisplay.swap(display.mDisplay);
+					pBaseline->mDisplayPlan = std::move(display.mDisplayPlan);
+				}
+			}
+		}
+		else if (record.mType == RECORD_AUDIO_BASELINE)
+		{
+			pBaseline->mHasAudio = true;
+			pBaseline->mAudioDevice = ReadString(pData, record.mSize);
+		}
+		else if (record.mType == RECORD_TRANSITION)
+		{
+			++pBaseline->mTransitions;
+		}
+
+		offset += sizeof(record) + AlignRecordSize(record.mSize);
+	}
+
+	mUsed = offset;
+}
+
+void RestoreJournal::ResetLocked()
+{
+	// Zeroed front to back: the first record header goes first, so a crash part way
+	// through still leaves an empty journal rather than stale records.
+	memset(mpView + sizeof(RestoreJournalHeader), 0, mUsed - sizeof(RestoreJournalHeader));
+	mUsed = sizeof(RestoreJournalHeader);
+	mBaseline = Baseline();
+}
+
+bool RestoreJournal::AppendLocked(RecordType type, const vector<BYTE>& payload, bool flush)
+{
+	UINT32 size = (UINT32)payload.size();
+	UINT32 recordSize = sizeof(RestoreJournalRecord) + AlignRecordSize(size);
+
+	// Room is always left for the zeroed header that ends the journal.
+	if (payload.size() > JOURNAL_SIZE || mUsed + recordSize + sizeof(RestoreJournalRecord) > JOURNAL_SIZE)
+		return false;
+
+	RestoreJournalRecord record;
+	record.mType = type;
+	record.mSize = size;
+	record.mChecksum = GetRecordChecksum(type, size, payload.data());
+
+	BYTE* pRecord = mpView + mUsed;
+	memcpy(pRecord + sizeof(record), payload.data(), size);
+	memcpy(pRecord, &record, sizeof(record));
+	mUsed += recordSize;
+
+	if (flush)
+	{
+		FlushViewOfFile(pRecord, recordSize);
+		FlushFileBuffers(mFile);
+	}
+
+	return true;
+}
+
+void RestoreJournal::AppendBaselineLocked()
+{
+	if (mBaseline.mHasDisplay)
+	{
+		vector<BYTE> payload = GetDisplayBaselinePayload(mBaseline.mDisplay, mBaseline.mDisplayPlan);
+
+		if (!AppendLocked(RECORD_DISPLAY_BASELINE, payload, true))
+			LogMessage(L"Display baseline doesn't fit in the restore journal.");
+	}
+
+	if (mBaseline.mHasAudio)
+	{
+		vector<BYTE> payload;
+		AppendPayload(payload, mBaseline.mAudioDevice.c_str(), mBaseline.mAudioDevice.size());
+		AppendLocked(RECORD_AUDIO_BASELINE, payload, true);
+	}
+}
+
+// Full: start over with just the baseline, which is all a restore needs. Baseline records
+// are already in mBaseline; anything else is appended again after it.
+void RestoreJournal::AppendOrCompactLocked(RecordType type, const vector<BYTE>& payload, bool flush)
+{
+	if (AppendLocked(type, payload, flush))
+		return;
+
+	Baseline baseline = mBaseline;
+	ResetLocked();
+	mBaseline = baseline;
+	AppendBaselineLocked();
+
+	if (type == RECORD_TRANSITION)
+		AppendLocked(type, payload, flush);
+}
+
+void RestoreJournal::RecordDisplayBaseline(const DisplayConfig::TopologyState& state, const DisplayConfig::Plan& plan)
+{
+	AcquireSRWLockExclusive(&mLock);
+
+	if (mpView)
+	{
+		mBaseline.mHasDisplay = true;
+		mBaseline.mDisplay = state;
+		mBaseline.mDisplayPlan = plan;
+
+		AppendOrCompactLocked(RECORD_DISPLAY_BASELINE, GetDisplayBaselinePayload(state, plan), true);
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+void RestoreJournal::RecordAudioBaseline(const wstring& deviceName)
+{
+	AcquireSRWLockExclusive(&mLock);
+
+	if (mpView)
+	{
+		mBaseline.mHasAudio = true;
+		mBaseline.mAudioDevice = deviceName;
+
+		vector<BYTE> payload;
+		AppendPayload(payload, deviceName.c_str(), deviceName.size());
+		AppendOrCompactLocked(RECORD_AUDIO_BASELINE, payload, true);
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+void RestoreJournal::RecordTransition(const wstring& menuItemName)
+{
+	AcquireSRWLockExclusive(&mLock);
+
+	if (mpView && !mBaseline.IsEmpty())
+	{
+		mTransitionPayload.clear();
+		AppendPayload(mTransitionPayload, menuItemName.c_str(), menuItemName.size());
+		AppendOrCompactLocked(RECORD_TRANSITION, mTransitionPayload, false);
+		++mBaseline.mTransitions;
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+void RestoreJournal::RecordRestored()
+{
+	AcquireSRWLockExclusive(&mLock);
+
+	if (mpView)
+	{
+		ResetLocked();
+		FlushViewOfFile(mpView, 0);
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+}
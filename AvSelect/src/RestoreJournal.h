@@ -0,0 +1,101 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include "DisplaySettings.h"
+
+/* What RestoreOnExit and -setuntilexit will put back, kept on disk so a process that
+   dies before restoring doesn't lose it. The next start replays the journal and
+   restores what was left behind.
+
+   The file is mapped and only ever appended to. A record is copied into the view and
+   is on disk as far as a crashed process is concerned; only baselines are flushed, so
+   they also survive a power cut. Each record carries a checksum, so replay stops
+   cleanly at a torn tail. Marking the baseline restored empties the journal again.
+
+   The file is opened exclusively; while one instance holds it, others run without a
+   journal rather than replaying a baseline that's still in use.
+*/
+class RestoreJournal
+{
+public:
+	struct Baseline
+	{
+		bool mHasDisplay = false;
+		DisplayConfig::TopologyState mDisplay;
+		DisplayConfig::Plan mDisplayPlan;
+		bool mHasAudio = false;
+		std::wstring mAudioDevice;
+		// MenuItems applied since the baseline was taken, for the log.
+		UINT32 mTransitions = 0;
+
+		bool IsEmpty() const { return !mHasDisplay && !mHasAudio; }
+	};
+
+	RestoreJournal();
+	~RestoreJournal();
+	RestoreJournal(const RestoreJournal&) = delete;
+	RestoreJournal& operator=(const RestoreJournal&) = delete;
+
+	// Fills in *pLeftover with whatever the last owner didn't restore.
+	bool Open(const std::wstring& fileName, Baseline* pLeftover);
+	void Close();
+	bool IsOpen() const;
+
+	void RecordDisplayBaseline(const DisplayConfig::TopologyState& state, const DisplayConfig::Plan& plan);
+	void RecordAudioBaseline(const std::wstring& deviceName);
+	void RecordTransition(const std::wstring& menuItemName);
+	// The baseline is back in place; there's nothing left to replay.
+	void RecordRestored();
+
+private:
+	enum RecordType : UINT32
+	{
+		RECORD_END = 0,
+		RECORD_DISPLAY_BASELINE,
+		RECORD_AUDIO_BASELINE,
+		RECORD_TRANSITION,
+	};
+
+	// Large enough for a baseline of several dozen paths plus a long session of transitions.
+	static const UINT32 JOURNAL_SIZE = 256 * 1024;
+
+	void Replay(Baseline* pBaseline);
+	void ResetLocked();
+	bool AppendLocked(RecordType type, const std::vector<BYTE>& payload, bool flush);
+	void AppendOrCompactLocked(RecordType type, const std::vector<BYTE>& payload, bool flush);
+	void AppendBaselineLocked();
+
+	mutable SRWLOCK mLock;
+	HANDLE mFile;
+	HANDLE mMapping;
+	BYTE* mpView;
+	UINT32 mUsed;
+
+	// Kept so the journal can be compacted down to it when it fills up.
+	Baseline mBaseline;
+	// Reused by every RecordTransition, which is on a pick's way and shouldn't allocate.
+	std::vector<BYTE> mTransitionPayload;
+};
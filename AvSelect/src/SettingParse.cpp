@@ -21,6 +21,7 @@
 * SOFTWARE. */
 
 #include <stdafx.h>
+#include <algorithm>
 
 using namespace std;
 
@@ -29,55 +30,76 @@ wstring Widen(string s)
 	return wstring(s.begin(), s.end());
 }
 
-UserConfig::Field GetRequiredField(const UserConfig::State state, std::string name)
+const UserConfig::Field& GetRequiredField(const UserConfig::State& state, std::string_view name)
 {
 	const UserConfig::Field* pState = state.GetField(name);
 	if (!pState)
-		throw runtime_error("<" + name + "> required.");
+		throw runtime_error("<" + string(name) + "> required.");
 
 	return *pState;
 }
 
-void CheckRequiredValues(UserConfig::Field field, vector<std::pair<std::string, bool>> recognizedValues)
+static const ParamList sNoValues;
+
+void CheckRequiredValues(const UserConfig::Field& field, const ParamList& recognizedValues)
 {
-	auto valueList = field.GetValueList();
-	for (auto pair : recognizedValues)
-	{
-		auto item = std::find(valueList.begin(), valueList.end(), pair.first);
+	CheckRequiredValues(field, recognizedValues, sNoValues);
+}
 
-		if (item == valueList.end() && pair.second)
-			throw runtime_error("Error parsing <" + field.GetName() + ">. Required attribute " + pair.first + " not found.");
+// Counts instead of copying the field's value list, so a valid field costs no allocation.
+void CheckRequiredValues(const UserConfig::Field& field, const ParamList& recognizedValues, 
+	const ParamList& moreRecognizedValues)
+{
+	size_t recognizedCount = 0;
 
-		if (item != valueList.end())
-			valueList.erase(item);
+	for (const ParamList* pList : { &recognizedValues, &moreRecognizedValues })
+	{
+		for (const std::pair<std::string, bool>& pair : *pList)
+		{
+			if (field.HasValue(pair.first))
+				++recognizedCount;
+			else if (pair.second)
+				throw runtime_error("Error parsing <" + field.GetName() + ">. Required attribute " + pair.first + " not found.");
+		}
 	}
 
-	if (!valueList.empty())
-		throw runtime_error("Error parsing <" + field.GetName() + ">. Unrecognized attribute " + valueList[0] + ".");
+	if (recognizedCount == field.GetValueCount())
+		return;
+
+	for (const string& value : field.GetValueList())
+	{
+		auto isValue = [&value](const std::pair<std::string, bool>& pair) { return pair.first == value; };
+
+		if (std::none_of(recognizedValues.begin(), recognizedValues.end(), isValue) &&
+			std::none_of(moreRecognizedValues.begin(), moreRecognizedValues.end(), isValue))
+		{
+			throw runtime_error("Error parsing <" + field.GetName() + ">. Unrecognized attribute " + value + ".");
+		}
+	}
 }
 
-bool ReadValue(const UserConfig::Field* pField, string valueName, string& parsedValue, bool required)
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, string& parsedValue, bool required)
 {
 	if (!pField) return false;
-	string value = pField->GetValue(valueName);
+	const string& value = pField->GetValue(valueName);
 	if (value == "") return false;
 	parsedValue = value;
 	return true;
 }
 
-bool ReadValue(const UserConfig::Field* pField, string valueName, wstring& parsedValue, bool required)
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, wstring& parsedValue, bool required)
 {
 	if (!pField) return false;
-	string value = pField->GetValue(valueName);
+	const string& value = pField->GetValue(valueName);
 	if (value == "") return false;
-	parsedValue = Widen(value);
+	parsedValue = pField->GetWideValue(valueName);
 	return true;
 }
 
-bool ReadValue(const UserConfig::Field* pField, string valueName, int& parsedValue, bool required)
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, int& parsedValue, bool required)
 {
 	if (!pField) return false;
-	string value = pField->GetValue(valueName);
+	const string& value = pField->GetValue(valueName);
 	if (value == "") return false;
 
 	try
@@ -87,14 +109,14 @@ bool ReadValue(const UserConfig::Field* pField, string valueName, int& parsedVal
 	}
 	catch (...)
 	{
-		throw "'" + valueName + "' must be a valid int. Cannot parse '" + value + "'.";
+		throw "'" + string(valueName) + "' must be a valid int. Cannot parse '" + value + "'.";
 	}
 }
 
-bool ReadValue(const UserConfig::Field* pField, string valueName, unsigned long& parsedValue, bool required)
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, unsigned long& parsedValue, bool required)
 {
 	if (!pField) return false;
-	string value = pField->GetValue(valueName);
+	const string& value = pField->GetValue(valueName);
 	if (value == "") return false;
 
 	try
@@ -104,14 +126,14 @@ bool ReadValue(const UserConfig::Field* pField, string valueName, unsigned long&
 	}
 	catch (...)
 	{
-		throw "'" + valueName + "' must be a valid unsigned long. Cannot parse '" + value + "'.";
+		throw "'" + string(valueName) + "' must be a valid unsigned long. Cannot parse '" + value + "'.";
 	}
 }
 
-bool ReadValue(const UserConfig::Field* pField, string valueName, unsigned long long& parsedValue, bool required)
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, unsigned long long& parsedValue, bool required)
 {
 	if (!pField) return false;
-	string value = pField->GetValue(valueName);
+	const string& value = pField->GetValue(valueName);
 	if (value == "") return false;
 
 	try
@@ -121,31 +143,31 @@ bool ReadValue(const UserConfig::Field* pField, string valueName, unsigned long
 	}
 	catch (...)
 	{
-		throw "'" + valueName + "' must be a valid unsigned long long. Cannot parse '" + value + "'.";
+		throw "'" + string(valueName) + "' must be a valid unsigned long long. Cannot parse '" + value + "'.";
 	}
 }
 
-bool ReadValue(const UserConfig::Field* pField, std::string valueName, bool& parsedValue, bool required)
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, bool& parsedValue, bool required)
 {
 	if (!pField) return false;
-	string value = pField->GetValue(valueName);
+	const string& value = pField->GetValue(valueName);
 	if (value == "") return false;
 
 	if (!_stricmp(value.c_str(), "true"))
 		parsedValue = true;
 	else if (!_stricmp(value.c_str(), "false"))
 		parsedValue = false;
-	else throw runtime_error("'" + valueName + "' must be either \"true\" or \"false\". Cannot parse '" 
+	else throw runtime_error("'" + string(valueName) + "' must be either \"true\" or \"false\". Cannot parse '" 
 		+ value + "'.");
 
 	return true;
 }
 
-bool ReadValue(const UserConfig::Field* pField, std::string valueName, DISPLAYCONFIG_RATIONAL& parsedValue, UINT32 defaultDenominator,
+bool ReadValue(const UserConfig::Field* pField, std::string_view valueName, DISPLAYCONFIG_RATIONAL& parsedValue, UINT32 defaultDenominator,
 	bool required)
 {
 	if (!pField) return false;
-	string value = pField->GetValue(valueName);
+	const string& value = pField->GetValue(valueName);
 	if (value == "") return false;
 
 	try
@@ -167,7 +189,7 @@ bool ReadValue(const UserConfig::Field* pField, std::string valueName, DISPLAYCO
 	}
 	catch (...)
 	{
-		throw "'" + valueName + "' must be a valid unsigned long or rational (ulong/ulong). Cannot parse '" + value + "'.";
+		throw "'" + string(valueName) + "' must be a valid unsigned long or rational (ulong/ulong). Cannot parse '" + value + "'.";
 	}
 
 	return true;
@@ -0,0 +1,137 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <exception>
+#include <functional>
+#include <memory>
+
+/* Collapses concurrent identical queries into one. The first caller runs the query;
+   callers that arrive while it is running wait for it and get the same result (or the
+   same exception) instead of issuing their own.
+
+   Forget detaches the running query, so callers after a change that may make its
+   answer stale start a fresh one.
+*/
+template <typename Result>
+class SingleFlight
+{
+public:
+	typedef std::shared_ptr<const Result> ResultPtr;
+
+	SingleFlight()
+	:
+	mQueries(0),
+	mJoins(0)
+	{
+		InitializeSRWLock(&mLock);
+		InitializeConditionVariable(&mDone);
+	}
+
+	SingleFlight(const SingleFlight&) = delete;
+	SingleFlight& operator=(const SingleFlight&) = delete;
+
+	ResultPtr Do(const std::function<Result()>& query)
+	{
+		AcquireSRWLockExclusive(&mLock);
+
+		std::shared_ptr<Flight> pFlight = mpInFlight;
+
+		if (pFlight)
+		{
+			++mJoins;
+
+			while (!pFlight->mDone)
+				SleepConditionVariableSRW(&mDone, &mLock, INFINITE, 0);
+
+			ReleaseSRWLockExclusive(&mLock);
+			return pFlight->Get();
+		}
+
+		pFlight = std::make_shared<Flight>();
+		mpInFlight = pFlight;
+		++mQueries;
+		ReleaseSRWLockExclusive(&mLock);
+
+		ResultPtr pResult;
+		std::exception_ptr error;
+
+		try
+		{
+			pResult = std::make_shared<const Result>(query());
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		AcquireSRWLockExclusive(&mLock);
+		pFlight->mResult = pResult;
+		pFlight->mError = error;
+		pFlight->mDone = true;
+		if (mpInFlight == pFlight)
+			mpInFlight = NULL;
+		ReleaseSRWLockExclusive(&mLock);
+
+		WakeAllConditionVariable(&mDone);
+		return pFlight->Get();
+	}
+
+	void Forget()
+	{
+		AcquireSRWLockExclusive(&mLock);
+		mpInFlight = NULL;
+		ReleaseSRWLockExclusive(&mLock);
+	}
+
+	// Queries actually run, and calls that joined one instead.
+	void GetStats(UINT64* pQueries, UINT64* pJoins) const
+	{
+		AcquireSRWLockShared(&mLock);
+		*pQueries = mQueries;
+		*pJoins = mJoins;
+		ReleaseSRWLockShared(&mLock);
+	}
+
+private:
+	struct Flight
+	{
+		bool mDone = false;
+		ResultPtr mResult;
+		std::exception_ptr mError;
+
+		ResultPtr Get() const
+		{
+			if (mError)
+				std::rethrow_exception(mError);
+			return mResult;
+		}
+	};
+
+	mutable SRWLOCK mLock;
+	CONDITION_VARIABLE mDone;
+	std::shared_ptr<Flight> mpInFlight;
+	UINT64 mQueries;
+	UINT64 mJoins;
+};
@@ -0,0 +1,163 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "TargetNameCache.h"
+#include "TransitionGraph.h"
+#include "DisplayBackend.h"
+
+using namespace std;
+
+TargetNameCache g_TargetNameCache;
+
+static bool QueryTargetNames(const DisplayConfig::DeviceId& target, TargetNameCache::TargetNames& names)
+{
+	DISPLAYCONFIG_TARGET_DEVICE_NAME queryInfo;
+	ZeroMemory(&queryInfo, sizeof(queryInfo));
+	queryInfo.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_TARGET_NAME;
+	queryInfo.header.size = sizeof(queryInfo);
+	queryInfo.header.adapterId = target.mAdapterId;
+	queryInfo.header.id = target.mId;
+
+	if (DisplayBackend::Get().GetDeviceInfo(&queryInfo.header) != ERROR_SUCCESS)
+		return false;
+
+	names.mFriendlyName = queryInfo.monitorFriendlyDeviceName;
+	names.mDevicePath = queryInfo.monitorDevicePath;
+	return true;
+}
+
+static bool QuerySourceName(const DisplayConfig::DeviceId& source, wstring& name)
+{
+	DISPLAYCONFIG_SOURCE_DEVICE_NAME queryInfo;
+	ZeroMemory(&queryInfo, sizeof(queryInfo));
+	queryInfo.header.type = DISPLAYCONFIG_DEVICE_INFO_GET_SOURCE_NAME;
+	queryInfo.header.size = sizeof(queryInfo);
+	queryInfo.header.adapterId = source.mAdapterId;
+	queryInfo.header.id = source.mId;
+
+	if (DisplayBackend::Get().GetDeviceInfo(&queryInfo.header) != ERROR_SUCCESS)
+		return false;
+
+	name = queryInfo.viewGdiDeviceName;
+	return true;
+}
+
+static UINT64 GetAdapterKey(const DisplayConfig::DeviceId& id)
+{
+	return id.mAdapterId.LowPart | ((UINT64)id.mAdapterId.HighPart << 32);
+}
+
+TargetNameCache::TargetNameCache()
+:
+mGeneration(0)
+{
+	InitializeSRWLock(&mLock);
+}
+
+void TargetNameCache::Lookup(
+	const vector<DisplayConfig::DeviceId>& targets,
+	vector<TargetNames>& targetNames,
+	const vector<DisplayConfig::DeviceId>& sources,
+	vector<wstring>& sourceNames)
+{
+	targetNames.assign(targets.size(), TargetNames());
+	sourceNames.assign(sources.size(), wstring());
+
+	map<UINT64, AdapterBatch> batches;
+
+	AcquireSRWLockShared(&mLock);
+	UINT64 generation = mGeneration;
+
+	for (size_t i = 0; i < targets.size(); ++i)
+	{
+		auto it = mTargetNames.find(targets[i]);
+		if (it != mTargetNames.end())
+			targetNames[i] = it->second;
+		else
+			batches[GetAdapterKey(targets[i])].mTargetIndices.push_back(i);
+	}
+
+	for (size_t i = 0; i < sources.size(); ++i)
+	{
+		auto it = mSourceNames.find(sources[i]);
+		if (it != mSourceNames.end())
+			sourceNames[i] = it->second;
+		else
+			batches[GetAdapterKey(sources[i])].mSourceIndices.push_back(i);
+	}
+
+	ReleaseSRWLockShared(&mLock);
+
+	if (batches.empty())
+		return;
+
+	// Each batch only writes the slots it owns.
+	vector<char> targetFound(targets.size()), sourceFound(sources.size());
+	TransitionGraph graph;
+
+	for (auto& batch : batches)
+	{
+		const AdapterBatch* pBatch = &batch.second;
+
+		graph.AddNode(L"Display names for adapter " + to_wstring(batch.first), 
+			[&, pBatch]()
+		{
+			for (size_t i : pBatch->mTargetIndices)
+				targetFound[i] = QueryTargetNames(targets[i], targetNames[i]);
+			for (size_t i : pBatch->mSourceIndices)
+				sourceFound[i] = QuerySourceName(sources[i], sourceNames[i]);
+			return true;
+		});
+	}
+
+	graph.Run();
+
+	AcquireSRWLockExclusive(&mLock);
+
+	// Names fetched across a hotplug may already be stale; use them but don't keep them.
+	if (generation == mGeneration)
+	{
+		for (size_t i = 0; i < targets.size(); ++i)
+		{
+			if (targetFound[i])
+				mTargetNames[targets[i]] = targetNames[i];
+		}
+
+		for (size_t i = 0; i < sources.size(); ++i)
+		{
+			if (sourceFound[i])
+				mSourceNames[sources[i]] = sourceNames[i];
+		}
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+void TargetNameCache::Invalidate()
+{
+	AcquireSRWLockExclusive(&mLock);
+	++mGeneration;
+	mTargetNames.clear();
+	mSourceNames.clear();
+	ReleaseSRWLockExclusive(&mLock);
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "DisplaySettings.h"
+
+/* Names DisplayConfigGetDeviceInfo reports for targets (monitor friendly name and device
+   path) and sources (GDI device name). They only change when a device is plugged in or
+   removed, so they're kept until Invalidate is called on a hotplug notification.
+
+   Cold lookups are grouped by adapter and each adapter's are issued on their own thread,
+   so a refresh after a hotplug doesn't grow with the number of monitors.
+*/
+class TargetNameCache
+{
+public:
+	struct TargetNames
+	{
+		std::wstring mFriendlyName;
+		std::wstring mDevicePath;
+	};
+
+	TargetNameCache();
+
+	// Fills targetNames/sourceNames in the order of targets/sources. A name the driver
+	// wouldn't report is left empty, and asked for again next time.
+	void Lookup(
+		const std::vector<DisplayConfig::DeviceId>& targets,
+		std::vector<TargetNames>& targetNames,
+		const std::vector<DisplayConfig::DeviceId>& sources,
+		std::vector<std::wstring>& sourceNames);
+
+	void Invalidate();
+
+private:
+	struct AdapterBatch
+	{
+		std::vector<size_t> mTargetIndices;
+		std::vector<size_t> mSourceIndices;
+	};
+
+	SRWLOCK mLock;
+	UINT64 mGeneration;
+	std::map<DisplayConfig::DeviceId, TargetNames> mTargetNames;
+	std::map<DisplayConfig::DeviceId, std::wstring> mSourceNames;
+};
+
+extern TargetNameCache g_TargetNameCache;
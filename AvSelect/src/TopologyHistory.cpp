@@ -0,0 +1,151 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "TopologyHistory.h"
+
+using namespace std;
+
+TopologyHistory::TopologyHistory()
+:
+mHasCurrent(false)
+{
+	InitializeSRWLock(&mLock);
+}
+
+void TopologyHistory::Record(const DisplayConfig::TopologyState& state)
+{
+	AcquireSRWLockExclusive(&mLock);
+	RecordLocked(state);
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+bool TopologyHistory::Peek(const DisplayConfig::TopologyState& live, int steps, DisplayConfig::TopologyState* pTarget) const
+{
+	if (!steps)
+		return false;
+
+	AcquireSRWLockShared(&mLock);
+
+	bool reachable = mHasCurrent;
+	size_t back = 0, forward = 0;
+
+	if (reachable && live != mCurrent)
+	{
+		// live is one ahead of mCurrent, and the redo side no longer applies to it.
+		reachable = steps < 0;
+		back = (size_t)(-steps) - 1;
+	}
+	else if (steps < 0)
+	{
+		back = (size_t)(-steps);
+	}
+	else
+	{
+		forward = (size_t)steps;
+	}
+
+	reachable = reachable && back <= mUndo.size() && forward <= mRedo.size();
+
+	if (reachable)
+	{
+		DisplayConfig::TopologyState state = mCurrent;
+
+		for (size_t i = 0; i < back; ++i)
+			DisplayConfig::PatchTopology(state, mUndo[mUndo.size() - 1 - i]);
+
+		for (size_t i = 0; i < forward; ++i)
+			DisplayConfig::PatchTopology(state, mRedo[mRedo.size() - 1 - i]);
+
+		pTarget->swap(state);
+	}
+
+	ReleaseSRWLockShared(&mLock);
+	return reachable;
+}
+
+void TopologyHistory::Move(const DisplayConfig::TopologyState& live, int steps, const DisplayConfig::TopologyState& actual)
+{
+	AcquireSRWLockExclusive(&mLock);
+
+	RecordLocked(live);
+
+	for (; steps < 0 && !mUndo.empty(); ++steps)
+		StepLocked(mUndo, mRedo);
+
+	for (; steps > 0 && !mRedo.empty(); --steps)
+		StepLocked(mRedo, mUndo);
+
+	// The driver may not have landed exactly on the planned state. Re-anchor both
+	// neighbours on what it did land on, so the next step starts from the truth.
+	if (actual != mCurrent)
+	{
+		for (deque<DisplayConfig::TopologyDiff>* pSide : { &mUndo, &mRedo })
+		{
+			if (pSide->empty())
+				continue;
+
+			DisplayConfig::TopologyState neighbour = mCurrent;
+			DisplayConfig::PatchTopology(neighbour, pSide->back());
+			pSide->back() = DisplayConfig::DiffTopology(actual, neighbour);
+		}
+
+		mCurrent = actual;
+	}
+
+	ReleaseSRWLockExclusive(&mLock);
+}
+
+void TopologyHistory::GetDepth(size_t* pUndo, size_t* pRedo) const
+{
+	AcquireSRWLockShared(&mLock);
+	*pUndo = mUndo.size();
+	*pRedo = mRedo.size();
+	ReleaseSRWLockShared(&mLock);
+}
+
+void TopologyHistory::RecordLocked(const DisplayConfig::TopologyState& state)
+{
+	if (mHasCurrent && state == mCurrent)
+		return;
+
+	if (mHasCurrent)
+	{
+		mUndo.push_back(DisplayConfig::DiffTopology(state, mCurrent));
+		if (mUndo.size() > MAX_STEPS)
+			mUndo.pop_front();
+	}
+
+	mRedo.clear();
+	mCurrent = state;
+	mHasCurrent = true;
+}
+
+void TopologyHistory::StepLocked(deque<DisplayConfig::TopologyDiff>& from, deque<DisplayConfig::TopologyDiff>& to)
+{
+	DisplayConfig::TopologyState neighbour = mCurrent;
+	DisplayConfig::PatchTopology(neighbour, from.back());
+	from.pop_back();
+
+	to.push_back(DisplayConfig::DiffTopology(neighbour, mCurrent));
+	mCurrent.swap(neighbour);
+}
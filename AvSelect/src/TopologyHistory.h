@@ -0,0 +1,76 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <deque>
+#include "DisplaySettings.h"
+
+/* Undo and redo for the display topology. Only the current state is kept whole; every
+   other entry is the TopologyDiff that takes its neighbour back to it, which for a
+   typical change names one or two targets instead of copying the path and mode arrays.
+
+   Nothing here touches the displays. Peek works out where a jump of any number of steps
+   lands by patching a copy of the current state, so the caller can reach it with one
+   diff from whatever is showing. Move then commits the jump once that apply succeeded.
+
+   The history is bounded to MAX_STEPS entries behind the current one; the oldest is
+   dropped first. Recording a new state drops the redo side, as in an editor.
+*/
+class TopologyHistory
+{
+public:
+	enum { MAX_STEPS = 32 };
+
+	TopologyHistory();
+	TopologyHistory(const TopologyHistory&) = delete;
+	TopologyHistory& operator=(const TopologyHistory&) = delete;
+
+	// Makes state the current entry. Does nothing if it already is.
+	void Record(const DisplayConfig::TopologyState& state);
+
+	// Finds the state steps entries from live; negative steps go back. If live isn't the
+	// current entry, the displays were changed behind the history's back and live counts
+	// as a newer entry nobody recorded, with nothing to redo. Returns false if the
+	// history doesn't reach that far.
+	bool Peek(const DisplayConfig::TopologyState& live, int steps, DisplayConfig::TopologyState* pTarget) const;
+
+	// Commits a jump Peek planned and the caller applied. actual is what the displays
+	// show afterwards, which becomes the current entry in place of the planned one.
+	void Move(const DisplayConfig::TopologyState& live, int steps, const DisplayConfig::TopologyState& actual);
+
+	void GetDepth(size_t* pUndo, size_t* pRedo) const;
+
+private:
+	void RecordLocked(const DisplayConfig::TopologyState& state);
+	// Moves mCurrent one entry towards from's side.
+	void StepLocked(std::deque<DisplayConfig::TopologyDiff>& from, std::deque<DisplayConfig::TopologyDiff>& to);
+
+	mutable SRWLOCK mLock;
+	bool mHasCurrent;
+	DisplayConfig::TopologyState mCurrent;
+	// back() is the step next to mCurrent. The undo side is bounded, so it drops from
+	// the front.
+	std::deque<DisplayConfig::TopologyDiff> mUndo;
+	std::deque<DisplayConfig::TopologyDiff> mRedo;
+};
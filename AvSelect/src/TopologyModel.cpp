@@ -0,0 +1,96 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "TopologyModel.h"
+
+using namespace std;
+
+TopologyModel g_TopologyModel;
+
+TopologyModel::TopologyModel()
+:
+mEpoch(1)
+{
+	InitializeSRWLock(&mWriterLock);
+}
+
+TopologyModel::SnapshotPtr TopologyModel::Load(DisplayConfig::QueryScope scope) const
+{
+	return std::atomic_load(scope == DisplayConfig::QUERY_ALL_PATHS ? &mAllPaths : &mActivePaths);
+}
+
+bool TopologyModel::IsCurrent(const SnapshotPtr& pSnapshot) const
+{
+	return pSnapshot && pSnapshot->mEpoch == mEpoch.load();
+}
+
+TopologyModel::SnapshotPtr TopologyModel::Acquire(DisplayConfig::QueryScope scope)
+{
+	SnapshotPtr pSnapshot = Load(scope);
+	if (IsCurrent(pSnapshot))
+		return pSnapshot;
+
+	AcquireSRWLockExclusive(&mWriterLock);
+
+	try
+	{
+		// Someone else may have published while we waited.
+		pSnapshot = Load(scope);
+
+		if (!IsCurrent(pSnapshot))
+		{
+			// Invalidated while querying means already stale; the next Acquire queries again.
+			UINT64 epoch = mEpoch.load();
+			SnapshotPtr pActive = Load(DisplayConfig::QUERY_ACTIVE_PATHS);
+
+			if (!pActive || pActive->mEpoch != epoch)
+			{
+				pActive = std::make_shared<const Snapshot>(epoch, DisplayConfig(DisplayConfig::QUERY_ACTIVE_PATHS));
+				std::atomic_store(&mActivePaths, pActive);
+			}
+
+			pSnapshot = pActive;
+
+			if (scope == DisplayConfig::QUERY_ALL_PATHS)
+			{
+				DisplayConfig allPaths(pActive->mConfig);
+				allPaths.UpgradeToAllPaths();
+				pSnapshot = std::make_shared<const Snapshot>(epoch, allPaths);
+				std::atomic_store(&mAllPaths, pSnapshot);
+			}
+		}
+	}
+	catch (...)
+	{
+		ReleaseSRWLockExclusive(&mWriterLock);
+		throw;
+	}
+
+	ReleaseSRWLockExclusive(&mWriterLock);
+	return pSnapshot;
+}
+
+void TopologyModel::Invalidate()
+{
+	++mEpoch;
+}
@@ -0,0 +1,79 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+#include <memory>
+#include "DisplaySettings.h"
+
+/* The one shared view of the display topology.
+
+   Snapshots are immutable once published and tagged with the epoch they were queried
+   in. Invalidate bumps the epoch; the next Acquire that finds its snapshot stale queries
+   again and publishes the result. Readers only load a pointer, so the menu, the config
+   window and transitions share one query instead of each making their own. Queries are
+   serialized, so there is one writer at a time.
+*/
+class TopologyModel
+{
+public:
+	struct Snapshot
+	{
+		Snapshot(UINT64 epoch, const DisplayConfig& config)
+		:
+		mEpoch(epoch),
+		mFingerprint(config.GetFingerprint()),
+		mConfig(config)
+		{}
+
+		const UINT64 mEpoch;
+		const UINT64 mFingerprint;
+		const DisplayConfig mConfig;
+	};
+
+	typedef std::shared_ptr<const Snapshot> SnapshotPtr;
+
+	TopologyModel();
+
+	// Throws if the topology can't be queried. An all-paths snapshot is the active-only
+	// one of the same epoch, upgraded.
+	SnapshotPtr Acquire(DisplayConfig::QueryScope scope = DisplayConfig::QUERY_ACTIVE_PATHS);
+
+	// Call whenever the displays may have changed: after an apply, on a display change
+	// or hotplug notification.
+	void Invalidate();
+
+	UINT64 GetEpoch() const { return mEpoch.load(); }
+
+private:
+	SnapshotPtr Load(DisplayConfig::QueryScope scope) const;
+	bool IsCurrent(const SnapshotPtr& pSnapshot) const;
+
+	SRWLOCK mWriterLock;
+	std::atomic<UINT64> mEpoch;
+	SnapshotPtr mActivePaths;
+	SnapshotPtr mAllPaths;
+};
+
+extern TopologyModel g_TopologyModel;
@@ -0,0 +1,192 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#include <stdafx.h>
+#include "TransitionGraph.h"
+#include "ApplyExecutor.h"
+
+using namespace std;
+
+TransitionGraph::NodeId TransitionGraph::AddNode(wstring_view name, Work work,
+	const vector<NodeId>& dependencies)
+{
+	return AddNode(name, wstring_view(), std::move(work), dependencies);
+}
+
+TransitionGraph::NodeId TransitionGraph::AddNode(wstring_view name, wstring_view detail, Work work,
+	const vector<NodeId>& dependencies)
+{
+	NodeId id = mNodeCount++;
+	if (id == mNodes.size())
+		mNodes.push_back(Node());
+
+	Node& node = mNodes[id];
+	node.mName.assign(name.data(), name.size());
+	if (!detail.empty())
+	{
+		node.mName += L' ';
+		node.mName.append(detail.data(), detail.size());
+	}
+	node.mWork = std::move(work);
+	node.mDependents.clear();
+	node.mUnfinishedDependencies = 0;
+	node.mState = NodeState_Pending;
+	node.mResult = false;
+
+	for (NodeId dependency : dependencies)
+		AddDependency(id, dependency);
+
+	return id;
+}
+
+void TransitionGraph::AddDependency(NodeId id, NodeId dependency)
+{
+	assert(dependency < id && id < mNodeCount);
+	mNodes[dependency].mDependents.push_back(id);
+	++mNodes[id].mUnfinishedDependencies;
+}
+
+void TransitionGraph::Clear()
+{
+	// The work is released now rather than when the node is next reused, so nothing it
+	// captured outlives the transition.
+	for (size_t i = 0; i < mNodeCount; ++i)
+		mNodes[i].mWork = nullptr;
+
+	mNodeCount = 0;
+}
+
+DWORD WINAPI TransitionGraph::NodeThreadProc(LPVOID lpParam)
+{
+	Node* pNode = (Node*)lpParam;
+	pNode->mResult = Invoke(*pNode);
+	return 0;
+}
+
+bool TransitionGraph::Invoke(Node& node)
+{
+	try
+	{
+		return node.mWork();
+	}
+	catch (const std::exception& e)
+	{
+		ErrorMsg(node.mName + L" failed: " + Widen(e.what()));
+		return false;
+	}
+}
+
+void TransitionGraph::Complete(NodeId id, vector<NodeId>& ready)
+{
+	Node& node = mNodes[id];
+	node.mState = node.mResult ? NodeState_Succeeded : NodeState_Failed;
+
+	for (NodeId dependent : node.mDependents)
+	{
+		if (!node.mResult)
+			Skip(dependent);
+		else if (--mNodes[dependent].mUnfinishedDependencies == 0 &&
+			mNodes[dependent].mState == NodeState_Pending)
+			ready.push_back(dependent);
+	}
+}
+
+void TransitionGraph::Skip(NodeId id)
+{
+	Node& node = mNodes[id];
+	if (node.mState != NodeState_Pending)
+		return;
+
+	LogMessage(L"Skipped: " + node.mName);
+	node.mState = NodeState_Skipped;
+
+	for (NodeId dependent : node.mDependents)
+		Skip(dependent);
+}
+
+void TransitionGraph::Run(const CancelToken* pCancel)
+{
+	vector<NodeId>& ready = mReady;
+	vector<HANDLE>& runningThreads = mRunningThreads;
+	vector<NodeId>& runningNodes = mRunningNodes;
+	ready.clear();
+	runningThreads.clear();
+	runningNodes.clear();
+
+	for (NodeId id = 0; id < mNodeCount; ++id)
+	{
+		if (mNodes[id].mUnfinishedDependencies == 0)
+			ready.push_back(id);
+	}
+
+	while (!ready.empty() || !runningThreads.empty())
+	{
+		if (pCancel && pCancel->IsCancelled())
+		{
+			for (NodeId id : ready)
+				Skip(id);
+			ready.clear();
+		}
+
+		while (!ready.empty())
+		{
+			NodeId id = ready.back();
+			ready.pop_back();
+			mNodes[id].mState = NodeState_Running;
+
+			// The last runnable node with nothing else in flight runs on this thread.
+			HANDLE hThread = NULL;
+			if (!ready.empty() || !runningThreads.empty())
+				hThread = CreateThread(NULL, 0, NodeThreadProc, &mNodes[id], 0, NULL);
+
+			if (hThread)
+			{
+				runningThreads.push_back(hThread);
+				runningNodes.push_back(id);
+			}
+			else
+			{
+				mNodes[id].mResult = Invoke(mNodes[id]);
+				Complete(id, ready);
+			}
+		}
+
+		if (runningThreads.empty())
+			continue;
+
+		DWORD rc = WaitForMultipleObjects((DWORD)runningThreads.size(), runningThreads.data(), FALSE, INFINITE);
+		size_t finished = rc - WAIT_OBJECT_0;
+
+		if (finished >= runningThreads.size())
+		{
+			// Can't tell which one finished; fall back to waiting on them in order.
+			finished = 0;
+			WaitForSingleObject(runningThreads[0], INFINITE);
+		}
+
+		CloseHandle(runningThreads[finished]);
+		NodeId id = runningNodes[finished];
+		runningThreads.erase(runningThreads.begin() + finished);
+		runningNodes.erase(runningNodes.begin() + finished);
+		Complete(id, ready);
+	}
+}
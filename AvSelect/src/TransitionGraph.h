@@ -0,0 +1,96 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <Windows.h>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class CancelToken;
+
+/* The work of one MenuItem as a small dependency DAG.
+
+   A node starts once every node it depends on has succeeded; nodes with no path between
+   them run concurrently on their own threads, so the transition takes as long as its
+   slowest branch. A node that fails (returns false or throws) causes its dependents to
+   be skipped. After cancellation no new nodes are started.
+*/
+class TransitionGraph
+{
+public:
+	typedef size_t NodeId;
+	typedef std::function<bool()> Work;
+
+	NodeId AddNode(std::wstring_view name, Work work,
+		const std::vector<NodeId>& dependencies = std::vector<NodeId>());
+	// Named "name detail", e.g. with the device a node switches to.
+	NodeId AddNode(std::wstring_view name, std::wstring_view detail, Work work,
+		const std::vector<NodeId>& dependencies = std::vector<NodeId>());
+	// dependency must have been added before id.
+	void AddDependency(NodeId id, NodeId dependency);
+
+	// Blocks until every node has finished or been skipped.
+	void Run(const CancelToken* pCancel = NULL);
+
+	// Drops every node but keeps their storage, so a graph reused for the next
+	// transition doesn't allocate its nodes again.
+	void Clear();
+
+	bool IsEmpty() const { return mNodeCount == 0; }
+
+private:
+	enum NodeState
+	{
+		NodeState_Pending,
+		NodeState_Running,
+		NodeState_Succeeded,
+		NodeState_Failed,
+		NodeState_Skipped
+	};
+
+	struct Node
+	{
+		std::wstring mName;
+		Work mWork;
+		std::vector<NodeId> mDependents;
+		size_t mUnfinishedDependencies = 0;
+		NodeState mState = NodeState_Pending;
+		bool mResult = false;
+	};
+
+	static DWORD WINAPI NodeThreadProc(LPVOID lpParam);
+	static bool Invoke(Node& node);
+	void Complete(NodeId id, std::vector<NodeId>& ready);
+	void Skip(NodeId id);
+
+	// Only the first mNodeCount are in use; the rest are kept for reuse.
+	std::vector<Node> mNodes;
+	size_t mNodeCount = 0;
+
+	// Run's bookkeeping, kept for reuse like the nodes.
+	std::vector<NodeId> mReady;
+	std::vector<HANDLE> mRunningThreads;
+	std::vector<NodeId> mRunningNodes;
+};
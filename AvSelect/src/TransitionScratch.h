@@ -0,0 +1,64 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+#pragma once
+
+#include <optional>
+#include <vector>
+#include "DisplaySettings.h"
+#include "TransitionGraph.h"
+
+// A DefaultAudioDevice state, as PlanMenuItem reads it. The name points into the loaded
+// UserConfig, which outlives any transition.
+struct SetDefaultAudioDeviceParam
+{
+	bool mWaitForDisplay = false;
+	int mDelayMs = 0;
+	const std::wstring* mpAudioDeviceName = NULL;
+	bool mBeep = false;
+	bool mHideErrors = false;
+};
+
+/* What a transition reuses from the one before it: once warmed, the snapshot copy, the
+   audio switches and the graph's nodes land in storage they already own, so a hotkey
+   that hits a current snapshot and a cached plan doesn't go to the heap for any of them.
+   Transitions run one at a time (on the executor's thread, or from the command line
+   before it starts), so one of these serves them all.
+*/
+struct TransitionScratch
+{
+	// Copies snapshot over the previous transition's config.
+	DisplayConfig& CopySnapshot(const DisplayConfig& snapshot)
+	{
+		if (mDisplayConfig)
+			*mDisplayConfig = snapshot;
+		else
+			mDisplayConfig.emplace(snapshot);
+
+		return *mDisplayConfig;
+	}
+
+	std::optional<DisplayConfig> mDisplayConfig;
+	std::vector<SetDefaultAudioDeviceParam> mAudioStates;
+	TransitionGraph mGraph;
+	std::vector<TransitionGraph::NodeId> mReadyDependencies;
+};
@@ -21,270 +21,861 @@
 * SOFTWARE. */
 
 #include "stdafx.h"
-#include "rapidxml\rapidxml.hpp"
-#include "rapidxml\rapidxml_utils.hpp"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
 #include "UserConfig.h"
+#include "Util.h"
 
-using namespace rapidxml;
 using namespace std;
 
-bool UserConfig::ParseBooleanAttribute(const char* pHelpContext, rapidxml::xml_attribute<>* pAttribute)
+#define DEFAULT_DISPLAY_QUERY_TIMEOUT_MS 5000
+#define DEFAULT_DISPLAY_APPLY_TIMEOUT_MS 20000
+#define DEFAULT_AUDIO_TIMEOUT_MS 5000
+#define MAX_CALL_TIMEOUT_MS 600000
+// Plugging in a TV typically raises a handful of display and device node changes
+// spread over a second or so.
+#define DEFAULT_HOTPLUG_SETTLE_MS 1500
+#define MAX_HOTPLUG_SETTLE_MS 60000
+#define DEFAULT_PIN_CHECK_SECONDS 60
+#define MAX_PIN_CHECK_SECONDS 86400
+
+bool UserConfig::ParseBooleanAttribute(const char* pHelpContext, const ConfigReader::Attribute& attribute)
 {
-	if (!_strnicmp(pAttribute->value(), "TRUE", 5))
+	if (!_strnicmp(attribute.mValue.c_str(), "TRUE", 5))
 		return true;
-	else if (!_strnicmp(pAttribute->value(), "FALSE", 5))
+	else if (!_strnicmp(attribute.mValue.c_str(), "FALSE", 5))
 		return false;
 	else
 		throw ParseException(string() +
-			pHelpContext + ": attribute '" + pAttribute->name() + "', requires value of: 'True' or 'False'");
+			pHelpContext + ": attribute '" + attribute.mName + "', requires value of: 'True' or 'False'");
 }
 
-void UserConfig::ExpectAttribute(const char* pHelpContext, rapidxml::xml_attribute<>* pAttribute, const char* pExpectedName)
+UINT32 UserConfig::ParseUIntAttribute(const char* pHelpContext, const ConfigReader::Attribute& attribute, UINT32 maxValue)
+{
+	char* pEnd = NULL;
+	unsigned long value = strtoul(attribute.mValue.c_str(), &pEnd, 10);
+
+	if (attribute.mValue.empty() || *pEnd || value > maxValue)
+		throw ParseException(string() +
+			pHelpContext + ": attribute '" + attribute.mName + "', requires a whole number from 0 to " + std::to_string(maxValue));
+
+	return (UINT32)value;
+}
+
+void UserConfig::ExpectAttribute(const char* pHelpContext, const ConfigReader::Attribute* pAttribute, const char* pExpectedName)
 {
 	if (!pAttribute)
 		throw ParseException(string() +
 			pHelpContext + ": Expected attribute '" + pExpectedName + "'");
 
-	if (strcmp(pAttribute->name(), pExpectedName))
+	if (pAttribute->mName != pExpectedName)
 		throw ParseException(string() +
-			pHelpContext + ": unExpected attribute '" + pAttribute->next_attribute()->name() + 
+			pHelpContext + ": unExpected attribute '" + pAttribute->mName + 
 				"', Expected: '" + pExpectedName + "'.");
 }
 
-void UserConfig::ExpectNoSiblings(const char* pHelpContext, rapidxml::xml_attribute<>* pAttribute)
+void UserConfig::ExpectOnlyAttribute(const char* pHelpContext, ConfigReader& reader, const char* pExpectedName)
 {
-	if (pAttribute->next_attribute())
-		throw ParseException(string() + pHelpContext + ": no additional attributes Expected after '" + pAttribute->name() +
-			"', therefore attribute '" + pAttribute->next_attribute()->name() + "' is unExpected.");
+	const vector<ConfigReader::Attribute>& attributes = reader.GetAttributes();
+	ExpectAttribute(pHelpContext, attributes.empty() ? NULL : &attributes[0], pExpectedName);
+
+	if (attributes.size() > 1)
+		throw ParseException(string() + pHelpContext + ": no additional attributes Expected after '" + attributes[0].mName +
+			"', therefore attribute '" + attributes[1].mName + "' is unExpected.");
 }
 
-void UserConfig::ExpectNode(const char* pHelpContext, rapidxml::xml_node<>* pNode, const char* pExpectedName)
+// found is what NextChild returned; if true, the reader is at the child's start tag.
+void UserConfig::ExpectNode(const char* pHelpContext, ConfigReader& reader, bool found, const char* pExpectedName)
 {
-	if (!pNode)
+	if (!found)
 		throw ParseException(string() +
 			pHelpContext + ": Expected element '" + pExpectedName + "'");
 
-	if (strcmp(pNode->name(), pExpectedName))
-		throw ParseException(string() + pHelpContext + ": unExpected element <" + pNode->name() + 
+	if (reader.GetName() != pExpectedName)
+		throw ParseException(string() + pHelpContext + ": unExpected element <" + reader.GetName() + 
 			">, Expected <" + pExpectedName + ">.");
 }
 
-void UserConfig::ExpectNoSiblings(const char* pHelpContext, rapidxml::xml_node<>* pNode)
+// After the end of pPreviousName, which must have been its parent's last child.
+void UserConfig::ExpectNoSiblings(const char* pHelpContext, ConfigReader& reader, const char* pPreviousName)
 {
-	if (pNode->next_sibling())
+	if (NextChild(pHelpContext, reader))
 		throw ParseException(string() + pHelpContext + ": no additional elements Expected after <" +
-			pNode->name() + ">, therefore <" + pNode->next_sibling()->name() + "> is unExpected.");
+			pPreviousName + ">, therefore <" + reader.GetName() + "> is unExpected.");
 }
 
-void UserConfig::ExpectNoAttributes(const char* pHelpContext, rapidxml::xml_node<>* pNode)
+void UserConfig::ExpectNoAttributes(const char* pHelpContext, ConfigReader& reader)
 {
-	if (pNode->first_attribute())
-		throw ParseException(string() + pHelpContext + "<" + pNode->name() + ">" +
-			": no attributes Expected, therefore, attribute '" + pNode->first_attribute()->name() + "' is unExpected.");
+	if (!reader.GetAttributes().empty())
+		throw ParseException(string() + pHelpContext + "<" + reader.GetName() + ">" +
+			": no attributes Expected, therefore, attribute '" + reader.GetAttributes()[0].mName + "' is unExpected.");
 }
 
-void UserConfig::ExpectNoValue(const char* pHelpContext, rapidxml::xml_node<>* pNode)
+/* Steps to the next child element of the one being read, returning false at its end
+   tag instead. Text is an error, since none of the elements that contain others take
+   a value.
+*/
+bool UserConfig::NextChild(const char* pHelpContext, ConfigReader& reader)
 {
-	if (pNode->value_size() > 0)
-		throw ParseException(string() + pHelpContext + "<" + pNode->name() + ">" + 
-			": value should not be supplied '" + pNode->value() + "'.");
+	switch (reader.Next())
+	{
+	case ConfigReader::Token_Start:
+		return true;
+	case ConfigReader::Token_Text:
+		throw ParseException(string() + pHelpContext + "<" + reader.GetTextParent() + ">" + 
+			": value should not be supplied '" + reader.GetText() + "'.");
+	default:
+		return false;
+	}
 }
 
-void UserConfig::ParseFile(std::string fileName)
+UserConfig::UserConfig()
 {
-	mpDoubleClickAction = NULL;
-
-	file<> configFile(fileName.c_str());
-	xml_document<> config;
-	config.parse<0>(configFile.data());
+	Reset();
+}
 
-	xml_node<>* pRoot = config.first_node("AvSelectorConfig");
+void UserConfig::Reset()
+{
+	mMenuItems.clear();
+	mStates.clear();
+	mFields.clear();
+	mValues.clear();
+	mAutoApplyTargets.clear();
+	mStrings.clear();
+	mWideStrings.clear();
+	mStringIndex.clear();
+	mNameIndex.clear();
+	mContentHash = 0;
+	mpDoubleClickAction = NULL;
+	mpOnTrayExitAction = NULL;
+	mRestoreOnExit = false;
+	mConfirmDisplayChangeSeconds = 0;
+	mDisplayQueryTimeoutMs = DEFAULT_DISPLAY_QUERY_TIMEOUT_MS;
+	mDisplayApplyTimeoutMs = DEFAULT_DISPLAY_APPLY_TIMEOUT_MS;
+	mAudioTimeoutMs = DEFAULT_AUDIO_TIMEOUT_MS;
+	mHotplugSettleMs = DEFAULT_HOTPLUG_SETTLE_MS;
+	mPinProfile = false;
+	mPinCheckSeconds = DEFAULT_PIN_CHECK_SECONDS;
+	mPartial = false;
+}
 
+void UserConfig::ParseRootAttributes(const ConfigReader& reader,
+	std::optional<std::string>* pDoubleClickAction, std::optional<std::string>* pSetOnExit)
+{
 	const char* pContext = "";
-	char* pDoubleClickAction = NULL;
-	char* pSetOnExit = NULL;
-	
-	for (xml_attribute<>* pAtt = pRoot->first_attribute();
-		pAtt;
-		pAtt = pAtt->next_attribute())
+
+	for (const ConfigReader::Attribute& att : reader.GetAttributes())
 	{
-		if (!strcmp(pAtt->name(), "DoubleClickTray"))
-			pDoubleClickAction = pAtt->value();
-		else if (!strcmp(pAtt->name(), "SetOnExit"))
-			pSetOnExit = pAtt->value();
-		else if (!strcmp(pAtt->name(), "RestoreOnExit"))
-			mRestoreOnExit = ParseBooleanAttribute(pContext, pAtt);
+		if (att.mName == "DoubleClickTray")
+			*pDoubleClickAction = att.mValue;
+		else if (att.mName == "SetOnExit")
+			*pSetOnExit = att.mValue;
+		else if (att.mName == "RestoreOnExit")
+			mRestoreOnExit = ParseBooleanAttribute(pContext, att);
+		else if (att.mName == "ConfirmDisplayChangeSeconds")
+			mConfirmDisplayChangeSeconds = ParseUIntAttribute(pContext, att, 600);
+		else if (att.mName == "DisplayQueryTimeoutMs")
+			mDisplayQueryTimeoutMs = ParseUIntAttribute(pContext, att, MAX_CALL_TIMEOUT_MS);
+		else if (att.mName == "DisplayApplyTimeoutMs")
+			mDisplayApplyTimeoutMs = ParseUIntAttribute(pContext, att, MAX_CALL_TIMEOUT_MS);
+		else if (att.mName == "AudioTimeoutMs")
+			mAudioTimeoutMs = ParseUIntAttribute(pContext, att, MAX_CALL_TIMEOUT_MS);
+		else if (att.mName == "HotplugSettleMs")
+			mHotplugSettleMs = ParseUIntAttribute(pContext, att, MAX_HOTPLUG_SETTLE_MS);
+		else if (att.mName == "PinProfile")
+			mPinProfile = ParseBooleanAttribute(pContext, att);
+		else if (att.mName == "PinCheckSeconds")
+			mPinCheckSeconds = ParseUIntAttribute(pContext, att, MAX_PIN_CHECK_SECONDS);
 		else
-			throw runtime_error(string() + "Attribute '" + pAtt->name() + "' not recognized.");
+			throw runtime_error(string() + "Attribute '" + att.mName + "' not recognized.");
+	}
+}
+
+// Done once every MenuItem is in place, since adding one can move the others.
+void UserConfig::ResolveActions(const std::optional<std::string>& doubleClickAction, const std::optional<std::string>& setOnExit)
+{
+	for (MenuItem& menuItem : mMenuItems)
+	{
+		if (doubleClickAction && !mpDoubleClickAction && menuItem.GetName() == *doubleClickAction)
+			mpDoubleClickAction = &menuItem;
+
+		if (setOnExit && !mpOnTrayExitAction && menuItem.GetName() == *setOnExit)
+			mpOnTrayExitAction = &menuItem;
 	}
 
-	ExpectNoValue(pContext, pRoot);
+	if (doubleClickAction && !mpDoubleClickAction)
+		throw runtime_error("DoubleClickTray=\"" + *doubleClickAction + "\" not found.");
+
+	if (setOnExit && !mpOnTrayExitAction)
+		throw runtime_error("SetOnExit=\"" + *setOnExit + "\" not found.");
+}
+
+void UserConfig::ParseFile(std::string fileName)
+{
+	Reset();
+
+	ifstream stream(fileName, ios::binary);
+	if (!stream)
+		throw runtime_error("cannot open file " + fileName);
 
-	xml_node<>* pMenuItems = pRoot->first_node();
+	ConfigReader reader(stream);
 
-	pContext = "<AvSelectorConfig>";
-	ExpectNode(pContext, pMenuItems, "MenuItems");
-	ExpectNoSiblings(pContext, pMenuItems);
-	ExpectNoAttributes(pContext, pMenuItems);
-	ExpectNoValue(pContext, pMenuItems);
-	
-	for (xml_node<>* pMenuItemNode = pMenuItems->first_node();
-		pMenuItemNode;
-		pMenuItemNode = pMenuItemNode->next_sibling())
+	ExpectNode("", reader, reader.Next() == ConfigReader::Token_Start, "AvSelectorConfig");
+
+	optional<string> doubleClickAction;
+	optional<string> setOnExit;
+	ParseRootAttributes(reader, &doubleClickAction, &setOnExit);
+
+	const char* pContext = "<AvSelectorConfig>";
+	ExpectNode(pContext, reader, NextChild("", reader), "MenuItems");
+	ExpectNoAttributes(pContext, reader);
+
+	while (NextChild("<AvSelectorConfig><MenuItems>", reader))
 	{
-		mMenuItems.push_back(MenuItem());
-		mMenuItems.back().Parse(pMenuItemNode);
+		ExpectNode("<AvSelectorConfig><MenuItems>", reader, true, "MenuItem");
+		ParseMenuItem(reader, (UINT32)mMenuItems.size());
+	}
+
+	ExpectNoSiblings(pContext, reader, "MenuItems");
+
+	// Anything after the root is left unread, as the DOM parser left it unlooked at. The
+	// hash covers the whole file, and its terminator as it always has, so that plan
+	// caches keyed on it carry over.
+	mContentHash = Fnv1a64(reader.FinishContentHash(), "", 1);
 
-		if (pDoubleClickAction && mMenuItems.back().GetName() == pDoubleClickAction)
+	FinishLoading(doubleClickAction, setOnExit);
+}
+
+// Steps over the comment, CDATA section or processing instruction at p, which points at
+// '<'. Returns p if it's none of these, or NULL for anything the scan won't follow.
+static const char* SkipMarkup(const char* p)
+{
+	const char* pClose;
+
+	if (!strncmp(p, "<!--", 4))
+		pClose = "-->";
+	else if (!strncmp(p, "<![CDATA[", 9))
+		pClose = "]]>";
+	else if (!strncmp(p, "<?", 2))
+		pClose = "?>";
+	else if (p[1] == '!')
+		return NULL; // e.g. a DOCTYPE, which could declare entities
+	else
+		return p;
+
+	const char* pEnd = strstr(p + 2, pClose);
+	return pEnd ? pEnd + strlen(pClose) : NULL;
+}
+
+// The '>' ending the tag at p, past any quoted attribute values, or NULL.
+static const char* FindTagEnd(const char* p)
+{
+	char quote = 0;
+
+	for (; *p; ++p)
+	{
+		if (quote)
 		{
-			mpDoubleClickAction = &mMenuItems.back();
-			pDoubleClickAction = NULL;
+			if (*p == quote)
+				quote = 0;
 		}
+		else if (*p == '"' || *p == '\'')
+			quote = *p;
+		else if (*p == '>')
+			return p;
+	}
 
-		if (pSetOnExit && mMenuItems.back().GetName() == pSetOnExit)
+	return NULL;
+}
+
+static bool IsTagNamed(const char* pName, const char* pExpected)
+{
+	size_t length = strlen(pExpected);
+	return !strncmp(pName, pExpected, length) &&
+		(pName[length] == '>' || pName[length] == '/' || isspace((unsigned char)pName[length]));
+}
+
+// The Name attribute of the tag running from pTag to pTagEnd. False if it has none, or
+// if it uses entities, which only a real parse will expand.
+static bool ReadNameAttribute(const char* pTag, const char* pTagEnd, string* pName)
+{
+	const char* p = pTag + 1;
+	while (p < pTagEnd && !isspace((unsigned char)*p) && *p != '/')
+		++p;
+
+	while (p < pTagEnd)
+	{
+		while (p < pTagEnd && (isspace((unsigned char)*p) || *p == '/'))
+			++p;
+
+		const char* pAttName = p;
+		while (p < pTagEnd && *p != '=' && !isspace((unsigned char)*p))
+			++p;
+		string attName(pAttName, p);
+
+		while (p < pTagEnd && isspace((unsigned char)*p))
+			++p;
+		if (p >= pTagEnd || *p != '=')
+			return false;
+		++p;
+		while (p < pTagEnd && isspace((unsigned char)*p))
+			++p;
+		if (p >= pTagEnd || (*p != '"' && *p != '\''))
+			return false;
+
+		const char* pValue = p + 1;
+		const char* pValueEnd = (const char*)memchr(pValue, *p, pTagEnd - pValue);
+		if (!pValueEnd)
+			return false;
+		p = pValueEnd + 1;
+
+		if (attName == "Name")
 		{
-			mpOnTrayExitAction = &mMenuItems.back();
-			pSetOnExit = NULL;
+			pName->assign(pValue, pValueEnd);
+			return pName->find('&') == string::npos;
 		}
 	}
 
-	if (pDoubleClickAction)
-		throw runtime_error("DoubleClickTray=\"" + string(pDoubleClickAction) + "\" not found.");
+	return false;
+}
+
+/* Finds the end of the root element's start tag, and the extent and name of every
+   MenuItem, looking at no more than tag boundaries. Returns false for anything it
+   isn't sure of, leaving that to the full parse and its errors.
+*/
+bool UserConfig::ScanMenuItems(const char* pText, size_t* pRootEnd, vector<MenuItemSpan>* pSpans)
+{
+	bool inRoot = false;
+	bool inMenuItem = false;
+	const char* p = pText;
+
+	while ((p = strchr(p, '<')) != NULL)
+	{
+		const char* pNext = SkipMarkup(p);
+		if (!pNext)
+			return false;
+		if (pNext != p)
+		{
+			p = pNext;
+			continue;
+		}
+
+		const char* pTagEnd = FindTagEnd(p);
+		if (!pTagEnd)
+			return false;
+
+		bool closing = p[1] == '/';
+		bool selfClosing = pTagEnd[-1] == '/';
+
+		if (!inRoot)
+		{
+			if (closing || selfClosing || !IsTagNamed(p + 1, "AvSelectorConfig"))
+				return false;
+
+			inRoot = true;
+			*pRootEnd = pTagEnd - pText;
+		}
+		else if (closing && IsTagNamed(p + 2, "MenuItem"))
+		{
+			if (!inMenuItem)
+				return false;
+
+			inMenuItem = false;
+			pSpans->back().mEnd = pTagEnd + 1 - pText;
+		}
+		else if (!closing && IsTagNamed(p + 1, "MenuItem"))
+		{
+			if (inMenuItem || selfClosing)
+				return false;
+
+			MenuItemSpan span;
+			if (!ReadNameAttribute(p, pTagEnd, &span.mName))
+				return false;
 
-	if (pSetOnExit)
-		throw runtime_error("SetOnExit=\"" + string(pSetOnExit) + "\" not found.");
+			span.mBegin = p - pText;
+			span.mEnd = 0;
+			pSpans->push_back(span);
+			inMenuItem = true;
+		}
+
+		p = pTagEnd + 1;
+	}
+
+	return inRoot && !inMenuItem;
 }
 
-void UserConfig::MenuItem::Parse(rapidxml::xml_node<>* pMenuItemNode)
+void UserConfig::ParseFileFor(std::string fileName, const std::string& menuItemName)
 {
-	const char* pContext = "<AvSelectorConfig><MenuItems>";
-	ExpectNode(pContext, pMenuItemNode, "MenuItem");
-	ExpectNoValue(pContext, pMenuItemNode);
+	Reset();
+
+	ifstream stream(fileName, ios::binary);
+	if (!stream)
+		throw runtime_error("cannot open file " + fileName);
 
-	pContext = "<AvSelectorConfig><MenuItems><MenuItem>";
-	xml_attribute<>* pName = pMenuItemNode->first_attribute("Name");
-	mName = pName->value();
+	vector<char> text((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+	text.push_back(0);
+	mContentHash = Fnv1a64(FNV1A64_OFFSET_BASIS, &text[0], text.size());
 
-	xml_node<>* pHotkeyNode = pMenuItemNode->first_node();
-	xml_node<>* pTargetStatesNode;
+	size_t rootEnd = 0;
+	vector<MenuItemSpan> spans;
 
-	ZeroMemory(&mHotkey, sizeof (mHotkey));
-	if (!strcmp(pHotkeyNode->name(), "Hotkey"))
+	if (!ScanMenuItems(&text[0], &rootEnd, &spans))
 	{
-		mHotkey.Parse(pHotkeyNode);
-		pTargetStatesNode = pHotkeyNode->next_sibling();
+		ParseFile(fileName);
+		return;
 	}
-	else
+
+	// The root's start tag on its own, closed so that it reads as a whole element.
+	istringstream rootText(string(&text[0], rootEnd) + "/>");
+	ConfigReader root(rootText);
+	ExpectNode("", root, root.Next() == ConfigReader::Token_Start, "AvSelectorConfig");
+
+	optional<string> doubleClickAction;
+	optional<string> setOnExit;
+	ParseRootAttributes(root, &doubleClickAction, &setOnExit);
+
+	for (size_t i = 0; i < spans.size(); ++i)
 	{
-		pTargetStatesNode = pHotkeyNode; // it was a target states node after all
+		const MenuItemSpan& span = spans[i];
+		if (span.mName != menuItemName && span.mName != doubleClickAction && span.mName != setOnExit)
+			continue;
+
+		istringstream itemText(string(&text[span.mBegin], span.mEnd - span.mBegin));
+		ConfigReader item(itemText);
+		item.Next();
+
+		ParseMenuItem(item, (UINT32)i);
 	}
 
-	ExpectNode(pContext, pTargetStatesNode, "TargetStates");
-	ExpectNoSiblings(pContext, pTargetStatesNode);
-	ExpectNoAttributes(pContext, pTargetStatesNode);
-	ExpectNoValue(pContext, pTargetStatesNode);
+	FinishLoading(doubleClickAction, setOnExit);
+	mPartial = true;
+}
+
+UINT32 UserConfig::Intern(const std::string& text)
+{
+	auto found = mStringIndex.find(text);
+	if (found != mStringIndex.end())
+		return found->second;
+
+	UINT32 index = (UINT32)mStrings.size();
+	mStrings.push_back(text);
+	mWideStrings.push_back(Widen(text));
+	mStringIndex.emplace(text, index);
+	return index;
+}
+
+// Each Parse starts with the reader at the element's start tag, and leaves it at its end tag.
+void UserConfig::ParseMenuItem(ConfigReader& reader, UINT32 index)
+{
+	const char* pContext = "<AvSelectorConfig><MenuItems><MenuItem>";
+	const ConfigReader::Attribute* pName = reader.GetAttribute("Name");
+	ExpectAttribute(pContext, pName, "Name");
+
+	mMenuItems.push_back(MenuItem());
+	MenuItem& menuItem = mMenuItems.back();
+	menuItem.mpConfig = this;
+	menuItem.mName = Intern(pName->mValue);
+	menuItem.mIndex = index;
+	menuItem.mFirstAutoApplyTarget = (UINT32)mAutoApplyTargets.size();
+	menuItem.mAutoApplyTargetCount = 0;
+	menuItem.mAutoApplyEndpointCount = 0;
+
+	bool found = NextChild(pContext, reader);
+
+	ZeroMemory(&menuItem.mHotkey, sizeof (menuItem.mHotkey));
+	if (found && reader.GetName() == "Hotkey")
+	{
+		menuItem.mHotkey.Parse(reader);
+		found = NextChild(pContext, reader);
+	}
 
-	for (xml_node<>* pState = pTargetStatesNode->first_node();
-		pState;
-		pState = pState->next_sibling())
+	if (found && reader.GetName() == "AutoApply")
 	{
-		mTargetStates.push_back(State());
-		mTargetStates.back().Parse(pState);
+		ParseAutoApply(reader, &menuItem);
+		found = NextChild(pContext, reader);
 	}
+
+	ExpectNode(pContext, reader, found, "TargetStates");
+	ExpectNoAttributes(pContext, reader);
+
+	menuItem.mFirstState = (UINT32)mStates.size();
+
+	while (NextChild("<AvSelectorConfig><MenuItems><MenuItem><TargetStates>", reader))
+		ParseState(reader);
+
+	menuItem.mStateCount = (UINT32)mStates.size() - menuItem.mFirstState;
+
+	ExpectNoSiblings(pContext, reader, "TargetStates");
 }
 
-void UserConfig::State::Parse(rapidxml::xml_node<>* pStateNode)
+void UserConfig::ParseAutoApply(ConfigReader& reader, MenuItem* pMenuItem)
+{
+	const char* pContext = "<AvSelectorConfig><MenuItems><MenuItem>";
+	ExpectNoAttributes(pContext, reader);
+
+	pContext = "<AvSelectorConfig><MenuItems><MenuItem><AutoApply>";
+
+	// Endpoints are kept after the displays, so one range holds each.
+	vector<wstring> endpoints;
+
+	while (NextChild(pContext, reader))
+	{
+		ExpectNode(pContext, reader, true, "Connected");
+
+		const vector<ConfigReader::Attribute>& attributes = reader.GetAttributes();
+		if (attributes.size() == 1 && attributes[0].mName == "AudioEndpoint")
+		{
+			endpoints.push_back(mWideStrings[Intern(attributes[0].mValue)]);
+		}
+		else
+		{
+			ExpectOnlyAttribute(pContext, reader, "FriendlyName");
+
+			// Interned like everything else, so an embedded build can refer to it.
+			mAutoApplyTargets.push_back(mWideStrings[Intern(attributes[0].mValue)]);
+			++pMenuItem->mAutoApplyTargetCount;
+		}
+
+		// Takes no value; anything nested is ignored.
+		while (NextChild(pContext, reader))
+			reader.SkipElement();
+	}
+
+	mAutoApplyTargets.insert(mAutoApplyTargets.end(), endpoints.begin(), endpoints.end());
+	pMenuItem->mAutoApplyEndpointCount = (UINT32)endpoints.size();
+
+	if (!pMenuItem->mAutoApplyTargetCount && !pMenuItem->mAutoApplyEndpointCount)
+		throw ParseException(string() + pContext +
+			": Expected at least one <Connected FriendlyName=\"...\"/> or <Connected AudioEndpoint=\"...\"/>.");
+}
+
+void UserConfig::ParseState(ConfigReader& reader)
 {
 	const char* pContext = "<AvSelectorConfig><MenuItems><MenuItem><TargetStates>";
-	ExpectNode(pContext, pStateNode, "State");
-	ExpectNoValue(pContext, pStateNode);
+	ExpectNode(pContext, reader, true, "State");
 
 	pContext = "<AvSelectorConfig><MenuItems><MenuItem><TargetStates><State>";
 
-	for (xml_attribute<>* pAtt = pStateNode->first_attribute();
-		pAtt;
-		pAtt = pAtt->next_attribute())
+	State state;
+	state.mpConfig = this;
+	string type;
+
+	for (const ConfigReader::Attribute& att : reader.GetAttributes())
 	{
-		if (!strcmp(pAtt->name(), "Type"))
-			mType = pAtt->value();
-		else if (!strcmp(pAtt->name(), "Optional"))
-			mOptional = _stricmp(pAtt->value(), "false");
-		else if (!strcmp(pAtt->name(), "ContinueOnError"))
-			mContinueOnError = _stricmp(pAtt->value(), "false");
+		if (att.mName == "Type")
+			type = att.mValue;
+		else if (att.mName == "Optional")
+			state.mOptional = _stricmp(att.mValue.c_str(), "false");
+		else if (att.mName == "ContinueOnError")
+			state.mContinueOnError = _stricmp(att.mValue.c_str(), "false");
 		else
 			throw ParseException(string() +
-				pContext + ": unExpected attribute '" + pAtt->next_attribute()->name() +
+				pContext + ": unExpected attribute '" + att.mName +
 				"', Expected: 'Type','Optional','ContinueOnError'.");
 	}
 
-	if (mType.empty())
+	if (type.empty())
 	{
 		UserConfig::ExpectAttribute(pContext, nullptr, "Type");
 	}
 
-	for (xml_node<>* pStateField = pStateNode->first_node();
-		pStateField;
-		pStateField = pStateField->next_sibling())
+	state.mType = Intern(type);
+
+	// Gathered first, since a field may be given more than once and its values are
+	// merged, but each field's values must end up side by side.
+	map<string, map<string, string>> fields;
+
+	while (NextChild(pContext, reader))
+	{
+		map<string, string>& values = fields[reader.GetName()];
+
+		for (const ConfigReader::Attribute& value : reader.GetAttributes())
+			values[value.mName] = value.mValue;
+
+		// A field is all attributes; whatever it holds is ignored.
+		reader.SkipElement();
+	}
+
+	state.mFirstField = (UINT32)mFields.size();
+	state.mFieldCount = (UINT32)fields.size();
+
+	for (const auto& gathered : fields)
+	{
+		Field field;
+		field.mpConfig = this;
+		field.mName = Intern(gathered.first);
+		field.mFirstValue = (UINT32)mValues.size();
+		field.mValueCount = (UINT32)gathered.second.size();
+		mFields.push_back(field);
+
+		for (const auto& value : gathered.second)
+			mValues.push_back(Value{ Intern(value.first), Intern(value.second) });
+	}
+
+	mStates.push_back(state);
+}
+
+void UserConfig::FinishLoading(const std::optional<std::string>& doubleClickAction, const std::optional<std::string>& setOnExit)
+{
+	BuildNameIndex();
+
+	unordered_map<string, UINT32>().swap(mStringIndex);
+
+	ResolveActions(doubleClickAction, setOnExit);
+}
+
+void UserConfig::BuildNameIndex()
+{
+	size_t size = 16;
+	while (size < mMenuItems.size() * 2)
+		size *= 2;
+
+	mNameIndex.assign(size, 0);
+
+	for (UINT32 index = 0; index < (UINT32)mMenuItems.size(); ++index)
+	{
+		const string& name = mMenuItems[index].GetName();
+		size_t slot = (size_t)Fnv1a64(FNV1A64_OFFSET_BASIS, name.data(), name.size()) & (size - 1);
+
+		// A later item of the same name takes the slot, as GetMenuItem finds the last.
+		while (mNameIndex[slot] && mMenuItems[mNameIndex[slot] - 1].GetName() != name)
+			slot = (slot + 1) & (size - 1);
+
+		mNameIndex[slot] = index + 1;
+	}
+}
+
+void UserConfig::LoadEmbedded(const EmbeddedConfig& config)
+{
+	Reset();
+
+	mStrings.reserve(config.mStringCount);
+	mWideStrings.reserve(config.mStringCount);
+	for (UINT32 i = 0; i < config.mStringCount; ++i)
+	{
+		mStrings.push_back(string(config.mpStrings[i]));
+		mWideStrings.push_back(Widen(mStrings.back()));
+	}
+
+	mMenuItems.reserve(config.mMenuItemCount);
+	for (const EmbeddedMenuItem& embedded : Range<EmbeddedMenuItem>(config.mpMenuItems, config.mMenuItemCount))
 	{
-		Field& field = mFields[pStateField->name()];
+		MenuItem menuItem;
+		menuItem.mpConfig = this;
+		menuItem.mName = embedded.mName;
+		menuItem.mIndex = (UINT32)mMenuItems.size();
+		menuItem.mHotkey.mModifierFlags = embedded.mModifierFlags;
+		menuItem.mHotkey.mVk = embedded.mVk;
+		menuItem.mFirstState = embedded.mFirstState;
+		menuItem.mStateCount = embedded.mStateCount;
+		menuItem.mFirstAutoApplyTarget = embedded.mFirstAutoApplyTarget;
+		menuItem.mAutoApplyTargetCount = embedded.mAutoApplyTargetCount;
+		menuItem.mAutoApplyEndpointCount = embedded.mAutoApplyEndpointCount;
+		mMenuItems.push_back(menuItem);
+	}
+
+	mStates.reserve(config.mStateCount);
+	for (const EmbeddedState& embedded : Range<EmbeddedState>(config.mpStates, config.mStateCount))
+	{
+		State state;
+		state.mpConfig = this;
+		state.mType = embedded.mType;
+		state.mOptional = embedded.mOptional;
+		state.mContinueOnError = embedded.mContinueOnError;
+		state.mFirstField = embedded.mFirstField;
+		state.mFieldCount = embedded.mFieldCount;
+		mStates.push_back(state);
+	}
 
-		for (xml_attribute<>* pValue = pStateField->first_attribute();
-			pValue;
-			pValue = pValue->next_attribute())
+	mFields.reserve(config.mFieldCount);
+	for (const EmbeddedField& embedded : Range<EmbeddedField>(config.mpFields, config.mFieldCount))
+	{
+		Field field;
+		field.mpConfig = this;
+		field.mName = embedded.mName;
+		field.mFirstValue = embedded.mFirstValue;
+		field.mValueCount = embedded.mValueCount;
+		mFields.push_back(field);
+	}
+
+	mValues.reserve(config.mValueCount);
+	for (const EmbeddedValue& embedded : Range<EmbeddedValue>(config.mpValues, config.mValueCount))
+		mValues.push_back(Value{ embedded.mName, embedded.mValue });
+
+	mAutoApplyTargets.reserve(config.mAutoApplyTargetCount);
+	for (UINT32 target : Range<UINT32>(config.mpAutoApplyTargets, config.mAutoApplyTargetCount))
+		mAutoApplyTargets.push_back(mWideStrings[target]);
+
+	mRestoreOnExit = config.mRestoreOnExit;
+	mConfirmDisplayChangeSeconds = config.mConfirmDisplayChangeSeconds;
+	mDisplayQueryTimeoutMs = config.mDisplayQueryTimeoutMs;
+	mDisplayApplyTimeoutMs = config.mDisplayApplyTimeoutMs;
+	mAudioTimeoutMs = config.mAudioTimeoutMs;
+	mHotplugSettleMs = config.mHotplugSettleMs;
+	mPinProfile = config.mPinProfile;
+	mPinCheckSeconds = config.mPinCheckSeconds;
+	mContentHash = config.mContentHash;
+
+	BuildNameIndex();
+
+	if (config.mDoubleClickAction != NO_MENU_ITEM)
+		mpDoubleClickAction = &mMenuItems[config.mDoubleClickAction];
+	if (config.mOnTrayExitAction != NO_MENU_ITEM)
+		mpOnTrayExitAction = &mMenuItems[config.mOnTrayExitAction];
+}
+
+// Byte by byte, so that whatever the file held comes back exactly.
+static void WriteStringLiteral(ostream& stream, const string& text)
+{
+	stream << "std::string_view(\"";
+
+	for (unsigned char c : text)
+	{
+		if (c == '"' || c == '\\' || c == '?')
+			stream << '\\' << c;
+		else if (c >= 0x20 && c < 0x7F)
+			stream << c;
+		else
 		{
-			field.mValues[pValue->name()] = pValue->value();
+			// Always three octal digits, so a digit after it can't be taken as part of it.
+			stream << '\\' << (char)('0' + (c >> 6)) << (char)('0' + ((c >> 3) & 7)) << (char)('0' + (c & 7));
 		}
+	}
+
+	stream << "\", " << text.size() << ")";
+}
+
+// C++ has no empty arrays, so an empty table gets one unused entry.
+static void WriteTableEnd(ostream& stream, size_t count, const char* pFiller)
+{
+	if (!count)
+		stream << "\t" << pFiller << "\n";
+
+	stream << "};\n\n";
+}
+
+void UserConfig::WriteEmbedded(std::ostream& stream) const
+{
+	stream << "// Generated from config.xml by EmbedConfig. Do not edit.\n\n";
 
-		field.mName = pStateField->name();
+	stream << "static constexpr std::string_view sStrings[] = {\n";
+	for (const string& text : mStrings)
+	{
+		stream << "\t";
+		WriteStringLiteral(stream, text);
+		stream << ",\n";
+	}
+	WriteTableEnd(stream, mStrings.size(), "std::string_view()");
+
+	stream << "static constexpr UserConfig::EmbeddedMenuItem sMenuItems[] = {\n";
+	for (const MenuItem& menuItem : mMenuItems)
+	{
+		stream << "\t{ " << menuItem.mName << ", " << menuItem.mHotkey.mModifierFlags << ", " << menuItem.mHotkey.mVk << ", " <<
+			menuItem.mFirstState << ", " << menuItem.mStateCount << ", " <<
+			menuItem.mFirstAutoApplyTarget << ", " << menuItem.mAutoApplyTargetCount << ", " <<
+			menuItem.mAutoApplyEndpointCount << " },\n";
+	}
+	WriteTableEnd(stream, mMenuItems.size(), "{}");
+
+	stream << "static constexpr UserConfig::EmbeddedState sStates[] = {\n";
+	for (const State& state : mStates)
+	{
+		stream << "\t{ " << state.mType << ", " << (state.mOptional ? "true" : "false") << ", " <<
+			(state.mContinueOnError ? "true" : "false") << ", " << state.mFirstField << ", " << state.mFieldCount << " },\n";
+	}
+	WriteTableEnd(stream, mStates.size(), "{}");
+
+	stream << "static constexpr UserConfig::EmbeddedField sFields[] = {\n";
+	for (const Field& field : mFields)
+		stream << "\t{ " << field.mName << ", " << field.mFirstValue << ", " << field.mValueCount << " },\n";
+	WriteTableEnd(stream, mFields.size(), "{}");
+
+	stream << "static constexpr UserConfig::EmbeddedValue sValues[] = {\n";
+	for (const Value& value : mValues)
+		stream << "\t{ " << value.mName << ", " << value.mValue << " },\n";
+	WriteTableEnd(stream, mValues.size(), "{}");
+
+	// AutoApply patterns are kept widened, so they're found again among the interned strings.
+	stream << "static constexpr UINT32 sAutoApplyTargets[] = {\n";
+	for (const wstring& target : mAutoApplyTargets)
+	{
+		size_t index = find(mWideStrings.begin(), mWideStrings.end(), target) - mWideStrings.begin();
+		if (index == mWideStrings.size())
+			throw runtime_error("AutoApply target missing from the string table.");
+
+		stream << "\t" << index << ",\n";
 	}
+	WriteTableEnd(stream, mAutoApplyTargets.size(), "0");
+
+	UINT32 doubleClickAction = mpDoubleClickAction ? (UINT32)(mpDoubleClickAction - mMenuItems.data()) : NO_MENU_ITEM;
+	UINT32 onTrayExitAction = mpOnTrayExitAction ? (UINT32)(mpOnTrayExitAction - mMenuItems.data()) : NO_MENU_ITEM;
+
+	stream << "static constexpr UserConfig::EmbeddedConfig sEmbeddedConfig = {\n" <<
+		"\tsStrings, " << mStrings.size() << ",\n" <<
+		"\tsMenuItems, " << mMenuItems.size() << ",\n" <<
+		"\tsStates, " << mStates.size() << ",\n" <<
+		"\tsFields, " << mFields.size() << ",\n" <<
+		"\tsValues, " << mValues.size() << ",\n" <<
+		"\tsAutoApplyTargets, " << mAutoApplyTargets.size() << ",\n" <<
+		"\t" << doubleClickAction << "u, // DoubleClickTray\n" <<
+		"\t" << onTrayExitAction << "u, // SetOnExit\n" <<
+		"\t" << (mRestoreOnExit ? "true" : "false") << ", // RestoreOnExit\n" <<
+		"\t" << mConfirmDisplayChangeSeconds << ", // ConfirmDisplayChangeSeconds\n" <<
+		"\t" << mDisplayQueryTimeoutMs << ", // DisplayQueryTimeoutMs\n" <<
+		"\t" << mDisplayApplyTimeoutMs << ", // DisplayApplyTimeoutMs\n" <<
+		"\t" << mAudioTimeoutMs << ", // AudioTimeoutMs\n" <<
+		"\t" << mHotplugSettleMs << ", // HotplugSettleMs\n" <<
+		"\t" << (mPinProfile ? "true" : "false") << ", // PinProfile\n" <<
+		"\t" << mPinCheckSeconds << ", // PinCheckSeconds\n" <<
+		"\t0x" << hex << mContentHash << dec << "ULL, // content hash\n" <<
+		"};\n";
 }
 
-void UserConfig::Hotkey::Parse(rapidxml::xml_node<>* pHotkeyNode)
+void UserConfig::Hotkey::Parse(ConfigReader& reader)
 {
 	mModifierFlags = MOD_NOREPEAT;
 	bool VkFound = false;
 	const char* pContext = "<AvSelectorConfig><MenuItems><MenuItem><Hotkey>";
 
-	for (xml_attribute<>* pAtt = pHotkeyNode->first_attribute();
-		pAtt;
-		pAtt = pAtt->next_attribute())
+	for (const ConfigReader::Attribute& att : reader.GetAttributes())
 	{
-		if (!strcmp(pAtt->name(), "VkHex"))
+		if (att.mName == "VkHex")
 		{
 			if (VkFound)
 				throw ParseException(string() + pContext + 
 					"Hotkey respecifies the key. Use VkHex or Char, not both.");
 
 			VkFound = true;
-			mVk = strtoul(pAtt->value(), NULL, 16);
+			mVk = strtoul(att.mValue.c_str(), NULL, 16);
 		} 
-		else if (!strcmp(pAtt->name(), "Char"))
+		else if (att.mName == "Char")
 		{
 			if (VkFound)
 				throw ParseException(string() + pContext + 
 					"Hotkey respecifies the key. Use VkHex or Char, not both.");
 
 			VkFound = true;
-			mVk = toupper(pAtt->value()[0]);
+			mVk = toupper(att.mValue.c_str()[0]);
 		}
-		else if (!strcmp(pAtt->name(), "ModAlt"))
+		else if (att.mName == "ModAlt")
 		{
-			if (ParseBooleanAttribute(pContext, pAtt))
+			if (ParseBooleanAttribute(pContext, att))
 				mModifierFlags |= MOD_ALT;
 		}
-		else if (!strcmp(pAtt->name(), "ModShift"))
+		else if (att.mName == "ModShift")
 		{
-			if (ParseBooleanAttribute(pContext, pAtt))
+			if (ParseBooleanAttribute(pContext, att))
 				mModifierFlags |= MOD_SHIFT;
 		}
-		else if (!strcmp(pAtt->name(), "ModCtrl"))
+		else if (att.mName == "ModCtrl")
 		{
-			if (ParseBooleanAttribute(pContext, pAtt))
+			if (ParseBooleanAttribute(pContext, att))
 				mModifierFlags |= MOD_CONTROL;
 		}
 		else
 		{
-			throw ParseException(string() + pContext + "Attribute '" + pAtt->name() + "' unrecognized.");
+			throw ParseException(string() + pContext + "Attribute '" + att.mName + "' unrecognized.");
 		}
 	}
 
@@ -295,13 +886,27 @@ void UserConfig::Hotkey::Parse(rapidxml::xml_node<>* pHotkeyNode)
 	if (!VkFound)
 		throw ParseException(string() + pContext +
 			"Hotkey requires either VkHex or Char attribute, otherwise no key is specified.");
+
+	// Whatever the element holds is ignored.
+	reader.SkipElement();
+}
+
+const UserConfig::Value* UserConfig::Field::FindValue(std::string_view name) const
+{
+	for (const Value& value : Range<Value>(mpConfig->mValues.data() + mFirstValue, mValueCount))
+	{
+		if (mpConfig->mStrings[value.mName] == name)
+			return &value;
+	}
+
+	return NULL;
 }
 
 vector<string> UserConfig::Field::GetValueList() const
 {
 	vector<string> v;
-	for (auto it : mValues) {
-		v.push_back(it.first);
+	for (const Value& value : Range<Value>(mpConfig->mValues.data() + mFirstValue, mValueCount)) {
+		v.push_back(mpConfig->mStrings[value.mName]);
 	}
 	return v;
 }
@@ -309,21 +914,26 @@ vector<string> UserConfig::Field::GetValueList() const
 string UserConfig::Field::ToString() const
 {
 	string s = "<" + GetName();
-	vector<string> v;
-	for (auto value : mValues) {
-		s += string(" ") + value.first + "=" + "\"" + value.second + "\"";
+	for (const Value& value : Range<Value>(mpConfig->mValues.data() + mFirstValue, mValueCount)) {
+		s += string(" ") + mpConfig->mStrings[value.mName] + "=" + "\"" + mpConfig->mStrings[value.mValue] + "\"";
 	}
 	return s + "/>";
 }
 
-const UserConfig::MenuItem* UserConfig::GetMenuItem(std::string name) const
+const UserConfig::MenuItem* UserConfig::GetMenuItem(std::string_view name) const
 {
-	const UserConfig::MenuItem* pMenuItem = NULL;
-	for (auto& item : GetMenuItems())
+	if (mNameIndex.empty())
+		return NULL;
+
+	size_t mask = mNameIndex.size() - 1;
+	size_t slot = (size_t)Fnv1a64(FNV1A64_OFFSET_BASIS, name.data(), name.size()) & mask;
+
+	for (; mNameIndex[slot]; slot = (slot + 1) & mask)
 	{
-		if (name == item.GetName())
-			pMenuItem = &item;
+		const MenuItem& menuItem = mMenuItems[mNameIndex[slot] - 1];
+		if (menuItem.GetName() == name)
+			return &menuItem;
 	}
 
-	return pMenuItem;
-}
\ No newline at end of file
+	return NULL;
+}
@@ -23,8 +23,11 @@
 #pragma once
 
 #include <vector>
-#include <map>
-#include "rapidxml\rapidxml.hpp"
+#include <iosfwd>
+#include <unordered_map>
+#include <optional>
+#include <string_view>
+#include "ConfigReader.h"
 
 #define EXT_DEFINE_EXCEPTION_BEGIN(Name, BaseException) \
 	class Name : public BaseException {                 \
@@ -42,6 +45,11 @@
 	EXT_DEFINE_EXCEPTION_BEGIN(Name, BaseException) \
 	EXT_DEFINE_EXCEPTION_END
 
+/* The loaded config.xml. Everything under the MenuItems is held in flat arrays: each
+   MenuItem names a run of mStates, each State a run of mFields, and each Field a run of
+   mValues. Names and values are indices into mStrings, which holds each distinct
+   string once. Items, states and fields point back at the config, so it can't be copied.
+*/
 class UserConfig
 {
 public:
@@ -50,49 +58,91 @@ public:
 
 	EXT_DEFINE_EXCEPTION(ParseException, std::runtime_error);
 
+	// A run of one of the flat arrays, for range-for.
+	template <typename T>
+	class Range
+	{
+	public:
+		Range(const T* pBegin, size_t count) : mpBegin(pBegin), mCount(count) {}
+		const T* begin() const { return mpBegin; }
+		const T* end() const { return mpBegin + mCount; }
+		size_t size() const { return mCount; }
+		bool empty() const { return mCount == 0; }
+		const T& operator[](size_t index) const { return mpBegin[index]; }
+	private:
+		const T* mpBegin;
+		size_t mCount;
+	};
+
 	struct Hotkey
 	{
 	public:
 		unsigned int mModifierFlags;
 		unsigned int mVk;
-		void Parse(rapidxml::xml_node<>* pHotkeyNode);
+		void Parse(ConfigReader& reader);
+	};
+
+private:
+	struct Value
+	{
+		UINT32 mName;
+		UINT32 mValue;
 	};
 
+public:
 	class Field
 	{
-		friend class UserConfig::State;
+		friend class UserConfig;
 	private:
-		std::string mName;
-		std::map<std::string, std::string> mValues;
-		void Parse(rapidxml::xml_node<>* pStateNode);
+		const UserConfig* mpConfig;
+		UINT32 mName;
+		// Sorted by name.
+		UINT32 mFirstValue;
+		UINT32 mValueCount;
+		const Value* FindValue(std::string_view name) const;
 	public:
-		const std::string GetName() const { return mName; }
+		const std::string& GetName() const { return mpConfig->mStrings[mName]; }
 		std::vector<std::string> GetValueList() const;
-		const std::string GetValue(std::string name) const
+		size_t GetValueCount() const { return mValueCount; }
+		bool HasValue(std::string_view name) const { return FindValue(name) != NULL; }
+		const std::string& GetValue(std::string_view name) const
 		{
-			auto it = mValues.find(name);
-			return (it == mValues.end()) ? "" : it->second;
+			static const std::string empty;
+			const Value* pValue = FindValue(name);
+			return pValue ? mpConfig->mStrings[pValue->mValue] : empty;
+		}
+		// The same value widened once at parse time, for matching against device names.
+		const std::wstring& GetWideValue(std::string_view name) const
+		{
+			static const std::wstring empty;
+			const Value* pValue = FindValue(name);
+			return pValue ? mpConfig->mWideStrings[pValue->mValue] : empty;
 		}
 		std::string ToString() const;
 	};
 
 	class State
 	{
-		friend class UserConfig::MenuItem;
+		friend class UserConfig;
 	private:
+		const UserConfig* mpConfig;
 		bool mOptional = false;
 		bool mContinueOnError = false;
-		std::string mType;
-		std::map<std::string, Field> mFields;
-		void Parse(rapidxml::xml_node<>* pStateNode);
+		UINT32 mType;
+		UINT32 mFirstField;
+		UINT32 mFieldCount;
 	public:
 		bool IsOptional() const { return mOptional; }
 		bool ContinueOnError() const { return mContinueOnError; }
-		const std::string GetType() const { return mType; }
-		const Field* GetField(std::string name) const
+		const std::string& GetType() const { return mpConfig->mStrings[mType]; }
+		const Field* GetField(std::string_view name) const
 		{ 
-			auto it = mFields.find(name);
-			return (it == mFields.end()) ? NULL : &it->second;
+			for (const Field& field : Range<Field>(mpConfig->mFields.data() + mFirstField, mFieldCount))
+			{
+				if (field.GetName() == name)
+					return &field;
+			}
+			return NULL;
 		}
 	};
 
@@ -100,34 +150,207 @@ public:
 	{
 		friend class UserConfig;
 	private:
-		std::string mName;
-		std::vector<State> mTargetStates;
+		const UserConfig* mpConfig;
+		UINT32 mName;
+		UINT32 mIndex;
 		Hotkey mHotkey;
-		void Parse(rapidxml::xml_node<>* pMenuItemNode);
+		UINT32 mFirstState;
+		UINT32 mStateCount;
+		UINT32 mFirstAutoApplyTarget;
+		UINT32 mAutoApplyTargetCount;
+		UINT32 mAutoApplyEndpointCount;
 	public:
 		const Hotkey& GetHotkey() const { return mHotkey; }
-		const std::string GetName() const { return mName; }
-		const std::vector<State>& GetTargetStates() const { return mTargetStates; }
+		// FriendlyName patterns that must all be connected for this item to be picked
+		// automatically when displays are plugged in or removed. Empty if it never is.
+		Range<std::wstring> GetAutoApplyTargets() const
+		{
+			return Range<std::wstring>(mpConfig->mAutoApplyTargets.data() + mFirstAutoApplyTarget, mAutoApplyTargetCount);
+		}
+		// Audio endpoint name patterns that must all be active as well. They follow the
+		// item's display patterns in mAutoApplyTargets.
+		Range<std::wstring> GetAutoApplyEndpoints() const
+		{
+			return Range<std::wstring>(mpConfig->mAutoApplyTargets.data() + mFirstAutoApplyTarget + mAutoApplyTargetCount,
+				mAutoApplyEndpointCount);
+		}
+		const std::string& GetName() const { return mpConfig->mStrings[mName]; }
+		// Where the item is among all the MenuItems of config.xml, including any a partial
+		// parse skipped.
+		UINT32 GetIndex() const { return mIndex; }
+		// The name widened once at parse time, for logging a pick without converting it.
+		const std::wstring& GetWideName() const { return mpConfig->mWideStrings[mName]; }
+		Range<State> GetTargetStates() const { return Range<State>(mpConfig->mStates.data() + mFirstState, mStateCount); }
+	};
+
+	/* The same arrays as plain tables, which EmbedConfig writes out as constexpr C++ for
+	   a build with config.xml compiled in. Strings are indices into mpStrings, and an
+	   action that isn't set is NO_MENU_ITEM.
+	*/
+	struct EmbeddedMenuItem
+	{
+		UINT32 mName;
+		UINT32 mModifierFlags;
+		UINT32 mVk;
+		UINT32 mFirstState;
+		UINT32 mStateCount;
+		UINT32 mFirstAutoApplyTarget;
+		UINT32 mAutoApplyTargetCount;
+		UINT32 mAutoApplyEndpointCount;
 	};
+
+	struct EmbeddedState
+	{
+		UINT32 mType;
+		bool mOptional;
+		bool mContinueOnError;
+		UINT32 mFirstField;
+		UINT32 mFieldCount;
+	};
+
+	struct EmbeddedField
+	{
+		UINT32 mName;
+		UINT32 mFirstValue;
+		UINT32 mValueCount;
+	};
+
+	struct EmbeddedValue
+	{
+		UINT32 mName;
+		UINT32 mValue;
+	};
+
+	static const UINT32 NO_MENU_ITEM = 0xFFFFFFFF;
+
+	struct EmbeddedConfig
+	{
+		const std::string_view* mpStrings;
+		UINT32 mStringCount;
+		const EmbeddedMenuItem* mpMenuItems;
+		UINT32 mMenuItemCount;
+		const EmbeddedState* mpStates;
+		UINT32 mStateCount;
+		const EmbeddedField* mpFields;
+		UINT32 mFieldCount;
+		const EmbeddedValue* mpValues;
+		UINT32 mValueCount;
+		const UINT32* mpAutoApplyTargets;
+		UINT32 mAutoApplyTargetCount;
+		UINT32 mDoubleClickAction;
+		UINT32 mOnTrayExitAction;
+		bool mRestoreOnExit;
+		UINT32 mConfirmDisplayChangeSeconds;
+		UINT32 mDisplayQueryTimeoutMs;
+		UINT32 mDisplayApplyTimeoutMs;
+		UINT32 mAudioTimeoutMs;
+		UINT32 mHotplugSettleMs;
+		bool mPinProfile;
+		UINT32 mPinCheckSeconds;
+		UINT64 mContentHash;
+	};
+
+	UserConfig();
+	UserConfig(const UserConfig&) = delete;
+	UserConfig& operator=(const UserConfig&) = delete;
+
 private:
 	std::vector<MenuItem> mMenuItems;
+	std::vector<State> mStates;
+	std::vector<Field> mFields;
+	std::vector<Value> mValues;
+	std::vector<std::wstring> mAutoApplyTargets;
+	std::vector<std::string> mStrings;
+	// mStrings, widened.
+	std::vector<std::wstring> mWideStrings;
+	// Where each string is in mStrings; only kept while loading.
+	std::unordered_map<std::string, UINT32> mStringIndex;
+	// Open addressing on the hash of the name: 1 + the index of the last MenuItem with
+	// that name, or 0 for an empty slot. The size is a power of two.
+	std::vector<UINT32> mNameIndex;
+
 	MenuItem* mpDoubleClickAction;
 	MenuItem* mpOnTrayExitAction;
 	bool mRestoreOnExit;
+	UINT32 mConfirmDisplayChangeSeconds;
+	UINT32 mDisplayQueryTimeoutMs;
+	UINT32 mDisplayApplyTimeoutMs;
+	UINT32 mAudioTimeoutMs;
+	UINT32 mHotplugSettleMs;
+	bool mPinProfile;
+	UINT32 mPinCheckSeconds;
+	UINT64 mContentHash;
+	bool mPartial;
 
-	static bool ParseBooleanAttribute(const char* pHelpContext, rapidxml::xml_attribute<>* pAttribute);
-	static void ExpectAttribute(const char* pHelpContext, rapidxml::xml_attribute<>* pAttribute, const char* pExpectedName);
-	static void ExpectNoSiblings(const char* pHelpContext, rapidxml::xml_attribute<>* pAttribute);
-	static void ExpectNode(const char* pHelpContext, rapidxml::xml_node<>* pNode, const char* pExpectedName);
-	static void ExpectNoSiblings(const char* pHelpContext, rapidxml::xml_node<>* pNode);
-	static void ExpectNoAttributes(const char* pHelpContext, rapidxml::xml_node<>* pNode);
-	static void ExpectNoValue(const char* pHelpContext, rapidxml::xml_node<>* pNode);
+	// Where a MenuItem element lies in config.xml, found without parsing it.
+	struct MenuItemSpan
+	{
+		std::string mName;
+		size_t mBegin;
+		size_t mEnd;
+	};
+
+	static bool ScanMenuItems(const char* pText, size_t* pRootEnd, std::vector<MenuItemSpan>* pSpans);
+	void Reset();
+	void ParseRootAttributes(const ConfigReader& reader,
+		std::optional<std::string>* pDoubleClickAction, std::optional<std::string>* pSetOnExit);
+	void ResolveActions(const std::optional<std::string>& doubleClickAction, const std::optional<std::string>& setOnExit);
+	UINT32 Intern(const std::string& text);
+	void ParseMenuItem(ConfigReader& reader, UINT32 index);
+	void ParseAutoApply(ConfigReader& reader, MenuItem* pMenuItem);
+	void ParseState(ConfigReader& reader);
+	void FinishLoading(const std::optional<std::string>& doubleClickAction, const std::optional<std::string>& setOnExit);
+	void BuildNameIndex();
+
+	static bool ParseBooleanAttribute(const char* pHelpContext, const ConfigReader::Attribute& attribute);
+	static UINT32 ParseUIntAttribute(const char* pHelpContext, const ConfigReader::Attribute& attribute, UINT32 maxValue);
+	static void ExpectAttribute(const char* pHelpContext, const ConfigReader::Attribute* pAttribute, const char* pExpectedName);
+	static void ExpectOnlyAttribute(const char* pHelpContext, ConfigReader& reader, const char* pExpectedName);
+	static void ExpectNode(const char* pHelpContext, ConfigReader& reader, bool found, const char* pExpectedName);
+	static void ExpectNoSiblings(const char* pHelpContext, ConfigReader& reader, const char* pPreviousName);
+	static void ExpectNoAttributes(const char* pHelpContext, ConfigReader& reader);
+	static bool NextChild(const char* pHelpContext, ConfigReader& reader);
 
 public:
 	const std::vector<MenuItem>& GetMenuItems() const { return mMenuItems; }
-	const MenuItem* GetMenuItem(std::string name) const;
+	const MenuItem* GetMenuItem(std::string_view name) const;
 	const MenuItem* GetDoubleClickAction() const { return mpDoubleClickAction; }
 	const MenuItem* GetOnTrayExitAction() const { return mpOnTrayExitAction; }
 	const bool GetShouldRestoreOnExit() const { return mRestoreOnExit; }
+	// 0 unless display changes should be rolled back when not confirmed in time.
+	UINT32 GetConfirmDisplayChangeSeconds() const { return mConfirmDisplayChangeSeconds; }
+	// How long a single call into the display driver or the audio service may block
+	// before it's given up on. 0 waits forever.
+	UINT32 GetDisplayQueryTimeoutMs() const { return mDisplayQueryTimeoutMs; }
+	UINT32 GetDisplayApplyTimeoutMs() const { return mDisplayApplyTimeoutMs; }
+	UINT32 GetAudioTimeoutMs() const { return mAudioTimeoutMs; }
+	// How long display arrival and removal events must stop before an AutoApply rule is
+	// picked for the new set of connected displays.
+	UINT32 GetHotplugSettleMs() const { return mHotplugSettleMs; }
+	// Whether the display state a MenuItem leaves behind is put back when something else
+	// changes it, and how often to look when nothing says it changed (0 never does).
+	bool GetPinProfile() const { return mPinProfile; }
+	UINT32 GetPinCheckSeconds() const { return mPinCheckSeconds; }
+	// Changes whenever config.xml does, so anything derived from it can be keyed on it.
+	UINT64 GetContentHash() const { return mContentHash; }
+	// Streams the file through a ConfigReader, checking it and building the MenuItems as
+	// it goes, in one pass and without a DOM.
 	void ParseFile(std::string fileName);
-};
\ No newline at end of file
+	// Parses only the named MenuItem, and those DoubleClickTray and SetOnExit name, for a
+	// command line that applies one item and exits. The others are located but neither
+	// parsed nor checked. Falls back to ParseFile if the file defeats the quick scan.
+	void ParseFileFor(std::string fileName, const std::string& menuItemName);
+	// Whether only some of the MenuItems were parsed, by ParseFileFor.
+	bool IsPartial() const { return mPartial; }
+	// Takes the config from tables compiled into the binary, which were checked when
+	// they were generated. Reads no file and parses nothing.
+	void LoadEmbedded(const EmbeddedConfig& config);
+	// Writes the loaded config as the C++ tables LoadEmbedded takes, named
+	// sEmbeddedConfig.
+	void WriteEmbedded(std::ostream& stream) const;
+};
+
+#ifdef AVSELECT_EMBEDDED_CONFIG
+// Generated from config.xml at build time; see EmbeddedConfig.cpp.
+extern const UserConfig::EmbeddedConfig g_EmbeddedConfig;
+#endif
\ No newline at end of file
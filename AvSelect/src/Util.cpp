@@ -21,6 +21,7 @@
 * SOFTWARE. */
 
 #include <stdafx.h>
+#include <atomic>
 
 using namespace std;
 
@@ -51,6 +52,19 @@ size_t FindOutsideQuotes(wstring string, wstring substring)
 	return string::npos;
 }
 
+UINT64 Fnv1a64(UINT64 hash, const void* pData, size_t size)
+{
+	const BYTE* pBytes = (const BYTE*)pData;
+
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= pBytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
 //////////////////////////////////////////////////////////////////////////
 //    https://www.codeproject.com/Articles/188256/A-Simple-Wildcard-Matching-Function
 //    Under License: https://www.codeproject.com/info/cpol10.aspx
@@ -115,3 +129,54 @@ bool WildcardMatch(const WCHAR *pszString, const WCHAR *pszMatch)
 	// Have a match? Only if both are at the end...
 	return !*pszString && !*pszMatch;
 }
+
+#ifdef AVSELECT_COUNT_ALLOCATIONS
+
+static std::atomic<UINT64> sAllocationCount(0);
+
+void* operator new(size_t size)
+{
+	++sAllocationCount;
+	if (void* p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	free(p);
+}
+
+UINT64 GetAllocationCount()
+{
+	return sAllocationCount.load();
+}
+
+#else
+
+UINT64 GetAllocationCount()
+{
+	return 0;
+}
+
+#endif
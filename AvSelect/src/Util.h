@@ -25,4 +25,41 @@
 #include <Windows.h>
 
 bool WildcardMatch(const WCHAR *pszString, const WCHAR *pszMatch);
-std::size_t FindOutsideQuotes(std::wstring string, std::wstring substring);
\ No newline at end of file
+std::size_t FindOutsideQuotes(std::wstring string, std::wstring substring);
+
+#define FNV1A64_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+// FNV-1a, for stable fingerprints of display topology and config content.
+UINT64 Fnv1a64(UINT64 hash, const void* pData, size_t size);
+
+template <typename T>
+inline UINT64 Fnv1a64Value(UINT64 hash, const T& value) { return Fnv1a64(hash, &value, sizeof(value)); }
+
+inline UINT64 Fnv1a64String(UINT64 hash, const std::wstring& value) 
+{ return Fnv1a64(Fnv1a64Value(hash, value.size()), value.c_str(), value.size() * sizeof(WCHAR)); }
+
+// Raw copies of plain structs, for the files that outlive a run.
+template <typename T>
+inline void AppendPayload(std::vector<BYTE>& payload, const T* pItems, size_t count)
+{
+	const BYTE* pBytes = (const BYTE*)pItems;
+	payload.insert(payload.end(), pBytes, pBytes + count * sizeof(T));
+}
+
+// Advances pData past what was read. Returns false, reading nothing, if fewer than count
+// items are left before pEnd.
+template <typename T>
+inline bool ReadPayload(const BYTE*& pData, const BYTE* pEnd, T* pItems, size_t count)
+{
+	size_t size = count * sizeof(T);
+	if ((size_t)(pEnd - pData) < size)
+		return false;
+
+	memcpy(pItems, pData, size);
+	pData += size;
+	return true;
+}
+
+// Heap allocations made by this process so far. Always 0 unless the build defines
+// AVSELECT_COUNT_ALLOCATIONS, which replaces the global operator new to count them.
+UINT64 GetAllocationCount();
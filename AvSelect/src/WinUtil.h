@@ -23,14 +23,22 @@
 #pragma once
 
 #include "WinError.h"
-#include <fstream>
+#include <sstream>
+#include <string>
 
-extern std::wfstream g_log;
+void LogMessage(std::wstring msg);
 
 namespace WinUtil {
 	inline void ImplErrOut(HRESULT hr) { }
 	inline void ImplOriginateErrOut(HRESULT hr, const char* source) 
-	{ if (FAILED(hr)) g_log << "Error Hr:" << std::hex << hr << std::endl; }
+	{
+		if (FAILED(hr))
+		{
+			std::wstringstream ss;
+			ss << L"Error Hr:" << std::hex << hr;
+			LogMessage(ss.str());
+		}
+	}
 }
 
 #define PROP_HR_ERR(label, uhr)                      \
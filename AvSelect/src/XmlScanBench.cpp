@@ -0,0 +1,371 @@
+/* Copyright (c) 2014 Nicholas Ver Hoeve
+*
+* This software is published under the MIT License:
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE. */
+
+/* Measures and checks the SSE2/AVX2 scans in rapidxml.hpp. The Makefile builds it twice,
+   as XmlScanBench and as XmlScanBenchScalar with RAPIDXML_NO_SIMD, so the two parse the
+   same file with and without the scans.
+
+   XmlScanBench generate <file> <items> [valueLength]
+       Writes a config.xml with that many MenuItems. valueLength pads every attribute
+       value to at least that many characters; without it they're as long as real ones.
+   XmlScanBench parse <file> [iterations]
+       Times parsing the file and prints the rate and a fingerprint of the DOM.
+   XmlScanBench fingerprint <file>
+       Prints only the fingerprint, so both builds' DOMs can be compared.
+   XmlScanBench check
+       Compares each scan kernel with a byte-wise scan over random strings, including
+       ones that end right before an unreadable page. Exits with 1 if any disagree.
+*/
+
+#include "rapidxml/rapidxml.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+static string Pad(string value, size_t length)
+{
+	for (size_t i = 0; value.size() < length; ++i)
+		value += (char)('a' + i % 26);
+	return value;
+}
+
+static int Generate(const char* pFile, int items, size_t valueLength)
+{
+	ofstream out(pFile, ios::binary);
+	if (!out)
+	{
+		cerr << "can't write " << pFile << endl;
+		return 1;
+	}
+
+	out << "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<AvSelectorConfig DoubleClickTray=\"" <<
+		Pad("Item 0", valueLength) << "\">\n  <MenuItems>\n";
+
+	for (int i = 0; i < items; ++i)
+	{
+		string n = to_string(i);
+		out <<
+			"\n    <MenuItem Name=\"" << Pad("Item " + n, valueLength) << "\">\n"
+			"      <Hotkey Char=\"" << (char)('A' + i % 26) << "\" ModAlt=\"True\"/>\n"
+			"      <!-- Picked when display " << n << " is plugged in -->\n"
+			"      <TargetStates>\n"
+			"        <State Type=\"DisplaySettings\">\n"
+			"          <Target FriendlyName=\"" << Pad("Display " + n, valueLength) << "\" />\n"
+			"          <Enabled Value=\"True\" />\n"
+			"          <Resolution Width=\"1920\" Height=\"1080\" BitsPerPixel=\"32\" />\n"
+			"          <LocationRelativeToTarget FriendlyName=\"" << Pad("Acer X34", valueLength) << "\" X=\"3440\" Y=\"0\" />\n"
+			"        </State>\n"
+			"        <State Type=\"DefaultAudioDevice\">\n"
+			"          <AudioDevice FriendlyName=\"" << Pad("*NVIDIA High Definition Audio &amp; " + n, valueLength) << "\" />\n"
+			"        </State>\n"
+			"      </TargetStates>\n"
+			"    </MenuItem>\n";
+	}
+
+	out << "  </MenuItems>\n</AvSelectorConfig>\n";
+	return 0;
+}
+
+static bool ReadFile(const char* pFile, string* pText)
+{
+	ifstream in(pFile, ios::binary);
+	if (!in)
+	{
+		cerr << "can't read " << pFile << endl;
+		return false;
+	}
+
+	stringstream text;
+	text << in.rdbuf();
+	*pText = text.str();
+	return true;
+}
+
+// FNV-1a over every node's type, name and value and every attribute, depth first.
+static uint64_t Fingerprint(const rapidxml::xml_node<>* pNode, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+	auto add = [&hash](const char* pData, size_t size)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			hash ^= (unsigned char)pData[i];
+			hash *= 0x100000001b3ULL;
+		}
+		hash ^= 0xFF;
+		hash *= 0x100000001b3ULL;
+	};
+
+	char type = (char)pNode->type();
+	add(&type, 1);
+	add(pNode->name(), pNode->name_size());
+	add(pNode->value(), pNode->value_size());
+
+	for (const rapidxml::xml_attribute<>* pAttribute = pNode->first_attribute(); pAttribute; pAttribute = pAttribute->next_attribute())
+	{
+		add(pAttribute->name(), pAttribute->name_size());
+		add(pAttribute->value(), pAttribute->value_size());
+	}
+
+	for (const rapidxml::xml_node<>* pChild = pNode->first_node(); pChild; pChild = pChild->next_sibling())
+		hash = Fingerprint(pChild, hash);
+
+	return hash;
+}
+
+// Parsing is destructive, so each parse gets a fresh copy; only the parse is timed.
+static uint64_t ParseOnce(const string& text, vector<char>* pBuffer, chrono::steady_clock::duration* pElapsed)
+{
+	pBuffer->assign(text.begin(), text.end());
+	pBuffer->push_back('\0');
+
+	rapidxml::xml_document<> document;
+
+	auto start = chrono::steady_clock::now();
+	document.parse<0>(pBuffer->data());
+	*pElapsed = chrono::steady_clock::now() - start;
+
+	return Fingerprint(&document);
+}
+
+static int Parse(const char* pFile, int iterations, bool timed)
+{
+	string text;
+	if (!ReadFile(pFile, &text))
+		return 1;
+
+	vector<char> buffer;
+	uint64_t fingerprint;
+	chrono::steady_clock::duration elapsed, total(0), best(chrono::hours(1));
+
+	try
+	{
+		fingerprint = ParseOnce(text, &buffer, &elapsed);
+
+		for (int i = 0; timed && i < iterations; ++i)
+		{
+			if (ParseOnce(text, &buffer, &elapsed) != fingerprint)
+			{
+				cerr << pFile << ": parsed differently on iteration " << i << endl;
+				return 1;
+			}
+
+			total += elapsed;
+			if (elapsed < best)
+				best = elapsed;
+		}
+	}
+	catch (const rapidxml::parse_error& e)
+	{
+		cerr << pFile << ": " << e.what() << endl;
+		return 1;
+	}
+
+	if (timed)
+	{
+		// The best run is the steadiest figure to compare builds by.
+		double mean = chrono::duration<double>(total).count() / iterations;
+		double fastest = chrono::duration<double>(best).count();
+		printf("%s: %.1f MB, %.2f ms per parse on average, %.2f ms at best (%.0f MB/s)\n", pFile, text.size() / 1e6,
+			mean * 1000, fastest * 1000, text.size() / 1e6 / fastest);
+	}
+
+	printf(timed ? "dom %016llx\n" : "%016llx\n", (unsigned long long)fingerprint);
+	return 0;
+}
+
+#if defined(RAPIDXML_SIMD)
+
+struct Scan
+{
+	int mMode;
+	char mC1;
+	char mC2;
+	const char* mpName;
+};
+
+// What each of skip()'s fast_skip calls asks for.
+static const Scan SCANS[] = {
+	{ rapidxml::internal::scan_whitespace, 0, 0, "whitespace" },
+	{ rapidxml::internal::scan_text, '<', '<', "text" },
+	{ rapidxml::internal::scan_text, '<', '&', "pure text" },
+	{ rapidxml::internal::scan_text_ws, '<', '&', "pure text, normalizing whitespace" },
+	{ rapidxml::internal::scan_text, '"', '"', "attribute value" },
+	{ rapidxml::internal::scan_text, '"', '&', "pure attribute value" },
+};
+
+static bool IsSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static const char* ScanBytewise(const Scan& scan, const char* p)
+{
+	for (;; ++p)
+	{
+		if (scan.mMode == rapidxml::internal::scan_whitespace)
+		{
+			if (!IsSpace(*p))
+				return p;
+		}
+		else if (!*p || *p == scan.mC1 || *p == scan.mC2 || (scan.mMode == rapidxml::internal::scan_text_ws && IsSpace(*p)))
+		{
+			return p;
+		}
+	}
+}
+
+template<int Mode>
+static const char* ScanKernel(int level, const char* p, char c1, char c2)
+{
+	if (level == rapidxml::internal::simd_avx2)
+		return rapidxml::internal::scan_avx2<Mode>(p, c1, c2);
+	return rapidxml::internal::scan_sse2<Mode>(p, c1, c2);
+}
+
+static const char* ScanKernel(int level, const Scan& scan, const char* p)
+{
+	switch (scan.mMode)
+	{
+	case rapidxml::internal::scan_whitespace:
+		return ScanKernel<rapidxml::internal::scan_whitespace>(level, p, scan.mC1, scan.mC2);
+	case rapidxml::internal::scan_text:
+		return ScanKernel<rapidxml::internal::scan_text>(level, p, scan.mC1, scan.mC2);
+	default:
+		return ScanKernel<rapidxml::internal::scan_text_ws>(level, p, scan.mC1, scan.mC2);
+	}
+}
+
+static int Check()
+{
+	const size_t PAGE = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t MAX_LENGTH = 300;
+
+	// Two readable pages and an unreadable one after them.
+	char* pPages = (char*)mmap(NULL, PAGE * 3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pPages == MAP_FAILED || mprotect(pPages + PAGE * 2, PAGE, PROT_NONE) != 0)
+	{
+		cerr << "can't set up the guard page" << endl;
+		return 1;
+	}
+	char* pGuard = pPages + PAGE * 2;
+
+	// Mostly characters no scan stops at, with each kind of stop mixed in now and then.
+	static const char FILLER[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789*_-.()/=\xC3\xA9";
+	static const char STOPS[] = " \t\r\n<&\"'";
+
+	mt19937 random(47);
+	int mismatches = 0;
+	uint64_t scans = 0;
+
+	int levels[2] = { rapidxml::internal::simd_sse2, rapidxml::internal::simd_avx2 };
+	int levelCount = rapidxml::internal::simd_dispatch<0>::level == rapidxml::internal::simd_avx2 ? 2 : 1;
+
+	if (rapidxml::internal::simd_dispatch<0>::level == rapidxml::internal::simd_none)
+	{
+		cout << "  this CPU has no SSE2; nothing to check" << endl;
+		return 0;
+	}
+
+	for (int round = 0; round < 20000; ++round)
+	{
+		size_t length = random() % MAX_LENGTH;
+		// Half end right at the guard page, the rest anywhere in the readable pages.
+		char* pText = round % 2 ? pGuard - 1 - length : pPages + random() % (PAGE * 2 - MAX_LENGTH - 1);
+		bool spaces = round % 3 == 0;
+
+		for (size_t i = 0; i < length; ++i)
+		{
+			if (spaces && random() % 4)
+				pText[i] = STOPS[random() % 4];
+			else if (random() % 64 == 0)
+				pText[i] = STOPS[random() % (sizeof(STOPS) - 1)];
+			else
+				pText[i] = FILLER[random() % (sizeof(FILLER) - 1)];
+		}
+		pText[length] = '\0';
+
+		for (const Scan& scan : SCANS)
+		{
+			const char* pExpected = ScanBytewise(scan, pText);
+
+			for (int level = 0; level < levelCount; ++level)
+			{
+				const char* pFound = ScanKernel(levels[level], scan, pText);
+				++scans;
+
+				if (pFound != pExpected)
+				{
+					if (++mismatches <= 10)
+						cout << "  FAILED " << (levels[level] == rapidxml::internal::simd_avx2 ? "AVX2 " : "SSE2 ") << scan.mpName <<
+							" scan of " << length << " characters stopped at " << (pFound - pText) << ", not " << (pExpected - pText) << endl;
+				}
+			}
+		}
+	}
+
+	cout << "  " << scans << " scans " << (levelCount == 2 ? "with SSE2 and AVX2" : "with SSE2") << ", " <<
+		mismatches << " mismatches" << endl;
+
+	munmap(pPages, PAGE * 3);
+	return mismatches ? 1 : 0;
+}
+
+#else
+
+static int Check()
+{
+	cout << "  built without the SIMD scans; nothing to check" << endl;
+	return 0;
+}
+
+#endif
+
+int main(int argc, char* argv[])
+{
+	string command = argc > 1 ? argv[1] : "";
+
+	if (command == "generate" && argc > 3)
+		return Generate(argv[2], atoi(argv[3]), argc > 4 ? (size_t)atoi(argv[4]) : 0);
+
+	if (command == "parse" && argc > 2)
+		return Parse(argv[2], argc > 3 ? atoi(argv[3]) : 20, true);
+
+	if (command == "fingerprint" && argc > 2)
+		return Parse(argv[2], 0, false);
+
+	if (command == "check")
+		return Check();
+
+	cerr << "usage: XmlScanBench generate <file> <items> [valueLength] | parse <file> [iterations] | fingerprint <file> | check" << endl;
+	return 1;
+}
@@ -123,6 +123,28 @@ namespace rapidxml
     #define RAPIDXML_DYNAMIC_POOL_SIZE (64 * 1024)
 #endif
 
+///////////////////////////////////////////////////////////////////////////
+// SIMD scanning
+
+#if !defined(RAPIDXML_NO_SIMD) && (defined(_MSC_VER) || defined(__GNUC__)) && \
+    (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__))
+    // Whitespace, text and attribute values are scanned 16 or 32 characters at a time with SSE2 or AVX2,
+    // whichever the CPU has, and with the lookup tables otherwise.
+    // Define RAPIDXML_NO_SIMD before including rapidxml.hpp to always use the lookup tables.
+    #define RAPIDXML_SIMD
+    #include <emmintrin.h>
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+        #define RAPIDXML_TARGET_SSE2
+        #define RAPIDXML_TARGET_AVX2
+    #else
+        #include <cpuid.h>
+        #define RAPIDXML_TARGET_SSE2 __attribute__((target("sse2")))
+        #define RAPIDXML_TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+#endif
+
 #ifndef RAPIDXML_ALIGNMENT
     // Memory allocation alignment.
     // Define RAPIDXML_ALIGNMENT before including rapidxml.hpp if you want to override the default value, which is the size of pointer.
@@ -335,6 +357,168 @@ namespace rapidxml
             }
             return true;
         }
+
+        // Kinds of SIMD scan. Each also stops at the terminating zero, which is never whitespace.
+        enum scan_mode
+        {
+            scan_whitespace,    // Stop at the first character that is not whitespace
+            scan_text,          // Stop at either of two characters
+            scan_text_ws        // Stop at either of two characters, or at whitespace
+        };
+
+#if defined(RAPIDXML_SIMD)
+
+        enum simd_level
+        {
+            simd_none,
+            simd_sse2,
+            simd_avx2
+        };
+
+        inline int detect_simd_level()
+        {
+            unsigned int regs[4] = { 0, 0, 0, 0 };   // eax, ebx, ecx, edx
+#if defined(_MSC_VER)
+            __cpuid(reinterpret_cast<int *>(regs), 0);
+            unsigned int max_leaf = regs[0];
+            __cpuid(reinterpret_cast<int *>(regs), 1);
+#else
+            unsigned int max_leaf = __get_cpuid_max(0, 0);
+            if (max_leaf >= 1)
+                __cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#endif
+            if (max_leaf < 1 || !(regs[3] & (1u << 26)))
+                return simd_none;
+
+            // AVX2 also needs the OS to save the upper halves of the registers
+            bool os_avx = (regs[2] & (1u << 27)) && (regs[2] & (1u << 28));
+            if (max_leaf < 7 || !os_avx)
+                return simd_sse2;
+#if defined(_MSC_VER)
+            if ((_xgetbv(0) & 6) != 6)
+                return simd_sse2;
+            __cpuidex(reinterpret_cast<int *>(regs), 7, 0);
+#else
+            unsigned int xcr0_lo, xcr0_hi;
+            __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+            if ((xcr0_lo & 6) != 6)
+                return simd_sse2;
+            __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+            return (regs[1] & (1u << 5)) ? simd_avx2 : simd_sse2;
+        }
+
+        // Detected once, at static initialization; anything parsed before then uses the lookup tables.
+        // It must be a template for the same reason lookup_tables is.
+        template<int Dummy>
+        struct simd_dispatch
+        {
+            static const int level;
+        };
+
+        template<int Dummy>
+        const int simd_dispatch<Dummy>::level = detect_simd_level();
+
+        inline unsigned int lowest_set_bit(unsigned int mask)
+        {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward(&index, mask);
+            return index;
+#else
+            return __builtin_ctz(mask);
+#endif
+        }
+
+        // Bit per character of the aligned block at which a scan in Mode stops
+        template<int Mode>
+        RAPIDXML_TARGET_SSE2 inline unsigned int stop_mask_sse2(const char *block, char c1, char c2)
+        {
+            __m128i data = _mm_load_si128(reinterpret_cast<const __m128i *>(block));
+            unsigned int whitespace = 0;
+            if (Mode != scan_text)
+                whitespace = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(data, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(data, _mm_set1_epi8('\t'))),
+                    _mm_or_si128(_mm_cmpeq_epi8(data, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(data, _mm_set1_epi8('\r')))));
+            if (Mode == scan_whitespace)
+                return ~whitespace & 0xFFFFu;
+            unsigned int stop = _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(data, _mm_setzero_si128()),
+                _mm_or_si128(_mm_cmpeq_epi8(data, _mm_set1_epi8(c1)), _mm_cmpeq_epi8(data, _mm_set1_epi8(c2)))));
+            return stop | whitespace;
+        }
+
+        template<int Mode>
+        RAPIDXML_TARGET_AVX2 inline unsigned int stop_mask_avx2(const char *block, char c1, char c2)
+        {
+            __m256i data = _mm256_load_si256(reinterpret_cast<const __m256i *>(block));
+            unsigned int whitespace = 0;
+            if (Mode != scan_text)
+                whitespace = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(data, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(data, _mm256_set1_epi8('\t'))),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(data, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(data, _mm256_set1_epi8('\r'))))));
+            if (Mode == scan_whitespace)
+                return ~whitespace;
+            unsigned int stop = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi8(data, _mm256_setzero_si256()),
+                _mm256_or_si256(_mm256_cmpeq_epi8(data, _mm256_set1_epi8(c1)), _mm256_cmpeq_epi8(data, _mm256_set1_epi8(c2))))));
+            return stop | whitespace;
+        }
+
+        // Loads are aligned, so while they read past the terminating zero, they never reach into the next page
+        template<int Mode>
+        RAPIDXML_TARGET_SSE2 inline const char *scan_sse2(const char *text, char c1, char c2)
+        {
+            const char *block = reinterpret_cast<const char *>(reinterpret_cast<std::size_t>(text) & ~std::size_t(15));
+            unsigned int mask = stop_mask_sse2<Mode>(block, c1, c2) & (~0u << (text - block));
+            while (!mask)
+            {
+                block += 16;
+                mask = stop_mask_sse2<Mode>(block, c1, c2);
+            }
+            return block + lowest_set_bit(mask);
+        }
+
+        template<int Mode>
+        RAPIDXML_TARGET_AVX2 inline const char *scan_avx2(const char *text, char c1, char c2)
+        {
+            const char *block = reinterpret_cast<const char *>(reinterpret_cast<std::size_t>(text) & ~std::size_t(31));
+            unsigned int mask = stop_mask_avx2<Mode>(block, c1, c2) & (~0u << (text - block));
+            while (!mask)
+            {
+                block += 32;
+                mask = stop_mask_avx2<Mode>(block, c1, c2);
+            }
+            return block + lowest_set_bit(mask);
+        }
+
+#endif
+
+        // Skips ahead as a scan in Mode would, as far as SIMD can take it; the caller's lookup table
+        // predicate finishes the job, and does all of it where SIMD isn't available.
+        template<int Mode, class Ch>
+        inline Ch *simd_skip(Ch *text, Ch c1, Ch c2)
+        {
+#if defined(RAPIDXML_SIMD)
+            if (sizeof(Ch) != 1)
+                return text;
+            const char *p = reinterpret_cast<const char *>(text);
+            switch (simd_dispatch<0>::level)
+            {
+            case simd_avx2:
+                p = scan_avx2<Mode>(p, static_cast<char>(c1), static_cast<char>(c2));
+                break;
+            case simd_sse2:
+                p = scan_sse2<Mode>(p, static_cast<char>(c1), static_cast<char>(c2));
+                break;
+            }
+            return text + (p - reinterpret_cast<const char *>(text));
+#else
+            (void)c1;
+            (void)c2;
+            return text;
+#endif
+        }
     }
     //! \endcond
 
@@ -1431,6 +1615,11 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_whitespace[static_cast<unsigned char>(ch)];
             }
+
+            static Ch *fast_skip(Ch *text)
+            {
+                return internal::simd_skip<internal::scan_whitespace>(text, Ch(0), Ch(0));
+            }
         };
 
         // Detect node name character
@@ -1440,6 +1629,11 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_node_name[static_cast<unsigned char>(ch)];
             }
+
+            static Ch *fast_skip(Ch *text)
+            {
+                return text;
+            }
         };
 
         // Detect attribute name character
@@ -1449,6 +1643,11 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_attribute_name[static_cast<unsigned char>(ch)];
             }
+
+            static Ch *fast_skip(Ch *text)
+            {
+                return text;
+            }
         };
 
         // Detect text character (PCDATA)
@@ -1458,6 +1657,11 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_text[static_cast<unsigned char>(ch)];
             }
+
+            static Ch *fast_skip(Ch *text)
+            {
+                return internal::simd_skip<internal::scan_text>(text, Ch('<'), Ch('<'));
+            }
         };
 
         // Detect text character (PCDATA) that does not require processing
@@ -1467,6 +1671,11 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_text_pure_no_ws[static_cast<unsigned char>(ch)];
             }
+
+            static Ch *fast_skip(Ch *text)
+            {
+                return internal::simd_skip<internal::scan_text>(text, Ch('<'), Ch('&'));
+            }
         };
 
         // Detect text character (PCDATA) that does not require processing
@@ -1476,6 +1685,11 @@ namespace rapidxml
             {
                 return internal::lookup_tables<0>::lookup_text_pure_with_ws[static_cast<unsigned char>(ch)];
             }
+
+            static Ch *fast_skip(Ch *text)
+            {
+                return internal::simd_skip<internal::scan_text_ws>(text, Ch('<'), Ch('&'));
+            }
         };
 
         // Detect attribute value character
@@ -1490,6 +1704,11 @@ namespace rapidxml
                     return internal::lookup_tables<0>::lookup_attribute_data_2[static_cast<unsigned char>(ch)];
                 return 0;       // Should never be executed, to avoid warnings on Comeau
             }
+
+            static Ch *fast_skip(Ch *text)
+            {
+                return internal::simd_skip<internal::scan_text>(text, Quote, Quote);
+            }
         };
 
         // Detect attribute value character
@@ -1504,6 +1723,11 @@ namespace rapidxml
                     return internal::lookup_tables<0>::lookup_attribute_data_2_pure[static_cast<unsigned char>(ch)];
                 return 0;       // Should never be executed, to avoid warnings on Comeau
             }
+
+            static Ch *fast_skip(Ch *text)
+            {
+                return internal::simd_skip<internal::scan_text>(text, Quote, Ch('&'));
+            }
         };
 
         // Insert coded character, using UTF8 or 8-bit ASCII
@@ -1554,10 +1778,18 @@ namespace rapidxml
         }
 
         // Skip characters until predicate evaluates to true
+        // Short runs, the usual case, aren't worth setting up a SIMD scan for; longer ones are handed to the predicate's fast_skip.
         template<class StopPred, int Flags>
         static void skip(Ch *&text)
         {
             Ch *tmp = text;
+            for (Ch *short_end = tmp + 16; tmp != short_end; ++tmp)
+                if (!StopPred::test(*tmp))
+                {
+                    text = tmp;
+                    return;
+                }
+            tmp = StopPred::fast_skip(tmp);
             while (StopPred::test(*tmp))
                 ++tmp;
             text = tmp;
@@ -2587,6 +2819,8 @@ namespace rapidxml
 
 // Undefine internal macros
 #undef RAPIDXML_PARSE_ERROR
+#undef RAPIDXML_TARGET_SSE2
+#undef RAPIDXML_TARGET_AVX2
 
 // On MSVC, restore warnings state
 #ifdef _MSC_VER